@@ -37,6 +37,7 @@
 #include <syscall.h>
 #include <process.h>
 #include <file_syscall.h>
+#include <futex.h>
 #include <copyinout.h>
 /*
  * System call dispatcher.
@@ -110,6 +111,11 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
 	    /* Add stuff here */
 	    case SYS_getpid:
 		err = sys_getpid(&retval);
@@ -124,6 +130,31 @@ syscall(struct trapframe *tf)
                                 (userptr_t)tf->tf_a1);
                 break;
 
+	    case SYS_spawn:
+		err = sys_spawn((userptr_t)tf->tf_a0,
+				(userptr_t)tf->tf_a1, &retval);
+		break;
+
+	    case SYS___threadfork:
+		err = sys___threadfork((userptr_t)tf->tf_a0,
+				       (userptr_t)tf->tf_a1,
+				       (userptr_t)tf->tf_a2, &retval);
+		break;
+
+	    case SYS_threadexit:
+		err = sys_threadexit((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_threadjoin:
+		err = sys_threadjoin((userptr_t)tf->tf_a0,
+				     (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_schedstat:
+		err = sys_schedstat((userptr_t)tf->tf_a0,
+				    (unsigned)tf->tf_a1, &retval);
+		break;
+
             case SYS_waitpid:
                 err = sys_waitpid(&retval, (userptr_t)tf->tf_a0,
                                 (userptr_t)tf->tf_a1,
@@ -149,6 +180,49 @@ syscall(struct trapframe *tf)
 	    case SYS_write:
 		err = sys_write((int)tf->tf_a0,(userptr_t)tf->tf_a1,(size_t)tf->tf_a2,&retval);
 		break;
+
+	    case SYS_readv:
+		err = sys_readv((int)tf->tf_a0,(userptr_t)tf->tf_a1,(int)tf->tf_a2,&retval);
+		break;
+
+	    case SYS_writev:
+		err = sys_writev((int)tf->tf_a0,(userptr_t)tf->tf_a1,(int)tf->tf_a2,&retval);
+		break;
+
+	    /* the last two arguments (length, flags) are on the stack */
+	    case SYS_copy_file_range:
+	    {
+		uint32_t stackargs[2];
+
+		err = copyin((userptr_t)tf->tf_sp+16, stackargs, sizeof(stackargs));
+		if(err){
+			break;
+		}
+		err = sys_copy_file_range((int)tf->tf_a0,(userptr_t)tf->tf_a1,
+					  (int)tf->tf_a2,(userptr_t)tf->tf_a3,
+					  (size_t)stackargs[0],
+					  (unsigned)stackargs[1],&retval);
+		break;
+	    }
+
+	    /* the 64-bit offset is aligned past a3, onto the stack */
+	    case SYS_pread:
+	    case SYS_pwrite:
+	    {
+		off_t pos;
+
+		err = copyin((userptr_t)tf->tf_sp+16, &pos, sizeof(off_t));
+		if(err){
+			break;
+		}
+		if(callno == SYS_pread){
+			err = sys_pread((int)tf->tf_a0,(userptr_t)tf->tf_a1,(size_t)tf->tf_a2,pos,&retval);
+		}
+		else{
+			err = sys_pwrite((int)tf->tf_a0,(userptr_t)tf->tf_a1,(size_t)tf->tf_a2,pos,&retval);
+		}
+		break;
+	    }
  
 	    case SYS_dup2:
 		err = sys_dup2((int)tf->tf_a0,(int)tf->tf_a1,&retval);
@@ -201,6 +275,11 @@ syscall(struct trapframe *tf)
 		err = sys_sbrk((userptr_t)tf->tf_a0, &retval);
 		break;
 
+	    case SYS_futex:
+		err = sys_futex((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+				(int)tf->tf_a2, &retval);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
@@ -73,6 +73,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Restart the count register, so a new compare value is measured
+ * from now. ($9 == c0_count.)
+ */
+static
+void
+mips_timer_restart(void)
+{
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 $0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -116,6 +132,21 @@ mainbus_bootstrap(void)
 	mips_timer_set(CPU_FREQUENCY / HZ);
 }
 
+/*
+ * Stretch the next timer interrupt on this cpu to NTICKS hardclock
+ * periods. mainbus_interrupt resets it to one period when it fires.
+ */
+void
+mainbus_settimer(unsigned nticks)
+{
+	KASSERT(nticks >= 1 && nticks <= MAINBUS_MAXTIMERTICKS);
+	COMPILE_ASSERT((uint64_t)(CPU_FREQUENCY / HZ) *
+		       MAINBUS_MAXTIMERTICKS < 0x100000000ULL);
+
+	mips_timer_restart();
+	mips_timer_set(CPU_FREQUENCY / HZ * nticks);
+}
+
 /*
  * Start all secondary CPUs.
  */
@@ -479,11 +479,21 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
+	/*
+	 * Make sure nobody picked the vnode up since VOP_DECREF
+	 * decided to reclaim it; if they did, consume the reference
+	 * VOP_DECREF handed us.
+	 */
+	spinlock_acquire(&ev->ev_v.vn_countlock);
 	if (ev->ev_v.vn_refcount != 1) {
+		KASSERT(ev->ev_v.vn_refcount > 1);
+		ev->ev_v.vn_refcount--;
+		spinlock_release(&ev->ev_v.vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&ev->ev_v.vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
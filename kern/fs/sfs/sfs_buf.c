@@ -0,0 +1,1047 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Block buffer cache.
+ *
+ * Each mounted volume has SFS_BUFSPACE bytes' worth of buffers, each
+ * the size of the volume's blocks, or SFS_MINBUFS if that's more. Cached blocks are found through a
+ * hash on the block number; all buffers sit on an LRU list, most
+ * recently used first, with invalid buffers at the tail. A miss
+ * takes the least recently used buffer that isn't busy, writing it
+ * back first if it's dirty. Dirty buffers are otherwise written only
+ * by sfs_buf_flush, which sfs_sync calls; a syncer thread runs
+ * vfs_sync every SFS_SYNCSECS seconds so nothing stays dirty long.
+ *
+ * On journaled volumes, pinned buffers (metadata changed since the
+ * last commit) are never written back; evicting one moves its
+ * contents to the volume's list of saved blocks, and a miss on a
+ * saved block takes it back from there instead of reading the disk.
+ *
+ * Read-ahead: sfs_buf_readahead queues disk blocks, and a worker
+ * thread reads them into the cache in the background.
+ *
+ * Each volume's hash chains, LRU list and buffer flags are protected
+ * by its sfs_buflock. A busy buffer belongs to whoever made it busy:
+ * a caller between sfs_buf_get and sfs_buf_release, or a thread
+ * reading or writing it. Disk I/O is done with the buffer busy and
+ * sfs_buflock released; anyone else who wants the block waits on
+ * sfs_bufcv and then looks it up again, since it may have been
+ * evicted or failed to load in the meantime. The read-ahead queue has
+ * its own lock, which is never held together with a sfs_buflock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <bitmap.h>
+#include <sfs.h>
+
+#define SFS_BUFHASHFN(block)  ((block) % SFS_BUFHASH)
+
+/* Counters for all volumes, for sfs_buf_printstats. */
+struct sfs_bufstats {
+	unsigned long lookups;          /* sfs_buf_get calls */
+	unsigned long hits;             /* ... that found the block cached */
+	unsigned long reads;            /* blocks read from disk */
+	unsigned long writes;           /* dirty blocks written back */
+	unsigned long evictions;        /* valid blocks pushed out */
+	unsigned long readaheads;       /* blocks read ahead */
+	unsigned long rahits;           /* ... that were then used */
+};
+static struct sfs_bufstats sfs_bufstats;
+static struct spinlock sfs_bufstatlock = SPINLOCK_INITIALIZER;
+
+#define SFS_BUFSTAT(field) do {                    \
+		spinlock_acquire(&sfs_bufstatlock); \
+		sfs_bufstats.field++;               \
+		spinlock_release(&sfs_bufstatlock); \
+	} while (0)
+
+/*
+ * Read-ahead queue: a ring of (volume, block) pairs. When it's full,
+ * further requests are dropped. sfs_racurrent is the volume the
+ * read-ahead thread is working on outside the lock, so that unmount
+ * can wait for it to finish.
+ */
+#define SFS_RAQUEUE  128
+
+static struct {
+	struct sfs_fs *sfs;
+	uint32_t block;
+} sfs_raqueue[SFS_RAQUEUE];
+static unsigned sfs_rahead, sfs_ranum;
+static struct sfs_fs *sfs_racurrent;
+static struct lock *sfs_ralock;
+static struct cv *sfs_racv;
+
+static bool sfs_threads_started;
+
+////////////////////////////////////////////////////////////
+//
+// LRU list and hash chains
+
+static
+void
+sfs_lru_remove(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	if (buf->b_lruprev != NULL) {
+		buf->b_lruprev->b_lrunext = buf->b_lrunext;
+	}
+	else {
+		sfs->sfs_lruhead = buf->b_lrunext;
+	}
+	if (buf->b_lrunext != NULL) {
+		buf->b_lrunext->b_lruprev = buf->b_lruprev;
+	}
+	else {
+		sfs->sfs_lrutail = buf->b_lruprev;
+	}
+	buf->b_lrunext = buf->b_lruprev = NULL;
+}
+
+static
+void
+sfs_lru_addhead(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	buf->b_lruprev = NULL;
+	buf->b_lrunext = sfs->sfs_lruhead;
+	if (sfs->sfs_lruhead != NULL) {
+		sfs->sfs_lruhead->b_lruprev = buf;
+	}
+	else {
+		sfs->sfs_lrutail = buf;
+	}
+	sfs->sfs_lruhead = buf;
+}
+
+static
+void
+sfs_lru_addtail(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	buf->b_lrunext = NULL;
+	buf->b_lruprev = sfs->sfs_lrutail;
+	if (sfs->sfs_lrutail != NULL) {
+		sfs->sfs_lrutail->b_lrunext = buf;
+	}
+	else {
+		sfs->sfs_lruhead = buf;
+	}
+	sfs->sfs_lrutail = buf;
+}
+
+static
+struct sfs_buf *
+sfs_hash_find(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+
+	for (buf = sfs->sfs_bufhash[SFS_BUFHASHFN(block)];
+	     buf != NULL; buf = buf->b_hashnext) {
+		if (buf->b_block == block) {
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_hash_remove(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_buf **pp;
+
+	for (pp = &sfs->sfs_bufhash[SFS_BUFHASHFN(buf->b_block)];
+	     *pp != NULL; pp = &(*pp)->b_hashnext) {
+		if (*pp == buf) {
+			*pp = buf->b_hashnext;
+			buf->b_hashnext = NULL;
+			return;
+		}
+	}
+	panic("sfs: buffer for block %u not in hash\n", buf->b_block);
+}
+
+static
+void
+sfs_hash_add(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	unsigned ix = SFS_BUFHASHFN(buf->b_block);
+
+	buf->b_hashnext = sfs->sfs_bufhash[ix];
+	sfs->sfs_bufhash[ix] = buf;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Write-back
+
+/*
+ * Write a dirty buffer back to disk. Called with sfs_buflock held and
+ * the buffer made busy by the caller; the lock is dropped for the
+ * write.
+ */
+static
+int
+sfs_buf_writeback(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+	KASSERT(buf->b_valid && buf->b_dirty && buf->b_busy);
+
+	lock_release(sfs->sfs_buflock);
+	result = sfs_wblock(sfs, buf->b_data, buf->b_block);
+	lock_acquire(sfs->sfs_buflock);
+	if (result) {
+		return result;
+	}
+	buf->b_dirty = false;
+	SFS_BUFSTAT(writes);
+	return 0;
+}
+
+/*
+ * Keep a pinned buffer's contents aside, on the volume's list of
+ * saved blocks, so the buffer can be reused before the next commit.
+ * Called with sfs_buflock held and the buffer busy.
+ */
+static
+int
+sfs_buf_save(struct sfs_fs *sfs, struct sfs_buf *buf)
+{
+	struct sfs_jsaved *js;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+	KASSERT(buf->b_valid && buf->b_pinned && buf->b_busy);
+
+	js = kmalloc(sizeof(*js));
+	if (js == NULL) {
+		return ENOMEM;
+	}
+	js->js_data = kmalloc(sfs->sfs_blocksize);
+	if (js->js_data == NULL) {
+		kfree(js);
+		return ENOMEM;
+	}
+	memcpy(js->js_data, buf->b_data, sfs->sfs_blocksize);
+	js->js_block = buf->b_block;
+	js->js_next = sfs->sfs_jsaved;
+	sfs->sfs_jsaved = js;
+	sfs->sfs_jnsaved++;
+
+	buf->b_pinned = false;
+	buf->b_dirty = false;
+	sfs->sfs_jpinned--;
+	return 0;
+}
+
+/*
+ * Check if BLOCK is on the list of saved blocks. Called with
+ * sfs_buflock held.
+ */
+static
+bool
+sfs_buf_findsaved(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_jsaved *js;
+
+	for (js = sfs->sfs_jsaved; js != NULL; js = js->js_next) {
+		if (js->js_block == block) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Take BLOCK off the list of saved blocks, if it's there. Called with
+ * sfs_buflock held.
+ */
+static
+struct sfs_jsaved *
+sfs_buf_takesaved(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_jsaved **jsp, *js;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+	for (jsp = &sfs->sfs_jsaved; *jsp != NULL; jsp = &(*jsp)->js_next) {
+		if ((*jsp)->js_block == block) {
+			js = *jsp;
+			*jsp = js->js_next;
+			sfs->sfs_jnsaved--;
+			return js;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write back every dirty buffer, lowest block first, so the disk head
+ * sweeps across once. Pinned buffers wait for the next commit.
+ */
+int
+sfs_buf_flush(struct sfs_fs *sfs)
+{
+	struct sfs_buf *buf;
+	unsigned i;
+	int result = 0;
+
+	lock_acquire(sfs->sfs_buflock);
+	while (1) {
+		buf = NULL;
+		for (i=0; i<sfs->sfs_nbufs; i++) {
+			struct sfs_buf *b = &sfs->sfs_bufs[i];
+			if (!b->b_valid || !b->b_dirty || b->b_pinned) {
+				continue;
+			}
+			if (buf == NULL || b->b_block < buf->b_block) {
+				buf = b;
+			}
+		}
+		if (buf == NULL) {
+			break;
+		}
+		if (buf->b_busy) {
+			/* Someone's using it; wait, then look again */
+			cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+			continue;
+		}
+		buf->b_busy = true;
+		result = sfs_buf_writeback(sfs, buf);
+		buf->b_busy = false;
+		cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+		if (result) {
+			break;
+		}
+	}
+	lock_release(sfs->sfs_buflock);
+
+	return result;
+}
+
+/*
+ * Syncer thread: push everything out every SFS_SYNCSECS seconds.
+ * Started by the first mount and never stops; vfs_sync with nothing
+ * mounted is harmless.
+ */
+static
+void
+sfs_syncer(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		clocksleep(SFS_SYNCSECS);
+		vfs_sync();
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Find BLOCK in the cache, or bring it in, and hand it back busy.
+ * Misses take the least recently used buffer nobody's using, writing
+ * it back (or saving it, if it's pinned) if need be, and read or zero
+ * it, or take it back from the saved blocks. If READAHEAD is set, this
+ * is the read-ahead thread: a block that's already cached (or on its
+ * way in) is left alone and EEXIST returned.
+ *
+ * Called and returns with sfs_buflock held, but drops it for I/O and
+ * while waiting.
+ */
+static
+int
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block, bool doread,
+	       bool readahead, struct sfs_buf **ret)
+{
+	struct sfs_buf *buf, *pinned;
+	struct sfs_jsaved *js;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_buflock));
+
+	while (1) {
+		buf = sfs_hash_find(sfs, block);
+		if (buf != NULL) {
+			if (readahead) {
+				return EEXIST;
+			}
+			if (buf->b_busy) {
+				cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+				continue;
+			}
+			SFS_BUFSTAT(hits);
+			if (buf->b_readahead) {
+				buf->b_readahead = false;
+				SFS_BUFSTAT(rahits);
+			}
+			break;
+		}
+
+		/*
+		 * Not cached. If it's saved and being committed, wait
+		 * for the commit to write it in place.
+		 */
+		if (sfs->sfs_jsavedbusy && sfs_buf_findsaved(sfs, block)) {
+			cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+			continue;
+		}
+
+		/*
+		 * Find a buffer to put it in. Pinned ones are the last
+		 * resort, since they have to be saved.
+		 */
+		pinned = NULL;
+		for (buf = sfs->sfs_lrutail; buf != NULL;
+		     buf = buf->b_lruprev) {
+			if (buf->b_busy) {
+				continue;
+			}
+			if (!buf->b_pinned) {
+				break;
+			}
+			if (pinned == NULL) {
+				pinned = buf;
+			}
+		}
+		if (buf == NULL) {
+			buf = pinned;
+		}
+		if (buf == NULL) {
+			cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+			continue;
+		}
+		buf->b_busy = true;
+
+		if (buf->b_pinned) {
+			result = sfs_buf_save(sfs, buf);
+			if (result) {
+				buf->b_busy = false;
+				cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+				return result;
+			}
+		}
+		else if (buf->b_valid && buf->b_dirty) {
+			result = sfs_buf_writeback(sfs, buf);
+			if (result) {
+				buf->b_busy = false;
+				cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+				return result;
+			}
+		}
+		if (buf->b_valid) {
+			sfs_hash_remove(sfs, buf);
+			buf->b_valid = false;
+			SFS_BUFSTAT(evictions);
+		}
+
+		/* Someone else may have loaded BLOCK while we wrote */
+		if (sfs_hash_find(sfs, block) != NULL) {
+			sfs_lru_remove(sfs, buf);
+			sfs_lru_addtail(sfs, buf);
+			buf->b_busy = false;
+			cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+			continue;
+		}
+
+		/*
+		 * Claim the block. It's busy, so anyone else looking
+		 * for it will wait until it's loaded.
+		 */
+		buf->b_block = block;
+		buf->b_valid = true;
+		buf->b_dirty = false;
+		buf->b_readahead = readahead;
+		sfs_hash_add(sfs, buf);
+
+		js = sfs->sfs_jnsaved > 0 ? sfs_buf_takesaved(sfs, block) : NULL;
+		if (js != NULL) {
+			memcpy(buf->b_data, js->js_data, sfs->sfs_blocksize);
+			kfree(js->js_data);
+			kfree(js);
+			buf->b_dirty = true;
+			buf->b_pinned = true;
+			sfs->sfs_jpinned++;
+		}
+		else if (doread) {
+			lock_release(sfs->sfs_buflock);
+			result = sfs_rblock(sfs, buf->b_data, block);
+			lock_acquire(sfs->sfs_buflock);
+			if (result) {
+				/* leave it invalid, at the tail */
+				sfs_hash_remove(sfs, buf);
+				buf->b_valid = false;
+				sfs_lru_remove(sfs, buf);
+				sfs_lru_addtail(sfs, buf);
+				buf->b_busy = false;
+				cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+				return result;
+			}
+			SFS_BUFSTAT(reads);
+		}
+		else {
+			bzero(buf->b_data, sfs->sfs_blocksize);
+		}
+		break;
+	}
+
+	buf->b_busy = true;
+	sfs_lru_remove(sfs, buf);
+	sfs_lru_addhead(sfs, buf);
+	*ret = buf;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-ahead
+
+/*
+ * Read-ahead thread: take blocks off the queue and read them in.
+ * While it works on a block, sfs_racurrent tells sfs_buf_cleanup not
+ * to free the volume out from under it.
+ */
+static
+void
+sfs_readaheader(void *junk1, unsigned long junk2)
+{
+	struct sfs_fs *sfs;
+	struct sfs_buf *buf;
+	uint32_t block;
+	int result;
+
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		lock_acquire(sfs_ralock);
+		while (sfs_ranum == 0) {
+			cv_wait(sfs_racv, sfs_ralock);
+		}
+		sfs = sfs_raqueue[sfs_rahead].sfs;
+		block = sfs_raqueue[sfs_rahead].block;
+		sfs_rahead = (sfs_rahead + 1) % SFS_RAQUEUE;
+		sfs_ranum--;
+		sfs_racurrent = sfs;
+		lock_release(sfs_ralock);
+
+		lock_acquire(sfs->sfs_buflock);
+		result = sfs_buf_lookup(sfs, block, true, true, &buf);
+		if (result == 0) {
+			buf->b_busy = false;
+			cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+			SFS_BUFSTAT(readaheads);
+		}
+		lock_release(sfs->sfs_buflock);
+
+		lock_acquire(sfs_ralock);
+		sfs_racurrent = NULL;
+		cv_broadcast(sfs_racv, sfs_ralock);
+		lock_release(sfs_ralock);
+	}
+}
+
+/*
+ * Queue blocks to be read into the cache in the background. Blocks
+ * already cached are skipped.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, const uint32_t *blocks, unsigned n)
+{
+	uint32_t want[SFS_RAMAX];
+	unsigned i, ix, nwant;
+
+	KASSERT(n <= SFS_RAMAX);
+
+	lock_acquire(sfs->sfs_buflock);
+	nwant = 0;
+	for (i=0; i<n; i++) {
+		if (sfs_hash_find(sfs, blocks[i]) == NULL) {
+			want[nwant++] = blocks[i];
+		}
+	}
+	lock_release(sfs->sfs_buflock);
+
+	lock_acquire(sfs_ralock);
+	for (i=0; i<nwant && sfs_ranum < SFS_RAQUEUE; i++) {
+		ix = (sfs_rahead + sfs_ranum) % SFS_RAQUEUE;
+		sfs_raqueue[ix].sfs = sfs;
+		sfs_raqueue[ix].block = want[i];
+		sfs_ranum++;
+	}
+	cv_broadcast(sfs_racv, sfs_ralock);
+	lock_release(sfs_ralock);
+}
+
+/*
+ * Drop a volume's pending read-ahead, and wait for any block the
+ * thread is already reading, at unmount.
+ */
+static
+void
+sfs_readahead_purge(struct sfs_fs *sfs)
+{
+	unsigned i, from, to, num;
+
+	lock_acquire(sfs_ralock);
+	while (sfs_racurrent == sfs) {
+		cv_wait(sfs_racv, sfs_ralock);
+	}
+	num = 0;
+	for (i=0; i<sfs_ranum; i++) {
+		from = (sfs_rahead + i) % SFS_RAQUEUE;
+		if (sfs_raqueue[from].sfs == sfs) {
+			continue;
+		}
+		to = (sfs_rahead + num) % SFS_RAQUEUE;
+		sfs_raqueue[to] = sfs_raqueue[from];
+		num++;
+	}
+	sfs_ranum = num;
+	lock_release(sfs_ralock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool doread,
+	    struct sfs_buf **ret)
+{
+	int result;
+
+	SFS_BUFSTAT(lookups);
+
+	lock_acquire(sfs->sfs_buflock);
+	result = sfs_buf_lookup(sfs, block, doread, false, ret);
+	lock_release(sfs->sfs_buflock);
+	return result;
+}
+
+void
+sfs_buf_dirty(struct sfs_buf *buf)
+{
+	KASSERT(buf->b_valid);
+	KASSERT(buf->b_busy);
+	buf->b_dirty = true;
+}
+
+/*
+ * Mark a buffer holding metadata (an inode, indirect block or
+ * directory block) dirty. On a journaled volume it's pinned until
+ * the next commit, and the block no longer counts as freed.
+ */
+void
+sfs_buf_metadirty(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	sfs_buf_dirty(buf);
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_buflock);
+	if (!buf->b_pinned) {
+		buf->b_pinned = true;
+		sfs->sfs_jpinned++;
+	}
+	if (!bitmap_isset(sfs->sfs_jmeta, buf->b_block)) {
+		bitmap_mark(sfs->sfs_jmeta, buf->b_block);
+	}
+	if (bitmap_isset(sfs->sfs_jrevoke, buf->b_block)) {
+		bitmap_unmark(sfs->sfs_jrevoke, buf->b_block);
+		sfs->sfs_jnrevoke--;
+	}
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Note that BLOCK has been freed, on a journaled volume. If it was
+ * metadata that might be in the journal, or is about to be, the next
+ * transaction says so, so that replay doesn't write it over whatever
+ * the block gets used for next.
+ */
+void
+sfs_buf_revoke(struct sfs_fs *sfs, uint32_t block)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_buflock);
+	if (bitmap_isset(sfs->sfs_jmeta, block) &&
+	    !bitmap_isset(sfs->sfs_jrevoke, block)) {
+		bitmap_mark(sfs->sfs_jrevoke, block);
+		sfs->sfs_jnrevoke++;
+	}
+	lock_release(sfs->sfs_buflock);
+}
+
+void
+sfs_buf_release(struct sfs_buf *buf)
+{
+	struct sfs_fs *sfs = buf->b_fs;
+
+	lock_acquire(sfs->sfs_buflock);
+	KASSERT(buf->b_busy);
+	buf->b_busy = false;
+	cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Check whether BLOCK is cached, without counting a lookup or
+ * touching the LRU order. For callers deciding whether to bypass the
+ * cache.
+ */
+bool
+sfs_buf_cached(struct sfs_fs *sfs, uint32_t block)
+{
+	bool ret;
+
+	lock_acquire(sfs->sfs_buflock);
+	ret = sfs_hash_find(sfs, block) != NULL;
+	lock_release(sfs->sfs_buflock);
+	return ret;
+}
+
+/*
+ * Drop any cached copy of BLOCK, dirty or not, because the caller is
+ * overwriting it on disk. Waits for the read-ahead thread if it's
+ * reading the block in.
+ */
+void
+sfs_buf_invalidate(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *buf;
+	struct sfs_jsaved *js;
+
+	lock_acquire(sfs->sfs_buflock);
+	while ((buf = sfs_hash_find(sfs, block)) != NULL && buf->b_busy) {
+		cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+	}
+	if (buf != NULL) {
+		if (buf->b_pinned) {
+			buf->b_pinned = false;
+			sfs->sfs_jpinned--;
+		}
+		sfs_hash_remove(sfs, buf);
+		buf->b_valid = false;
+		buf->b_dirty = false;
+		sfs_lru_remove(sfs, buf);
+		sfs_lru_addtail(sfs, buf);
+	}
+	js = sfs->sfs_jnsaved > 0 ? sfs_buf_takesaved(sfs, block) : NULL;
+	lock_release(sfs->sfs_buflock);
+
+	if (js != NULL) {
+		kfree(js->js_data);
+		kfree(js);
+	}
+}
+
+/*
+ * For a commit, with no operation in progress: make every pinned
+ * buffer busy and put it in BUFS, which has room for them all.
+ * Revoked blocks aren't logged; their buffers are unpinned and
+ * cleaned, and their saved copies dropped. The other saved blocks
+ * stay on the volume's list, for the commit to log and then write
+ * in place; until then anyone who wants one waits. Returns the number
+ * of buffers.
+ */
+unsigned
+sfs_buf_jcollect(struct sfs_fs *sfs, struct sfs_buf **bufs)
+{
+	struct sfs_jsaved **jsp, *js;
+	unsigned i, n;
+
+	lock_acquire(sfs->sfs_buflock);
+ again:
+	for (i=0; i<sfs->sfs_nbufs; i++) {
+		if (sfs->sfs_bufs[i].b_pinned && sfs->sfs_bufs[i].b_busy) {
+			cv_wait(sfs->sfs_bufcv, sfs->sfs_buflock);
+			goto again;
+		}
+	}
+
+	n = 0;
+	for (i=0; i<sfs->sfs_nbufs; i++) {
+		struct sfs_buf *buf = &sfs->sfs_bufs[i];
+		if (!buf->b_pinned) {
+			continue;
+		}
+		if (bitmap_isset(sfs->sfs_jrevoke, buf->b_block)) {
+			buf->b_pinned = false;
+			buf->b_dirty = false;
+			sfs->sfs_jpinned--;
+			continue;
+		}
+		buf->b_busy = true;
+		bufs[n++] = buf;
+	}
+
+	jsp = &sfs->sfs_jsaved;
+	while (*jsp != NULL) {
+		js = *jsp;
+		if (bitmap_isset(sfs->sfs_jrevoke, js->js_block)) {
+			*jsp = js->js_next;
+			sfs->sfs_jnsaved--;
+			kfree(js->js_data);
+			kfree(js);
+		}
+		else {
+			jsp = &js->js_next;
+		}
+	}
+	sfs->sfs_jsavedbusy = true;
+	lock_release(sfs->sfs_buflock);
+
+	return n;
+}
+
+/*
+ * After a commit: let go of the buffers sfs_buf_jcollect handed out,
+ * unpinning them if the commit worked, and if DROPSAVED is set drop
+ * the saved blocks, which the commit has written in place.
+ */
+void
+sfs_buf_jdone(struct sfs_fs *sfs, struct sfs_buf **bufs, unsigned n,
+	      bool committed, bool dropsaved)
+{
+	struct sfs_jsaved *js;
+	unsigned i;
+
+	lock_acquire(sfs->sfs_buflock);
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy && bufs[i]->b_pinned);
+		if (committed) {
+			bufs[i]->b_pinned = false;
+			sfs->sfs_jpinned--;
+		}
+		bufs[i]->b_busy = false;
+	}
+	while (dropsaved && sfs->sfs_jsaved != NULL) {
+		js = sfs->sfs_jsaved;
+		sfs->sfs_jsaved = js->js_next;
+		sfs->sfs_jnsaved--;
+		kfree(js->js_data);
+		kfree(js);
+	}
+	sfs->sfs_jsavedbusy = false;
+	cv_broadcast(sfs->sfs_bufcv, sfs->sfs_buflock);
+	lock_release(sfs->sfs_buflock);
+}
+
+/*
+ * Start the syncer and read-ahead threads, on the first mount.
+ */
+static
+int
+sfs_buf_startthreads(void)
+{
+	int result;
+
+	sfs_ralock = lock_create("sfs readahead");
+	if (sfs_ralock == NULL) {
+		return ENOMEM;
+	}
+	sfs_racv = cv_create("sfs readahead");
+	if (sfs_racv == NULL) {
+		lock_destroy(sfs_ralock);
+		sfs_ralock = NULL;
+		return ENOMEM;
+	}
+
+	result = thread_fork("sfs syncer", sfs_syncer, NULL, 0, NULL);
+	if (result) {
+		cv_destroy(sfs_racv);
+		lock_destroy(sfs_ralock);
+		sfs_racv = NULL;
+		sfs_ralock = NULL;
+		return result;
+	}
+	result = thread_fork("sfs readahead", sfs_readaheader, NULL, 0, NULL);
+	if (result) {
+		/* The syncer is harmless on its own; leave it be */
+		return result;
+	}
+
+	sfs_threads_started = true;
+	return 0;
+}
+
+/*
+ * Free the buffers, and the data of the first N of them.
+ */
+static
+void
+sfs_buf_freedata(struct sfs_fs *sfs, unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		kfree(sfs->sfs_bufs[i].b_data);
+	}
+	kfree(sfs->sfs_bufs);
+	sfs->sfs_bufs = NULL;
+}
+
+/*
+ * Set up the cache at mount time. Needs sfs_blocksize.
+ */
+int
+sfs_buf_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+	int result;
+
+	sfs->sfs_buflock = lock_create("sfs buffers");
+	if (sfs->sfs_buflock == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_bufcv = cv_create("sfs buffers");
+	if (sfs->sfs_bufcv == NULL) {
+		lock_destroy(sfs->sfs_buflock);
+		return ENOMEM;
+	}
+	sfs->sfs_nbufs = SFS_BUFSPACE / sfs->sfs_blocksize;
+	if (sfs->sfs_nbufs < SFS_MINBUFS) {
+		sfs->sfs_nbufs = SFS_MINBUFS;
+	}
+	sfs->sfs_bufs = kmalloc(sfs->sfs_nbufs * sizeof(struct sfs_buf));
+	if (sfs->sfs_bufs == NULL) {
+		cv_destroy(sfs->sfs_bufcv);
+		lock_destroy(sfs->sfs_buflock);
+		return ENOMEM;
+	}
+	for (i=0; i<sfs->sfs_nbufs; i++) {
+		sfs->sfs_bufs[i].b_data = kmalloc(sfs->sfs_blocksize);
+		if (sfs->sfs_bufs[i].b_data == NULL) {
+			sfs_buf_freedata(sfs, i);
+			cv_destroy(sfs->sfs_bufcv);
+			lock_destroy(sfs->sfs_buflock);
+			return ENOMEM;
+		}
+	}
+
+	for (i=0; i<SFS_BUFHASH; i++) {
+		sfs->sfs_bufhash[i] = NULL;
+	}
+	sfs->sfs_lruhead = sfs->sfs_lrutail = NULL;
+	sfs->sfs_jpinned = 0;
+	sfs->sfs_jsaved = NULL;
+	sfs->sfs_jnsaved = 0;
+	sfs->sfs_jsavedbusy = false;
+	for (i=0; i<sfs->sfs_nbufs; i++) {
+		struct sfs_buf *buf = &sfs->sfs_bufs[i];
+		buf->b_fs = sfs;
+		buf->b_hashnext = NULL;
+		buf->b_block = 0;
+		buf->b_valid = false;
+		buf->b_dirty = false;
+		buf->b_readahead = false;
+		buf->b_busy = false;
+		buf->b_pinned = false;
+		sfs_lru_addtail(sfs, buf);
+	}
+
+	if (!sfs_threads_started) {
+		result = sfs_buf_startthreads();
+		if (result) {
+			sfs_buf_freedata(sfs, sfs->sfs_nbufs);
+			cv_destroy(sfs->sfs_bufcv);
+			lock_destroy(sfs->sfs_buflock);
+			return result;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Tear down the cache at unmount time. Must already be flushed.
+ */
+void
+sfs_buf_cleanup(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs_readahead_purge(sfs);
+
+	for (i=0; i<sfs->sfs_nbufs; i++) {
+		KASSERT(!sfs->sfs_bufs[i].b_busy);
+		KASSERT(!sfs->sfs_bufs[i].b_dirty);
+	}
+	KASSERT(sfs->sfs_jsaved == NULL);
+	sfs_buf_freedata(sfs, sfs->sfs_nbufs);
+	cv_destroy(sfs->sfs_bufcv);
+	lock_destroy(sfs->sfs_buflock);
+}
+
+/*
+ * Print the cache counters, summed over all volumes, and optionally
+ * clear them.
+ */
+void
+sfs_buf_printstats(bool reset)
+{
+	struct sfs_bufstats st;
+	uint64_t pct;
+
+	spinlock_acquire(&sfs_bufstatlock);
+	st = sfs_bufstats;
+	if (reset) {
+		bzero(&sfs_bufstats, sizeof(sfs_bufstats));
+	}
+	spinlock_release(&sfs_bufstatlock);
+
+	pct = st.lookups == 0 ? 0 : (uint64_t)st.hits * 1000 / st.lookups;
+	kprintf("sfs buffer cache: %d KB or %d buffers per volume, "
+		"whichever is more\n", SFS_BUFSPACE/1024, SFS_MINBUFS);
+	kprintf("    %lu lookups, %lu hits (%lu.%lu%%)\n",
+		st.lookups, st.hits,
+		(unsigned long)(pct/10), (unsigned long)(pct%10));
+	kprintf("    %lu blocks read, %lu written back, %lu evicted\n",
+		st.reads, st.writes, st.evictions);
+	kprintf("    %lu blocks read ahead, %lu of them used\n",
+		st.readaheads, st.rahits);
+}
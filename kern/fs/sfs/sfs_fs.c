@@ -39,23 +39,21 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
 
-/* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
-
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
  * We always do the whole bitmap at once; writing individual sectors
  * might or might not be a worthwhile optimization.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
+ * The free block bitmap consists of SFS_FS_BITBLOCKS blocks of bits,
+ * one bit for each block on the filesystem. The number of blocks in
+ * the bitmap is thus rounded up to the nearest multiple of the number
+ * of bits in a block, e.g. 512*8 = 4096 for the original format.
+ * (This rounded number is SFS_FS_BITMAPSIZE.) This means
  * that the bitmap will (in general) contain space for some number of
  * invalid sectors that are actually beyond the end of the disk
  * device. This is ok. These sectors are supposed to be marked "in
@@ -63,27 +61,26 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * BITDATA is the bitmap's data: the live copy when reading at mount
+ * time, or a snapshot taken under sfs_freemaplock when writing.
  */
 
 static
 int
-sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw, char *bitdata)
 {
 	uint32_t j, mapsize;
-	char *bitdata;
 	int result;
 
 	/* Number of blocks in the bitmap. */
 	mapsize = SFS_FS_BITBLOCKS(sfs);
-
-	/* Pointer to our bitmap data in memory. */
-	bitdata = bitmap_getdata(sfs->sfs_freemap);
 	
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+		void *ptr = bitdata + j*sfs->sfs_blocksize;
 
 		/* and read or write it. The bitmap starts at sector 2. */ 
 		if (rw == UIO_READ) {
@@ -101,6 +98,55 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	return 0;
 }
 
+/*
+ * Read or write the superblock. It's at the start of block 0, and no
+ * bigger than the smallest block size, so it has I/O of its own.
+ */
+static
+int
+sfs_superio(struct sfs_fs *sfs, enum uio_rw rw, struct sfs_super *sp)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, sp, sizeof(*sp), 0, rw);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Build the free-run summary the allocator uses to skip full parts of
+ * the disk: a count of free blocks for each block of the freemap.
+ */
+static
+int
+sfs_countfree(struct sfs_fs *sfs)
+{
+	uint32_t g, i, ngroups, nblocks, first, limit;
+
+	ngroups = SFS_FS_BITBLOCKS(sfs);
+	nblocks = sfs->sfs_super.sp_nblocks;
+
+	sfs->sfs_groupfree = kmalloc(ngroups * sizeof(uint32_t));
+	if (sfs->sfs_groupfree == NULL) {
+		return ENOMEM;
+	}
+
+	for (g=0; g<ngroups; g++) {
+		sfs->sfs_groupfree[g] = 0;
+		first = g * SFS_FS_BLOCKBITS(sfs);
+		limit = first + SFS_FS_BLOCKBITS(sfs);
+		if (limit > nblocks) {
+			limit = nblocks;
+		}
+		for (i=first; i<limit; i++) {
+			if (!bitmap_isset(sfs->sfs_freemap, i)) {
+				sfs->sfs_groupfree[g]++;
+			}
+		}
+	}
+	return 0;
+}
+
 /*
  * Sync routine. This is what gets invoked if you do FS_SYNC on the
  * sfs filesystem structure.
@@ -111,11 +157,14 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
+	struct vnode **vns;
+	struct sfs_super sb;
+	char *mapcopy;
+	size_t mapbytes;
 	unsigned i, num;
+	bool writesb;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,34 +197,93 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
+	/*
+	 * Go over the array of loaded vnodes, syncing as we go. VOP_FSYNC
+	 * takes the vnode lock, which mustn't be waited for while holding
+	 * the table lock, so take a reference to each vnode first and
+	 * sync them afterwards.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 	num = vnodearray_num(sfs->sfs_vnodes);
+	vns = kmalloc((num > 0 ? num : 1) * sizeof(struct vnode *));
+	if (vns == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	for (i=0; i<num; i++) {
+		vns[i] = vnodearray_get(sfs->sfs_vnodes, i);
+		VOP_INCREF(vns[i]);
+	}
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		VOP_FSYNC(vns[i]);
+		VOP_DECREF(vns[i]);
+	}
+	kfree(vns);
+
+	/*
+	 * That put the inodes in the buffer cache. On a journaled
+	 * volume one commit takes them and the rest of the metadata,
+	 * freemap included, to the journal; they go in place later.
+	 * Otherwise write it all back now.
+	 */
+	if (sfs->sfs_journaled) {
+		result = sfs_jcommit(sfs, false);
+	}
+	else {
+		result = sfs_buf_flush(sfs);
+	}
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * If the free block map or superblock need to be written,
+	 * snapshot them and write the copies, so allocation can carry
+	 * on during the I/O.
+	 */
+	mapbytes = SFS_FS_BITBLOCKS(sfs) * sfs->sfs_blocksize;
+	mapcopy = kmalloc(mapbytes);
+	if (mapcopy == NULL) {
+		return ENOMEM;
 	}
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_freemapdirty && !sfs->sfs_journaled) {
+		memcpy(mapcopy, bitmap_getdata(sfs->sfs_freemap), mapbytes);
+		sfs->sfs_freemapdirty = false;
+		lock_release(sfs->sfs_freemaplock);
+
+		result = sfs_mapio(sfs, UIO_WRITE, mapcopy);
+
+		lock_acquire(sfs->sfs_freemaplock);
 		if (result) {
-			vfs_biglock_release();
+			sfs->sfs_freemapdirty = true;
+			lock_release(sfs->sfs_freemaplock);
+			kfree(mapcopy);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	writesb = sfs->sfs_superdirty;
+	if (writesb) {
+		sb = sfs->sfs_super;
+		sfs->sfs_superdirty = false;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	kfree(mapcopy);
 
 	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	if (writesb) {
+		result = sfs_superio(sfs, UIO_WRITE, &sb);
 		if (result) {
-			vfs_biglock_release();
+			lock_acquire(sfs->sfs_freemaplock);
+			sfs->sfs_superdirty = true;
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
-		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -189,13 +297,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	/* Set at mount time and never changed */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -208,22 +312,50 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
 	vfs_biglock_acquire();
 	
 	/* Do we have any files open? If so, can't unmount. */
+	lock_acquire(sfs->sfs_vnlock);
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
+		lock_release(sfs->sfs_vnlock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Reclaiming the last vnodes may have dirtied inode blocks.
+	 * On a journaled volume, commit that and leave the journal
+	 * empty, so the next mount has nothing to replay.
+	 */
+	if (sfs->sfs_journaled) {
+		result = sfs_jcommit(sfs, true);
+	}
+	else {
+		result = sfs_buf_flush(sfs);
+	}
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_reserved == 0);
 
 	/* Once we start nuking stuff we can't fail. */
+	kfree(sfs->sfs_diov);
+	lock_destroy(sfs->sfs_diovlock);
+	sfs_buf_cleanup(sfs);
+	sfs_jcleanup(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs->sfs_groupfree);
 	bitmap_destroy(sfs->sfs_freemap);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -255,6 +387,7 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
 	vfs_biglock_acquire();
@@ -267,15 +400,14 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 */
 	KASSERT(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	KASSERT(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	KASSERT(sizeof(struct sfs_inode2)==SFS_BLOCKSIZE);
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
 	 * We can't mount on devices with the wrong sector size.
 	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * (Original-format volumes have one sector per block; in the
+	 * current format a block may be several sectors.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
 		vfs_biglock_release();
@@ -296,13 +428,39 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		vfs_biglock_release();
 		return ENOMEM;
 	}
+	for (i=0; i<SFS_VNHASH; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	/* Create locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
 
-	/* Set the device so we can use sfs_rblock() */
+	/*
+	 * Set the device so we can use sfs_rwblock(), and a block
+	 * size for its messages until we know the real one.
+	 */
 	sfs->sfs_device = dev;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
 	/* Load superblock */
-	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	result = sfs_superio(sfs, UIO_READ, &sfs->sfs_super);
 	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
@@ -316,36 +474,141 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
 		return EINVAL;
 	}
 	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
+	switch (sfs->sfs_super.sp_version) {
+	    case SFS_OLDVERSION:
+		sfs->sfs_blocksize = SFS_BLOCKSIZE;
+		break;
+	    case SFS_VERSION:
+		sfs->sfs_blocksize = sfs->sfs_super.sp_blocksize;
+		if (sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+		    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE ||
+		    (sfs->sfs_blocksize & (sfs->sfs_blocksize - 1)) != 0) {
+			kprintf("sfs: Bad block size %u\n",
+				sfs->sfs_blocksize);
+			lock_destroy(sfs->sfs_freemaplock);
+			lock_destroy(sfs->sfs_vnlock);
+			vnodearray_destroy(sfs->sfs_vnodes);
+			kfree(sfs);
+			vfs_biglock_release();
+			return EINVAL;
+		}
+		break;
+	    default:
+		kprintf("sfs: Unknown format version %u\n",
+			sfs->sfs_super.sp_version);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return EINVAL;
+	}
+
+	if ((uint64_t)sfs->sfs_super.sp_nblocks * sfs->sfs_blocksize >
+	    (uint64_t)dev->d_blocks * dev->d_blocksize) {
+		kprintf("sfs: warning - fs has %u blocks of %u bytes, "
+			"device has %u of %u\n",
+			sfs->sfs_super.sp_nblocks, sfs->sfs_blocksize,
+			dev->d_blocks, dev->d_blocksize);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/* Replay the journal, if any, before loading what it covers */
+	result = sfs_jinit(sfs);
+	if (result) {
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
+		sfs_jcleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
 		return ENOMEM;
 	}
-	result = sfs_mapio(sfs, UIO_READ);
+	result = sfs_mapio(sfs, UIO_READ, bitmap_getdata(sfs->sfs_freemap));
+	if (result) {
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jcleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/* Summarize free space for the allocator; start it at the front */
+	result = sfs_countfree(sfs);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jcleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
 		vfs_biglock_release();
 		return result;
 	}
+	sfs->sfs_allocnext = 0;
+	sfs->sfs_reserved = 0;
+
+	/* Set up the buffer cache */
+	result = sfs_buf_init(sfs);
+	if (result) {
+		kfree(sfs->sfs_groupfree);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jcleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return result;
+	}
+
+	/*
+	 * The iovecs for writing out delayed blocks are kept here
+	 * rather than on the stack, because sfs_dflush is deep in the
+	 * write path.
+	 */
+	sfs->sfs_diovlock = lock_create("sfs delayed");
+	sfs->sfs_diov = kmalloc(SFS_DELAYMAX * sizeof(struct iovec));
+	if (sfs->sfs_diovlock == NULL || sfs->sfs_diov == NULL) {
+		if (sfs->sfs_diovlock != NULL) {
+			lock_destroy(sfs->sfs_diovlock);
+		}
+		kfree(sfs->sfs_diov);
+		sfs_buf_cleanup(sfs);
+		kfree(sfs->sfs_groupfree);
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_jcleanup(sfs);
+		lock_destroy(sfs->sfs_freemaplock);
+		lock_destroy(sfs->sfs_vnlock);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -0,0 +1,1108 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * SFS filesystem
+ *
+ * Metadata journal.
+ *
+ * Changes to metadata collect in the buffer cache (pinned, so they
+ * aren't written in place) and in the freemap (blocks marked in
+ * sfs_mapdirty) until a commit. A commit waits for the operations in
+ * progress to finish and holds off new ones; puts every modified
+ * inode into the buffer cache; and writes the pinned buffers, saved
+ * blocks and modified freemap blocks to the journal as one
+ * transaction, which takes one device request for the descriptors and
+ * blocks and one for the commit block. The buffers are then unpinned,
+ * to be written in place whenever they're evicted or flushed. Blocks
+ * freed since they were journaled are listed as revoked. Blocks freed
+ * in a transaction are logged as free but kept (sfs_jfreed) until its
+ * commit block is on disk, so nothing can be written over them while
+ * a crash would still give them back to the file they came from.
+ *
+ * Once the journal is more than half full, a commit also writes
+ * everything in place (a checkpoint) and starts the journal over. If
+ * a transaction turns up that won't fit, the journal is replayed as at
+ * mount time to empty it first.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Counters for all volumes, for sfs_jprintstats. */
+struct sfs_jstats {
+	unsigned long ops;              /* operations */
+	unsigned long commits;          /* transactions committed */
+	unsigned long logged;           /* ... blocks in them */
+	unsigned long revoked;          /* ... revoke entries in them */
+	unsigned long checkpoints;      /* journal emptied after commit */
+	unsigned long overflows;        /* ... or replayed to make room */
+	unsigned long replayed;         /* transactions replayed at mount */
+};
+static struct sfs_jstats sfs_jstats;
+static struct spinlock sfs_jstatlock = SPINLOCK_INITIALIZER;
+
+#define SFS_JSTAT(field, n) do {                   \
+		spinlock_acquire(&sfs_jstatlock);   \
+		sfs_jstats.field += (n);            \
+		spinlock_release(&sfs_jstatlock);   \
+	} while (0)
+
+/*
+ * State for replay: space for a descriptor and a logged block, and
+ * the revoke entries found, with the transaction each is in.
+ */
+struct sfs_jrev {
+	uint32_t jv_block;
+	uint32_t jv_seq;
+};
+
+struct sfs_jreplay {
+	char *jr_desc;
+	char *jr_data;
+	struct sfs_jrev *jr_revs;
+	unsigned jr_nrevs;
+	unsigned jr_maxrevs;
+};
+
+////////////////////////////////////////////////////////////
+//
+// Journal blocks
+
+/*
+ * Add LEN bytes of DATA to the running checksum SUM.
+ */
+static
+uint32_t
+sfs_jsum(uint32_t sum, const void *data, size_t len)
+{
+	const uint32_t *words = data;
+	size_t i;
+
+	for (i=0; i<len/sizeof(uint32_t); i++) {
+		sum = ((sum << 5) | (sum >> 27)) + words[i];
+	}
+	return sum;
+}
+
+/*
+ * Read or write block JBLOCK of the journal.
+ */
+static
+int
+sfs_jio(struct sfs_fs *sfs, enum uio_rw rw, void *data, uint32_t jblock)
+{
+	uint32_t block = sfs->sfs_super.sp_jstart + jblock;
+
+	if (rw == UIO_READ) {
+		return sfs_rblock(sfs, data, block);
+	}
+	return sfs_wblock(sfs, data, block);
+}
+
+/*
+ * Fill in BUF as a journal block of type TYPE.
+ */
+static
+struct sfs_jhdr *
+sfs_jmkhdr(struct sfs_fs *sfs, char *buf, uint32_t type, uint32_t seq)
+{
+	struct sfs_jhdr *hdr = (struct sfs_jhdr *)buf;
+
+	bzero(buf, sfs->sfs_blocksize);
+	hdr->jh_magic = SFS_JMAGIC;
+	hdr->jh_type = type;
+	hdr->jh_seq = seq;
+	return hdr;
+}
+
+/*
+ * Mark the journal empty: replay is to start with transaction SEQ,
+ * which isn't there yet. BUF is scratch space.
+ */
+static
+int
+sfs_jreset(struct sfs_fs *sfs, char *buf, uint32_t seq)
+{
+	int result;
+
+	sfs_jmkhdr(sfs, buf, SFS_JTYPE_HEADER, seq);
+	result = sfs_jio(sfs, UIO_WRITE, buf, 0);
+	if (result) {
+		return result;
+	}
+	sfs->sfs_jseq = seq;
+	sfs->sfs_jhead = 1;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Replay
+
+/*
+ * Check whether BLOCK, logged in transaction SEQ, has been revoked
+ * since: by that transaction or a later one, or since the last commit.
+ */
+static
+bool
+sfs_jrevoked(struct sfs_fs *sfs, struct sfs_jreplay *jr, uint32_t block,
+	     uint32_t seq)
+{
+	unsigned i;
+
+	if (bitmap_isset(sfs->sfs_jrevoke, block)) {
+		return true;
+	}
+	for (i=0; i<jr->jr_nrevs; i++) {
+		if (jr->jr_revs[i].jv_block == block &&
+		    jr->jr_revs[i].jv_seq - seq < 0x80000000) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Remember that transaction SEQ revokes BLOCK.
+ */
+static
+int
+sfs_jaddrev(struct sfs_jreplay *jr, uint32_t block, uint32_t seq)
+{
+	struct sfs_jrev *revs;
+	unsigned max;
+
+	if (jr->jr_nrevs == jr->jr_maxrevs) {
+		max = jr->jr_maxrevs ? jr->jr_maxrevs * 2 : 64;
+		revs = kmalloc(max * sizeof(*revs));
+		if (revs == NULL) {
+			return ENOMEM;
+		}
+		if (jr->jr_nrevs > 0) {
+			memcpy(revs, jr->jr_revs,
+			       jr->jr_nrevs * sizeof(*revs));
+		}
+		kfree(jr->jr_revs);
+		jr->jr_revs = revs;
+		jr->jr_maxrevs = max;
+	}
+	jr->jr_revs[jr->jr_nrevs].jv_block = block;
+	jr->jr_revs[jr->jr_nrevs].jv_seq = seq;
+	jr->jr_nrevs++;
+	return 0;
+}
+
+/*
+ * Look at transaction SEQ, which should start at block OFF of the
+ * journal. If it's complete, set *LEN to the number of blocks it
+ * takes; otherwise set it to 0. The first time through (APPLY false)
+ * check the checksum and collect the revoke entries; the second time,
+ * write the logged blocks that haven't been revoked in place.
+ */
+static
+int
+sfs_jtrans(struct sfs_fs *sfs, struct sfs_jreplay *jr, uint32_t off,
+	   uint32_t seq, bool apply, uint32_t *len)
+{
+	uint32_t jblocks = sfs->sfs_super.sp_jblocks;
+	uint32_t jstart = sfs->sfs_super.sp_jstart;
+	struct sfs_jhdr *hdr = (struct sfs_jhdr *)jr->jr_desc;
+	uint32_t *ents = (uint32_t *)(hdr + 1);
+	uint32_t pos, sum, block, i;
+	unsigned nrevs = jr->jr_nrevs;
+	int result;
+
+	*len = 0;
+	sum = 0;
+	pos = off;
+	while (1) {
+		if (pos >= jblocks) {
+			goto incomplete;
+		}
+		result = sfs_jio(sfs, UIO_READ, jr->jr_desc, pos);
+		if (result) {
+			return result;
+		}
+		if (hdr->jh_magic != SFS_JMAGIC || hdr->jh_seq != seq) {
+			goto incomplete;
+		}
+		if (hdr->jh_type == SFS_JTYPE_COMMIT) {
+			if (!apply && hdr->jh_sum != sum) {
+				goto incomplete;
+			}
+			*len = pos + 1 - off;
+			return 0;
+		}
+		if (hdr->jh_type != SFS_JTYPE_DESC ||
+		    hdr->jh_count > SFS_BSJENTRIES(sfs->sfs_blocksize)) {
+			goto incomplete;
+		}
+		sum = sfs_jsum(sum, jr->jr_desc, sfs->sfs_blocksize);
+		pos++;
+
+		for (i=0; i<hdr->jh_count; i++) {
+			block = ents[i] & ~SFS_JREVOKE;
+			if (block >= sfs->sfs_super.sp_nblocks ||
+			    (block >= jstart && block < jstart + jblocks)) {
+				goto incomplete;
+			}
+			if (ents[i] & SFS_JREVOKE) {
+				if (!apply) {
+					result = sfs_jaddrev(jr, block, seq);
+					if (result) {
+						return result;
+					}
+				}
+				continue;
+			}
+			if (pos >= jblocks) {
+				goto incomplete;
+			}
+			result = sfs_jio(sfs, UIO_READ, jr->jr_data, pos);
+			if (result) {
+				return result;
+			}
+			pos++;
+			if (!apply) {
+				sum = sfs_jsum(sum, jr->jr_data,
+					       sfs->sfs_blocksize);
+			}
+			else if (!sfs_jrevoked(sfs, jr, block, seq)) {
+				result = sfs_wblock(sfs, jr->jr_data, block);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+
+ incomplete:
+	/* Forget its revoke entries; it never happened */
+	jr->jr_nrevs = nrevs;
+	return 0;
+}
+
+/*
+ * Replay the journal: write every complete transaction's blocks in
+ * place, in order, leaving out those revoked by the same or a later
+ * transaction or since the last commit, and then mark the journal
+ * empty. Used at mount time, and to make room when a transaction
+ * won't fit.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, unsigned *ntrans)
+{
+	struct sfs_jreplay jr;
+	struct sfs_jhdr *hdr;
+	uint32_t firstseq, seq, off, len;
+	int result;
+
+	jr.jr_revs = NULL;
+	jr.jr_nrevs = jr.jr_maxrevs = 0;
+	jr.jr_desc = kmalloc(sfs->sfs_blocksize);
+	if (jr.jr_desc == NULL) {
+		return ENOMEM;
+	}
+	jr.jr_data = kmalloc(sfs->sfs_blocksize);
+	if (jr.jr_data == NULL) {
+		kfree(jr.jr_desc);
+		return ENOMEM;
+	}
+
+	result = sfs_jio(sfs, UIO_READ, jr.jr_desc, 0);
+	if (result) {
+		goto out;
+	}
+	hdr = (struct sfs_jhdr *)jr.jr_desc;
+	if (hdr->jh_magic != SFS_JMAGIC || hdr->jh_type != SFS_JTYPE_HEADER) {
+		kprintf("sfs: %s: Bad journal header\n",
+			sfs->sfs_super.sp_volname);
+		result = EINVAL;
+		goto out;
+	}
+	firstseq = hdr->jh_seq;
+
+	/* Find the complete transactions, and what they revoke */
+	seq = firstseq;
+	off = 1;
+	while (1) {
+		result = sfs_jtrans(sfs, &jr, off, seq, false, &len);
+		if (result) {
+			goto out;
+		}
+		if (len == 0) {
+			break;
+		}
+		off += len;
+		seq++;
+	}
+
+	/* Now write them in place */
+	off = 1;
+	for (*ntrans = 0; *ntrans < seq - firstseq; (*ntrans)++) {
+		result = sfs_jtrans(sfs, &jr, off, firstseq + *ntrans,
+				    true, &len);
+		if (result) {
+			goto out;
+		}
+		if (len == 0) {
+			/* It was there a moment ago */
+			result = EIO;
+			goto out;
+		}
+		off += len;
+	}
+
+	result = sfs_jreset(sfs, jr.jr_desc, seq);
+
+ out:
+	kfree(jr.jr_revs);
+	kfree(jr.jr_data);
+	kfree(jr.jr_desc);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Commit
+
+/*
+ * Write everything committed in place, and start the journal over.
+ * Called with no operation in progress, right after a commit, so
+ * nothing is pinned and the freemap is as committed.
+ */
+static
+int
+sfs_jcheckpoint(struct sfs_fs *sfs)
+{
+	uint32_t g, ngroups = SFS_FS_BITBLOCKS(sfs);
+	char *buf;
+	int result;
+
+	buf = kmalloc(sfs->sfs_blocksize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = sfs_buf_flush(sfs);
+	if (result) {
+		kfree(buf);
+		return result;
+	}
+
+	for (g=0; g<ngroups; g++) {
+		if (!bitmap_isset(sfs->sfs_jmaplogged, g)) {
+			continue;
+		}
+		lock_acquire(sfs->sfs_freemaplock);
+		memcpy(buf, (char *)bitmap_getdata(sfs->sfs_freemap) +
+		       g * sfs->sfs_blocksize, sfs->sfs_blocksize);
+		lock_release(sfs->sfs_freemaplock);
+		result = sfs_wblock(sfs, buf, SFS_MAP_LOCATION + g);
+		if (result) {
+			kfree(buf);
+			return result;
+		}
+		bitmap_unmark(sfs->sfs_jmaplogged, g);
+	}
+
+	result = sfs_jreset(sfs, buf, sfs->sfs_jseq);
+	kfree(buf);
+	if (result) {
+		return result;
+	}
+
+	/* Nothing's in the journal any more */
+	lock_acquire(sfs->sfs_buflock);
+	bzero(bitmap_getdata(sfs->sfs_jmeta),
+	      SFS_FS_BITMAPSIZE(sfs) / CHAR_BIT);
+	lock_release(sfs->sfs_buflock);
+
+	SFS_JSTAT(checkpoints, 1);
+	return 0;
+}
+
+/*
+ * Collect the revoked blocks into ENTS, as descriptor entries.
+ */
+static
+unsigned
+sfs_jgetrevokes(struct sfs_fs *sfs, uint32_t *ents)
+{
+	uint32_t *words = bitmap_getdata(sfs->sfs_jrevoke);
+	uint32_t nwords = SFS_FS_BITMAPSIZE(sfs) / 32;
+	uint32_t w, b;
+	unsigned n = 0;
+
+	for (w=0; w<nwords; w++) {
+		if (words[w] == 0) {
+			continue;
+		}
+		for (b = w*32; b < (w+1)*32; b++) {
+			if (bitmap_isset(sfs->sfs_jrevoke, b)) {
+				ents[n++] = b | SFS_JREVOKE;
+			}
+		}
+	}
+	KASSERT(n == sfs->sfs_jnrevoke);
+	return n;
+}
+
+/*
+ * Copy freemap block G into BUF as this transaction leaves it: with
+ * the blocks freed in it free, though they stay marked in memory
+ * until it commits. Called with sfs_freemaplock held.
+ */
+static
+void
+sfs_jmapcopy(struct sfs_fs *sfs, char *buf, uint32_t g)
+{
+	uint32_t bs = sfs->sfs_blocksize;
+	const char *map, *freed;
+	uint32_t i;
+
+	map = (const char *)bitmap_getdata(sfs->sfs_freemap) + g * bs;
+	freed = (const char *)bitmap_getdata(sfs->sfs_jfreed) + g * bs;
+	for (i=0; i<bs; i++) {
+		buf[i] = map[i] & ~freed[i];
+	}
+}
+
+/*
+ * The transaction that freed the blocks in sfs_jfreed is on disk; make
+ * them available. The freemap in memory then matches what was logged.
+ */
+static
+void
+sfs_jrelease(struct sfs_fs *sfs)
+{
+	uint32_t *words = bitmap_getdata(sfs->sfs_jfreed);
+	uint32_t nwords = SFS_FS_BITMAPSIZE(sfs) / 32;
+	uint32_t groupbits = SFS_FS_BLOCKBITS(sfs);
+	uint32_t w, b;
+	unsigned n = 0;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	for (w=0; w<nwords; w++) {
+		if (words[w] == 0) {
+			continue;
+		}
+		for (b = w*32; b < (w+1)*32; b++) {
+			if (bitmap_isset(sfs->sfs_jfreed, b)) {
+				bitmap_unmark(sfs->sfs_jfreed, b);
+				bitmap_unmark(sfs->sfs_freemap, b);
+				sfs->sfs_groupfree[b / groupbits]++;
+				n++;
+			}
+		}
+	}
+	KASSERT(n == sfs->sfs_jnfreed);
+	sfs->sfs_jnfreed = 0;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Commit a transaction, and with CHECKPOINT set (or if the journal's
+ * getting full) follow it with a checkpoint. Called with no
+ * operation in progress.
+ */
+static
+int
+sfs_jdocommit(struct sfs_fs *sfs, bool checkpoint)
+{
+	uint32_t bs = sfs->sfs_blocksize;
+	uint32_t jblocks = sfs->sfs_super.sp_jblocks;
+	uint32_t perdesc = SFS_BSJENTRIES(bs);
+	uint32_t ngroups = SFS_FS_BITBLOCKS(sfs);
+	struct sfs_buf **bufs = NULL;
+	struct sfs_jsaved *js;
+	struct sfs_jhdr *hdr;
+	char **datas = NULL, **descs = NULL, *cbuf = NULL;
+	uint32_t *ents = NULL, *mapgroups = NULL;
+	struct iovec *iov = NULL;
+	struct uio ku;
+	unsigned nbufs, nsaved, nmaps, nrevs, nlog, nent, ndesc, need;
+	unsigned i, j, k, d, li, junk;
+	uint32_t g, sum;
+	bool collected = false, committed = false, savedwritten = false;
+	int result;
+
+	nsaved = nmaps = ndesc = 0;
+
+	/* Get the modified inodes into the buffer cache first */
+	result = sfs_sync_inodes(sfs);
+	if (result) {
+		return result;
+	}
+	/* Now they're pinned, and counted as such */
+	sfs->sfs_jbegun = 0;
+
+	bufs = kmalloc(sfs->sfs_nbufs * sizeof(*bufs));
+	mapgroups = kmalloc(ngroups * sizeof(uint32_t));
+	if (bufs == NULL || mapgroups == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	/* No operation is running, so nothing else touches sfs_mapdirty */
+	nmaps = 0;
+	for (g=0; g<ngroups; g++) {
+		if (bitmap_isset(sfs->sfs_mapdirty, g)) {
+			mapgroups[nmaps++] = g;
+		}
+	}
+
+	nbufs = sfs_buf_jcollect(sfs, bufs);
+	collected = true;
+	nsaved = 0;
+	for (js = sfs->sfs_jsaved; js != NULL; js = js->js_next) {
+		nsaved++;
+	}
+	nrevs = sfs->sfs_jnrevoke;
+	nlog = nbufs + nsaved + nmaps;
+	nent = nlog + nrevs;
+	if (nent == 0) {
+		goto done;
+	}
+	ndesc = DIVROUNDUP(nent, perdesc);
+	need = nlog + ndesc + 1;
+
+	if (need > jblocks - sfs->sfs_jhead) {
+		/* Won't fit; put what's there in place to make room */
+		result = sfs_jreplay(sfs, &junk);
+		if (result) {
+			goto out;
+		}
+		SFS_JSTAT(overflows, 1);
+		if (need > jblocks - sfs->sfs_jhead) {
+			/*
+			 * Operations are kept small enough (see
+			 * sfs_jroom) that this shouldn't happen. If it
+			 * does anyway, fail the commit: the changes
+			 * stay pinned in memory, and sync reports the
+			 * error instead of getting them to disk.
+			 */
+			kprintf("sfs: %s: transaction of %u blocks won't "
+				"fit in the journal\n",
+				sfs->sfs_super.sp_volname, need);
+			result = ENOSPC;
+			goto out;
+		}
+	}
+
+	/*
+	 * Lay out the entries, revokes first, and the blocks they
+	 * list: the buffers, the saved blocks, then the freemap.
+	 */
+	ents = kmalloc(nent * sizeof(uint32_t));
+	datas = kmalloc(nlog * sizeof(char *));
+	descs = kmalloc(ndesc * sizeof(char *));
+	iov = kmalloc((nlog + ndesc) * sizeof(struct iovec));
+	cbuf = kmalloc(bs);
+	if (descs != NULL) {
+		for (d=0; d<ndesc; d++) {
+			descs[d] = NULL;
+		}
+	}
+	if (datas != NULL) {
+		for (i=0; i<nmaps; i++) {
+			datas[nbufs + nsaved + i] = NULL;
+		}
+	}
+	if (ents == NULL || datas == NULL || descs == NULL || iov == NULL ||
+	    cbuf == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	k = sfs_jgetrevokes(sfs, ents);
+	li = 0;
+	for (i=0; i<nbufs; i++) {
+		ents[k++] = bufs[i]->b_block;
+		datas[li++] = bufs[i]->b_data;
+	}
+	for (js = sfs->sfs_jsaved; js != NULL; js = js->js_next) {
+		ents[k++] = js->js_block;
+		datas[li++] = js->js_data;
+	}
+	for (i=0; i<nmaps; i++) {
+		datas[li] = kmalloc(bs);
+		if (datas[li] == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+		lock_acquire(sfs->sfs_freemaplock);
+		sfs_jmapcopy(sfs, datas[li], mapgroups[i]);
+		lock_release(sfs->sfs_freemaplock);
+		ents[k++] = SFS_MAP_LOCATION + mapgroups[i];
+		li++;
+	}
+	KASSERT(k == nent && li == nlog);
+
+	/* Descriptors, each followed by its blocks */
+	sum = 0;
+	k = 0;
+	li = 0;
+	j = 0;
+	for (d=0; d<ndesc; d++) {
+		descs[d] = kmalloc(bs);
+		if (descs[d] == NULL) {
+			result = ENOMEM;
+			goto out;
+		}
+		hdr = sfs_jmkhdr(sfs, descs[d], SFS_JTYPE_DESC, sfs->sfs_jseq);
+		hdr->jh_count = nent - k < perdesc ? nent - k : perdesc;
+		memcpy(hdr + 1, ents + k, hdr->jh_count * sizeof(uint32_t));
+		sum = sfs_jsum(sum, descs[d], bs);
+		iov[j].iov_kbase = descs[d];
+		iov[j].iov_len = bs;
+		j++;
+		for (i=0; i<hdr->jh_count; i++, k++) {
+			if (ents[k] & SFS_JREVOKE) {
+				continue;
+			}
+			sum = sfs_jsum(sum, datas[li], bs);
+			iov[j].iov_kbase = datas[li];
+			iov[j].iov_len = bs;
+			j++;
+			li++;
+		}
+	}
+	KASSERT(j == nlog + ndesc);
+
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = j;
+	ku.uio_offset = (off_t)(sfs->sfs_super.sp_jstart + sfs->sfs_jhead) *
+		bs;
+	ku.uio_resid = j * bs;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = NULL;
+	result = sfs_rwblock(sfs, &ku);
+	if (result) {
+		goto out;
+	}
+
+	/* Only once all that's on disk, the commit block */
+	hdr = sfs_jmkhdr(sfs, cbuf, SFS_JTYPE_COMMIT, sfs->sfs_jseq);
+	hdr->jh_count = nlog;
+	hdr->jh_sum = sum;
+	result = sfs_jio(sfs, UIO_WRITE, cbuf, sfs->sfs_jhead + j);
+	if (result) {
+		goto out;
+	}
+	committed = true;
+	sfs->sfs_jseq++;
+	sfs->sfs_jhead += need;
+
+	/* Only now can the blocks it freed be used again */
+	sfs_jrelease(sfs);
+
+	for (i=0; i<nmaps; i++) {
+		bitmap_unmark(sfs->sfs_mapdirty, mapgroups[i]);
+		if (!bitmap_isset(sfs->sfs_jmaplogged, mapgroups[i])) {
+			bitmap_mark(sfs->sfs_jmaplogged, mapgroups[i]);
+		}
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs->sfs_nmapdirty = 0;
+	sfs->sfs_freemapdirty = false;
+	lock_release(sfs->sfs_freemaplock);
+
+	lock_acquire(sfs->sfs_buflock);
+	bzero(bitmap_getdata(sfs->sfs_jrevoke),
+	      SFS_FS_BITMAPSIZE(sfs) / CHAR_BIT);
+	sfs->sfs_jnrevoke = 0;
+	lock_release(sfs->sfs_buflock);
+
+	SFS_JSTAT(commits, 1);
+	SFS_JSTAT(logged, nlog);
+	SFS_JSTAT(revoked, nrevs);
+
+	/*
+	 * The saved blocks aren't in the cache to be written in place
+	 * later, so do it now. If that fails they're kept, and are in
+	 * the next transaction too.
+	 */
+	for (js = sfs->sfs_jsaved; js != NULL; js = js->js_next) {
+		result = sfs_wblock(sfs, js->js_data, js->js_block);
+		if (result) {
+			goto out;
+		}
+	}
+
+ done:
+	savedwritten = true;
+	sfs_buf_jdone(sfs, bufs, nbufs, committed, savedwritten);
+	collected = false;
+
+	if (checkpoint || sfs->sfs_jhead - 1 > (jblocks - 1) / 2) {
+		result = sfs_jcheckpoint(sfs);
+	}
+
+ out:
+	if (collected) {
+		sfs_buf_jdone(sfs, bufs, nbufs, committed, savedwritten);
+	}
+	if (datas != NULL) {
+		for (i=0; i<nmaps; i++) {
+			kfree(datas[nbufs + nsaved + i]);
+		}
+	}
+	if (descs != NULL) {
+		for (d=0; d<ndesc; d++) {
+			kfree(descs[d]);
+		}
+	}
+	kfree(cbuf);
+	kfree(iov);
+	kfree(descs);
+	kfree(datas);
+	kfree(ents);
+	kfree(mapgroups);
+	kfree(bufs);
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Count the blocks a transaction might hold if NOPS operations each
+ * add SFS_JOPBLOCKS blocks to what's already there, and NBEGUN
+ * operations have each left up to SFS_JOPINODES inodes to be synced
+ * when it commits (but no more than are loaded). Unlocked look at
+ * the counts; it's only a hint.
+ */
+static
+unsigned
+sfs_jused(struct sfs_fs *sfs, unsigned nops, unsigned nbegun)
+{
+	unsigned logged, inodes, loaded;
+
+	logged = sfs->sfs_jpinned + sfs->sfs_jnsaved + sfs->sfs_nmapdirty;
+	inodes = nbegun * SFS_JOPINODES;
+	loaded = vnodearray_num(sfs->sfs_vnodes);
+	if (inodes > loaded) {
+		inodes = loaded;
+	}
+	return logged + nops * SFS_JOPBLOCKS + inodes;
+}
+
+/*
+ * The most a transaction should hold: a quarter of the journal,
+ * leaving the rest as slack for descriptor blocks and for estimates
+ * that are off.
+ */
+static
+unsigned
+sfs_jlimit(struct sfs_fs *sfs)
+{
+	return (sfs->sfs_super.sp_jblocks - 1) / 4;
+}
+
+/*
+ * Check whether a transaction might not fit in the journal if one
+ * more operation starts.
+ */
+static
+bool
+sfs_jfull(struct sfs_fs *sfs)
+{
+	return sfs_jused(sfs, sfs->sfs_jnops + 1, sfs->sfs_jbegun + 1) >
+		sfs_jlimit(sfs);
+}
+
+/*
+ * How many more blocks the calling operation can change, leaving
+ * SFS_JOPBLOCKS for each of the others in progress. Operations that
+ * can change any number (writing out delayed blocks, truncating)
+ * check this as they go, and when it gets low stop where the file
+ * is consistent and end the operation; the next sfs_jbegin then
+ * commits. Without a journal there's no limit, and the size of the
+ * volume is as good as any.
+ */
+unsigned
+sfs_jroom(struct sfs_fs *sfs)
+{
+	unsigned used, limit;
+
+	if (!sfs->sfs_journaled) {
+		return sfs->sfs_super.sp_nblocks;
+	}
+
+	KASSERT(sfs->sfs_jnops > 0);
+	used = sfs_jused(sfs, sfs->sfs_jnops - 1, sfs->sfs_jbegun);
+	limit = sfs_jlimit(sfs);
+	return used < limit ? limit - used : 0;
+}
+
+/*
+ * Start an operation that changes metadata. Called before taking any
+ * vnode lock. If a commit is wanted, or what's been done so far is
+ * getting too big, wait for it, or do it if no operations are left.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	int result;
+
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	while (1) {
+		if (sfs->sfs_jcommitting || sfs->sfs_jwant > 0) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+			continue;
+		}
+		if (!sfs_jfull(sfs)) {
+			break;
+		}
+		if (sfs->sfs_jnops > 0) {
+			cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+			continue;
+		}
+
+		sfs->sfs_jcommitting = true;
+		lock_release(sfs->sfs_jlock);
+		result = sfs_jdocommit(sfs, false);
+		if (result) {
+			kprintf("sfs: %s: commit: %s\n",
+				sfs->sfs_super.sp_volname, strerror(result));
+		}
+		lock_acquire(sfs->sfs_jlock);
+		sfs->sfs_jcommitting = false;
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+		if (result) {
+			/* Go ahead anyway; the blocks stay pinned */
+			break;
+		}
+	}
+	sfs->sfs_jnops++;
+	sfs->sfs_jbegun++;
+	lock_release(sfs->sfs_jlock);
+
+	SFS_JSTAT(ops, 1);
+}
+
+/*
+ * Finish an operation.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_jlock);
+	KASSERT(sfs->sfs_jnops > 0);
+	sfs->sfs_jnops--;
+	if (sfs->sfs_jnops == 0) {
+		cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	lock_release(sfs->sfs_jlock);
+}
+
+/*
+ * Commit everything done so far: wait for the operations in progress
+ * to finish, holding off new ones.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs, bool checkpoint)
+{
+	int result;
+
+	KASSERT(sfs->sfs_journaled);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jwant++;
+	while (sfs->sfs_jcommitting || sfs->sfs_jnops > 0) {
+		cv_wait(sfs->sfs_jcv, sfs->sfs_jlock);
+	}
+	sfs->sfs_jwant--;
+	sfs->sfs_jcommitting = true;
+	lock_release(sfs->sfs_jlock);
+
+	result = sfs_jdocommit(sfs, checkpoint);
+
+	lock_acquire(sfs->sfs_jlock);
+	sfs->sfs_jcommitting = false;
+	cv_broadcast(sfs->sfs_jcv, sfs->sfs_jlock);
+	lock_release(sfs->sfs_jlock);
+
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Setup
+
+/*
+ * Destroy the journal state. Everything must have been checkpointed.
+ */
+void
+sfs_jcleanup(struct sfs_fs *sfs)
+{
+	if (!sfs->sfs_journaled) {
+		return;
+	}
+	KASSERT(sfs->sfs_jnops == 0);
+	bitmap_destroy(sfs->sfs_jfreed);
+	bitmap_destroy(sfs->sfs_mapdirty);
+	bitmap_destroy(sfs->sfs_jmaplogged);
+	bitmap_destroy(sfs->sfs_jrevoke);
+	bitmap_destroy(sfs->sfs_jmeta);
+	cv_destroy(sfs->sfs_jcv);
+	lock_destroy(sfs->sfs_jlock);
+	sfs->sfs_journaled = false;
+}
+
+/*
+ * Set up the journal at mount time, if the volume has one, and
+ * replay it. Needs sfs_blocksize, and comes before the freemap is
+ * loaded, since replay may change it.
+ */
+int
+sfs_jinit(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	uint32_t bitblocks;
+	unsigned ntrans;
+	int result;
+
+	sfs->sfs_journaled = false;
+	sfs->sfs_nmapdirty = 0;
+	if (SFS_FS_ISOLD(sfs) || sp->sp_jblocks == 0) {
+		return 0;
+	}
+
+	bitblocks = SFS_FS_BITBLOCKS(sfs);
+	if (sp->sp_jstart < SFS_MAP_LOCATION + bitblocks ||
+	    sp->sp_jstart > sp->sp_nblocks ||
+	    sp->sp_jblocks > sp->sp_nblocks - sp->sp_jstart ||
+	    sp->sp_jblocks < SFS_JMINSIZE(bitblocks)) {
+		kprintf("sfs: %s: Bad journal (%u blocks at %u)\n",
+			sp->sp_volname, sp->sp_jblocks, sp->sp_jstart);
+		return EINVAL;
+	}
+
+	sfs->sfs_jlock = lock_create("sfs journal");
+	sfs->sfs_jcv = cv_create("sfs journal");
+	sfs->sfs_jmeta = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	sfs->sfs_jrevoke = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	sfs->sfs_jmaplogged = bitmap_create(bitblocks);
+	sfs->sfs_mapdirty = bitmap_create(bitblocks);
+	sfs->sfs_jfreed = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	if (sfs->sfs_jlock == NULL || sfs->sfs_jcv == NULL ||
+	    sfs->sfs_jmeta == NULL || sfs->sfs_jrevoke == NULL ||
+	    sfs->sfs_jmaplogged == NULL || sfs->sfs_mapdirty == NULL ||
+	    sfs->sfs_jfreed == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	sfs->sfs_jnops = 0;
+	sfs->sfs_jbegun = 0;
+	sfs->sfs_jwant = 0;
+	sfs->sfs_jcommitting = false;
+	sfs->sfs_jnrevoke = 0;
+	sfs->sfs_jnfreed = 0;
+
+	result = sfs_jreplay(sfs, &ntrans);
+	if (result) {
+		goto fail;
+	}
+	if (ntrans > 0) {
+		kprintf("sfs: %s: Replayed %u journal transaction%s\n",
+			sp->sp_volname, ntrans, ntrans == 1 ? "" : "s");
+		SFS_JSTAT(replayed, ntrans);
+	}
+	sfs->sfs_journaled = true;
+	return 0;
+
+ fail:
+	if (sfs->sfs_jfreed != NULL) {
+		bitmap_destroy(sfs->sfs_jfreed);
+	}
+	if (sfs->sfs_mapdirty != NULL) {
+		bitmap_destroy(sfs->sfs_mapdirty);
+	}
+	if (sfs->sfs_jmaplogged != NULL) {
+		bitmap_destroy(sfs->sfs_jmaplogged);
+	}
+	if (sfs->sfs_jrevoke != NULL) {
+		bitmap_destroy(sfs->sfs_jrevoke);
+	}
+	if (sfs->sfs_jmeta != NULL) {
+		bitmap_destroy(sfs->sfs_jmeta);
+	}
+	if (sfs->sfs_jcv != NULL) {
+		cv_destroy(sfs->sfs_jcv);
+	}
+	if (sfs->sfs_jlock != NULL) {
+		lock_destroy(sfs->sfs_jlock);
+	}
+	return result;
+}
+
+/*
+ * Print the journal counters, summed over all volumes, and optionally
+ * clear them.
+ */
+void
+sfs_jprintstats(bool reset)
+{
+	struct sfs_jstats st;
+
+	spinlock_acquire(&sfs_jstatlock);
+	st = sfs_jstats;
+	if (reset) {
+		bzero(&sfs_jstats, sizeof(sfs_jstats));
+	}
+	spinlock_release(&sfs_jstatlock);
+
+	kprintf("sfs journal: %lu operations in %lu transactions\n",
+		st.ops, st.commits);
+	kprintf("    %lu blocks logged, %lu revoked\n",
+		st.logged, st.revoked);
+	kprintf("    %lu checkpoints, %lu to make room, "
+		"%lu transactions replayed\n",
+		st.checkpoints, st.overflows, st.replayed);
+}
@@ -45,10 +45,17 @@
 #include <device.h>
 #include <sfs.h>
 
+/* Longest run of blocks sfs_extentio hands the device in one request */
+#define SFS_MAXEXTENT  64
+
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Used by sfs_reclaim */
+static int sfs_fsync(struct vnode *v);
+static int sfs_truncstep(struct sfs_vnode *sv, off_t len, bool *done);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -58,22 +65,40 @@ static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	/* No need to read it; a cached copy still needs zeroing though */
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buf->b_data, sfs->sfs_blocksize);
+	sfs_buf_metadirty(buf);
+	sfs_buf_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out. It goes to the buffer
+ * cache; sfs_sync (or eviction) takes it to disk.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct sfs_buf *buf;
+		int result;
+
+		result = sfs_buf_get(sfs, sv->sv_ino, false, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buf->b_data, &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_metadirty(buf);
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -84,37 +109,171 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Find a block for a new inode: the start of a run of SFS_ALLOCRUN
+ * free blocks at or after the allocation cursor, so the file's data
+ * can follow it without running into its neighbours. Parts of the
+ * disk without that many free blocks are skipped by way of the
+ * free-run summary. If there's no such run anywhere, any free block
+ * will do. Called with sfs_freemaplock held.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc_fresh(struct sfs_fs *sfs, uint32_t *diskblock)
 {
+	uint32_t nblocks = sfs->sfs_super.sp_nblocks;
+	uint32_t ngroups = SFS_FS_BITBLOCKS(sfs);
+	uint32_t groupbits = SFS_FS_BLOCKBITS(sfs);
+	uint32_t start, g0, g, i, from, to;
+	unsigned block;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	start = sfs->sfs_allocnext;
+	if (start >= nblocks) {
+		start = 0;
+	}
+	g0 = start / groupbits;
+
+	/* Go around once, ending with the part of g0 before START */
+	for (i=0; i<=ngroups; i++) {
+		g = (g0 + i) % ngroups;
+		if (sfs->sfs_groupfree[g] < SFS_ALLOCRUN) {
+			continue;
+		}
+		from = (i == 0) ? start : g * groupbits;
+		to = (i == ngroups) ? start : (g + 1) * groupbits;
+		result = bitmap_findrun(sfs->sfs_freemap, from, to,
+					SFS_ALLOCRUN, &block);
+		if (result == 0) {
+			bitmap_mark(sfs->sfs_freemap, block);
+			sfs->sfs_allocnext = block + SFS_ALLOCRUN;
+			*diskblock = block;
+			return 0;
+		}
+	}
+
+	result = bitmap_alloc_near(sfs->sfs_freemap, start, &block);
 	if (result) {
 		return result;
 	}
+	sfs->sfs_allocnext = block + 1;
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Count the free blocks. Called with sfs_freemaplock held.
+ */
+static
+uint32_t
+sfs_nfree(struct sfs_fs *sfs)
+{
+	uint32_t g, ngroups, nfree;
+
+	ngroups = SFS_FS_BITBLOCKS(sfs);
+	nfree = 0;
+	for (g=0; g<ngroups; g++) {
+		nfree += sfs->sfs_groupfree[g];
+	}
+	return nfree;
+}
+
+/*
+ * Note that the freemap has changed at BLOCK; journaled volumes keep
+ * track of which of its blocks. Called with sfs_freemaplock held.
+ */
+static
+void
+sfs_mapdirty(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t g = block / SFS_FS_BLOCKBITS(sfs);
+
 	sfs->sfs_freemapdirty = true;
+	if (sfs->sfs_journaled && !bitmap_isset(sfs->sfs_mapdirty, g)) {
+		bitmap_mark(sfs->sfs_mapdirty, g);
+		sfs->sfs_nmapdirty++;
+	}
+}
+
+/*
+ * Allocate a block. If GOAL is nonzero, it's where the caller would
+ * like the block to be (right after the file's previous block); if
+ * it's taken, the next free block after it is used. If GOAL is zero
+ * this is a new inode, which gets a fresh run of space, and which
+ * mustn't use up space reserved for delayed writes; other blocks are
+ * allocated against such a reservation. If CLEAR is set the block is
+ * zeroed; otherwise the caller is about to write all of it. Blocks
+ * freed since the last commit are still marked, so aren't candidates.
+ */
+static
+int
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, bool clear,
+	   uint32_t *diskblock)
+{
+	unsigned block;
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	if (goal == 0 && sfs_nfree(sfs) <= sfs->sfs_reserved) {
+		result = ENOSPC;
+	}
+	else if (goal == 0 || goal >= sfs->sfs_super.sp_nblocks) {
+		result = sfs_balloc_fresh(sfs, diskblock);
+	}
+	else if (!bitmap_isset(sfs->sfs_freemap, goal)) {
+		bitmap_mark(sfs->sfs_freemap, goal);
+		*diskblock = goal;
+		result = 0;
+	}
+	else {
+		result = bitmap_alloc_near(sfs->sfs_freemap, goal, &block);
+		*diskblock = block;
+	}
+	if (result) {
+		lock_release(sfs->sfs_freemaplock);
+		return result;
+	}
+	sfs_mapdirty(sfs, *diskblock);
+	sfs->sfs_groupfree[*diskblock / SFS_FS_BLOCKBITS(sfs)]--;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
 	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	if (clear) {
+		return sfs_clearblock(sfs, *diskblock);
+	}
+	return 0;
 }
 
 /*
- * Free a block.
+ * Free a block. If it was metadata in the journal, it's revoked, so
+ * that replay won't write it over whatever the block is used for next.
+ * On a journaled volume it stays marked in use, and out of the free-run
+ * summary, until the transaction freeing it has committed: a crash
+ * before then brings back whatever pointed to it, so nothing else may
+ * be written there yet. sfs_jdocommit lets it go.
  */
 static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(bitmap_isset(sfs->sfs_freemap, diskblock));
+	sfs_mapdirty(sfs, diskblock);
+	if (sfs->sfs_journaled) {
+		KASSERT(!bitmap_isset(sfs->sfs_jfreed, diskblock));
+		bitmap_mark(sfs->sfs_jfreed, diskblock);
+		sfs->sfs_jnfreed++;
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, diskblock);
+		sfs->sfs_groupfree[diskblock / SFS_FS_BLOCKBITS(sfs)]++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	sfs_buf_revoke(sfs, diskblock);
 }
 
 /*
@@ -124,11 +283,16 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
 ////////////////////////////////////////////////////////////
@@ -136,32 +300,35 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 // Block mapping/inode maintenance
 
 /*
- * Look up the disk block number (from 0 up to the number of blocks on
- * the disk) given a file and the logical block number within that
- * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * Allocation goal for a file's block, given the disk block holding
+ * the file's previous block (0 if none): right after it, or failing
+ * that right after the inode.
  */
 static
-int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+uint32_t
+sfs_bgoal(struct sfs_vnode *sv, uint32_t prevblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	return (prevblock != 0 ? prevblock : sv->sv_ino) + 1;
+}
 
+/*
+ * sfs_bmap for the original format: direct blocks, then one indirect
+ * block.
+ */
+static
+int
+sfs_bmap_old(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	     uint32_t *diskblock)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
 	uint32_t block;
 	uint32_t idblock;
 	uint32_t idnum, idoff;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +343,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_balloc(sfs, sfs_bgoal(sv, fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0), false,
+				&block);
 			if (result) {
 				return result;
 			}
@@ -236,7 +405,9 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc(sfs, sfs_bgoal(sv,
+				sv->sv_i.sfi_direct[SFS_NDIRECT-1]), true,
+				&idblock);
 		if (result) {
 			return result;
 		}
@@ -247,40 +418,275 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
+		/* sfs_balloc cleared it, in the buffer cache */
 	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+
+	/* Get the indirect block from the buffer cache. */
+	result = sfs_buf_get(sfs, idblock, true, &idbuf);
+	if (result) {
+		return result;
 	}
+	idptrs = (uint32_t *)idbuf->b_data;
 
 	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	block = idptrs[idoff];
 
 	/* If there's no block there, allocate one */
 	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = sfs_balloc(sfs, sfs_bgoal(sv, idoff > 0 ?
+				idptrs[idoff-1] : idblock), false, &block);
 		if (result) {
+			sfs_buf_release(idbuf);
 			return result;
 		}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Remember the block we allocated; the buffer is now dirty */
+		idptrs[idoff] = block;
+		sfs_buf_metadirty(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Current format: look FILEBLOCK up in the inode's extents. Returns
+ * the disk block, or 0 if no extent covers it.
+ */
+static
+uint32_t
+sfs_extent_find(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_extent *e;
+	unsigned i;
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sv->sv_i2.sfi_extents[i];
+		if (e->sfe_len > 0 && fileblock >= e->sfe_fileblock &&
+		    fileblock - e->sfe_fileblock < e->sfe_len) {
+			return e->sfe_diskblock + (fileblock - e->sfe_fileblock);
+		}
+	}
+	return 0;
+}
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+/*
+ * Current format: map FILEBLOCK to DISKBLOCK with an extent, if it
+ * can be done: by growing an extent it continues on disk (and joining
+ * that to the next one if the gap is now closed), or else with an
+ * unused extent. Returns false if all the extents are in use
+ * elsewhere.
+ */
+static
+bool
+sfs_extent_add(struct sfs_vnode *sv, uint32_t fileblock, uint32_t diskblock)
+{
+	struct sfs_extent *e, *f;
+	unsigned i, j;
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sv->sv_i2.sfi_extents[i];
+		if (e->sfe_len == 0 ||
+		    e->sfe_fileblock + e->sfe_len != fileblock ||
+		    e->sfe_diskblock + e->sfe_len != diskblock) {
+			continue;
+		}
+		e->sfe_len++;
+		for (j=0; j<SFS_NEXTENTS; j++) {
+			f = &sv->sv_i2.sfi_extents[j];
+			if (f->sfe_len > 0 && f->sfe_fileblock == fileblock+1 &&
+			    f->sfe_diskblock == diskblock+1) {
+				e->sfe_len += f->sfe_len;
+				bzero(f, sizeof(*f));
+				break;
+			}
+		}
+		sv->sv_dirty = true;
+		return true;
+	}
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sv->sv_i2.sfi_extents[i];
+		if (e->sfe_len > 0 && e->sfe_fileblock == fileblock+1 &&
+		    e->sfe_diskblock == diskblock+1) {
+			e->sfe_fileblock--;
+			e->sfe_diskblock--;
+			e->sfe_len++;
+			sv->sv_dirty = true;
+			return true;
+		}
+	}
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sv->sv_i2.sfi_extents[i];
+		if (e->sfe_len == 0) {
+			e->sfe_fileblock = fileblock;
+			e->sfe_diskblock = diskblock;
+			e->sfe_len = 1;
+			sv->sv_dirty = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Current format: find where in the tree of indirect blocks FILEBLOCK
+ * is mapped. The indirect block maps file blocks 0 to DBPERIDB-1; the
+ * double indirect block holds indirect blocks for the DBPERIDB*DBPERIDB
+ * after that. Sets *IDBLOCK to the indirect block and *IDOFF to the
+ * slot in it, or *IDBLOCK to 0 if the indirect block isn't there. If
+ * DOALLOC is set, missing indirect blocks are allocated, cleared,
+ * near GOAL. The caller has checked FILEBLOCK is in range.
+ */
+static
+int
+sfs_tree_find(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
+	      uint32_t goal, uint32_t *idblock, uint32_t *idoff)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *didbuf;
+	uint32_t *didptrs;
+	uint32_t perid, didblock, block;
+	int result;
+
+	perid = SFS_FS_DBPERIDB(sfs);
+	if (fileblock < perid) {
+		block = sv->sv_i2.sfi_indirect;
+		if (block == 0 && doalloc) {
+			result = sfs_balloc(sfs, goal, true, &block);
+			if (result) {
+				return result;
+			}
+			sv->sv_i2.sfi_indirect = block;
+			sv->sv_dirty = true;
+		}
+		*idblock = block;
+		*idoff = fileblock;
+		return 0;
+	}
+	fileblock -= perid;
+
+	didblock = sv->sv_i2.sfi_dindirect;
+	if (didblock == 0) {
+		if (!doalloc) {
+			*idblock = 0;
+			return 0;
+		}
+		result = sfs_balloc(sfs, goal, true, &didblock);
 		if (result) {
 			return result;
 		}
+		sv->sv_i2.sfi_dindirect = didblock;
+		sv->sv_dirty = true;
+	}
+
+	result = sfs_buf_get(sfs, didblock, true, &didbuf);
+	if (result) {
+		return result;
+	}
+	didptrs = (uint32_t *)didbuf->b_data;
+	block = didptrs[fileblock / perid];
+	sfs_buf_release(didbuf);
+
+	if (block == 0 && doalloc) {
+		/* Don't hold one buffer while sfs_balloc gets another */
+		result = sfs_balloc(sfs, goal, true, &block);
+		if (result) {
+			return result;
+		}
+		result = sfs_buf_get(sfs, didblock, true, &didbuf);
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+		didptrs = (uint32_t *)didbuf->b_data;
+		didptrs[fileblock / perid] = block;
+		sfs_buf_metadirty(didbuf);
+		sfs_buf_release(didbuf);
+	}
+	*idblock = block;
+	*idoff = fileblock % perid;
+	return 0;
+}
+
+/*
+ * sfs_bmap for the current format. Blocks are looked for in the
+ * extents and then in the tree. A new block goes in an extent if it
+ * can, and in the tree if not.
+ */
+static
+int
+sfs_bmap2(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	  uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t perid, block, prevblock, idblock, idoff;
+	int result;
+
+	perid = SFS_FS_DBPERIDB(sfs);
+	if (fileblock >= perid + perid * perid) {
+		return EFBIG;
+	}
+
+	block = sfs_extent_find(sv, fileblock);
+	if (block == 0) {
+		result = sfs_tree_find(sv, fileblock, false, 0,
+				       &idblock, &idoff);
+		if (result) {
+			return result;
+		}
+		if (idblock != 0) {
+			result = sfs_buf_get(sfs, idblock, true, &idbuf);
+			if (result) {
+				return result;
+			}
+			idptrs = (uint32_t *)idbuf->b_data;
+			block = idptrs[idoff];
+			sfs_buf_release(idbuf);
+		}
+	}
+
+	if (block == 0 && doalloc) {
+		prevblock = 0;
+		if (fileblock > 0) {
+			result = sfs_bmap2(sv, fileblock-1, 0, &prevblock);
+			if (result) {
+				return result;
+			}
+		}
+		result = sfs_balloc(sfs, sfs_bgoal(sv, prevblock), false,
+				    &block);
+		if (result) {
+			return result;
+		}
+
+		if (!sfs_extent_add(sv, fileblock, block)) {
+			result = sfs_tree_find(sv, fileblock, true, block+1,
+					       &idblock, &idoff);
+			if (result == 0) {
+				result = sfs_buf_get(sfs, idblock, true,
+						     &idbuf);
+			}
+			if (result) {
+				sfs_bfree(sfs, block);
+				return result;
+			}
+			idptrs = (uint32_t *)idbuf->b_data;
+			idptrs[idoff] = block;
+			sfs_buf_metadirty(idbuf);
+			sfs_buf_release(idbuf);
+		}
 	}
 
-	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
 		      block, fileblock, sv->sv_ino);
@@ -289,6 +695,409 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+/*
+ * Look up the disk block number (from 0 up to the number of blocks on
+ * the disk) given a file and the logical block number within that
+ * file. If DOALLOC is set, and no such block exists, one will be
+ * allocated, as close after the file's previous block as possible.
+ * Only sfs_dflush allocates, against the file's reservation, and it
+ * writes the whole block, so data blocks aren't cleared.
+ */
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (SFS_FS_ISOLD(sfs)) {
+		return sfs_bmap_old(sv, fileblock, doalloc, diskblock);
+	}
+	return sfs_bmap2(sv, fileblock, doalloc, diskblock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+
+/*
+ * Give back N blocks of the space reserved for delayed writes.
+ */
+static
+void
+sfs_dunreserve(struct sfs_fs *sfs, uint32_t n)
+{
+	lock_acquire(sfs->sfs_freemaplock);
+	KASSERT(sfs->sfs_reserved >= n);
+	sfs->sfs_reserved -= n;
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Free a delayed-write block that's been taken off its file's list.
+ */
+static
+void
+sfs_dfree(struct sfs_dblock *db)
+{
+	kfree(db->db_data);
+	kfree(db);
+}
+
+/*
+ * Find the delayed-write block for FILEBLOCK of a file, if any.
+ */
+static
+struct sfs_dblock *
+sfs_dfind(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_dblock *db;
+
+	for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+		if (db->db_fileblock >= fileblock) {
+			return db->db_fileblock == fileblock ? db : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write out a file's delayed-write blocks. Allocate disk blocks for
+ * all of them first, in file order, so they end up next to each
+ * other, then write each run of consecutive disk blocks with one
+ * device request straight from the delayed-write buffers. Anything
+ * already in the buffer cache for those blocks is stale (it was
+ * freed and is being reused) and is thrown away, before and after
+ * the write, as in sfs_extentio. The iovecs for a run are the
+ * volume's sfs_diov, which is too big to put on the stack here.
+ *
+ * On a journaled volume allocation stops, after at least one block,
+ * when sfs_jroom says the transaction is getting full. Then, or if
+ * allocation fails partway, the blocks that got disk blocks are
+ * still written and the rest stay delayed; callers that need them
+ * all written call again in another operation. Called with the
+ * vnode locked.
+ */
+static
+int
+sfs_dflush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct iovec *iov = sfs->sfs_diov;
+	struct uio ku;
+	struct sfs_dblock *db;
+	uint32_t first, n, i;
+	int result = 0, result2;
+
+	i = 0;
+	for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+		KASSERT(db->db_diskblock == 0);
+		if (i > 0 && sfs_jroom(sfs) < SFS_JOPBLOCKS) {
+			break;
+		}
+		result = sfs_bmap(sv, db->db_fileblock, 1, &db->db_diskblock);
+		if (result) {
+			break;
+		}
+		sfs_dunreserve(sfs, 1);
+		i++;
+	}
+
+	while (sv->sv_delayed != NULL && sv->sv_delayed->db_diskblock != 0) {
+		first = sv->sv_delayed->db_diskblock;
+		n = 0;
+		for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+			if (n == SFS_DELAYMAX || db->db_diskblock != first + n) {
+				break;
+			}
+			n++;
+		}
+
+		for (i=0; i<n; i++) {
+			sfs_buf_invalidate(sfs, first+i);
+		}
+
+		lock_acquire(sfs->sfs_diovlock);
+		db = sv->sv_delayed;
+		for (i=0; i<n; i++) {
+			iov[i].iov_kbase = db->db_data;
+			iov[i].iov_len = sfs->sfs_blocksize;
+			db = db->db_next;
+		}
+		ku.uio_iov = iov;
+		ku.uio_iovcnt = n;
+		ku.uio_offset = (off_t)first * sfs->sfs_blocksize;
+		ku.uio_resid = n * sfs->sfs_blocksize;
+		ku.uio_segflg = UIO_SYSSPACE;
+		ku.uio_rw = UIO_WRITE;
+		ku.uio_space = NULL;
+		result2 = sfs_rwblock(sfs, &ku);
+		lock_release(sfs->sfs_diovlock);
+
+		for (i=0; i<n; i++) {
+			sfs_buf_invalidate(sfs, first+i);
+		}
+		if (result2 && result == 0) {
+			result = result2;
+		}
+
+		/* The blocks are mapped now either way */
+		for (i=0; i<n; i++) {
+			db = sv->sv_delayed;
+			sv->sv_delayed = db->db_next;
+			sv->sv_ndelayed--;
+			sfs_dfree(db);
+		}
+	}
+
+	if (sv->sv_delayed == NULL && sv->sv_mapreserved > 0) {
+		sfs_dunreserve(sfs, sv->sv_mapreserved);
+		sv->sv_mapreserved = 0;
+	}
+	return result;
+}
+
+/*
+ * Throw away a file's delayed-write blocks from FILEBLOCK on, for
+ * truncate. Called with the vnode locked.
+ */
+static
+void
+sfs_ddiscard(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock **dbp, *db;
+	uint32_t n = 0;
+
+	dbp = &sv->sv_delayed;
+	while (*dbp != NULL && (*dbp)->db_fileblock < fileblock) {
+		dbp = &(*dbp)->db_next;
+	}
+	while (*dbp != NULL) {
+		db = *dbp;
+		*dbp = db->db_next;
+		sfs_dfree(db);
+		n++;
+	}
+	sv->sv_ndelayed -= n;
+
+	if (sv->sv_delayed == NULL) {
+		n += sv->sv_mapreserved;
+		sv->sv_mapreserved = 0;
+	}
+	if (n > 0) {
+		sfs_dunreserve(sfs, n);
+	}
+}
+
+/*
+ * Count the indirect blocks that allocating FILEBLOCK of a file might
+ * need and that aren't already reserved, for the file's other
+ * delayed-write blocks or because they exist. The reservation covers
+ * every indirect block any of the file's delayed-write blocks might
+ * need, and is only given back once they've all been written.
+ *
+ * In the current format this is pessimistic: the block will usually
+ * go in an extent and need none, and the indirect block for its part
+ * of the double indirect block isn't looked for on disk.
+ */
+static
+uint32_t
+sfs_dmapneed(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db;
+	uint32_t perid, need;
+	bool sameid, samedid;
+
+	if (SFS_FS_ISOLD(sfs)) {
+		if (fileblock < SFS_NDIRECT || sv->sv_i.sfi_indirect != 0 ||
+		    sv->sv_mapreserved > 0) {
+			return 0;
+		}
+		return 1;
+	}
+
+	/* Look for delayed blocks that would share indirect blocks */
+	perid = SFS_FS_DBPERIDB(sfs);
+	sameid = samedid = false;
+	for (db = sv->sv_delayed; db != NULL; db = db->db_next) {
+		if (fileblock < perid) {
+			sameid = sameid || db->db_fileblock < perid;
+		}
+		else if (db->db_fileblock >= perid) {
+			samedid = true;
+			sameid = sameid ||
+				db->db_fileblock / perid == fileblock / perid;
+		}
+	}
+
+	need = 0;
+	if (fileblock < perid) {
+		if (!sameid && sv->sv_i2.sfi_indirect == 0) {
+			need++;
+		}
+	}
+	else {
+		if (!samedid && sv->sv_i2.sfi_dindirect == 0) {
+			need++;
+		}
+		if (!sameid) {
+			need++;
+		}
+	}
+	return need;
+}
+
+/*
+ * Get the delayed-write block for FILEBLOCK of a file, which has no
+ * disk block, making a zeroed one if there isn't one yet. Making one
+ * reserves space for it, and first flushes the file's delayed writes
+ * if it or the volume has too many (see SFS_DELAYVOLUME). Called with
+ * the vnode locked.
+ */
+static
+int
+sfs_dget(struct sfs_vnode *sv, uint32_t fileblock, struct sfs_dblock **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db, **dbp;
+	uint32_t need, mapneed;
+	int result;
+
+	db = sfs_dfind(sv, fileblock);
+	if (db != NULL) {
+		*ret = db;
+		return 0;
+	}
+
+	/*
+	 * Unlocked look at sfs_reserved; it's only a hint. If the
+	 * transaction is full, leave it for the next operation;
+	 * sfs_write starts with a flush if there are too many.
+	 */
+	if ((sv->sv_ndelayed >= SFS_DELAYMAX ||
+	     (sfs->sfs_reserved >= SFS_DELAYVOLUME &&
+	      sv->sv_ndelayed >= SFS_DELAYMIN)) &&
+	    sfs_jroom(sfs) >= SFS_JOPBLOCKS) {
+		result = sfs_dflush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	/* If memory is short, flushing what we have gives some back */
+	while (1) {
+		db = kmalloc(sizeof(*db));
+		if (db != NULL) {
+			db->db_data = kmalloc(sfs->sfs_blocksize);
+			if (db->db_data != NULL) {
+				break;
+			}
+			kfree(db);
+		}
+		if (sv->sv_delayed == NULL ||
+		    sfs_jroom(sfs) < SFS_JOPBLOCKS) {
+			return ENOMEM;
+		}
+		result = sfs_dflush(sv);
+		if (result) {
+			return result;
+		}
+	}
+
+	mapneed = sfs_dmapneed(sv, fileblock);
+	need = 1 + mapneed;
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs_nfree(sfs) < sfs->sfs_reserved + need) {
+		lock_release(sfs->sfs_freemaplock);
+		sfs_dfree(db);
+		return ENOSPC;
+	}
+	sfs->sfs_reserved += need;
+	lock_release(sfs->sfs_freemaplock);
+
+	bzero(db->db_data, sfs->sfs_blocksize);
+	db->db_fileblock = fileblock;
+	db->db_diskblock = 0;
+
+	sv->sv_mapreserved += mapneed;
+
+	/* Keep the list in file block order */
+	dbp = &sv->sv_delayed;
+	while (*dbp != NULL && (*dbp)->db_fileblock < fileblock) {
+		dbp = &(*dbp)->db_next;
+	}
+	db->db_next = *dbp;
+	*dbp = db;
+	sv->sv_ndelayed++;
+
+	*ret = db;
+	return 0;
+}
+
+/*
+ * I/O to a block of a file that has no disk block: LEN bytes at
+ * SKIPSTART within it. Writes go to its delayed-write block; reads
+ * come from there if it's been written, or read as zeros.
+ */
+static
+int
+sfs_dio(struct sfs_vnode *sv, struct uio *uio, uint32_t skipstart,
+	uint32_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dblock *db;
+	uint32_t fileblock;
+	int result;
+
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		result = sfs_dget(sv, fileblock, &db);
+		if (result) {
+			return result;
+		}
+	}
+	else {
+		db = sfs_dfind(sv, fileblock);
+		if (db == NULL) {
+			return uiomovezeros(len, uio);
+		}
+	}
+	return uiomove(db->db_data + skipstart, len, uio);
+}
+
+/*
+ * Allocate FILEBLOCK of a directory, on a journaled volume. Directory
+ * blocks are metadata, which has to go through the journal, so they
+ * get their disk block at once instead of being delayed. Called with
+ * the vnode locked.
+ */
+static
+int
+sfs_dirbmap(struct sfs_vnode *sv, uint32_t fileblock, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t need;
+	int result;
+
+	KASSERT(sv->sv_delayed == NULL);
+
+	need = 1 + sfs_dmapneed(sv, fileblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs_nfree(sfs) < sfs->sfs_reserved + need) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+	sfs->sfs_reserved += need;
+	lock_release(sfs->sfs_freemaplock);
+
+	result = sfs_bmap(sv, fileblock, 1, diskblock);
+	sfs_dunreserve(sfs, need);
+	return result;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -308,135 +1117,212 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	bool isdir, isnew = false;
 	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	isdir = sv->sv_i.sfi_type == SFS_TYPE_DIR;
+	if (diskblock == 0 && isdir && sfs->sfs_journaled &&
+	    uio->uio_rw == UIO_WRITE) {
+		result = sfs_dirbmap(sv, fileblock, &diskblock);
+		if (result) {
+			return result;
+		}
+		isnew = true;
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * It's delayed, or about to be.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
+		return sfs_dio(sv, uio, skipstart, len);
 	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+
+	/*
+	 * Get the block from the buffer cache. A block just allocated
+	 * has nothing to read.
+	 */
+	result = sfs_buf_get(sfs, diskblock, !isnew, &buf);
+	if (result) {
+		return result;
+	}
+	if (isnew) {
+		bzero(buf->b_data, sfs->sfs_blocksize);
 	}
 
 	/*
 	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the buffer is dirty, even if uiomove
+	 * only got partway.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = uiomove(buf->b_data+skipstart, len, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		if (isdir) {
+			sfs_buf_metadirty(buf);
+		}
+		else {
+			sfs_buf_dirty(buf);
+		}
+	}
+	sfs_buf_release(buf);
+
+	return result;
+}
+
+/*
+ * Do I/O (either read or write) of a single whole block.
+ */
+static
+int
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	uint32_t diskblock;
+	uint32_t fileblock;
+	int result;
+
+	/* Get the block number within the file */
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	/* Look up the disk block number */
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	if (diskblock == 0) {
+		/* No block yet - delayed, or about to be */
+		return sfs_dio(sv, uio, 0, sfs->sfs_blocksize);
+	}
+
 	/*
-	 * If it was a write, write back the modified block.
+	 * Go through the buffer cache. A write covers the whole block,
+	 * so there's no need to read it first.
 	 */
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
+	result = sfs_buf_get(sfs, diskblock, uio->uio_rw == UIO_READ, &buf);
+	if (result) {
+		return result;
+	}
+
+	result = uiomove(buf->b_data, sfs->sfs_blocksize, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_buf_dirty(buf);
 	}
+	sfs_buf_release(buf);
 
-	return 0;
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O of up to MAXBLOCKS whole blocks, as many as are physically
+ * contiguous on disk, with a single device request.
+ *
+ * Only runs of more than one block go straight to disk. A single
+ * block, a hole, or (for reads) a cached first block is left to
+ * sfs_blockio and the buffer cache, as are blocks with no disk block
+ * yet, which sfs_blockio delays. A write run throws away any cached
+ * copies of the blocks it overwrites; a read run stops short of any
+ * cached block, which may be newer than the disk (or was read ahead).
+ *
+ * The caller holds the vnode lock, so the only other thread that can
+ * bring this file's blocks into the cache meanwhile is the read-ahead
+ * thread, and it only ever reads them.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_extentio(struct sfs_vnode *sv, struct uio *uio, uint32_t maxblocks)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
+	uint32_t fileblock, diskblock, nextblock;
+	uint32_t i, n;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
 	off_t saveoff;
 	off_t diskoff;
 	off_t saveres;
 	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(maxblocks > 0);
+	KASSERT(uio->uio_resid >= maxblocks * sfs->sfs_blocksize);
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	result = sfs_bmap(sv, fileblock, 0, &diskblock);
 	if (result) {
 		return result;
 	}
+	if (diskblock == 0 || maxblocks == 1 ||
+	    (uio->uio_rw == UIO_READ && sfs_buf_cached(sfs, diskblock))) {
+		return sfs_blockio(sv, uio);
+	}
 
-	if (diskblock == 0) {
-		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
-		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+	/*
+	 * Extend the run. A bmap failure just ends it; the next call
+	 * starts with that block and reports the error.
+	 */
+	for (n = 1; n < maxblocks && n < SFS_MAXEXTENT; n++) {
+		result = sfs_bmap(sv, fileblock+n, 0, &nextblock);
+		if (result || nextblock != diskblock+n) {
+			break;
+		}
+		if (uio->uio_rw == UIO_READ &&
+		    sfs_buf_cached(sfs, nextblock)) {
+			break;
+		}
+	}
+	if (n == 1) {
+		return sfs_blockio(sv, uio);
+	}
+
+	if (uio->uio_rw == UIO_WRITE) {
+		for (i=0; i<n; i++) {
+			sfs_buf_invalidate(sfs, diskblock+i);
+		}
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Do the I/O directly to the uio region, as for a single
+	 * block in sfs_blockio.
 	 */
 	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
+	diskoff = (off_t)diskblock * sfs->sfs_blocksize;
 	uio->uio_offset = diskoff;
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
+	diskres = n * sfs->sfs_blocksize;
 	uio->uio_resid = diskres;
-	
+
 	result = sfs_rwblock(sfs, uio);
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
 	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
 	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
 
+	/*
+	 * The read-ahead thread may have read some of the blocks back
+	 * in while we were writing them; drop those copies too.
+	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		for (i=0; i<n; i++) {
+			sfs_buf_invalidate(sfs, diskblock+i);
+		}
+	}
+
 	return result;
 }
 
@@ -447,8 +1333,8 @@ static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t blkoff;
-	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
@@ -476,13 +1362,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -502,12 +1388,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	}
 
 	/*
-	 * Now we should be block-aligned. Do the remaining whole blocks.
+	 * Now we should be block-aligned. Do the remaining whole blocks,
+	 * a contiguous run at a time.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	while (uio->uio_resid >= sfs->sfs_blocksize) {
+		result = sfs_extentio(sv, uio,
+				      uio->uio_resid / sfs->sfs_blocksize);
 		if (result) {
 			goto out;
 		}
@@ -516,7 +1403,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -541,6 +1428,96 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read-ahead. Called after a read of [START, END) in the file. If it
+ * picks up where the last read left off (or starts at the beginning),
+ * the file is being read sequentially: once the reader gets within
+ * half a window of what's been read ahead, queue the next window of
+ * blocks for the read-ahead thread, doubling the window each time.
+ * Anything else resets the window.
+ *
+ * The state is per vnode, not per open file, since that's all we see;
+ * two readers streaming one file at once will mostly defeat it.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t start, off_t end)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t blocks[SFS_RAMAX];
+	uint32_t first, last, from, to, fileblocks, ramax;
+	uint32_t i, diskblock, n;
+	bool sequential;
+	int result;
+
+	/* Keep the window to a quarter of the cache */
+	ramax = sfs->sfs_nbufs / 4;
+	if (ramax > SFS_RAMAX) {
+		ramax = SFS_RAMAX;
+	}
+	if (ramax < SFS_RAMIN) {
+		ramax = SFS_RAMIN;
+	}
+
+	if (end <= start) {
+		return;
+	}
+	first = start / sfs->sfs_blocksize;
+	last = (end - 1) / sfs->sfs_blocksize;
+
+	sequential = (first == sv->sv_ralast || first == sv->sv_ralast + 1);
+	if (!sequential) {
+		/* Random access, or starting over from the top */
+		sv->sv_rawindow = 0;
+		sv->sv_raend = last + 1;
+	}
+	sv->sv_ralast = last;
+	if (!sequential && first != 0) {
+		return;
+	}
+
+	if (last + 1 + sv->sv_rawindow / 2 < sv->sv_raend) {
+		/* Still far enough ahead */
+		return;
+	}
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < ramax) {
+		sv->sv_rawindow *= 2;
+	}
+	if (sv->sv_rawindow > ramax) {
+		sv->sv_rawindow = ramax;
+	}
+
+	fileblocks = DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize);
+	from = sv->sv_raend > last + 1 ? sv->sv_raend : last + 1;
+	to = last + 1 + sv->sv_rawindow;
+	if (to > fileblocks) {
+		to = fileblocks;
+	}
+	if (from >= to) {
+		return;
+	}
+
+	n = 0;
+	for (i = from; i < to; i++) {
+		result = sfs_bmap(sv, i, 0, &diskblock);
+		if (result) {
+			break;
+		}
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	sv->sv_raend = i;
+
+	if (n > 0) {
+		sfs_buf_readahead(sfs, blocks, n);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -636,6 +1613,213 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_dir);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Directory lookup cache
+
+static
+unsigned
+sfs_dc_hashname(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h % SFS_DIRHASH;
+}
+
+static
+void
+sfs_dc_destroy(struct sfs_dircache *dc)
+{
+	struct sfs_dirent *de;
+	unsigned i, num;
+
+	num = array_num(dc->dc_slots);
+	for (i=0; i<num; i++) {
+		de = array_get(dc->dc_slots, i);
+		if (de != NULL) {
+			kfree(de);
+		}
+	}
+	array_setsize(dc->dc_slots, 0);
+	array_destroy(dc->dc_slots);
+	kfree(dc);
+}
+
+static
+struct sfs_dirent *
+sfs_dc_find(struct sfs_dircache *dc, const char *name)
+{
+	struct sfs_dirent *de;
+
+	for (de = dc->dc_hash[sfs_dc_hashname(name)]; de; de = de->de_next) {
+		if (!strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Enter NAME -> INO in slot SLOT, growing the slot table if SLOT is
+ * past its end.
+ */
+static
+int
+sfs_dc_add(struct sfs_dircache *dc, const char *name, uint32_t ino,
+	   unsigned slot)
+{
+	struct sfs_dirent *de;
+	unsigned i, num, h;
+	int result;
+
+	num = array_num(dc->dc_slots);
+	if (slot >= num) {
+		result = array_setsize(dc->dc_slots, slot+1);
+		if (result) {
+			return result;
+		}
+		for (i=num; i<=slot; i++) {
+			array_set(dc->dc_slots, i, NULL);
+		}
+	}
+	KASSERT(array_get(dc->dc_slots, slot) == NULL);
+
+	de = kmalloc(sizeof(*de));
+	if (de == NULL) {
+		return ENOMEM;
+	}
+	de->de_ino = ino;
+	de->de_slot = slot;
+	strcpy(de->de_name, name);
+
+	h = sfs_dc_hashname(name);
+	de->de_next = dc->dc_hash[h];
+	dc->dc_hash[h] = de;
+	array_set(dc->dc_slots, slot, de);
+	return 0;
+}
+
+static
+void
+sfs_dc_remove(struct sfs_dircache *dc, unsigned slot)
+{
+	struct sfs_dirent *de, **pp;
+
+	if (slot >= array_num(dc->dc_slots)) {
+		return;
+	}
+	de = array_get(dc->dc_slots, slot);
+	if (de == NULL) {
+		return;
+	}
+	for (pp = &dc->dc_hash[sfs_dc_hashname(de->de_name)];
+	     *pp != de; pp = &(*pp)->de_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = de->de_next;
+	array_set(dc->dc_slots, slot, NULL);
+	kfree(de);
+
+	if (slot < dc->dc_freehint) {
+		dc->dc_freehint = slot;
+	}
+}
+
+/*
+ * Return the lowest empty slot, or -1 if there isn't one.
+ */
+static
+int
+sfs_dc_freeslot(struct sfs_dircache *dc)
+{
+	unsigned num = array_num(dc->dc_slots);
+
+	while (dc->dc_freehint < num &&
+	       array_get(dc->dc_slots, dc->dc_freehint) != NULL) {
+		dc->dc_freehint++;
+	}
+	return dc->dc_freehint < num ? (int)dc->dc_freehint : -1;
+}
+
+/*
+ * Read every entry of a directory into a new lookup cache. On ENOMEM
+ * the directory is simply left uncached.
+ */
+static
+int
+sfs_dc_build(struct sfs_vnode *sv)
+{
+	struct sfs_dircache *dc;
+	struct sfs_dir tsd;
+	int nentries = sfs_dir_nentries(sv);
+	int i, result;
+
+	KASSERT(sv->sv_dircache == NULL);
+
+	dc = kmalloc(sizeof(*dc));
+	if (dc == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DIRHASH; i++) {
+		dc->dc_hash[i] = NULL;
+	}
+	dc->dc_freehint = 0;
+	dc->dc_slots = array_create();
+	if (dc->dc_slots == NULL) {
+		kfree(dc);
+		return ENOMEM;
+	}
+	result = array_setsize(dc->dc_slots, nentries);
+	if (result) {
+		array_destroy(dc->dc_slots);
+		kfree(dc);
+		return result;
+	}
+	for (i=0; i<nentries; i++) {
+		array_set(dc->dc_slots, i, NULL);
+	}
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, &tsd, i);
+		if (result) {
+			sfs_dc_destroy(dc);
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+
+		/* Each name may legally appear only once... */
+		KASSERT(sfs_dc_find(dc, tsd.sfd_name) == NULL);
+
+		result = sfs_dc_add(dc, tsd.sfd_name, tsd.sfd_ino, i);
+		if (result) {
+			sfs_dc_destroy(dc);
+			return result;
+		}
+	}
+
+	sv->sv_dircache = dc;
+	return 0;
+}
+
+/*
+ * Drop a directory's lookup cache; the next search rebuilds it.
+ */
+static
+void
+sfs_dc_drop(struct sfs_vnode *sv)
+{
+	if (sv->sv_dircache != NULL) {
+		sfs_dc_destroy(sv->sv_dircache);
+		sv->sv_dircache = NULL;
+	}
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -647,11 +1831,44 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_dircache *dc;
+	struct sfs_dirent *de;
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
+	int nentries;
 	int i, result;
 
+	if (sv->sv_dircache == NULL) {
+		result = sfs_dc_build(sv);
+		if (result && result != ENOMEM) {
+			return result;
+		}
+	}
+
+	dc = sv->sv_dircache;
+	if (dc != NULL) {
+		if (emptyslot != NULL) {
+			i = sfs_dc_freeslot(dc);
+			if (i >= 0) {
+				*emptyslot = i;
+			}
+		}
+		de = sfs_dc_find(dc, name);
+		if (de == NULL) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = de->de_slot;
+		}
+		if (ino != NULL) {
+			*ino = de->de_ino;
+		}
+		return 0;
+	}
+
+	/* Out of memory for the cache; scan the directory instead. */
+	nentries = sfs_dir_nentries(sv);
+
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
 
@@ -729,8 +1946,17 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	/* Keep the lookup cache in step; if that fails, throw it away. */
+	if (sv->sv_dircache != NULL &&
+	    sfs_dc_add(sv->sv_dircache, name, ino, emptyslot)) {
+		sfs_dc_drop(sv);
+	}
+	return 0;
 }
 
 /*
@@ -741,13 +1967,22 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	if (sv->sv_dircache != NULL) {
+		sfs_dc_remove(sv->sv_dircache, slot);
+	}
+	return 0;
 }
 
 /*
@@ -764,22 +1999,123 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 	uint32_t ino;
 	int result;
 
-	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	if (result) {
+		return result;
+	}
+
+	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, ret);
+	if (result) {
+		return result;
+	}
+
+	if ((*ret)->sv_i.sfi_linkcount == 0) {
+		panic("sfs: Link count of file %u found in dir %u is 0\n",
+		      (*ret)->sv_ino, sv->sv_ino);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+
+static
+unsigned
+sfs_vnode_hashino(uint32_t ino)
+{
+	return ino % SFS_VNHASH;
+}
+
+/*
+ * Find a loaded vnode by inode number. Doesn't add a reference.
+ */
+static
+struct sfs_vnode *
+sfs_vnode_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	for (sv = sfs->sfs_vnhash[sfs_vnode_hashino(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+static
+int
+sfs_vnode_hash(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+	int result;
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, &sv->sv_index);
 	if (result) {
 		return result;
 	}
 
-	result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, ret);
-	if (result) {
-		return result;
-	}
+	h = sfs_vnode_hashino(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	return 0;
+}
 
-	if ((*ret)->sv_i.sfi_linkcount == 0) {
-		panic("sfs: Link count of file %u found in dir %u is 0\n",
-		      (*ret)->sv_ino, sv->sv_ino);
+/*
+ * Take a vnode out of the table. The last vnode in sfs_vnodes moves
+ * into the hole, so this doesn't depend on how many are loaded.
+ */
+static
+void
+sfs_vnode_unhash(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp, *last;
+	unsigned num;
+
+	for (pp = &sfs->sfs_vnhash[sfs_vnode_hashino(sv->sv_ino)];
+	     *pp != sv; pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
 	}
+	*pp = sv->sv_hashnext;
 
-	return 0;
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) == &sv->sv_v);
+	if (sv->sv_index != num - 1) {
+		last = vnodearray_get(sfs->sfs_vnodes, num - 1)->vn_data;
+		last->sv_index = sv->sv_index;
+		vnodearray_set(sfs->sfs_vnodes, sv->sv_index, &last->sv_v);
+	}
+	vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+}
+
+/*
+ * Put every loaded vnode's modified inode in the buffer cache, for a
+ * journal commit. Only operations change inodes, and there are none
+ * in progress, so the vnode locks aren't needed; the table lock keeps
+ * the table still.
+ */
+int
+sfs_sync_inodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i, num;
+	int result = 0;
+
+	lock_acquire(sfs->sfs_vnlock);
+	num = vnodearray_num(sfs->sfs_vnodes);
+	for (i=0; i<num && result == 0; i++) {
+		sv = vnodearray_get(sfs->sfs_vnodes, i)->vn_data;
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sfs->sfs_vnlock);
+	return result;
 }
 
 ////////////////////////////////////////////////////////////
@@ -801,7 +2137,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -890,69 +2226,100 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	bool linked, done;
 	int result;
 
-	vfs_biglock_acquire();
+ again:
+	/*
+	 * If the file is still linked, it can be looked up again as
+	 * soon as it leaves the table, so its delayed writes must be on
+	 * disk and the inode back in the buffer cache first. If there
+	 * are no on-disk references to it either, erase it. Either can
+	 * take more than one operation (see sfs_dflush), so do it
+	 * before taking the table lock; it does no harm if someone
+	 * picks the vnode up meanwhile.
+	 */
+	linked = sv->sv_i.sfi_linkcount > 0;
+	result = 0;
+	if (linked) {
+		result = sfs_fsync(v);
+	}
+	else {
+		done = false;
+		while (!done && result == 0) {
+			sfs_jbegin(sfs);
+			result = sfs_truncstep(sv, 0, &done);
+			sfs_jend(sfs);
+		}
+	}
+	if (result) {
+		/*
+		 * Keep the vnode, and give up the reference VOP_DECREF
+		 * gave us, so that whoever picks it up next (sfs_sync,
+		 * if nobody else) tries again when letting it go.
+		 */
+		spinlock_acquire(&v->vn_countlock);
+		KASSERT(v->vn_refcount > 0);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
+		return result;
+	}
+
+	/* This is an operation of its own; see sfs_jbegin */
+	sfs_jbegin(sfs);
+
+	/* Holding the table lock keeps sfs_loadvnode from handing it out */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
-	/* If there are no on-disk references to the file either, erase it. */
-	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
+	/*
+	 * Someone may have picked it up and let it go again in the
+	 * meantime, writing to it or unlinking it; if so, go back.
+	 * We have the only reference, so there's no need for the
+	 * vnode lock.
+	 */
+	if ((sv->sv_i.sfi_linkcount > 0) != linked ||
+	    (linked && (sv->sv_delayed != NULL || sv->sv_dirty)) ||
+	    (!linked && sv->sv_i.sfi_size > 0)) {
+		lock_release(sfs->sfs_vnlock);
+		sfs_jend(sfs);
+		goto again;
 	}
 
-	/* Sync the inode to disk */
-	result = sfs_sync_inode(sv);
-	if (result) {
-		vfs_biglock_release();
-		return result;
-	}
+	/* Remove the vnode structure from the table in the struct sfs_fs. */
+	sfs_vnode_unhash(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
 
-	/* If there are no on-disk references, discard the inode */
-	if (sv->sv_i.sfi_linkcount==0) {
+	/* Nobody can find it any more; free its inode if it's unlinked */
+	if (!linked) {
 		sfs_bfree(sfs, sv->sv_ino);
 	}
-
-	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_jend(sfs);
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	/* Directories: drop the lookup cache */
+	sfs_dc_drop(sv);
 
 	/* Release the storage for the vnode structure itself. */
+	lock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -967,32 +2334,73 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	off_t start;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
+	start = uio->uio_offset;
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (result == 0) {
+		sfs_readahead(sv, start, uio->uio_offset);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work, up to SFS_DELAYMAX
+ * blocks per operation, so each can be committed in its own
+ * transaction and the file's delayed blocks don't pile up waiting
+ * for one. If the file has SFS_DELAYMAX of them already, an
+ * operation writes some of those out instead. So a write of more
+ * than SFS_DELAYMAX blocks isn't atomic with respect to other
+ * writers of the file.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t chunk, rest;
+	int result = 0;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	while (uio->uio_resid > 0 && result == 0) {
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		if (sv->sv_ndelayed >= SFS_DELAYMAX) {
+			result = sfs_dflush(sv);
+		}
+		else {
+			/* Stop at a block boundary */
+			chunk = SFS_DELAYMAX * sfs->sfs_blocksize -
+				uio->uio_offset % sfs->sfs_blocksize;
+			rest = 0;
+			if (uio->uio_resid > chunk) {
+				rest = uio->uio_resid - chunk;
+				uio->uio_resid = chunk;
+			}
+			result = sfs_io(sv, uio);
+			uio->uio_resid += rest;
+		}
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+
+		/*
+		 * If there's space being freed, it can be had once the
+		 * freeing commits. Unlocked look at the count; if it's
+		 * wrong, the next try fails again or gets the space.
+		 */
+		if (result == ENOSPC && sfs->sfs_journaled &&
+		    sfs->sfs_jnfreed > 0) {
+			result = sfs_jcommit(sfs, false);
+		}
+	}
 
 	return result;
 }
@@ -1033,7 +2441,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +2463,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type is set when the vnode is loaded and never changes */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1093,18 +2500,29 @@ sfs_tryseek(struct vnode *v, off_t pos)
 
 /*
  * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * and some other cases. Writing out the delayed blocks may take
+ * more than one operation; see sfs_dflush.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	bool done = false;
+	int result = 0;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	while (!done && result == 0) {
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_dflush(sv);
+		done = sv->sv_delayed == NULL;
+		if (result == 0 && done) {
+			result = sfs_sync_inode(sv);
+		}
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+	}
 
 	return result;
 }
@@ -1121,36 +2539,21 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Truncate for the original format: free the direct and indirect
+ * blocks from BLOCKLEN on, and the indirect block if it's then empty.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_old(struct sfs_vnode *sv, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
-	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
 	uint32_t i, j, block;
 	uint32_t idblock, baseblock, highblock;
 	int result;
 	int hasnonzero, iddirty;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
-
 	/*
 	 * Go through the direct blocks. Discard any that are
 	 * past the limit we're truncating to.
@@ -1176,24 +2579,24 @@ sfs_truncate(struct vnode *v, off_t len)
 	if (blocklen < highblock && idblock != 0) {
 		/* We're past the proposed EOF; may need to free stuff */
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		/* Get the indirect block */
+		result = sfs_buf_get(sfs, idblock, true, &idbuf);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
+		idptrs = (uint32_t *)idbuf->b_data;
 		
 		hasnonzero = 0;
 		iddirty = 0;
 		for (j=0; j<SFS_DBPERIDB; j++) {
 			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
+			if (blocklen < baseblock+j && idptrs[j] != 0) {
+				sfs_bfree(sfs, idptrs[j]);
+				idptrs[j] = 0;
 				iddirty = 1;
 			}
 			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
+			if (idptrs[j]!=0) {
 				hasnonzero=1;
 			}
 		}
@@ -1205,25 +2608,267 @@ sfs_truncate(struct vnode *v, off_t len)
 			sv->sv_dirty = true;
 		}
 		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
+			/* The indirect block is dirty; it'll be written back */
+			sfs_buf_metadirty(idbuf);
+		}
+		sfs_buf_release(idbuf);
+	}
+	return 0;
+}
+
+/*
+ * Current format: free the blocks indirect block IDBLOCK maps that
+ * are past BLOCKLEN, given that its first slot is file block BASE.
+ * If it's left empty, free it too and set *FREED.
+ */
+static
+int
+sfs_idtruncate(struct sfs_vnode *sv, uint32_t idblock, uint32_t base,
+	       uint32_t blocklen, bool *freed)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t j, perid;
+	bool hasnonzero = false, iddirty = false;
+	int result;
+
+	perid = SFS_FS_DBPERIDB(sfs);
+	result = sfs_buf_get(sfs, idblock, true, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = (uint32_t *)idbuf->b_data;
+	for (j=0; j<perid; j++) {
+		if (base + j >= blocklen && idptrs[j] != 0) {
+			sfs_bfree(sfs, idptrs[j]);
+			idptrs[j] = 0;
+			iddirty = true;
+		}
+		if (idptrs[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+	if (iddirty) {
+		sfs_buf_metadirty(idbuf);
+	}
+	sfs_buf_release(idbuf);
+
+	*freed = !hasnonzero;
+	if (*freed) {
+		sfs_bfree(sfs, idblock);
+	}
+	return 0;
+}
+
+/*
+ * Truncate for the current format: cut back or free the extents that
+ * go past BLOCKLEN, and free the tree's blocks from there on, along
+ * with any indirect blocks that are left empty.
+ */
+static
+int
+sfs_truncate2(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_extent *e;
+	struct sfs_buf *didbuf;
+	uint32_t *didptrs;
+	uint32_t i, j, perid, idblock, didblock, keep;
+	bool freed, hasnonzero;
+	int result;
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sv->sv_i2.sfi_extents[i];
+		if (e->sfe_len == 0 ||
+		    e->sfe_fileblock + e->sfe_len <= blocklen) {
+			continue;
+		}
+		keep = e->sfe_fileblock < blocklen ?
+			blocklen - e->sfe_fileblock : 0;
+		for (j=keep; j<e->sfe_len; j++) {
+			sfs_bfree(sfs, e->sfe_diskblock + j);
+		}
+		if (keep == 0) {
+			bzero(e, sizeof(*e));
+		}
+		else {
+			e->sfe_len = keep;
+		}
+		sv->sv_dirty = true;
+	}
+
+	perid = SFS_FS_DBPERIDB(sfs);
+
+	idblock = sv->sv_i2.sfi_indirect;
+	if (idblock != 0 && blocklen < perid) {
+		result = sfs_idtruncate(sv, idblock, 0, blocklen, &freed);
+		if (result) {
+			return result;
+		}
+		if (freed) {
+			sv->sv_i2.sfi_indirect = 0;
+			sv->sv_dirty = true;
+		}
+	}
+
+	didblock = sv->sv_i2.sfi_dindirect;
+	if (didblock == 0) {
+		return 0;
+	}
+
+	/*
+	 * Go through the double indirect block one slot at a time, so
+	 * as not to hold its buffer while working on the indirect
+	 * blocks.
+	 */
+	j = blocklen > perid ? (blocklen - perid) / perid : 0;
+	for (; j<perid; j++) {
+		result = sfs_buf_get(sfs, didblock, true, &didbuf);
+		if (result) {
+			return result;
+		}
+		idblock = ((uint32_t *)didbuf->b_data)[j];
+		sfs_buf_release(didbuf);
+		if (idblock == 0) {
+			continue;
+		}
+
+		result = sfs_idtruncate(sv, idblock, perid + j * perid,
+					blocklen, &freed);
+		if (result) {
+			return result;
+		}
+		if (freed) {
+			result = sfs_buf_get(sfs, didblock, true, &didbuf);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
+			((uint32_t *)didbuf->b_data)[j] = 0;
+			sfs_buf_metadirty(didbuf);
+			sfs_buf_release(didbuf);
+		}
+	}
+
+	/* Free the double indirect block if it's empty now */
+	result = sfs_buf_get(sfs, didblock, true, &didbuf);
+	if (result) {
+		return result;
+	}
+	didptrs = (uint32_t *)didbuf->b_data;
+	hasnonzero = false;
+	for (j=0; j<perid; j++) {
+		if (didptrs[j] != 0) {
+			hasnonzero = true;
+			break;
+		}
+	}
+	sfs_buf_release(didbuf);
+	if (!hasnonzero) {
+		sfs_bfree(sfs, didblock);
+		sv->sv_i2.sfi_dindirect = 0;
+		sv->sv_dirty = true;
+	}
+	return 0;
+}
+
+/*
+ * Truncate a file to LEN, or as far towards it as the transaction
+ * has room for, for sfs_truncate and sfs_reclaim; each step is an
+ * operation of its own. Sets *DONE once the file is LEN long.
+ */
+static
+int
+sfs_truncstep(struct sfs_vnode *sv, off_t len, bool *done)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	/* Length in blocks (divide rounding up) */
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
+
+	uint32_t curlen, perid, room, nid, target;
+	int result;
+
+	*done = false;
+
+	lock_acquire(sv->sv_lock);
+
+	/*
+	 * Drop delayed writes past the limit, and write out the rest:
+	 * freeing indirect blocks below could take away ones they
+	 * were counting on instead of reserving. That might take a
+	 * step or more of its own.
+	 */
+	sfs_ddiscard(sv, blocklen);
+	if (sv->sv_delayed != NULL) {
+		result = sfs_dflush(sv);
+		if (result || sv->sv_delayed != NULL) {
+			lock_release(sv->sv_lock);
+			return result;
+		}
+	}
+
+	/*
+	 * Work back from the end. Freeing NID indirect blocks' worth
+	 * of the file changes at most NID+1 indirect blocks and the
+	 * double indirect block; extents only change the freemap,
+	 * and the original format has just the one indirect block.
+	 */
+	target = blocklen;
+	if (SFS_FS_ISOLD(sfs)) {
+		result = sfs_truncate_old(sv, target);
+	}
+	else {
+		curlen = DIVROUNDUP(sv->sv_i.sfi_size, sfs->sfs_blocksize);
+		perid = SFS_FS_DBPERIDB(sfs);
+		room = sfs_jroom(sfs);
+		nid = room > 2 ? room - 2 : 1;
+		if (curlen > blocklen && (curlen - blocklen) / perid > nid) {
+			target = curlen - nid * perid;
 		}
+		result = sfs_truncate2(sv, target);
+	}
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
 	}
 
 	/* Set the file size */
-	sv->sv_i.sfi_size = len;
+	if (target == blocklen) {
+		sv->sv_i.sfi_size = len;
+		*done = true;
+	}
+	else {
+		sv->sv_i.sfi_size = target * sfs->sfs_blocksize;
+	}
 
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
+/*
+ * Called for ftruncate(), a step at a time; see sfs_truncstep.
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	bool done = false;
+	int result = 0;
+
+	while (!done && result == 0) {
+		sfs_jbegin(sfs);
+		result = sfs_truncstep(sv, len, &done);
+		sfs_jend(sfs);
+	}
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +2904,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
@@ -1278,18 +2926,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1299,20 +2950,24 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -1327,24 +2982,35 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* No links to directories (which would also lock SV twice) */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	return 0;
 }
 
@@ -1356,32 +3022,45 @@ int
 sfs_remove(struct vnode *dir, const char *name)
 {
 	struct sfs_vnode *sv = dir->vn_data;
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
+	/* We don't support subdirectories */
+	KASSERT(victim->sv_i.sfi_type == SFS_TYPE_FILE);
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
-	/* Discard the reference that sfs_lookonce got us */
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	/*
+	 * Discard the reference that sfs_lookonce got us. This may
+	 * reclaim the file, which is another operation.
+	 */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1397,19 +3076,22 @@ sfs_rename(struct vnode *d1, const char *n1,
 	   struct vnode *d2, const char *n2)
 {
 	struct sfs_vnode *sv = d1->vn_data;
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1430,8 +3112,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -1443,14 +3127,18 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
+
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1464,11 +3152,15 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +3178,13 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* The type never changes, so there's nothing to lock */
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +3192,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +3209,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1644,43 +3330,33 @@ static const struct vnode_ops sfs_dirops = {
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * that's already resident. Called with sfs_vnlock held.
  */
 static
 int
-sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
-		 struct sfs_vnode **ret)
+sfs_doloadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
 	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
-
+	sv = sfs_vnode_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
@@ -1689,6 +3365,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (sv==NULL) {
 		return ENOMEM;
 	}
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		return ENOMEM;
+	}
 
 	/* Must be in an allocated block */
 	if (!sfs_bused(sfs, ino)) {
@@ -1697,11 +3378,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_get(sfs, ino, true, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
+	memcpy(&sv->sv_i, buf->b_data, sizeof(sv->sv_i));
+	sfs_buf_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
@@ -1736,17 +3420,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_ralast = 0;
+	sv->sv_raend = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_dircache = NULL;
+	sv->sv_delayed = NULL;
+	sv->sv_ndelayed = 0;
+	sv->sv_mapreserved = 0;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+	result = sfs_vnode_hash(sfs, sv);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
 		return result;
 	}
@@ -1756,6 +3449,19 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	return 0;
 }
 
+static
+int
+sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		 struct sfs_vnode **ret)
+{
+	int result;
+
+	lock_acquire(sfs->sfs_vnlock);
+	result = sfs_doloadvnode(sfs, ino, forcetype, ret);
+	lock_release(sfs->sfs_vnlock);
+	return result;
+}
+
 /*
  * Get vnode for the root of the filesystem.
  * The root vnode is always found in block 1 (SFS_ROOT_LOCATION).
@@ -1767,14 +3473,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
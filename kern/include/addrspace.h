@@ -36,9 +36,11 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
 
 
 /* 
@@ -84,9 +86,26 @@ struct addrspace {
 	segment* as_segment;
 	vaddr_t as_hpstart;
 	vaddr_t as_hpend;
+	unsigned as_refcount;		/* threads sharing this space */
+	struct spinlock as_reflock;	/* protects as_refcount */
+	struct lock* as_lock;		/* heap and thread stacks */
+	uint32_t as_stacksdefined;	/* thread stack slots with pages */
+	uint32_t as_stacksused;		/* thread stack slots in use */
 #endif
 };
 
+/*
+ * User stacks. The main thread's stack is the AS_STACKPAGES pages
+ * below USERSTACK. Below that are AS_MAXTHREADS-1 slots for the
+ * stacks of other threads in the same space, each AS_THREADSTACKPAGES
+ * pages with an unmapped guard page above it. Slot 0 is the main
+ * stack. A slot's pages are set up the first time it's used and kept
+ * for reuse after its thread exits.
+ */
+#define AS_STACKPAGES		12
+#define AS_MAXTHREADS		32
+#define AS_THREADSTACKPAGES	4
+
 /*
  * Functions in addrspace.c:
  *
@@ -104,8 +123,20 @@ struct addrspace {
  *                "seen" by the processor. Argument might be NULL, 
  *                meaning "no particular address space".
  *
- *    as_destroy - dispose of an address space. You may need to change
- *                the way this works if implementing user-level threads.
+ *    as_incref - add a reference, for another thread sharing the space.
+ *
+ *    as_shared - check whether other threads share the space. Only
+ *                a thread in it can add one, so if the caller is in
+ *                it and alone, the answer can't change under it.
+ *
+ *    as_destroy - drop a reference, and dispose of the address space
+ *                if it was the last one.
+ *
+ *    as_threadstack - claim a free thread stack slot, handing back the
+ *                slot number and the initial stack pointer (EAGAIN if
+ *                all slots are taken).
+ *
+ *    as_threadstack_release - give back a slot from as_threadstack.
  *
  *    as_define_region - set up a region of memory within the address
  *                space.
@@ -124,7 +155,12 @@ struct addrspace {
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(struct addrspace *);
+void              as_incref(struct addrspace *);
+bool              as_shared(struct addrspace *);
 void              as_destroy(struct addrspace *);
+int               as_threadstack(struct addrspace *, int *slot,
+                                 vaddr_t *stackptr);
+void              as_threadstack_release(struct addrspace *, int slot);
 
 int               as_define_region(struct addrspace *as, 
                                    vaddr_t vaddr, size_t sz,
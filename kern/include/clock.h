@@ -41,7 +41,8 @@
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
  *
- * gettime() may be used to fetch the current time of day.
+ * gettime() may be used to fetch the current time of day, once
+ * gettime_available() says the clock has been attached.
  * getinterval() computes the time from time1 to time2.
  *
  * XXX we have struct timespec now, let's use it.
@@ -61,6 +62,7 @@ void hardclock_bootstrap(void);
 void hardclock(void);
 void timerclock(void);
 
+bool gettime_available(void);
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
@@ -70,8 +72,61 @@ void getinterval(time_t secs1, uint32_t nsecs,
 /*
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
+ *
+ * clocksleep_ticks() is the same thing in units of hardclock ticks
+ * (1/HZ seconds), and clocksleep_ns() in nanoseconds, rounded up to
+ * the next tick.
  */
 void clocksleep(int seconds);
+void clocksleep_ticks(unsigned nticks);
+void clocksleep_ns(time_t secs, uint32_t nsecs);
+
+/*
+ * Callouts: call a function at a given hardclock tick in the future.
+ *
+ * Pending callouts are kept in a hashed timing wheel indexed by the
+ * tick they are due on, which CPU 0 advances from hardclock(); so
+ * scheduling and cancelling are O(1) and each tick only looks at one
+ * wheel slot. The function runs in interrupt context (from hardclock
+ * on CPU 0) and must not sleep; waking a thread is fine.
+ *
+ *    callout_init     - set up a callout to call FUNC(ARG).
+ *    callout_schedule - arrange for the call NTICKS ticks from now
+ *                       (at least 1). Reschedules if already pending.
+ *    callout_cancel   - take a pending callout off the wheel. Returns
+ *                       true if it was pending, false if it had already
+ *                       fired (or was never scheduled).
+ *    clock_ticks      - number of ticks since boot.
+ *
+ * The struct callout belongs to the caller and must stay valid until
+ * the callout has fired or been cancelled.
+ */
+struct callout {
+	struct callout *co_next;	/* wheel slot chain */
+	struct callout **co_prevp;	/* pointer to us in the chain */
+	uint64_t co_when;		/* tick when due */
+	void (*co_func)(void *);
+	void *co_arg;
+	bool co_pending;
+};
+
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned nticks);
+bool callout_cancel(struct callout *co);
+uint64_t clock_ticks(void);
+
+/*
+ * Tickless idle. thread_switch calls clock_idle_enter (interrupts
+ * off) right before waiting for an interrupt and clock_idle_exit
+ * right after; in between the cpu's timer is stretched out to the
+ * next pending callout (CPU 0) or IDLE_MAXTICKS (other cpus), and on
+ * the way out CPU 0 runs the callouts for the ticks it slept through.
+ * Setting clock_tickless to false goes back to ticking HZ times a
+ * second while idle.
+ */
+extern bool clock_tickless;
+void clock_idle_enter(void);
+void clock_idle_exit(void);
 
 
 #endif /* _CLOCK_H_ */
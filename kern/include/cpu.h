@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/schedstat.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -60,6 +61,16 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_tickless;		/* Idle waits with the timer stretched */
+	unsigned c_skippedticks;	/* Hardclocks not taken while idle */
+	bool c_idle_stretched;		/* Timer is stretched right now */
+	unsigned c_idle_hardclocks;	/* c_hardclocks when we went idle */
+	uint64_t c_idle_startticks;	/* Callout time when we went idle */
+	time_t c_idle_secs;		/* Time of day when we went idle */
+	uint32_t c_idle_nsecs;
+	struct threadlist c_threadcache; /* Exited threads kept for reuse */
+	unsigned c_threadcache_hits;	/* thread_forks served from it */
+	unsigned c_threadcache_misses;	/* thread_forks that had to allocate */
 
 	/*
 	 * Accessed by other cpus.
@@ -68,6 +79,7 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	struct schedstat c_schedstat;	/* Run queue statistics */
 
 	/*
 	 * Accessed by other cpus.
@@ -114,6 +126,25 @@ void cpu_hatch(unsigned software_number);
  */
 const char *cpu_identify(void);
 
+/*
+ * Return the number of CPUs in the system.
+ */
+unsigned cpu_count(void);
+
+/*
+ * Print per-cpu clock statistics: hardclocks taken and skipped while
+ * idle, and the resulting timer interrupt rate. Also thread cache use.
+ */
+void cpu_printstats(void);
+
+/*
+ * Scheduler statistics. cpu_schedstats copies out those for up to MAX
+ * cpus (zeroing them afterwards if RESET is set) and returns the
+ * number of cpus; cpu_printschedstats prints them.
+ */
+unsigned cpu_schedstats(struct schedstat *stats, unsigned max, bool reset);
+void cpu_printschedstats(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
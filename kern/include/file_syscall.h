@@ -2,14 +2,7 @@
 #ifndef _FILE_DESCRIPTOR_H
 #define _FILE_DESCRIPTOR_H
 
-struct filehandle{
-	char filename[NAME_MAX];	//file name, name size set to max size
-	int flags;			//flags to indicate previlages
-	off_t offset;			//file offset
-	int refcnt;			//to keep a count on the number of 
-	struct lock* lock;		//for synchronizing access to file descriptors
-	struct vnode* vn;		//representation of a file
-};
+#include <filetable.h>
 
 int
 sys_open(userptr_t , int, int*);
@@ -23,6 +16,21 @@ sys_write(int, userptr_t , size_t, int *);
 int
 sys_read(int, userptr_t , userptr_t, int *);
 
+int
+sys_pwrite(int, userptr_t, size_t, off_t, int *);
+
+int
+sys_pread(int, userptr_t, size_t, off_t, int *);
+
+int
+sys_writev(int, userptr_t, int, int *);
+
+int
+sys_readv(int, userptr_t, int, int *);
+
+int
+sys_copy_file_range(int, userptr_t, int, userptr_t, size_t, unsigned, int *);
+
 
 int
 sys_dup2(int, int , int*);
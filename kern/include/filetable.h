@@ -0,0 +1,73 @@
+#ifndef _FILETABLE_H_
+#define _FILETABLE_H_
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+/*
+ * An open file: one per successful open(), shared by every descriptor
+ * that refers to it, in this process (dup2) or others (fork). The
+ * reference count has its own spinlock, like a vnode's, so taking and
+ * dropping references never sleeps and never needs the I/O lock; the
+ * last reference closes the vnode. lock serializes I/O and the offset.
+ */
+struct filehandle{
+	int flags;			//flags to indicate previlages
+	off_t offset;			//file offset
+	int refcnt;			//descriptors and I/O in progress
+	struct spinlock countlock;	//protects refcnt
+	struct lock* lock;		//for synchronizing access to the offset
+	struct vnode* vn;		//representation of a file
+};
+
+struct filehandle* filehandle_create(struct vnode*, int flags);
+void filehandle_incref(struct filehandle*);
+void filehandle_decref(struct filehandle*);
+
+/*
+ * Per-process descriptor table. used[] has one bit per descriptor
+ * that is taken (or reserved by an open in progress), so the lowest
+ * free descriptor is found a word at a time. Everything is protected
+ * by fdt_lock, which is only ever held for a few instructions.
+ *
+ *    fdtable_create  - empty table.
+ *    fdtable_copy    - new table sharing all of OLD's open files (fork).
+ *    fdtable_incref  - add a reference, for another thread sharing the
+ *                      table.
+ *    fdtable_destroy - drop a reference; the last one closes everything
+ *                      and frees the table.
+ *    fdtable_alloc   - reserve the lowest free descriptor (EMFILE).
+ *    fdtable_install - put FH in a descriptor from fdtable_alloc; the
+ *                      table takes over the caller's reference.
+ *    fdtable_unalloc - give back a reserved but uninstalled descriptor.
+ *    fdtable_get     - look up FD and return its file with a reference
+ *                      held, to drop with filehandle_decref when done;
+ *                      NULL if FD isn't open.
+ *    fdtable_close   - close FD (EBADF if not open).
+ *    fdtable_dup2    - make NEWFD refer to OLDFD's file, closing
+ *                      whatever NEWFD had.
+ */
+#define FDTABLE_WORDS	((OPEN_MAX + 31) / 32)
+
+struct fdtable {
+	struct spinlock fdt_lock;
+	unsigned fdt_refcount;		/* threads sharing the table */
+	uint32_t fdt_used[FDTABLE_WORDS];
+	struct filehandle* fdt_files[OPEN_MAX];
+};
+
+struct fdtable* fdtable_create(void);
+int fdtable_copy(struct fdtable* old, struct fdtable** ret);
+void fdtable_incref(struct fdtable*);
+void fdtable_destroy(struct fdtable*);
+int fdtable_alloc(struct fdtable*, int* fd);
+void fdtable_install(struct fdtable*, int fd, struct filehandle*);
+void fdtable_unalloc(struct fdtable*, int fd);
+struct filehandle* fdtable_get(struct fdtable*, int fd);
+int fdtable_close(struct fdtable*, int fd);
+int fdtable_dup2(struct fdtable*, int oldfd, int newfd);
+
+#endif /* _FILETABLE_H_ */
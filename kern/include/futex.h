@@ -0,0 +1,13 @@
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+/*
+ * Kernel side of futex(). Sleepers are keyed on (address space, user
+ * virtual address) and hashed into a fixed table of buckets, each
+ * with its own lock, CV and list of waiters.
+ */
+
+void futex_bootstrap(void);
+int sys_futex(userptr_t, int, int, int32_t*);
+
+#endif /*_FUTEX_H*/
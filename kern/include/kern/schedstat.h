@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SCHEDSTAT_H_
+#define _KERN_SCHEDSTAT_H_
+
+/*
+ * Per-cpu scheduler statistics, as returned by schedstat().
+ *
+ * ss_hist counts run-queue waits (from being made runnable to being
+ * switched to) by size: bucket 0 is under 1 microsecond, bucket B
+ * is 2^(B-1) up to 2^B microseconds, and the last bucket takes
+ * everything longer.
+ */
+#define SCHEDSTAT_BUCKETS	20
+
+struct schedstat {
+	__u32 ss_cpu;			/* cpu number */
+	__u32 ss_switches;		/* context switches */
+	__u32 ss_idle;			/* switches that had to idle first */
+	__u32 ss_enqueues;		/* threads made runnable here */
+	__u32 ss_migrated_in;		/* threads moved here from elsewhere */
+	__u32 ss_migrated_out;		/* threads moved away */
+	__u32 ss_runqueue;		/* threads on the run queue now */
+	__u32 ss_maxrunqueue;		/* longest the run queue has been */
+	__u64 ss_waitns;		/* total run-queue wait, nanoseconds */
+	__u32 ss_hist[SCHEDSTAT_BUCKETS];
+};
+
+#endif /* _KERN_SCHEDSTAT_H_ */
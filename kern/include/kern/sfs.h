@@ -37,7 +37,8 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* size of our blocks (original fmt) */
+#define SFS_MAXBLOCKSIZE  4096          /* largest block size (current fmt) */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
@@ -46,6 +47,19 @@
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
+#define SFS_NEXTENTS      32            /* # of extents in inode (current) */
+
+/*
+ * Format versions, found in sp_version. The original format, with
+ * SFS_BLOCKSIZE blocks and struct sfs_inode, predates the field, so
+ * those volumes have 0 there. The current format has blocks of
+ * sp_blocksize bytes (a power of two from SFS_BLOCKSIZE up to
+ * SFS_MAXBLOCKSIZE) and struct sfs_inode2. The superblock is always
+ * in the first SFS_BLOCKSIZE bytes of the volume; the root directory
+ * and the freemap start at the same block numbers in both.
+ */
+#define SFS_OLDVERSION     0            /* original format */
+#define SFS_VERSION        2            /* current format */
 
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
@@ -59,6 +73,16 @@
 /* Size of bitmap (in blocks) */
 #define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
 
+/* The same for a volume with blocks of BSIZE bytes */
+#define SFS_BSBLOCKBITS(bsize)  ((bsize) * CHAR_BIT)
+#define SFS_BSBITMAPSIZE(nblocks, bsize) \
+	SFS_ROUNDUP(nblocks, SFS_BSBLOCKBITS(bsize))
+#define SFS_BSBITBLOCKS(nblocks, bsize) \
+	(SFS_BSBITMAPSIZE(nblocks, bsize)/SFS_BSBLOCKBITS(bsize))
+
+/* Number of block numbers in an indirect block of BSIZE bytes */
+#define SFS_BSDBPERIDB(bsize)   ((bsize) / sizeof(uint32_t))
+
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
@@ -71,9 +95,53 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_version;			/* Format version */
+	uint32_t sp_blocksize;			/* Block size (current format) */
+	uint32_t sp_jstart;			/* First block of journal */
+	uint32_t sp_jblocks;			/* Journal size; 0 if none */
+	uint32_t reserved[114];
 };
 
+/*
+ * Metadata journal (current format only, and optional). The journal
+ * is sp_jblocks blocks from sp_jstart, marked in use in the freemap.
+ * Its first block is a header giving the sequence number of the
+ * first transaction to replay; transactions follow one after
+ * another from the next block. Each is one or more descriptor
+ * blocks, each followed by the blocks it lists, then a commit block
+ * holding a checksum of everything before it. A descriptor entry
+ * with SFS_JREVOKE set has no block following: it says the block was
+ * freed, and its copies in this and earlier transactions mustn't be
+ * replayed. A transaction counts only if its commit block is there
+ * with the right sequence number and checksum; replay stops at the
+ * first one that isn't.
+ *
+ * Each block starts with a struct sfs_jhdr; descriptor entries come
+ * right after it. Only inodes, indirect blocks, directory blocks and
+ * the freemap are journaled; file data is written in place, before
+ * the transaction that allocates it commits.
+ */
+#define SFS_JMAGIC        0x53464a4c    /* journal block magic number */
+#define SFS_JTYPE_HEADER  1             /* journal header */
+#define SFS_JTYPE_DESC    2             /* descriptor block */
+#define SFS_JTYPE_COMMIT  3             /* commit block */
+#define SFS_JREVOKE       0x80000000    /* descriptor entry: block freed */
+
+struct sfs_jhdr {
+	uint32_t jh_magic;			/* SFS_JMAGIC */
+	uint32_t jh_type;			/* One of SFS_JTYPE_* above */
+	uint32_t jh_seq;			/* Transaction sequence number */
+	uint32_t jh_count;			/* # of entries, or blocks logged */
+	uint32_t jh_sum;			/* Commit: checksum */
+};
+
+/* Number of descriptor entries in a block of BSIZE bytes */
+#define SFS_BSJENTRIES(bsize) \
+	(((bsize) - sizeof(struct sfs_jhdr)) / sizeof(uint32_t))
+
+/* Smallest journal for a volume with BITBLOCKS blocks of freemap */
+#define SFS_JMINSIZE(bitblocks)  (2*(bitblocks) + 64)
+
 /*
  * On-disk inode
  */
@@ -86,6 +154,37 @@ struct sfs_inode {
 	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/*
+ * On-disk inode, current format. It takes the first 512 bytes of its
+ * block; the rest of the block is zero.
+ *
+ * Each block of the file is mapped either by one of the extents or by
+ * the tree of indirect blocks, never both. An extent maps sfe_len
+ * consecutive file blocks from sfe_fileblock to consecutive disk
+ * blocks from sfe_diskblock; unused extents have sfe_len 0. The
+ * indirect block maps file blocks from 0, and the double indirect
+ * block holds indirect blocks mapping the file blocks after those.
+ * Files are laid out contiguously where possible, so the tree is
+ * only used once a file has more than SFS_NEXTENTS pieces.
+ *
+ * The first three fields are the same as in struct sfs_inode.
+ */
+struct sfs_extent {
+	uint32_t sfe_fileblock;			/* First file block mapped */
+	uint32_t sfe_diskblock;			/* Where it is on disk */
+	uint32_t sfe_len;			/* Number of blocks */
+};
+
+struct sfs_inode2 {
+	uint32_t sfi_size;			/* Size of this file (bytes) */
+	uint16_t sfi_type;			/* One of SFS_TYPE_* above */
+	uint16_t sfi_linkcount;			/* # hard links to this file */
+	struct sfs_extent sfi_extents[SFS_NEXTENTS]; /* Extents */
+	uint32_t sfi_indirect;			/* Indirect block */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_waste[128-4-3*SFS_NEXTENTS]; /* unused, set to 0 */
+};
+
 /*
  * On-disk directory entry
  */
@@ -55,6 +55,14 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Make the next hardclock interrupt on the current cpu come NTICKS
+ * ticks from now rather than one; after it fires, the timer goes back
+ * to HZ by itself. Used to stop ticking while idle.
+ */
+#define MAINBUS_MAXTIMERTICKS	1000
+void mainbus_settimer(unsigned nticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
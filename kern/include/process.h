@@ -4,20 +4,44 @@
 
 #include <limits.h>
 
+/*
+ * A process. Children are on their parent's children list while they
+ * run and move to its zombies list when they exit, so the parent can
+ * find (and reap) any exited child without searching; the parent
+ * sleeps on its own waitchan until one shows up.
+ */
 struct process {
-	pid_t ppid;
-	struct lock* exitlock;
-	struct cv* exitcv;
+	pid_t pid;
+	pid_t ppid;			/* -1 if nobody will wait for us */
 	bool exited;
 	int exitcode;
 	struct thread* self;
+	struct wchan* waitchan;		/* children's exits wake us here */
+	struct process* children;	/* running children */
+	struct process* zombies;	/* exited children, not yet reaped */
+	struct process* sibling;	/* next on parent's list */
+	struct process** siblingp;	/* what points to us on that list */
 };
 
-struct process* process[PID_MAX];
+/*
+ * The process table, indexed by pid. Slots are handed out and taken
+ * back under a spinlock inside process.c (it has to work for the very
+ * first thread, before locks can be used); a process's own slot is
+ * stable until the pid is freed, so its owner can use it unlocked.
+ */
+extern struct process* process[PID_MAX];
 
-pid_t generate_pid(void);
+pid_t generate_pid(struct thread*);
+void pid_free(pid_t);
+void process_exit(pid_t, int);
+void process_thread_exit(struct thread*);
+int process_wait(pid_t, int, pid_t*, int*, userptr_t);
 int sys_getpid(int32_t*);
 int sys_execv(userptr_t, userptr_t);
+int sys_spawn(userptr_t, userptr_t, int32_t*);
+int sys___threadfork(userptr_t, userptr_t, userptr_t, int32_t*);
+int sys_threadexit(userptr_t);
+int sys_threadjoin(userptr_t, userptr_t);
 int sys_fork(int32_t*, struct trapframe*);
 void child_forkentry(void*, unsigned long);
 int sys_waitpid(int32_t*, userptr_t, userptr_t, userptr_t);
@@ -48,11 +48,186 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct cv;
+
+/*
+ * Buffer cache sizing: SFS_BUFSPACE bytes of block buffers per mounted
+ * volume, but never fewer than SFS_MINBUFS buffers, so bigger blocks
+ * don't leave too few for read-ahead and pinned metadata. They're
+ * found through SFS_BUFHASH hash chains. Dirty buffers are written
+ * back when evicted, on sync, and every SFS_SYNCSECS seconds.
+ */
+#define SFS_BUFSPACE   (64*1024)
+#define SFS_MINBUFS    128
+#define SFS_BUFHASH    64
+#define SFS_SYNCSECS   10
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;            /* volume the buffer belongs to */
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lrunext;      /* LRU list, most recent first */
+	struct sfs_buf *b_lruprev;
+	uint32_t b_block;               /* disk block held */
+	bool b_valid;                   /* true if b_block is held */
+	bool b_dirty;                   /* true if b_data newer than disk */
+	bool b_readahead;               /* read ahead, not yet used */
+	bool b_busy;                    /* held by someone, or doing I/O */
+	bool b_pinned;                  /* journaled; changed since commit */
+	char *b_data;                   /* block contents */
+};
+
+/*
+ * Journaling. Volumes with a journal log every change to metadata
+ * before it goes to disk in place. Operations that change metadata
+ * run between sfs_jbegin and sfs_jend, and a commit waits until none
+ * are in progress, so that each transaction holds whole operations:
+ * everything done since the last commit, in as few sequential writes
+ * as the journal's layout allows.
+ *
+ * A metadata buffer changed since the last commit is pinned, and
+ * can't be written in place until the commit. If one has to be
+ * evicted, its contents are kept aside as an sfs_jsaved until then.
+ * A transaction is committed on sync, or before an operation starts
+ * if it might otherwise not fit in the journal, allowing for
+ * SFS_JOPBLOCKS blocks per operation in progress and SFS_JOPINODES
+ * inodes per operation since the last commit; after a commit
+ * leaves the journal more than half full, everything in it is
+ * written in place and the journal starts over.
+ *
+ * SFS_JOPBLOCKS covers what the namespace operations change: two
+ * directory blocks, and for a directory that grows, its new block
+ * and the indirect blocks that map it. Writing out delayed blocks
+ * and truncating can change any number, so they go a step at a time,
+ * checking sfs_jroom, and when it runs low the operation ends and
+ * another one (after a commit) carries on. Such operations aren't
+ * atomic: a crash can leave a file partly truncated, or with only
+ * some of a long write's blocks allocated.
+ */
+#define SFS_JOPBLOCKS  8
+#define SFS_JOPINODES  4
+
+struct sfs_jsaved {
+	struct sfs_jsaved *js_next;
+	uint32_t js_block;              /* disk block */
+	char *js_data;                  /* its contents */
+};
+
+/*
+ * Each new inode starts a fresh run of at least SFS_ALLOCRUN free
+ * blocks, found from the allocation cursor, for its data to grow
+ * into; after that a file's blocks go right after their predecessors
+ * where possible.
+ */
+#define SFS_ALLOCRUN   32
+
+/*
+ * Read-ahead window, in blocks: it starts at SFS_RAMIN when a file is
+ * being read sequentially and doubles, up to SFS_RAMAX, each time the
+ * reader catches up with it. It's also kept to a quarter of the
+ * volume's buffers, so it doesn't evict what it read ahead.
+ */
+#define SFS_RAMIN      4
+#define SFS_RAMAX      32
+
+/*
+ * Directory lookup cache. The first search of a directory reads every
+ * entry into an in-memory table, hashed by name over SFS_DIRHASH
+ * chains; after that lookups, links and unlinks consult and update
+ * the table instead of scanning the directory. dc_slots maps each
+ * slot to its entry (NULL for an empty slot), and dc_freehint is the
+ * lowest slot that might be empty.
+ */
+#define SFS_DIRHASH    128
+
+struct sfs_dirent {
+	struct sfs_dirent *de_next;     /* hash chain */
+	uint32_t de_ino;                /* inode number */
+	int de_slot;                    /* slot in the directory */
+	char de_name[SFS_NAMELEN];      /* file name */
+};
+
+struct sfs_dircache {
+	struct sfs_dirent *dc_hash[SFS_DIRHASH];
+	struct array *dc_slots;         /* slot -> entry */
+	unsigned dc_freehint;           /* no empty slot below this */
+};
+
+/*
+ * Loaded vnodes are found by inode number through SFS_VNHASH hash
+ * chains; each also remembers its index in sfs_vnodes so it can be
+ * taken out again without searching.
+ */
+#define SFS_VNHASH     64
+
+/*
+ * Delayed allocation. Writes to parts of a file that have no disk
+ * blocks yet are held in memory, in sfs_dblocks kept on a list in
+ * file block order, with space reserved for them (and for
+ * any indirect blocks they might need) so that running out of space
+ * is reported by the write and not later. They get disk blocks
+ * together, in order, so they come out contiguous, and go to disk
+ * with one device request per run of up to SFS_DELAYMAX: when the
+ * file is synced or closed, or when a write finds SFS_DELAYMAX of
+ * them on the file. A write also flushes its file if the whole
+ * volume has SFS_DELAYVOLUME blocks reserved, room for SFS_DELAYMAX
+ * each for several writers at once, but only if the file has at
+ * least SFS_DELAYMIN of them: flushing a few blocks at a time gives
+ * up on keeping them together, and the files holding the most flush
+ * themselves soon enough. On a journaled volume that's as many as the
+ * transaction has room for (see SFS_JOPBLOCKS). Writes go at most
+ * SFS_DELAYMAX blocks per operation, so they can't pile up unbounded
+ * while waiting for a commit.
+ */
+#define SFS_DELAYMAX    64
+#define SFS_DELAYVOLUME (4*SFS_DELAYMAX)
+#define SFS_DELAYMIN    (SFS_DELAYMAX/4)
+
+struct sfs_dblock {
+	struct sfs_dblock *db_next;     /* next in file block order */
+	uint32_t db_fileblock;          /* block number within the file */
+	uint32_t db_diskblock;          /* disk block, once allocated */
+	char *db_data;                  /* block contents */
+};
+
+/*
+ * Locking. Each vnode has sv_lock, which covers its inode, its data
+ * and (for directories) its entries and lookup cache; directory
+ * operations lock the directory first, then the file. The volume
+ * has sfs_vnlock for the table of loaded vnodes, sfs_freemaplock for
+ * the free map, its summary, the space reservation and the
+ * superblock, and sfs_buflock for the buffer cache. Those three are
+ * never held while waiting for a vnode lock, and no disk I/O is done
+ * under sfs_freemaplock or sfs_buflock. sfs_diovlock is taken with a
+ * vnode locked, around writing one run of delayed blocks, and nothing
+ * else is taken under it. On a journaled volume an
+ * operation calls sfs_jbegin before taking any of these, and
+ * sfs_jend after letting go of them; operations don't nest, so
+ * anything that may reclaim a vnode comes after sfs_jend.
+ */
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
-	struct sfs_inode sv_i;		/* on-disk inode */
+	struct lock *sv_lock;           /* lock for everything below */
+	/*
+	 * On-disk inode, in the volume's format. The size, type and
+	 * link count are in the same place in both, so sv_i's are
+	 * used whatever the format.
+	 */
+	union {
+		struct sfs_inode sv_i;  /* original format */
+		struct sfs_inode2 sv_i2; /* current format */
+	};
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* vnode hash chain */
+	unsigned sv_index;              /* index in sfs_vnodes */
+	uint32_t sv_ralast;             /* last file block read */
+	uint32_t sv_raend;              /* end of blocks read ahead */
+	uint32_t sv_rawindow;           /* read-ahead window; 0 if random */
+	struct sfs_dircache *sv_dircache; /* directories: name table or NULL */
+	struct sfs_dblock *sv_delayed;  /* blocks not yet allocated */
+	unsigned sv_ndelayed;           /* number of them */
+	uint32_t sv_mapreserved;        /* reserved for indirect blocks */
 };
 
 struct sfs_fs {
@@ -60,9 +235,55 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	uint32_t sfs_blocksize;         /* block size */
+	struct lock *sfs_vnlock;        /* lock for loaded vnode table */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH]; /* same, by inode number */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_mapdirty;    /* which blocks of it, if journaled */
+	unsigned sfs_nmapdirty;         /* how many */
+	struct bitmap *sfs_jfreed;      /* freed since commit, if journaled */
+	unsigned sfs_jnfreed;           /* how many */
+	uint32_t sfs_allocnext;         /* allocation cursor for new inodes */
+	uint32_t *sfs_groupfree;        /* free blocks per freemap block */
+	uint32_t sfs_reserved;          /* blocks reserved for delayed writes */
+	struct lock *sfs_diovlock;      /* lock for sfs_diov */
+	struct iovec *sfs_diov;         /* SFS_DELAYMAX, for sfs_dflush */
+	struct lock *sfs_buflock;       /* lock for buffer cache */
+	struct cv *sfs_bufcv;           /* for waiting on busy buffers */
+	struct sfs_buf *sfs_bufs;       /* buffer cache */
+	unsigned sfs_nbufs;             /* number of buffers */
+	struct sfs_buf *sfs_bufhash[SFS_BUFHASH];
+	struct sfs_buf *sfs_lruhead;    /* most recently used buffer */
+	struct sfs_buf *sfs_lrutail;    /* least recently used buffer */
+
+	/*
+	 * Journal (sfs_journal.c), if sfs_journaled. sfs_jlock
+	 * covers the operation count and commit state. The pinned
+	 * count, saved blocks, and the sets of revoked blocks and of
+	 * blocks that may be in the journal are changed by operations
+	 * under sfs_buflock; commits read them with no operation in
+	 * progress.
+	 */
+	bool sfs_journaled;             /* true if logging metadata */
+	struct lock *sfs_jlock;         /* lock for operation count */
+	struct cv *sfs_jcv;             /* for waiting on it */
+	unsigned sfs_jnops;             /* operations in progress */
+	unsigned sfs_jbegun;            /* operations since last commit */
+	unsigned sfs_jwant;             /* threads waiting to commit */
+	bool sfs_jcommitting;           /* true while committing */
+	uint32_t sfs_jseq;              /* next transaction's number */
+	uint32_t sfs_jhead;             /* and where in the journal it goes */
+	unsigned sfs_jpinned;           /* pinned buffers */
+	struct sfs_jsaved *sfs_jsaved;  /* pinned blocks evicted */
+	unsigned sfs_jnsaved;           /* number of them */
+	bool sfs_jsavedbusy;            /* true while they're committed */
+	struct bitmap *sfs_jmeta;       /* blocks logged or pinned */
+	struct bitmap *sfs_jrevoke;     /* ... and freed since commit */
+	unsigned sfs_jnrevoke;          /* number of those */
+	struct bitmap *sfs_jmaplogged;  /* freemap blocks not yet in place */
 };
 
 /*
@@ -75,15 +296,69 @@ int sfs_mount(const char *device);
  * Internal functions
  */
 
+/* Format version and block-size-dependent sizes of a mounted volume */
+#define SFS_FS_ISOLD(sfs)       ((sfs)->sfs_super.sp_version == SFS_OLDVERSION)
+#define SFS_FS_BLOCKBITS(sfs)   SFS_BSBLOCKBITS((sfs)->sfs_blocksize)
+#define SFS_FS_BITMAPSIZE(sfs) \
+	SFS_BSBITMAPSIZE((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_BITBLOCKS(sfs) \
+	SFS_BSBITBLOCKS((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_DBPERIDB(sfs)    SFS_BSDBPERIDB((sfs)->sfs_blocksize)
+
 /* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, block, rw) \
+    uio_kinit(iov, uio, ptr, (sfs)->sfs_blocksize, \
+	      ((off_t)(block))*(sfs)->sfs_blocksize, rw)
 
 /* Convenience functions for block I/O */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/*
+ * Buffer cache (sfs_buf.c). sfs_buf_get hands back the buffer for
+ * BLOCK, busy, so nobody else can use it and it can't be evicted
+ * until sfs_buf_release; if it's already busy, sfs_buf_get waits. If
+ * DOREAD is false and the block isn't cached, the buffer comes back
+ * zeroed instead of being read, for callers about to overwrite the
+ * block. sfs_buf_cached is only a hint unless the caller otherwise
+ * keeps the block from being brought in.
+ */
+int sfs_buf_init(struct sfs_fs *sfs);
+void sfs_buf_cleanup(struct sfs_fs *sfs);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool doread,
+		struct sfs_buf **ret);
+void sfs_buf_dirty(struct sfs_buf *buf);
+void sfs_buf_metadirty(struct sfs_buf *buf);
+void sfs_buf_release(struct sfs_buf *buf);
+bool sfs_buf_cached(struct sfs_fs *sfs, uint32_t block);
+void sfs_buf_invalidate(struct sfs_fs *sfs, uint32_t block);
+void sfs_buf_readahead(struct sfs_fs *sfs, const uint32_t *blocks,
+		       unsigned n);
+int sfs_buf_flush(struct sfs_fs *sfs);
+void sfs_buf_printstats(bool reset);
+void sfs_buf_revoke(struct sfs_fs *sfs, uint32_t block);
+unsigned sfs_buf_jcollect(struct sfs_fs *sfs, struct sfs_buf **bufs);
+void sfs_buf_jdone(struct sfs_fs *sfs, struct sfs_buf **bufs, unsigned n,
+		   bool committed, bool dropsaved);
+
+/*
+ * Journal (sfs_journal.c). sfs_jinit replays the journal at mount
+ * time, before the freemap is loaded. sfs_jcommit commits what's
+ * been done so far, and with CHECKPOINT set also writes it all in
+ * place and empties the journal, as at unmount.
+ */
+int sfs_jinit(struct sfs_fs *sfs);
+void sfs_jcleanup(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+unsigned sfs_jroom(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs, bool checkpoint);
+void sfs_jprintstats(bool reset);
+
+/* In sfs_vnode.c: put every modified inode in the buffer cache */
+int sfs_sync_inodes(struct sfs_fs *sfs);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -69,9 +69,22 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds the lock held by a thread
+ * currently running on another cpu spins for a while (up to
+ * LOCK_SPIN_TRIES polls) on the assumption that the holder will let
+ * go soon, and only goes to sleep if the holder is not running or
+ * the spin runs out. lk_waiters counts the threads asleep on the
+ * wait channel so that an uncontended release doesn't need to touch
+ * the wait channel at all.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
+#define LOCK_SPIN_TRIES	1000
+
+/* Polls per spin; the lock benchmark sets it to 0 to compare with sleeping */
+extern unsigned lock_spintries;
+
 struct lock {
         char *lk_name;
         // add what you need here
@@ -79,7 +92,8 @@ struct lock {
 	struct wchan *lk_wchan;
 	struct spinlock lk_spin;
 	volatile bool lk_isLocked;
-	struct thread *thread;
+	volatile unsigned lk_waiters;	/* threads asleep on lk_wchan */
+	struct thread *volatile thread;	/* holder, or NULL */
 };
 
 struct lock *lock_create(const char *name);
@@ -145,18 +159,34 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
 
 /*
  * 13 Feb 2012 : GWA : Reader-writer locks.
+ *
+ * The rwlock is fair in both directions. Once a writer is waiting,
+ * newly arriving readers queue up behind it instead of joining the
+ * readers already inside, so writers cannot be starved. When a writer
+ * releases, every reader that was waiting at that point is admitted
+ * together as one batch (ahead of any other waiting writers), so
+ * readers cannot be starved either; the next writer gets in when the
+ * last reader of the batch leaves.
+ *
+ * rwlk_batch is bumped each time a batch of readers is admitted. A
+ * waiting reader remembers the value it saw on arrival and may enter
+ * once it changes, even if writers are waiting by then.
+ *
+ * rwlock_downgrade turns a held write lock into a read lock without
+ * letting any writer in between, and admits the readers waiting at
+ * that moment along with it.
  */
 
 struct rwlock {
 	char *rwlk_name;
 	struct wchan *rwlk_rwchan;		//wait channel for readers
 	struct wchan *rwlk_wwchan;		//wait channel for writers
-	struct lock *rwlk_lock;
 	struct spinlock rwlk_spin;
-	volatile int rwlk_rcount;		//counts no of readers currently accessing the resource
-	//volatile int rwlk_wcount;		//counts no of writers in wait channel
-	volatile bool rwlk_iswriting;
-	bool rwlk_prevrelease;		//false - read has been released; true - write
+	volatile unsigned rwlk_rcount;		//counts no of readers currently accessing the resource
+	volatile unsigned rwlk_rwaiting;	//counts no of readers in wait channel
+	volatile unsigned rwlk_wwaiting;	//counts no of writers in wait channel
+	volatile unsigned rwlk_batch;		//reader batch generation
+	struct thread *rwlk_writer;		//thread holding the write lock, if any
 };
 
 struct rwlock * rwlock_create(const char *);
@@ -166,5 +196,6 @@ void rwlock_acquire_read(struct rwlock *);
 void rwlock_release_read(struct rwlock *);
 void rwlock_acquire_write(struct rwlock *);
 void rwlock_release_write(struct rwlock *);
+void rwlock_downgrade(struct rwlock *);
 
 #endif /* _SYNCH_H_ */
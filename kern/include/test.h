@@ -86,10 +86,15 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int threadbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
+int lockbench(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
+int rwbench(int, char **);
+int callouttest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -97,6 +102,10 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int seqbench(int, char **);
+int lookupbench(int, char **);
+int appendbench(int, char **);
+int jcrashtest(int, char **);
 int printfile(int, char **);
 
 /* other tests */
@@ -100,6 +100,7 @@ struct thread {
 	bool t_in_interrupt;		/* Are we in an interrupt? */
 	int t_curspl;			/* Current spl*() state */
 	int t_iplhigh_count;		/* # of times IPL has been raised */
+	uint64_t t_enqueued;		/* When put on the run queue (ns) */
 
 	/*
 	 * Public fields
@@ -107,13 +108,14 @@ struct thread {
 
 	/* VM */
 	struct addrspace *t_addrspace;	/* virtual address space */
+	int t_stackslot;		/* user stack slot in t_addrspace */
 
 	/* VFS */
 	struct vnode *t_cwd;		/* current working directory */
 
 	/* add more here as needed */
 	pid_t t_pid;			/*Process id*/
-	struct filehandle *filetable[OPEN_MAX]; 	/*File table */
+	struct fdtable *t_fdtable;	/* Open file descriptors */
 };
 
 /* Call once during system startup to allocate data structures. */
@@ -132,15 +134,23 @@ void thread_shutdown(void);
  * Make a new thread, which will start executing at "func". The "data"
  * arguments (one pointer, one number) are passed to the function. The
  * current thread is used as a prototype for creating the new one. If
- * "ret" is non-null, the thread structure for the new thread is
- * handed back. (Note that using said thread structure from the parent
- * thread should be done only with caution, because in general the
- * child thread might exit at any time.) Returns an error code.
+ * "retpid" is non-null, the new thread's pid is handed back. (Not
+ * the thread structure: the child might exit at any time, and its
+ * structure be reused for another thread.) Returns an error code.
  */
 int thread_fork(const char *name, 
                 void (*func)(void *, unsigned long),
                 void *data1, unsigned long data2, 
-                struct thread **ret);
+                pid_t *retpid);
+
+/*
+ * Exited threads give their structure and stack to a small per-cpu
+ * cache, up to THREAD_CACHE_MAX of them, and thread_fork on that cpu
+ * takes from it before allocating. Setting thread_caching to false
+ * turns this off (for comparison in benchmarks).
+ */
+#define THREAD_CACHE_MAX 16
+extern bool thread_caching;
 
 /*
  * Cause the current thread to exit.
@@ -168,4 +178,7 @@ void thread_consider_migration(void);
 
 /* system call for sbrk */
 int sys_sbrk(userptr_t, int32_t*);
+
+/* system call for scheduler statistics */
+int sys_schedstat(userptr_t, unsigned, int32_t*);
 #endif /* _THREAD_H_ */
@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,10 +51,18 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are protected by vn_countlock. When VOP_DECREF drops
+ * the last reference it calls VOP_RECLAIM without the lock and
+ * without decrementing; the filesystem must recheck the count under
+ * whatever lock it uses to hand out new references, and if someone
+ * picked the vnode up in the meantime, consume the reference and
+ * return EBUSY.
  */
 struct vnode {
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
+	struct spinlock vn_countlock;   /* Lock for the counts */
 
 	struct fs *vn_fs;               /* Filesystem vnode belongs to */
 
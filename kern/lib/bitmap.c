@@ -95,27 +95,107 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
+/*
+ * Find the first clear bit in [from, to). Full 32-bit words of set
+ * bits are skipped four bytes at a time; this doesn't care about byte
+ * order, because an all-ones word looks the same either way.
+ */
+static
 int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+bitmap_findzero(struct bitmap *b, unsigned from, unsigned to, unsigned *index)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned ix, maxix, offset;
+        const unsigned wordbytes = sizeof(uint32_t);
+
+        if (from >= to) {
+                return ENOSPC;
+        }
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
+        ix = from / BITS_PER_WORD;
+        maxix = DIVROUNDUP(to, BITS_PER_WORD);
+        offset = from % BITS_PER_WORD;
+
+        while (ix < maxix) {
+                if (offset == 0 && ix % wordbytes == 0) {
+                        while (ix + wordbytes <= maxix &&
+                               *(uint32_t *)&b->v[ix] == 0xffffffff) {
+                                ix += wordbytes;
+                        }
+                        if (ix >= maxix) {
+                                break;
+                        }
+                }
+                if (b->v[ix] != WORD_ALLBITS) {
+                        for (; offset < BITS_PER_WORD; offset++) {
                                 WORD_TYPE mask = ((WORD_TYPE)1) << offset;
 
                                 if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
+                                        *index = ix*BITS_PER_WORD + offset;
+                                        return *index < to ? 0 : ENOSPC;
                                 }
                         }
-                        KASSERT(0);
                 }
+                ix++;
+                offset = 0;
+        }
+        return ENOSPC;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        int result;
+
+        result = bitmap_findzero(b, 0, b->nbits, index);
+        if (result) {
+                return result;
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        int result;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        result = bitmap_findzero(b, goal, b->nbits, index);
+        if (result) {
+                result = bitmap_findzero(b, 0, goal, index);
+        }
+        if (result) {
+                return result;
+        }
+        bitmap_mark(b, *index);
+        return 0;
+}
+
+int
+bitmap_findrun(struct bitmap *b, unsigned from, unsigned to, unsigned len,
+               unsigned *index)
+{
+        unsigned start, end;
+
+        KASSERT(len > 0);
+        if (to > b->nbits) {
+                to = b->nbits;
+        }
+
+        while (bitmap_findzero(b, from, to, &start) == 0) {
+                for (end = start+1;
+                     end < to && end-start < len && !bitmap_isset(b, end);
+                     end++) {
+                        /* nothing */
+                }
+                if (end-start >= len) {
+                        *index = start;
+                        return 0;
+                }
+                /* END is set (or the limit); keep looking past it */
+                from = end+1;
         }
         return ENOSPC;
 }
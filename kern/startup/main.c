@@ -49,6 +49,7 @@
 #include <test.h>
 #include <version.h>
 #include <swap.h>
+#include <futex.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -122,6 +123,7 @@ boot(void)
 
 	/* Late phase of initialization. */
 	vm_bootstrap();
+	futex_bootstrap();
 	kprintf_bootstrap();
 	thread_start_cpus();
 
@@ -35,6 +35,7 @@
 #include <lib.h>
 #include <uio.h>
 #include <clock.h>
+#include <cpu.h>
 #include <thread.h>
 #include <vfs.h>
 #include <sfs.h>
@@ -105,7 +106,8 @@ cmd_progthread(void *ptr, unsigned long nargs)
 	if (result) {
 		kprintf("Running program %s failed: %s\n", args[0],
 			strerror(result));
-		return;
+		/* common_prog is waiting for us; exit like a process */
+		sys_exit((userptr_t)1);
 	}
 
 	/* NOTREACHED: runprogram only returns on error. */
@@ -133,26 +135,22 @@ common_prog(int nargs, char **args)
 	kprintf("Warning: this probably won't work with a "
 		"synchronization-problems kernel.\n");
 #endif
-	struct thread* thread;
+	pid_t pid;
 	
 	result = thread_fork(args[0] /* thread name */,
 			cmd_progthread /* thread function */,
 			args /* thread arg */, nargs /* thread arg */,
-			&thread);
-
-	if(thread == NULL){
-		kprintf("thread_fork failed to allocate memory\n");
-		return -1;
-	}
+			&pid);
 
 	if (result) {
 		kprintf("thread_fork failed: %s\n", strerror(result));
 		return result;
 	}
 
-	int retval, str;
+	pid_t retval;
+	int str;
 
-	result = sys_waitpid(&retval, (userptr_t)thread->t_pid, (userptr_t)&str, (userptr_t)0);
+	result = process_wait(pid, 0, &retval, &str, NULL);
 	
 	if(result) {
 		kprintf("waitpid failed: %s\n", strerror(result));
@@ -397,6 +395,79 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_cpustats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	cpu_printstats();
+
+	return 0;
+}
+
+/*
+ * Usage: rq [reset]
+ */
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	if (nargs > 2 || (nargs == 2 && strcmp(args[1], "reset"))) {
+		kprintf("Usage: rq [reset]\n");
+		return EINVAL;
+	}
+
+	cpu_printschedstats();
+	if (nargs == 2) {
+		cpu_schedstats(NULL, 0, true);
+	}
+
+	return 0;
+}
+
+#if OPT_SFS
+/*
+ * Usage: bc [reset]
+ */
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	if (nargs > 2 || (nargs == 2 && strcmp(args[1], "reset"))) {
+		kprintf("Usage: bc [reset]\n");
+		return EINVAL;
+	}
+
+	sfs_buf_printstats(nargs == 2);
+	sfs_jprintstats(nargs == 2);
+
+	return 0;
+}
+#endif
+
+/*
+ * Usage: tickless [on|off]
+ */
+static
+int
+cmd_tickless(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		clock_tickless = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		clock_tickless = false;
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: tickless [on|off]\n");
+		return EINVAL;
+	}
+	kprintf("Tickless idle is %s\n", clock_tickless ? "on" : "off");
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -460,6 +531,7 @@ static const char *testmenu[] = {
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Thread create benchmark       ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
@@ -467,6 +539,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy5] CV test 2             (1)     ",
+	"[sy6] Lock benchmark        (1)     ",
+	"[rw1] RW lock test          (1)     ",
+	"[rw2] RW lock benchmark     (1)     ",
+	"[co1] Callout/timer test            ",
 	"[sp1] Whalematching Driver  (1)     ",
 	"[sp2] Stoplight Driver      (1)     ",
 	"[fs1] Filesystem test               ",
@@ -474,6 +550,10 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS sequential bench   (4)     ",
+	"[fs7] FS lookup bench       (4)     ",
+	"[fs8] FS append bench       (4)     ",
+	"[fs9] FS journal crash test (4)     ",
 	NULL
 };
 
@@ -498,6 +578,12 @@ static const char *mainmenu[] = {
 	"[?o] Operations menu                ",
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
+	"[cs] Per-cpu clock stats            ",
+	"[rq] Run queue stats [reset]        ",
+#if OPT_SFS
+	"[bc] SFS cache/journal stats [reset]",
+#endif
+	"[tickless] Tickless idle on/off     ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -546,6 +632,12 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "cs",		cmd_cpustats },
+	{ "rq",		cmd_schedstats },
+#if OPT_SFS
+	{ "bc",		cmd_bufstats },
+#endif
+	{ "tickless",	cmd_tickless },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -558,12 +650,17 @@ static struct {
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	threadbench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy5",	cvtest2 },
+	{ "sy6",	lockbench },
+	{ "rw1",	rwtest },
+	{ "rw2",	rwbench },
+	{ "co1",	callouttest },
 	
 #if OPT_SYNCHPROBS
   /* synchronization problem tests */
@@ -577,6 +674,10 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	seqbench },
+	{ "fs7",	lookupbench },
+	{ "fs8",	appendbench },
+	{ "fs9",	jcrashtest },
 
 	{ NULL, NULL }
 };
@@ -30,281 +30,411 @@ sys_open(userptr_t flname, int rwflag, int *retval)
 		return EFAULT;
 	}*/
 
-	if(strlen((char *) flname) == 0 || (rwflag & O_ACCMODE) > 3){
+	if(strlen(temp) == 0 || (rwflag & O_ACCMODE) > 3){
 		return EINVAL;
 	}
-        	
-	for(int itr=0; itr<OPEN_MAX; itr++)
-	{
-		if(curthread->filetable[itr]==NULL)
-		{
-			curthread->filetable[itr]=kmalloc(sizeof(struct filehandle));			/*initialize file table entry*/
-			if(curthread->filetable[itr]==NULL)
-			{
-				return ENOMEM;
-			}
-
-			curthread->filetable[itr]->flags=rwflag;						/*set flags */
-			curthread->filetable[itr]->refcnt=1;
-			curthread->filetable[itr]->lock=lock_create("open_lock");				/*dummy name for a lock*/
-				
-			if(curthread->filetable[itr]->lock==NULL)						/*return if lock is not available*/
-			{
-				kfree(curthread->filetable[itr]);
-				return ENOMEM;
-			}
-
-			char* tempflname;
-			if(itr >= 0 && itr <3){
-				tempflname = (char*) flname;
-			} else {
-				tempflname = kmalloc((strlen((char *)flname)+1)*sizeof(char));
-
-				if(tempflname==NULL)
-				{
-					return ENOMEM;
-				}
-
-				size_t fsize;
-
-				int result = copyinstr((const_userptr_t) flname, tempflname,(strlen((char *)flname)+1) * sizeof(char),&fsize);
-				if(result)
-				{
-					lock_destroy(curthread->filetable[itr]->lock);
-					kfree(curthread->filetable[itr]);
-					return result;
-				}
-			}
-                        curthread->filetable[itr]->offset=0;
-
-			/*have no clue what 0664 is, check working later*/			
-			int result = vfs_open(tempflname, rwflag,0664,&(curthread->filetable[itr]->vn));
-			if(result)
-			{
-				return result;
-			}
-
-			if(rwflag & O_APPEND){
-				struct stat st;
-				VOP_STAT(curthread->filetable[itr]->vn,&st);
-				curthread->filetable[itr]->offset = st.st_size;
-			}
-
-			*retval=itr;
-			return result;									/*if all steps succeed, return file descriptor*/
-		}
-	}
-	return EMFILE;	
-}
 
-
-int
-sys_close(int fd)
-{
-	if(fd < 0 || fd >= OPEN_MAX)
-	{
-		return EBADF;
+	/* Reserve the descriptor first so a full table can't create files */
+	int fd;
+	result = fdtable_alloc(curthread->t_fdtable, &fd);
+	if(result){
+		return result;
 	}
 
-	if(curthread->filetable[fd]==NULL)
-	{
-		return EBADF;
+	struct vnode* vn;
+	/*have no clue what 0664 is, check working later*/			
+	result = vfs_open(temp, rwflag, 0664, &vn);
+	if(result){
+		fdtable_unalloc(curthread->t_fdtable, fd);
+		return result;
 	}
 
-	if(curthread->filetable[fd]->refcnt==0)
-	{
-		return EBADF;
+	struct filehandle* fh = filehandle_create(vn, rwflag);
+	if(fh == NULL){
+		vfs_close(vn);
+		fdtable_unalloc(curthread->t_fdtable, fd);
+		return ENOMEM;
 	}
 
-	lock_acquire(curthread->filetable[fd]->lock);
-	curthread->filetable[fd]->refcnt-=1;
-	
-	if(curthread->filetable[fd]->refcnt==0)
-	{
-		vfs_close(curthread->filetable[fd]->vn);
-		lock_release(curthread->filetable[fd]->lock);
-		lock_destroy(curthread->filetable[fd]->lock);
-		kfree(curthread->filetable[fd]);
-		curthread->filetable[fd] = NULL;
-	}
-	else
-	{
-		lock_release(curthread->filetable[fd]->lock);
+	if(rwflag & O_APPEND){
+		struct stat st;
+		VOP_STAT(vn, &st);
+		fh->offset = st.st_size;
 	}
 
-	return 0;
+	fdtable_install(curthread->t_fdtable, fd, fh);
+	*retval = fd;
+	return 0;									/*if all steps succeed, return file descriptor*/
 }
 
 
-
 int
-sys_write(int fd, userptr_t buf, size_t count, int* retval)
+sys_close(int fd)
 {
-	char temp[count + 1];
-	int result;
-	size_t actual;
+	return fdtable_close(curthread->t_fdtable, fd);
+}
 
-	if(fd < 0 || fd >= OPEN_MAX){
-		return EBADF;
-	}
 
-	if(count <= 0){
-                return EINVAL;
-        }
 
-	if(count == 1){
-		result = copyin((const_userptr_t)buf, temp, count+1);
-		if(result){
-			return EFAULT;
+/*
+ * Common code for read and write and their vectored and positional
+ * forms. IOV is a kernel copy of IOVCNT user buffers. If POS is NULL
+ * the I/O happens at the open file's seek offset, under its lock, and
+ * moves the offset along; otherwise it happens at *POS and leaves the
+ * offset (and the lock) alone, so processes sharing a descriptor can
+ * do positional I/O side by side.
+ */
+static
+int
+file_rw(int fd, struct iovec* iov, int iovcnt, const off_t* pos,
+	enum uio_rw rw, int* retval)
+{
+	struct filehandle* fh;
+	struct uio uiovar;
+	size_t total = 0;
+	int accmode, ret;
+
+	for(int i = 0; i < iovcnt; i++){
+		total += iov[i].iov_len;
+		if(total < iov[i].iov_len || total > 0x7fffffff){
+			/* the byte count has to fit in the return value */
+			return EINVAL;
 		}
-	}else {
-		result = copyinstr((const_userptr_t)buf, temp, count+1, &actual);
-        	if(result){
-                	return EFAULT;
-        	}
 	}
 
-	/*if((char*)buf == (char*) 0x40000000 || (char*)buf >= (char*) 0x80000000){
-		return EFAULT;
-	}*/
+	fh = fdtable_get(curthread->t_fdtable, fd);
+	if(fh == NULL){
+		return EBADF;
+	}
 
-	if(curthread->filetable[fd] == NULL){
+	accmode = fh->flags & O_ACCMODE;
+	if((rw == UIO_READ && accmode == O_WRONLY) ||
+	   (rw == UIO_WRITE && accmode == O_RDONLY)){
+		filehandle_decref(fh);
 		return EBADF;
 	}
-	
-	struct iovec iovctr;
-	struct uio uiovar;
 
-	iovctr.iov_ubase = buf;
-	iovctr.iov_len = count;
+	if(pos != NULL && VOP_TRYSEEK(fh->vn, *pos)){
+		filehandle_decref(fh);
+		return *pos < 0 ? EINVAL : ESPIPE;
+	}
 
+	uiovar.uio_iov = iov;
+	uiovar.uio_iovcnt = iovcnt;
+	uiovar.uio_resid = total;
 	uiovar.uio_segflg = UIO_USERSPACE;
-	uiovar.uio_iov = &iovctr;
-	uiovar.uio_iovcnt = 1;
-	
-	if(curthread->filetable[fd] == NULL){
-		panic("Lock somehow vanished\n");
+	uiovar.uio_space = curthread->t_addrspace;
+	uiovar.uio_rw = rw;
+
+	if(pos == NULL){
+		/* hold the file's lock across the I/O so the offset stays ours */
+		lock_acquire(fh->lock);
+		uiovar.uio_offset = fh->offset;
+	}
+	else {
+		uiovar.uio_offset = *pos;
 	}
 
-	lock_acquire(curthread->filetable[fd]->lock);
-	uiovar.uio_offset = curthread->filetable[fd]->offset;/*is it 0 or the offset from current thread file table*/
-	uiovar.uio_resid = count;
-	uiovar.uio_space = curthread->t_addrspace;
-	uiovar.uio_rw = UIO_WRITE;
-	lock_release(curthread->filetable[fd]->lock);
-	
-	int ret;
-	ret = VOP_WRITE(curthread->filetable[fd]->vn,&uiovar);
-	
+	if(rw == UIO_READ){
+		ret = VOP_READ(fh->vn, &uiovar);
+	}
+	else {
+		ret = VOP_WRITE(fh->vn, &uiovar);
+	}
+
+	if(pos == NULL){
+		if(!ret){
+			fh->offset = uiovar.uio_offset;
+		}
+		lock_release(fh->lock);
+	}
+	filehandle_decref(fh);
+
 	if(ret){
 		return ret;
 	}
 
-	lock_acquire(curthread->filetable[fd]->lock);
-	int writediff = uiovar.uio_offset-curthread->filetable[fd]->offset;
-	curthread->filetable[fd]->offset=uiovar.uio_offset;
-	lock_release(curthread->filetable[fd]->lock);
+	*retval = total - uiovar.uio_resid;
+	return 0;
+}
+
+/* Fetch a user iovec array for readv/writev */
+static
+int
+file_copyiniov(userptr_t uiov, int iovcnt, struct iovec** ret){
+	struct iovec* iov;
+	int result;
+
+	if(iovcnt <= 0 || iovcnt > IOV_MAX){
+		return EINVAL;
+	}
+
+	iov = kmalloc(iovcnt * sizeof(struct iovec));
+	if(iov == NULL){
+		return ENOMEM;
+	}
 
-	*retval = writediff;
+	result = copyin((const_userptr_t)uiov, iov, iovcnt * sizeof(struct iovec));
+	if(result){
+		kfree(iov);
+		return result;
+	}
+
+	*ret = iov;
 	return 0;
 }
 
 int
-sys_read(int fd, userptr_t buf, userptr_t tempcount, int* retval)
+sys_write(int fd, userptr_t buf, size_t count, int* retval)
 {
-	size_t count = (size_t)tempcount;	
-	char temp[count+1];
-	int result;
-	size_t actual;
+	struct iovec iovctr;
 
-        if(fd < 0 || fd >= OPEN_MAX){
-                return EBADF;
+	if(count <= 0){
+                return EINVAL;
         }
 
+	iovctr.iov_ubase = buf;
+	iovctr.iov_len = count;
+	return file_rw(fd, &iovctr, 1, NULL, UIO_WRITE, retval);
+}
+
+int
+sys_read(int fd, userptr_t buf, userptr_t tempcount, int* retval)
+{
+	size_t count = (size_t)tempcount;	
+	struct iovec iovctr;
+
         if(count <= 0){
                 return EINVAL;
         }
 
-	if(count == 1){
-                result = copyin((const_userptr_t)buf, temp, count+1);
-                if(result){
-                        return EFAULT;
-                }
-        }else {
-		result = copyinstr((const_userptr_t)buf, temp, count+1, &actual);
-        	if(result){
-                	return EFAULT;
-        	}
-	}
+	iovctr.iov_ubase = buf;
+	iovctr.iov_len = count;
+	return file_rw(fd, &iovctr, 1, NULL, UIO_READ, retval);
+}
 
-        /*if((char*)buf == (char*) 0x40000000 || (char*)buf >= (char*) 0x80000000 
-		|| (void*)count == (void*) 0x40000000 || (void*)count >= (void*) 0x80000000){
-                return EFAULT;
-        }*/
+int
+sys_pwrite(int fd, userptr_t buf, size_t count, off_t pos, int* retval)
+{
+	struct iovec iovctr;
 
-        if(curthread->filetable[fd] == NULL){
-                return EBADF;
-        }
+	iovctr.iov_ubase = buf;
+	iovctr.iov_len = count;
+	return file_rw(fd, &iovctr, 1, &pos, UIO_WRITE, retval);
+}
 
-        struct iovec iovctr;
-        struct uio uiovar;
+int
+sys_pread(int fd, userptr_t buf, size_t count, off_t pos, int* retval)
+{
+	struct iovec iovctr;
 
-        iovctr.iov_ubase = buf;
-        iovctr.iov_len = count;
+	iovctr.iov_ubase = buf;
+	iovctr.iov_len = count;
+	return file_rw(fd, &iovctr, 1, &pos, UIO_READ, retval);
+}
 
-        uiovar.uio_iov = &iovctr;
-        uiovar.uio_iovcnt = 1;
+int
+sys_writev(int fd, userptr_t uiov, int iovcnt, int* retval)
+{
+	struct iovec* iov;
+	int result;
 
-        lock_acquire(curthread->filetable[fd]->lock);
-        uiovar.uio_offset = curthread->filetable[fd]->offset;/*is it 0 or the offset from current thread file table*/
-        lock_release(curthread->filetable[fd]->lock);
+	result = file_copyiniov(uiov, iovcnt, &iov);
+	if(result){
+		return result;
+	}
 
-        uiovar.uio_resid = count;
-        uiovar.uio_segflg = UIO_USERSPACE;
-        uiovar.uio_space = curthread->t_addrspace;
-        uiovar.uio_rw = UIO_READ;
+	result = file_rw(fd, iov, iovcnt, NULL, UIO_WRITE, retval);
+	kfree(iov);
+	return result;
+}
 
-        int ret = VOP_READ(curthread->filetable[fd]->vn,&uiovar);
-        if(ret){
-                 return ret;
-        }
+int
+sys_readv(int fd, userptr_t uiov, int iovcnt, int* retval)
+{
+	struct iovec* iov;
+	int result;
 
-	lock_acquire(curthread->filetable[fd]->lock);
-        int readdiff = uiovar.uio_offset - curthread->filetable[fd]->offset;
-	curthread->filetable[fd]->offset = uiovar.uio_offset;
-        lock_release(curthread->filetable[fd]->lock);
+	result = file_copyiniov(uiov, iovcnt, &iov);
+	if(result){
+		return result;
+	}
 
-        *retval = readdiff;
-	return 0;
+	result = file_rw(fd, iov, iovcnt, NULL, UIO_READ, retval);
+	kfree(iov);
+	return result;
 }
 
+/*
+ * Copy up to LEN bytes from one open file to another inside the
+ * kernel, through a kernel buffer, so the data never goes near user
+ * memory. Like pread/pwrite, a non-NULL offset pointer means "copy at
+ * *off and update *off" and leaves that file's seek offset alone; a
+ * NULL one means use and advance the seek offset. Returns the number
+ * of bytes copied, which is short only at end of input (or if an error
+ * happens after something has already been copied).
+ */
+#define COPY_CHUNK	(16 * 1024)
+
 int
-sys_dup2(int oldfd, int newfd, int* retval){
-	
-	if((oldfd < 0 || oldfd >= OPEN_MAX) || (newfd < 0 || newfd >= OPEN_MAX)){
+sys_copy_file_range(int infd, userptr_t uinoff, int outfd, userptr_t uoutoff,
+		    size_t len, unsigned flags, int* retval)
+{
+	struct filehandle* in;
+	struct filehandle* out;
+	struct iovec iov;
+	struct uio u;
+	off_t inpos, outpos;
+	size_t done = 0, chunk, got;
+	char* buf;
+	int result = 0;
+
+	if(flags != 0){
+		return EINVAL;
+	}
+	if(len > 0x7fffffff){
+		len = 0x7fffffff;
+	}
+
+	in = fdtable_get(curthread->t_fdtable, infd);
+	if(in == NULL){
 		return EBADF;
 	}
-	
-	if(curthread->filetable[oldfd] == NULL){	
+	out = fdtable_get(curthread->t_fdtable, outfd);
+	if(out == NULL){
+		filehandle_decref(in);
 		return EBADF;
 	}
 
-	if(newfd == oldfd){
-		*retval = newfd;
-		return 0;
+	if((in->flags & O_ACCMODE) == O_WRONLY ||
+	   (out->flags & O_ACCMODE) == O_RDONLY){
+		result = EBADF;
+		goto fail;
 	}
-	
-	if(curthread->filetable[newfd] != NULL){
-		int close = sys_close(newfd);
-		if(close){
-			return close;
+
+	if(uinoff != NULL){
+		result = copyin(uinoff, &inpos, sizeof(off_t));
+		if(result){
+			goto fail;
+		}
+	}
+	if(uoutoff != NULL){
+		result = copyin(uoutoff, &outpos, sizeof(off_t));
+		if(result){
+			goto fail;
 		}
 	}
 
-	lock_acquire(curthread->filetable[oldfd]->lock);
-	curthread->filetable[newfd] = curthread->filetable[oldfd];
-	curthread->filetable[newfd]->refcnt++;
-	lock_release(curthread->filetable[oldfd]->lock);
+	buf = kmalloc(COPY_CHUNK);
+	if(buf == NULL){
+		result = ENOMEM;
+		goto fail;
+	}
+
+	/*
+	 * Take the offset locks we need. If both ends use the same open
+	 * file's offset there's only one lock; otherwise go in address
+	 * order so two copies in opposite directions can't deadlock.
+	 */
+	if(uinoff == NULL && uoutoff == NULL && in != out && in > out){
+		lock_acquire(out->lock);
+		lock_acquire(in->lock);
+	}
+	else {
+		if(uinoff == NULL){
+			lock_acquire(in->lock);
+		}
+		if(uoutoff == NULL && (uinoff != NULL || in != out)){
+			lock_acquire(out->lock);
+		}
+	}
+	if(uinoff == NULL){
+		inpos = in->offset;
+	}
+	if(uoutoff == NULL){
+		outpos = in == out && uinoff == NULL ? inpos : out->offset;
+	}
+
+	if(inpos < 0 || outpos < 0){
+		result = EINVAL;
+	}
+	else if(in->vn == out->vn && inpos < outpos + (off_t)len &&
+		outpos < inpos + (off_t)len){
+		/* overlapping copy within one file */
+		result = EINVAL;
+	}
+	else if(VOP_TRYSEEK(in->vn, inpos) || VOP_TRYSEEK(out->vn, outpos)){
+		result = ESPIPE;
+	}
+
+	while(result == 0 && done < len){
+		chunk = len - done;
+		if(chunk > COPY_CHUNK){
+			chunk = COPY_CHUNK;
+		}
+
+		uio_kinit(&iov, &u, buf, chunk, inpos, UIO_READ);
+		result = VOP_READ(in->vn, &u);
+		got = chunk - u.uio_resid;
+		if(result || got == 0){
+			break;
+		}
+		inpos += got;
+
+		uio_kinit(&iov, &u, buf, got, outpos, UIO_WRITE);
+		result = VOP_WRITE(out->vn, &u);
+		outpos += got - u.uio_resid;
+		done += got - u.uio_resid;
+		if(result == 0 && u.uio_resid > 0){
+			/* short write (disk full); give back the rest */
+			inpos -= u.uio_resid;
+			break;
+		}
+	}
+
+	if(uinoff == NULL){
+		in->offset = inpos;
+	}
+	if(uoutoff == NULL){
+		out->offset = outpos;
+	}
+	if(uoutoff == NULL && (uinoff != NULL || in != out)){
+		lock_release(out->lock);
+	}
+	if(uinoff == NULL){
+		lock_release(in->lock);
+	}
+	kfree(buf);
+
+	if(done > 0){
+		/* report what got copied; the error (if any) comes next time */
+		result = 0;
+	}
+	if(result == 0){
+		if(uinoff != NULL){
+			result = copyout(&inpos, uinoff, sizeof(off_t));
+		}
+		if(result == 0 && uoutoff != NULL){
+			result = copyout(&outpos, uoutoff, sizeof(off_t));
+		}
+	}
+	*retval = done;
+
+ fail:
+	filehandle_decref(out);
+	filehandle_decref(in);
+	return result;
+}
+
+int
+sys_dup2(int oldfd, int newfd, int* retval){
+	int result;
+
+	result = fdtable_dup2(curthread->t_fdtable, oldfd, newfd);
+	if(result){
+		return result;
+	}
+
 	*retval = newfd;
 	return 0;
 }
@@ -319,52 +449,53 @@ sys_lseek(int fd, off_t *pos, int whence){
 		return EBADF;
 	}
 
-	if(curthread->filetable[fd] == NULL){
+	struct filehandle* fh = fdtable_get(curthread->t_fdtable, fd);
+	if(fh == NULL){
 		return EBADF;
 	}
 	
 	if(!(whence == SEEK_SET || whence == SEEK_CUR || whence == SEEK_END )){
+		filehandle_decref(fh);
 		*pos = -1;
 		return EINVAL;
 	}
 
 	//*pos can be negative if whence is SEEK_CUR
 	if(*pos < 0 && whence != SEEK_CUR){
+		filehandle_decref(fh);
 		*pos = -1;
 		return EINVAL;
 	}
-	
-	lock_acquire(curthread->filetable[fd]->lock);
-	VOP_STAT(curthread->filetable[fd]->vn,&st);
+
+	lock_acquire(fh->lock);
+	VOP_STAT(fh->vn,&st);
 	switch(whence){
 		case SEEK_SET:
 			posnew = *pos;
 			break;
 		
 		case SEEK_CUR:
-			posnew = curthread->filetable[fd]->offset + *pos;
+			posnew = fh->offset + *pos;
 			break;
 		
 		case SEEK_END:
+		default:
 			posnew = st.st_size + *pos;
 			break;
-		
-		default:
-			lock_release(curthread->filetable[fd]->lock);
-			*pos = -1;
-			return EINVAL;
 	}
 
-	int ret = VOP_TRYSEEK(curthread->filetable[fd]->vn, posnew);
+	int ret = VOP_TRYSEEK(fh->vn, posnew);
 	if(ret){
 		*pos = -1;
-		lock_release(curthread->filetable[fd]->lock);
+		lock_release(fh->lock);
+		filehandle_decref(fh);
 		return ESPIPE;
 	}
 	
-	curthread->filetable[fd]->offset = posnew;	
-	lock_release(curthread->filetable[fd]->lock);
-	*pos = curthread->filetable[fd]->offset;
+	fh->offset = posnew;	
+	lock_release(fh->lock);
+	filehandle_decref(fh);
+	*pos = posnew;
 	return 0;
 	
 }
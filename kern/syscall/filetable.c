@@ -0,0 +1,264 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <filetable.h>
+
+/*
+ * Open file objects.
+ */
+
+struct filehandle*
+filehandle_create(struct vnode* vn, int flags){
+	struct filehandle* fh;
+
+	fh = kmalloc(sizeof(struct filehandle));
+	if(fh == NULL){
+		return NULL;
+	}
+
+	fh->lock = lock_create("filehandle");
+	if(fh->lock == NULL){
+		kfree(fh);
+		return NULL;
+	}
+
+	spinlock_init(&fh->countlock);
+	fh->flags = flags;
+	fh->offset = 0;
+	fh->refcnt = 1;
+	fh->vn = vn;
+	return fh;
+}
+
+void
+filehandle_incref(struct filehandle* fh){
+	spinlock_acquire(&fh->countlock);
+	KASSERT(fh->refcnt > 0);
+	fh->refcnt++;
+	spinlock_release(&fh->countlock);
+}
+
+void
+filehandle_decref(struct filehandle* fh){
+	int refcnt;
+
+	spinlock_acquire(&fh->countlock);
+	KASSERT(fh->refcnt > 0);
+	refcnt = --fh->refcnt;
+	spinlock_release(&fh->countlock);
+
+	if(refcnt == 0){
+		vfs_close(fh->vn);
+		lock_destroy(fh->lock);
+		spinlock_cleanup(&fh->countlock);
+		kfree(fh);
+	}
+}
+
+/*
+ * Descriptor tables.
+ */
+
+struct fdtable*
+fdtable_create(void){
+	struct fdtable* fdt;
+	int i;
+
+	fdt = kmalloc(sizeof(struct fdtable));
+	if(fdt == NULL){
+		return NULL;
+	}
+
+	spinlock_init(&fdt->fdt_lock);
+	fdt->fdt_refcount = 1;
+	for(i = 0; i < FDTABLE_WORDS; i++){
+		fdt->fdt_used[i] = 0;
+	}
+	for(i = 0; i < OPEN_MAX; i++){
+		fdt->fdt_files[i] = NULL;
+	}
+	return fdt;
+}
+
+int
+fdtable_copy(struct fdtable* old, struct fdtable** ret){
+	struct fdtable* new;
+	struct filehandle* fh;
+	int fd;
+
+	new = fdtable_create();
+	if(new == NULL){
+		return ENOMEM;
+	}
+
+	/*
+	 * Descriptors reserved by an open in progress have no file yet;
+	 * the child doesn't get them.
+	 */
+	spinlock_acquire(&old->fdt_lock);
+	for(fd = 0; fd < OPEN_MAX; fd++){
+		fh = old->fdt_files[fd];
+		if(fh != NULL){
+			filehandle_incref(fh);
+			new->fdt_files[fd] = fh;
+			new->fdt_used[fd / 32] |= 1U << (fd % 32);
+		}
+	}
+	spinlock_release(&old->fdt_lock);
+
+	*ret = new;
+	return 0;
+}
+
+void
+fdtable_incref(struct fdtable* fdt){
+	spinlock_acquire(&fdt->fdt_lock);
+	KASSERT(fdt->fdt_refcount > 0);
+	fdt->fdt_refcount++;
+	spinlock_release(&fdt->fdt_lock);
+}
+
+void
+fdtable_destroy(struct fdtable* fdt){
+	unsigned refs;
+	int fd;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	KASSERT(fdt->fdt_refcount > 0);
+	refs = --fdt->fdt_refcount;
+	spinlock_release(&fdt->fdt_lock);
+	if(refs > 0){
+		return;
+	}
+
+	/* Nobody else can see the table any more; no need to lock */
+	for(fd = 0; fd < OPEN_MAX; fd++){
+		if(fdt->fdt_files[fd] != NULL){
+			filehandle_decref(fdt->fdt_files[fd]);
+		}
+	}
+	spinlock_cleanup(&fdt->fdt_lock);
+	kfree(fdt);
+}
+
+int
+fdtable_alloc(struct fdtable* fdt, int* ret){
+	uint32_t bits;
+	int word, fd;
+
+	spinlock_acquire(&fdt->fdt_lock);
+	for(word = 0; word < FDTABLE_WORDS; word++){
+		bits = fdt->fdt_used[word];
+		if(bits == 0xffffffff){
+			continue;
+		}
+		fd = word * 32 + __builtin_ctz(~bits);
+		if(fd >= OPEN_MAX){
+			break;
+		}
+		fdt->fdt_used[word] |= 1U << (fd % 32);
+		spinlock_release(&fdt->fdt_lock);
+		*ret = fd;
+		return 0;
+	}
+	spinlock_release(&fdt->fdt_lock);
+	return EMFILE;
+}
+
+void
+fdtable_install(struct fdtable* fdt, int fd, struct filehandle* fh){
+	spinlock_acquire(&fdt->fdt_lock);
+	KASSERT(fdt->fdt_used[fd / 32] & (1U << (fd % 32)));
+	KASSERT(fdt->fdt_files[fd] == NULL);
+	fdt->fdt_files[fd] = fh;
+	spinlock_release(&fdt->fdt_lock);
+}
+
+void
+fdtable_unalloc(struct fdtable* fdt, int fd){
+	spinlock_acquire(&fdt->fdt_lock);
+	KASSERT(fdt->fdt_files[fd] == NULL);
+	fdt->fdt_used[fd / 32] &= ~(1U << (fd % 32));
+	spinlock_release(&fdt->fdt_lock);
+}
+
+struct filehandle*
+fdtable_get(struct fdtable* fdt, int fd){
+	struct filehandle* fh;
+
+	if(fdt == NULL || fd < 0 || fd >= OPEN_MAX){
+		return NULL;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	fh = fdt->fdt_files[fd];
+	if(fh != NULL){
+		filehandle_incref(fh);
+	}
+	spinlock_release(&fdt->fdt_lock);
+	return fh;
+}
+
+int
+fdtable_close(struct fdtable* fdt, int fd){
+	struct filehandle* fh;
+
+	if(fdt == NULL || fd < 0 || fd >= OPEN_MAX){
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	fh = fdt->fdt_files[fd];
+	if(fh != NULL){
+		fdt->fdt_files[fd] = NULL;
+		fdt->fdt_used[fd / 32] &= ~(1U << (fd % 32));
+	}
+	spinlock_release(&fdt->fdt_lock);
+
+	if(fh == NULL){
+		return EBADF;
+	}
+	/* may close the vnode, which can sleep; not under the spinlock */
+	filehandle_decref(fh);
+	return 0;
+}
+
+int
+fdtable_dup2(struct fdtable* fdt, int oldfd, int newfd){
+	struct filehandle* fh;
+	struct filehandle* replaced;
+
+	if(fdt == NULL || oldfd < 0 || oldfd >= OPEN_MAX ||
+	   newfd < 0 || newfd >= OPEN_MAX){
+		return EBADF;
+	}
+
+	spinlock_acquire(&fdt->fdt_lock);
+	fh = fdt->fdt_files[oldfd];
+	if(fh == NULL){
+		spinlock_release(&fdt->fdt_lock);
+		return EBADF;
+	}
+	replaced = fdt->fdt_files[newfd];
+	if(replaced == fh){
+		/* same file already (includes oldfd == newfd) */
+		spinlock_release(&fdt->fdt_lock);
+		return 0;
+	}
+	if(replaced == NULL && (fdt->fdt_used[newfd / 32] & (1U << (newfd % 32)))){
+		/* reserved by an open in progress */
+		spinlock_release(&fdt->fdt_lock);
+		return EBUSY;
+	}
+	filehandle_incref(fh);
+	fdt->fdt_files[newfd] = fh;
+	fdt->fdt_used[newfd / 32] |= 1U << (newfd % 32);
+	spinlock_release(&fdt->fdt_lock);
+
+	if(replaced != NULL){
+		filehandle_decref(replaced);
+	}
+	return 0;
+}
@@ -0,0 +1,159 @@
+#include <types.h>
+#include <lib.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <synch.h>
+#include <current.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <thread.h>
+#include <futex.h>
+
+#define FUTEX_HASHSIZE	64
+
+/*
+ * One of these lives on the kernel stack of each thread sleeping in
+ * FUTEX_WAIT, linked into its bucket until a FUTEX_WAKE takes it off.
+ */
+struct futex_waiter {
+	struct addrspace* fw_as;
+	vaddr_t fw_vaddr;
+	volatile bool fw_woken;
+	struct futex_waiter* fw_next;
+};
+
+struct futex_bucket {
+	struct lock* fb_lock;
+	struct cv* fb_cv;
+	struct futex_waiter* fb_head;		//waiters in arrival order
+	struct futex_waiter* fb_tail;
+};
+
+static struct futex_bucket futextable[FUTEX_HASHSIZE];
+
+/* Function to pick the bucket for a (address space, address) key */
+static struct futex_bucket*
+futex_hash(struct addrspace* as, vaddr_t vaddr){
+	uint32_t h;
+
+	h = ((uint32_t)vaddr >> 2) ^ ((uint32_t)as >> 4);
+	h ^= h >> 11;
+	return &futextable[h % FUTEX_HASHSIZE];
+}
+
+void
+futex_bootstrap(void){
+	for(int itr = 0; itr < FUTEX_HASHSIZE; itr++){
+		futextable[itr].fb_lock = lock_create("futex");
+		futextable[itr].fb_cv = cv_create("futex");
+		if(futextable[itr].fb_lock == NULL || futextable[itr].fb_cv == NULL){
+			panic("futex_bootstrap: out of memory\n");
+		}
+		futextable[itr].fb_head = NULL;
+		futextable[itr].fb_tail = NULL;
+	}
+}
+
+static int
+futex_wait(struct addrspace* as, userptr_t uaddr, int val){
+	struct futex_bucket* bucket = futex_hash(as, (vaddr_t)uaddr);
+	struct futex_waiter waiter;
+	int cur;
+	int result;
+
+	/*
+	 * Check the value with the bucket locked, so a waker that changes
+	 * it and then calls FUTEX_WAKE can't slip in between the check and
+	 * our going to sleep.
+	 */
+	lock_acquire(bucket->fb_lock);
+	result = copyin((const_userptr_t)uaddr, &cur, sizeof(int));
+	if(result){
+		lock_release(bucket->fb_lock);
+		return result;
+	}
+
+	if(cur != val){
+		lock_release(bucket->fb_lock);
+		return EAGAIN;
+	}
+
+	waiter.fw_as = as;
+	waiter.fw_vaddr = (vaddr_t)uaddr;
+	waiter.fw_woken = false;
+	waiter.fw_next = NULL;
+	if(bucket->fb_tail == NULL){
+		bucket->fb_head = &waiter;
+	} else {
+		bucket->fb_tail->fw_next = &waiter;
+	}
+	bucket->fb_tail = &waiter;
+
+	while(!waiter.fw_woken){
+		cv_wait(bucket->fb_cv, bucket->fb_lock);
+	}
+	lock_release(bucket->fb_lock);
+
+	return 0;
+}
+
+static int
+futex_wake(struct addrspace* as, userptr_t uaddr, int count, int32_t* retval){
+	struct futex_bucket* bucket = futex_hash(as, (vaddr_t)uaddr);
+	struct futex_waiter** link;
+	struct futex_waiter* waiter;
+	struct futex_waiter* prev = NULL;
+	int woken = 0;
+
+	lock_acquire(bucket->fb_lock);
+	link = &bucket->fb_head;
+	while(*link != NULL && woken < count){
+		waiter = *link;
+		if(waiter->fw_as == as && waiter->fw_vaddr == (vaddr_t)uaddr){
+			*link = waiter->fw_next;
+			if(bucket->fb_tail == waiter){
+				bucket->fb_tail = prev;
+			}
+			waiter->fw_woken = true;
+			woken++;
+		} else {
+			prev = waiter;
+			link = &waiter->fw_next;
+		}
+	}
+
+	if(woken > 0){
+		cv_broadcast(bucket->fb_cv, bucket->fb_lock);
+	}
+	lock_release(bucket->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
+
+int
+sys_futex(userptr_t uaddr, int op, int val, int32_t* retval){
+	struct addrspace* as = curthread->t_addrspace;
+
+	if(uaddr == NULL || ((vaddr_t)uaddr & 3) != 0){
+		return EFAULT;
+	}
+
+	if(as == NULL){
+		return EINVAL;
+	}
+
+	switch(op){
+		case FUTEX_WAIT:
+			return futex_wait(as, uaddr, val);
+
+		case FUTEX_WAKE:
+			if(val < 0){
+				return EINVAL;
+			}
+			return futex_wake(as, uaddr, val, retval);
+
+		default:
+			return EINVAL;
+	}
+}
@@ -12,27 +12,351 @@
 #include <vfs.h>
 #include <syscall.h>
 #include <process.h>
+#include <filetable.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+
+/*
+ * Pid allocation.
+ *
+ * Free pids are kept in a bitmap, one bit per pid (pid 0 is never
+ * used, so its bit starts out set), and handed out by looking for
+ * the first clear bit at or after a cursor that moves round the table.
+ * That finds a pid a word at a time instead of probing every slot, and
+ * a pid that was just freed doesn't get handed straight back out while
+ * somebody may still be holding on to it.
+ *
+ * pid_lock protects the bitmap, the cursor, the process[] slots, and
+ * everything in struct process that other processes look at: the
+ * family lists, ppid and the exit status.
+ */
+#define PIDMAP_WORDS	((PID_MAX + 31) / 32)
+
+struct process* process[PID_MAX];
+
+static uint32_t pid_map[PIDMAP_WORDS] = { 0x1 };
+static pid_t pid_next = 1;
+static struct spinlock pid_lock = SPINLOCK_INITIALIZER;
+
+/* Find and mark a free pid, or return -1 if the table is full. */
+static
+pid_t
+pid_alloc(void){
+	unsigned word, first, i;
+	uint32_t bits;
+	pid_t pid;
+
+	KASSERT(spinlock_do_i_hold(&pid_lock));
+
+	/*
+	 * Look at the cursor's word (ignoring bits below the cursor),
+	 * then all the others, then the cursor's word again for the
+	 * bits we skipped the first time.
+	 */
+	first = pid_next / 32;
+	for(i = 0; i <= PIDMAP_WORDS; i++){
+		word = (first + i) % PIDMAP_WORDS;
+		bits = pid_map[word];
+		if(i == 0){
+			bits |= (1U << (pid_next % 32)) - 1;
+		}
+		if(bits == 0xffffffff){
+			continue;
+		}
+		pid = word * 32 + __builtin_ctz(~bits);
+		if(pid >= PID_MAX){
+			/* only the unused tail of the last word is free */
+			continue;
+		}
+		pid_map[word] |= 1U << (pid % 32);
+		pid_next = (pid + 1) % PID_MAX;
+		return pid;
+	}
+	return -1;
+}
+
+/* Put P at the head of the list at HEAD */
+static
+void
+proc_push(struct process** head, struct process* p){
+	KASSERT(spinlock_do_i_hold(&pid_lock));
+	KASSERT(p->siblingp == NULL);
+
+	p->sibling = *head;
+	if(p->sibling != NULL){
+		p->sibling->siblingp = &p->sibling;
+	}
+	p->siblingp = head;
+	*head = p;
+}
+
+/* Take P off whichever family list it's on, if any */
+static
+void
+proc_unlink(struct process* p){
+	KASSERT(spinlock_do_i_hold(&pid_lock));
 
-/* Function to generate pid for the newly created process */
+	if(p->siblingp == NULL){
+		return;
+	}
+	*p->siblingp = p->sibling;
+	if(p->sibling != NULL){
+		p->sibling->siblingp = p->siblingp;
+	}
+	p->sibling = NULL;
+	p->siblingp = NULL;
+}
+
+/* Give P's pid and slot back. Free P afterwards with proc_destroy. */
+static
+void
+proc_release(struct process* p){
+	KASSERT(spinlock_do_i_hold(&pid_lock));
+	KASSERT(process[p->pid] == p);
+	KASSERT(pid_map[p->pid / 32] & (1U << (p->pid % 32)));
+
+	proc_unlink(p);
+	process[p->pid] = NULL;
+	pid_map[p->pid / 32] &= ~(1U << (p->pid % 32));
+}
+
+static
+void
+proc_destroy(struct process* p){
+	wchan_destroy(p->waitchan);
+	kfree(p);
+}
+
+/*
+ * Function to generate pid for the newly created process. Sets up its
+ * process entry and hangs it on the creating thread's list of children.
+ */
 pid_t 
-generate_pid(){
+generate_pid(struct thread* thread){
+	struct process* proc;
+	struct process* parent;
+	pid_t pid;
+
+	proc = kmalloc(sizeof(struct process));
+	if(proc == NULL){
+		return -1;
+	}
+	proc->waitchan = wchan_create("wait");
+	if(proc->waitchan == NULL){
+		kfree(proc);
+		return -1;
+	}
+	proc->exited = false;
+	proc->exitcode = -1;
+	proc->self = thread;
+	proc->children = NULL;
+	proc->zombies = NULL;
+	proc->sibling = NULL;
+	proc->siblingp = NULL;
+
+	spinlock_acquire(&pid_lock);
+	pid = pid_alloc();
+	if(pid > 0){
+		KASSERT(process[pid] == NULL);
+		process[pid] = proc;
+		proc->pid = pid;
+		proc->ppid = -1;
+		/* No parent for the very first thread */
+		parent = (pid != 1 && curthread != NULL) ?
+			process[curthread->t_pid] : NULL;
+		if(parent != NULL){
+			proc->ppid = parent->pid;
+			proc_push(&parent->children, proc);
+		}
+	}
+	spinlock_release(&pid_lock);
+
+	if(pid < 0){
+		proc_destroy(proc);
+	}
+	return pid;
+}
+
+/* Throw away the entry for a process that never ran */
+void
+pid_free(pid_t pid){
+	struct process* proc;
+
+	KASSERT(pid > 0 && pid < PID_MAX);
+
+	spinlock_acquire(&pid_lock);
+	proc = process[pid];
+	KASSERT(proc != NULL);
+	proc_release(proc);
+	spinlock_release(&pid_lock);
+
+	proc_destroy(proc);
+}
+
+/*
+ * Common exit code. Record EXITCODE, disown our children (throwing
+ * away the ones that already exited), and then either become a zombie
+ * on our parent's list and wake it, or, if nobody can ever wait for us
+ * (no parent, or REAP), free our own entry.
+ */
+static
+void
+proc_exit(struct process* proc, int exitcode, bool reap){
+	struct process* parent;
+	struct process* child;
+	struct process* dead = NULL;
+
+	spinlock_acquire(&pid_lock);
+	KASSERT(!proc->exited);
+	proc->exitcode = exitcode;
+	proc->exited = true;
+
+	while((child = proc->children) != NULL){
+		proc_unlink(child);
+		child->ppid = -1;
+	}
+	while((child = proc->zombies) != NULL){
+		proc_release(child);
+		child->sibling = dead;
+		dead = child;
+	}
+
+	parent = proc->ppid > 0 ? process[proc->ppid] : NULL;
+	if(parent != NULL && !reap){
+		proc_unlink(proc);
+		proc_push(&parent->zombies, proc);
+		wchan_wakeall(parent->waitchan);
+	}
+	else {
+		proc_release(proc);
+		proc->sibling = dead;
+		dead = proc;
+	}
+	spinlock_release(&pid_lock);
+
+	while(dead != NULL){
+		child = dead;
+		dead = dead->sibling;
+		proc_destroy(child);
+	}
+}
+
+void
+process_exit(pid_t pid, int exitcode){
+	struct process* proc;
+
+	spinlock_acquire(&pid_lock);
+	proc = process[pid];
+	spinlock_release(&pid_lock);
+
+	KASSERT(proc != NULL);
+	proc_exit(proc, exitcode, false);
+}
+
+/*
+ * Called from thread_exit. A thread that gets here without going
+ * through sys_exit is a kernel thread that nobody is going to wait
+ * for, so its pid goes straight back to the pool instead of leaking.
+ */
+void
+process_thread_exit(struct thread* thread){
+	struct process* proc;
+	bool detached;
 
-	int itr = 1;	//pid should start only from 1 and not 0
-	pid_t pid = -1;
+	spinlock_acquire(&pid_lock);
+	proc = process[thread->t_pid];
+	detached = (proc != NULL && proc->self == thread && !proc->exited);
+	spinlock_release(&pid_lock);
 
-	for(; itr < PID_MAX; itr++){
-		if(process[itr] == NULL){
-			process[itr] = kmalloc(sizeof(struct process));
-			if(process[itr] == NULL){
-				return ENOMEM;
+	if(detached){
+		proc_exit(proc, _MKWAIT_EXIT(0), true);
+	}
+}
+
+/*
+ * Wait for a child to exit: PID, or any child if PID is -1. With
+ * WNOHANG, returns 0 in *retpid instead of sleeping. Children that
+ * exit are moved to their parent's zombie list, so waiting for any
+ * child just takes the first one there.
+ *
+ * If USTATUS isn't NULL the exit status is also copied out there, and
+ * the child is only reaped once that has worked; if it fails the child
+ * stays a zombie so it can still be waited for.
+ */
+int
+process_wait(pid_t pid, int options, pid_t* retpid, int* status,
+	     userptr_t ustatus){
+	struct process* me;
+	struct process* child;
+	int result;
+
+	if(pid != -1 && (pid < 1 || pid >= PID_MAX)){
+		return ESRCH;
+	}
+	if(pid == curthread->t_pid){
+		return EINVAL;
+	}
+
+	spinlock_acquire(&pid_lock);
+	me = process[curthread->t_pid];
+	KASSERT(me != NULL);
+
+	if(pid != -1){
+		child = process[pid];
+		if(child == NULL){
+			spinlock_release(&pid_lock);
+			return ESRCH;
+		}
+		if(child->ppid != me->pid){
+			spinlock_release(&pid_lock);
+			return ECHILD;
+		}
+	}
+
+	while(1){
+		if(pid == -1){
+			child = me->zombies;
+			if(child == NULL && me->children == NULL){
+				spinlock_release(&pid_lock);
+				return ECHILD;
 			}
-			
-			pid = itr;
+		}
+		if(child != NULL && child->exited){
 			break;
 		}
+		if(options & WNOHANG){
+			spinlock_release(&pid_lock);
+			*retpid = 0;
+			return 0;
+		}
+		/* proc_exit wakes us with pid_lock held, so no lost wakeups */
+		wchan_lock(me->waitchan);
+		spinlock_release(&pid_lock);
+		wchan_sleep(me->waitchan);
+		spinlock_acquire(&pid_lock);
 	}
 
-	return pid;
+	*status = child->exitcode;
+	*retpid = child->pid;
+	if(ustatus != NULL){
+		/*
+		 * Only we can reap our own children, so CHILD stays on
+		 * our zombie list while we copy out without the lock.
+		 */
+		spinlock_release(&pid_lock);
+		result = copyout(status, ustatus, sizeof(int));
+		if(result){
+			return result;
+		}
+		spinlock_acquire(&pid_lock);
+		KASSERT(process[child->pid] == child);
+	}
+	proc_release(child);
+	spinlock_release(&pid_lock);
+
+	proc_destroy(child);
+	return 0;
 }
 
 /* Function to provide the current process pid */
@@ -43,161 +367,508 @@ sys_getpid(int32_t* retval){
 	return 0;
 }
 
-int
-sys_execv(userptr_t arg1, userptr_t arg2){
-	char* progname; 
-	char** args = (char**) arg2;
+////////////////////////////////////////////////////////////
+//
+// Loading programs. Shared by execv and spawn.
 
-	char** kbuffer;
-	int argc = 0;
-	int count = 0;
-	int result;
-	int ksize;
-	int usize;
-	int argtotalsize = 0;
-	size_t actual;
-	struct vnode *vnode;
-	vaddr_t entrypoint, stackptr;
+/* Reject the pointers badcall likes to hand us */
+static
+bool
+exec_badptr(const void* ptr){
+	return ptr == (const void*) 0x40000000 || ptr >= (const void*) 0x80000000;
+}
 
-	if((char*)arg1 == (char*) 0x40000000 || (char*)arg1 >= (char*) 0x80000000 || 
-		(char*)arg2 == (char*) 0x40000000 || (char*)arg2 >= (char*) 0x80000000){
-                 return EFAULT;
-        }
+/*
+ * The arguments of a program being loaded, packed the way they will
+ * sit at the top of its stack: the argv array, then the strings, each
+ * word-aligned. Until exec_copyoutargs knows where the stack is, the
+ * argv slots hold offsets into ea_buf instead of pointers.
+ */
+struct execargs {
+	char* ea_buf;		/* ARG_MAX bytes */
+	size_t ea_len;		/* bytes of ea_buf in use */
+	int ea_argc;
+};
+
+static
+void
+exec_freeargs(struct execargs* ea){
+	kfree(ea->ea_buf);
+	ea->ea_buf = NULL;
+}
 
-	char temp[128];
-	result = copyinstr((const_userptr_t)arg1, temp, 128, &actual);
-	if(result){
-		return EFAULT;
-	}	
+/* argv[N] of packed arguments */
+static
+const char*
+exec_arg(struct execargs* ea, int n){
+	KASSERT(n >= 0 && n < ea->ea_argc);
+	return ea->ea_buf + ((vaddr_t*)ea->ea_buf)[n];
+}
 
-	if(arg1 == NULL || args == NULL){
+/*
+ * Copy the NULL-terminated user argv array UARGS and its strings into
+ * EA, to be freed with exec_freeargs. The strings are copied straight
+ * into place; together with the argv array they must fit in ARG_MAX,
+ * or it's E2BIG.
+ */
+static
+int
+exec_copyinargs(userptr_t uargs, struct execargs* ea){
+	userptr_t* argv;
+	userptr_t uarg;
+	size_t pos, actual;
+	int argc, count, result;
+
+	if(uargs == NULL || exec_badptr(uargs)){
 		return EFAULT;
 	}
 
-	if(strlen((char*)arg1) == 0){
-		return EINVAL;
+	ea->ea_buf = kmalloc(ARG_MAX);
+	if(ea->ea_buf == NULL){
+		return ENOMEM;
 	}
+	argv = (userptr_t*)ea->ea_buf;
 
-	progname = (char*) arg1;
-
-	for(count = 0; count < ARG_MAX; count++){
-		if((char*)args[count] == (char*) 0x40000000 || (char*)args[count] >= (char*) 0x80000000){
-			return EFAULT;
+	/* The pointers first, so we know where the strings start */
+	for(argc = 0; ; argc++){
+		if((argc + 1) * sizeof(userptr_t) > ARG_MAX){
+			result = E2BIG;
+			goto fail;
 		}
-
-		if(args[count] == NULL){
+		result = copyin(uargs + argc * sizeof(userptr_t), &argv[argc],
+				sizeof(userptr_t));
+		if(result){
+			goto fail;
+		}
+		if(argv[argc] == NULL){
 			break;
 		}
+		if(exec_badptr(argv[argc])){
+			result = EFAULT;
+			goto fail;
+		}
 	}
-	kbuffer = kmalloc(count * sizeof(char));
 
-	for(int var = 0; var < count; var++){
-		usize = strlen(args[var]) + 1;
-		if(usize == 0){
-			return EINVAL;
+	pos = (argc + 1) * sizeof(userptr_t);
+	for(count = 0; count < argc; count++){
+		uarg = argv[count];
+		result = copyinstr(uarg, ea->ea_buf + pos, ARG_MAX - pos,
+				   &actual);
+		if(result == ENAMETOOLONG){
+			result = E2BIG;
 		}
-
-		if(usize % 4 == 0){
-			ksize = usize;
-		} else {
-			ksize = usize + (4 - (usize % 4));
+		if(result){
+			goto fail;
 		}
-			
-		argtotalsize += ksize;
-		kbuffer[var] = kmalloc(sizeof(char) * ksize);
-		if((result = copyinstr((const_userptr_t)args[var], kbuffer[var], ksize, &actual)) != 0){
-			return result;
+		argv[count] = (userptr_t)pos;
+		pos += actual;
+		while(pos % sizeof(userptr_t) != 0){
+			if(pos >= ARG_MAX){
+				result = E2BIG;
+				goto fail;
+			}
+			ea->ea_buf[pos++] = '\0';
 		}
 	}
 
-	argc = count;
-	int32_t* kargv[argc+1];
+	ea->ea_len = pos;
+	ea->ea_argc = argc;
+	return 0;
 
-	kargv[0] = kmalloc(sizeof(int32_t));
-	*kargv[0] = (argc+1) * 4;		//'+1' -> since index starts with zero
+ fail:
+	exec_freeargs(ea);
+	return result;
+}
+
+/*
+ * Give the current thread a fresh address space holding the program
+ * in VN, throwing away the old one if there is one. On success the
+ * new space is active and *entrypoint and *stackptr are set.
+ */
+static
+int
+exec_load(struct vnode* vn, vaddr_t* entrypoint, vaddr_t* stackptr){
+	struct addrspace* old;
+	int result;
 
-	for(count = 1; count < argc; count++){
-		kargv[count] = kmalloc(sizeof(int32_t));
-		*kargv[count] = *kargv[count-1] + strlen(kbuffer[count-1]) + 1;
+	old = curthread->t_addrspace;
+	curthread->t_addrspace = NULL;
+	if(old != NULL){
+		as_activate(NULL);
+		/* sys_execv made sure no other thread is using it */
+		if(curthread->t_stackslot != 0){
+			as_threadstack_release(old, curthread->t_stackslot);
+			curthread->t_stackslot = 0;
+		}
+		as_destroy(old);
 	}
 
-	if(argc == 0){
-		kfree(kargv[argc]);
+	curthread->t_addrspace = as_create();
+	if(curthread->t_addrspace == NULL){
+		return ENOMEM;
 	}
-	kargv[argc] = NULL;
+	as_activate(curthread->t_addrspace);
 
-	//load the program
-	result = vfs_open(progname, O_RDONLY, 0, &vnode);
+	result = load_elf(vn, entrypoint);
 	if(result){
+		/* thread_exit destroys curthread->t_addrspace */
 		return result;
 	}
 
-	//KASSERT(curthread->t_addrspace == NULL);
-	as_destroy(curthread->t_addrspace);
+	return as_define_stack(curthread->t_addrspace, stackptr);
+}
 
-	//create an address space
-	curthread->t_addrspace = as_create();
-	if(curthread->t_addrspace == NULL){
-		vfs_close(vnode);
-		return ENOMEM;
+/*
+ * Put the packed arguments in EA at the top of the new user stack with
+ * a single copyout, turning the offsets in the argv array into user
+ * pointers on the way. *STACKPTR is moved down past all of it and
+ * *UARGV gets the user address of argv. EA can't be copied out again
+ * afterwards.
+ */
+static
+int
+exec_copyoutargs(struct execargs* ea, vaddr_t* stackptr, userptr_t* uargv){
+	vaddr_t* argv = (vaddr_t*)ea->ea_buf;
+	vaddr_t base;
+	int count, result;
+
+	/* keep the stack 8-aligned for the MIPS calling convention */
+	base = (*stackptr - ea->ea_len) & ~(vaddr_t)7;
+
+	for(count = 0; count < ea->ea_argc; count++){
+		argv[count] += base;
 	}
 
-	//Activate the address space for the executable
-	as_activate(curthread->t_addrspace);
+	result = copyout(ea->ea_buf, (userptr_t)base, ea->ea_len);
+	if(result){
+		return result;
+	}
+
+	*stackptr = base;
+	*uargv = (userptr_t)base;
+	return 0;
+}
 
-	//Load the elf
-	result = load_elf(vnode, &entrypoint);
+int
+sys_execv(userptr_t arg1, userptr_t arg2){
+	struct execargs ea;
+	char progname[PATH_MAX];
+	int result;
+	size_t actual;
+	struct vnode *vnode;
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+
+	if(arg1 == NULL || arg2 == NULL || exec_badptr(arg1) || exec_badptr(arg2)){
+		return EFAULT;
+	}
+
+	result = copyinstr((const_userptr_t)arg1, progname, sizeof(progname), &actual);
+	if(result){
+		return result;
+	}
+
+	if(strlen(progname) == 0){
+		return EINVAL;
+	}
+
+	/*
+	 * Other threads would go on running the old program, sharing
+	 * our descriptors. There's no way to stop them, so refuse.
+	 */
+	if(as_shared(curthread->t_addrspace)){
+		return EBUSY;
+	}
+
+	result = exec_copyinargs(arg2, &ea);
 	if(result){
-		vfs_close(vnode);
 		return result;
 	}
 
+	//load the program
+	result = vfs_open(progname, O_RDONLY, 0, &vnode);
+	if(result){
+		exec_freeargs(&ea);
+		return result;
+	}
+
+	result = exec_load(vnode, &entrypoint, &stackptr);
 	vfs_close(vnode);
+	if(result){
+		exec_freeargs(&ea);
+		return result;
+	}
+
+	result = exec_copyoutargs(&ea, &stackptr, &uargv);
+	exec_freeargs(&ea);
+	if(result){
+		return result;
+	}
+
+	enter_new_process(ea.ea_argc, uargv, stackptr, entrypoint);
+
+	panic("enter_new_process returned");
+	return EINVAL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// spawn: fork and exec in one go.
+//
+// The child is a new thread with no address space; it loads the
+// program itself through the same path execv uses, so the parent's
+// image is never copied. The parent sleeps (as with vfork) until the
+// child has either started running the program or failed to load it,
+// so load errors come back to the caller and the arguments can live on
+// the parent's kernel stack.
+
+struct spawnargs {
+	struct semaphore* sa_done;	/* child is loaded (or failed) */
+	struct vnode* sa_vn;		/* program, opened by the parent */
+	struct execargs sa_args;	/* kernel copy of argv */
+	int sa_result;			/* child's load result */
+	pid_t sa_pid;			/* child's pid */
+};
+
+static
+void
+spawn_entry(void* data1, unsigned long data2){
+	struct spawnargs* sa = data1;
+	vaddr_t entrypoint, stackptr;
+	userptr_t uargv;
+	int argc, result;
+
+	(void)data2;
+
+	result = exec_load(sa->sa_vn, &entrypoint, &stackptr);
+	if(result == 0){
+		result = exec_copyoutargs(&sa->sa_args, &stackptr, &uargv);
+	}
+	argc = sa->sa_args.ea_argc;
 
+	/* sa belongs to the parent; don't touch it after this */
+	sa->sa_pid = curthread->t_pid;
+	sa->sa_result = result;
+	V(sa->sa_done);
 
-	//Get the initial stack pointer
-	result = as_define_stack(curthread->t_addrspace, &stackptr);
+	if(result){
+		/* never ran; nobody will wait for us */
+		thread_exit();
+	}
+
+	enter_new_process(argc, uargv, stackptr, entrypoint);
+	panic("enter_new_process returned");
+}
+
+int
+sys_spawn(userptr_t arg1, userptr_t arg2, int32_t* retval){
+	struct spawnargs sa;
+	char progname[PATH_MAX];
+	size_t actual;
+	int result;
+
+	if(arg1 == NULL || exec_badptr(arg1)){
+		return EFAULT;
+	}
+
+	result = copyinstr((const_userptr_t)arg1, progname, sizeof(progname), &actual);
 	if(result){
 		return result;
 	}
 
-	//Calculate the bottom of the stack based on the initial stack pointer and kernel buffer
-	vaddr_t bottomstack = stackptr - (vaddr_t)argtotalsize - (vaddr_t)((argc+1) * (sizeof(int32_t)));
-	vaddr_t curstack = bottomstack;
-	vaddr_t kargstack = bottomstack;
+	if(strlen(progname) == 0){
+		return EINVAL;
+	}
 
-	for(count = 0; count < argc; count++){
-		kargstack = bottomstack + (count * sizeof(int32_t));
-		curstack = bottomstack + (vaddr_t)*kargv[count];
+	result = exec_copyinargs(arg2, &sa.sa_args);
+	if(result){
+		return result;
+	}
 
-		result = copyout(&curstack, (userptr_t)kargstack, sizeof(int32_t));
-		if(result){
-			return result;
-		}
+	result = vfs_open(progname, O_RDONLY, 0, &sa.sa_vn);
+	if(result){
+		exec_freeargs(&sa.sa_args);
+		return result;
+	}
 
-		result = copyoutstr(kbuffer[count], (userptr_t)curstack, strlen(kbuffer[count]) + 1, &actual);
-		if(result){
-			return result;
-		}	
+	sa.sa_result = 0;
+	sa.sa_done = sem_create("spawn", 0);
+	if(sa.sa_done == NULL){
+		vfs_close(sa.sa_vn);
+		exec_freeargs(&sa.sa_args);
+		return ENOMEM;
+	}
+
+	/* thread_fork hands the child our cwd and file table */
+	result = thread_fork(sa.sa_args.ea_argc > 0 ?
+			     exec_arg(&sa.sa_args, 0) : progname,
+			     spawn_entry, &sa, 0, NULL);
+	if(result == 0){
+		P(sa.sa_done);
+		result = sa.sa_result;
 	}
 
-	for(int count = 0; count<argc; count++){
-		kfree(kargv[count]);
-		kfree(kbuffer[count]);
+	sem_destroy(sa.sa_done);
+	vfs_close(sa.sa_vn);
+	exec_freeargs(&sa.sa_args);
+
+	if(result){
+		return result;
 	}
-	kfree(kbuffer);
+	*retval = sa.sa_pid;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Threads.
+//
+// A thread is a process that shares its creator's address space and
+// descriptor table (each has its own pid, cwd and user stack). Like
+// any child it is reaped by the thread that created it, with
+// threadjoin, which hands back what it passed to threadexit. Exiting
+// one thread, with threadexit or _exit, leaves the others running;
+// the address space goes away with the last of them. execv fails with
+// EBUSY while there are others, since they'd go on running the old
+// program.
+//
+// The kernel starts the new thread at ENTRY, a start routine in libc,
+// with FUNC and ARG in its first two argument registers, on a stack
+// from one of the address space's thread stack slots. As with spawn,
+// the creator waits until the new thread is set up, so the arguments
+// can live on its stack.
+
+struct threadargs {
+	struct semaphore* ta_done;	/* thread is set up */
+	struct addrspace* ta_as;	/* referenced for the thread */
+	struct fdtable* ta_fdt;		/* referenced for the thread */
+	int ta_slot;			/* its stack slot */
+	vaddr_t ta_stack;
+	vaddr_t ta_entry;
+	userptr_t ta_func;
+	userptr_t ta_arg;
+	pid_t ta_pid;			/* its pid */
+};
+
+static
+void
+thread_forkentry(void* data1, unsigned long data2){
+	struct threadargs* ta = data1;
+	vaddr_t entry, stack;
+	userptr_t func, arg;
 
-	enter_new_process(argc, (userptr_t)bottomstack, bottomstack, entrypoint);
+	(void)data2;
 
+	/* Trade the copy thread_fork made for the shared table */
+	fdtable_destroy(curthread->t_fdtable);
+	curthread->t_fdtable = ta->ta_fdt;
+
+	KASSERT(curthread->t_addrspace == NULL);
+	curthread->t_addrspace = ta->ta_as;
+	curthread->t_stackslot = ta->ta_slot;
+	as_activate(curthread->t_addrspace);
+
+	entry = ta->ta_entry;
+	func = ta->ta_func;
+	arg = ta->ta_arg;
+	/* leave the callee room to save its argument registers */
+	stack = ta->ta_stack - 16;
+
+	/* ta belongs to the creator; don't touch it after this */
+	ta->ta_pid = curthread->t_pid;
+	V(ta->ta_done);
+
+	enter_new_process((int)func, arg, stack, entry);
 	panic("enter_new_process returned");
-	return EINVAL;
+}
+
+int
+sys___threadfork(userptr_t entry, userptr_t func, userptr_t arg,
+		 int32_t* retval){
+	struct threadargs ta;
+	struct addrspace* as = curthread->t_addrspace;
+	int result;
+
+	if(entry == NULL || exec_badptr(entry)){
+		return EFAULT;
+	}
+	KASSERT(as != NULL);
+	KASSERT(curthread->t_fdtable != NULL);
+
+	result = as_threadstack(as, &ta.ta_slot, &ta.ta_stack);
+	if(result){
+		return result;
+	}
+
+	ta.ta_done = sem_create("threadfork", 0);
+	if(ta.ta_done == NULL){
+		as_threadstack_release(as, ta.ta_slot);
+		return ENOMEM;
+	}
+	as_incref(as);
+	fdtable_incref(curthread->t_fdtable);
+	ta.ta_as = as;
+	ta.ta_fdt = curthread->t_fdtable;
+	ta.ta_entry = (vaddr_t)entry;
+	ta.ta_func = func;
+	ta.ta_arg = arg;
+
+	result = thread_fork(curthread->t_name, thread_forkentry, &ta, 0, NULL);
+	if(result){
+		fdtable_destroy(ta.ta_fdt);
+		as_threadstack_release(as, ta.ta_slot);
+		as_destroy(as);
+		sem_destroy(ta.ta_done);
+		return result;
+	}
+
+	P(ta.ta_done);
+	sem_destroy(ta.ta_done);
+
+	*retval = ta.ta_pid;
+	return 0;
+}
+
+int
+sys_threadexit(userptr_t value){
+	struct addrspace* as = curthread->t_addrspace;
+
+	/*
+	 * Leave the address space before anyone joining can find out:
+	 * they may want the stack slot back, or to execv, which they
+	 * can't while the space is shared.
+	 */
+	curthread->t_addrspace = NULL;
+	as_activate(NULL);
+	if(curthread->t_stackslot != 0){
+		as_threadstack_release(as, curthread->t_stackslot);
+		curthread->t_stackslot = 0;
+	}
+	as_destroy(as);
+
+	process_exit(curthread->t_pid, (int)value);
+	thread_exit();
+
+	return 0;
+}
+
+int
+sys_threadjoin(userptr_t tid, userptr_t uvalue){
+	pid_t pid;
+	int value;
+
+	if(uvalue != NULL && exec_badptr(uvalue)){
+		return EFAULT;
+	}
+
+	return process_wait((pid_t)tid, 0, &pid, &value, uvalue);
 }
 
 int
 sys_fork(int32_t* retval, struct trapframe* tf){
 	struct trapframe* childtrap = NULL;
 	struct addrspace* childaddr = NULL;
-	struct thread* childthread = NULL;
+	pid_t childpid;
 	int result;
 
 	childtrap = kmalloc(sizeof(struct trapframe));
@@ -214,18 +885,15 @@ sys_fork(int32_t* retval, struct trapframe* tf){
 	}
 
 	result = thread_fork("process", child_forkentry, childtrap,
-				(unsigned long) childaddr, &childthread); 
-
-	if(childthread == NULL){
-		return ENOMEM;
-	}
-
+				(unsigned long) childaddr, &childpid); 
 	if(result){
+		as_destroy(childaddr);
+		kfree(childtrap);
 		return result;
 	}
 
-	*retval = childthread->t_pid;
-	return result;
+	*retval = childpid;
+	return 0;
 }
 
 void
@@ -251,19 +919,14 @@ child_forkentry(void* data1, unsigned long data2){
 int
 sys_waitpid(int32_t* retval, userptr_t arg1, userptr_t arg2, userptr_t arg3){
 	pid_t pid = (pid_t)arg1;
-	int* status = (int*)arg2;
 	int options = (int)arg3;
+	int status;
 
-	pid_t debug = curthread->t_pid;
-	(void)debug;
-
-	if(status == NULL || ((int)arg2 & 3) != 0){
+	if(arg2 == NULL || ((int)arg2 & 3) != 0){
 		return EFAULT;
 	}
 
-	if((int*)arg1 == (int*) 0x40000000 || (int*)arg1 == (int*) 0x80000000
-		|| (int*)arg2 == (int*) 0x40000000 || (int*)arg2 == (int*) 0x80000000
-		|| (int*)arg3 == (int*) 0x40000000 || (int*)arg3 == (int*) 0x80000000){
+	if((int*)arg2 == (int*) 0x40000000 || (int*)arg2 == (int*) 0x80000000){
 		return EFAULT;
 	}
 
@@ -271,57 +934,12 @@ sys_waitpid(int32_t* retval, userptr_t arg1, userptr_t arg2, userptr_t arg3){
 		return EINVAL;
 	}
 
-	if(pid < 1 || pid >= PID_MAX){
-		return ESRCH;
-	}
-
-	if(process[pid] == NULL){
-		return ESRCH;
-	}
-
-	if(curthread->t_pid == pid){
-		return EINVAL;
-	}
-
-	if(process[pid]->ppid != curthread->t_pid){
-		return ECHILD;
-	}
-
-	lock_acquire(process[pid]->exitlock);	
-	if(!process[pid]->exited){
-		cv_wait(process[pid]->exitcv, process[pid]->exitlock);
-	}
-	
-	*status = process[pid]->exitcode;
-	lock_release(process[pid]->exitlock);
-	*retval = pid;
-
-	lock_destroy(process[pid]->exitlock);
-	cv_destroy(process[pid]->exitcv);
-	kfree(process[pid]);
-	process[pid] = NULL;
-
-	return 0;
+	return process_wait(pid, options, retval, &status, arg2);
 }
 
 int
 sys_exit(userptr_t exitcode){
-	pid_t pid = curthread->t_pid;
-
-	process[pid]->exited = true;
-
-	pid_t ppid = process[pid]->ppid;
-	lock_acquire(process[pid]->exitlock);
-	if(!process[ppid]->exited){
-		process[pid]->exitcode = _MKWAIT_EXIT((int)exitcode);
-		cv_signal(process[pid]->exitcv,process[pid]->exitlock);
-		lock_release(process[pid]->exitlock);
-	}else{
-		lock_destroy(process[pid]->exitlock);
-		cv_destroy(process[pid]->exitcv);
-		kfree(process[pid]);
-		process[pid] = NULL;
-	}
+	process_exit(curthread->t_pid, _MKWAIT_EXIT((int)exitcode));
 
 	thread_exit();
 
@@ -62,36 +62,39 @@ runprogram(char *progname, unsigned long argc, char** args)
 	int result;
 
 	 /*setting up STDIN STDOUT STDERR*/
+	KASSERT(curthread->t_fdtable == NULL);
+	curthread->t_fdtable = fdtable_create();
+	if(curthread->t_fdtable == NULL){
+		return ENOMEM;
+	}
+
 	for(int count = 0; count < 3; count++){
-		int flag;
+		int flag, fd;
+		char path[] = "con:";
+		struct vnode* vn;
+		struct filehandle* fh;
+
 		if(count == 0){
 			flag = O_RDONLY;
 		}else{
 			flag = O_WRONLY;
 		}
 
-		curthread->filetable[count] = kmalloc(sizeof(struct filehandle));
-		if(curthread->filetable[count] == NULL){
-			return ENOMEM;
+		result = vfs_open(path, flag, 0664, &vn);
+		if(result){
+			/* thread_exit destroys curthread->t_fdtable */
+			return result;
 		}
 
-		curthread->filetable[count]->flags = flag;                                        /*set flags */
-        	curthread->filetable[count]->offset = 0;
-        	curthread->filetable[count]->refcnt = 1;
-        	curthread->filetable[count]->lock = lock_create("std_lock");
-
-		if(curthread->filetable[count]->lock == NULL){
-			kfree(curthread->filetable[count]);
+		fh = filehandle_create(vn, flag);
+		if(fh == NULL){
+			vfs_close(vn);
 			return ENOMEM;
 		}
 
-		char* path = kstrdup("con:");
-
-		result = vfs_open(path, flag, 06664, &curthread->filetable[count]->vn);
-
-        	if(result){
-                	return result;
-        	}
+		result = fdtable_alloc(curthread->t_fdtable, &fd);
+		KASSERT(result == 0 && fd == count);
+		fdtable_install(curthread->t_fdtable, fd, fh);
 	}
 
 	/* Open the file. */
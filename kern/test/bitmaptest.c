@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -101,6 +102,35 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Full map: nothing near anything, no runs. */
+	KASSERT(bitmap_alloc_near(b, TESTSIZE/2, &x) == ENOSPC);
+	KASSERT(bitmap_findrun(b, 0, TESTSIZE, 1, &x) == ENOSPC);
+
+	/*
+	 * Free every third bit, plus a run of 40 in the middle. Then
+	 * alloc_near should take the next free bit at or after its goal,
+	 * wrapping, and findrun should find the run.
+	 */
+	for (i=0; i<TESTSIZE; i++) {
+		if (i%3 == 0 || (i >= 300 && i < 340)) {
+			bitmap_unmark(b, i);
+		}
+	}
+	KASSERT(bitmap_findrun(b, 0, TESTSIZE, 40, &x) == 0 && x == 300);
+	KASSERT(bitmap_findrun(b, 0, TESTSIZE, 41, &x) == ENOSPC);
+	KASSERT(bitmap_findrun(b, 310, TESTSIZE, 20, &x) == 0 && x == 310);
+	KASSERT(bitmap_findrun(b, 0, 300, 2, &x) == ENOSPC);
+	KASSERT(bitmap_alloc_near(b, 100, &x) == 0 && x == 102);
+	KASSERT(bitmap_alloc_near(b, 102, &x) == 0 && x == 105);
+	KASSERT(bitmap_alloc_near(b, TESTSIZE-1, &x) == 0 && x == 0);
+	while (bitmap_alloc_near(b, 200, &x) == 0) {
+		KASSERT(x < TESTSIZE);
+	}
+	for (i=0; i<TESTSIZE; i++) {
+		KASSERT(bitmap_isset(b, i));
+	}
+	bitmap_destroy(b);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Callout and timed sleep test.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <test.h>
+
+#define NCALLOUTS 8
+
+static struct callout callouts[NCALLOUTS];
+static volatile uint64_t firedat[NCALLOUTS];
+static volatile unsigned nfired;
+static struct semaphore *calloutsem;
+
+static
+void
+callouttest_func(void *arg)
+{
+	unsigned num = (unsigned)arg;
+
+	firedat[num] = clock_ticks();
+	nfired++;
+	V(calloutsem);
+}
+
+int
+callouttest(int nargs, char **args)
+{
+	uint64_t start;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned i, expect;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	if (calloutsem == NULL) {
+		calloutsem = sem_create("callouttest", 0);
+		if (calloutsem == NULL) {
+			panic("callouttest: sem_create failed\n");
+		}
+	}
+
+	kprintf("Starting callout test...\n");
+	nfired = 0;
+
+	/*
+	 * Callout i is due at 3*i+1 ticks; the second-to-last one goes
+	 * past a full turn of the wheel. Cancel the odd ones.
+	 */
+	start = clock_ticks();
+	for (i=0; i<NCALLOUTS; i++) {
+		firedat[i] = 0;
+		callout_init(&callouts[i], callouttest_func, (void *)i);
+		callout_schedule(&callouts[i],
+				 i == NCALLOUTS-2 ? 300 : 3*i+1);
+	}
+	expect = 0;
+	for (i=0; i<NCALLOUTS; i++) {
+		if (i % 2 == 1) {
+			if (!callout_cancel(&callouts[i])) {
+				kprintf("callout %u: cancel failed\n", i);
+				ok = false;
+			}
+		}
+		else {
+			expect++;
+		}
+	}
+	for (i=0; i<expect; i++) {
+		P(calloutsem);
+	}
+
+	for (i=0; i<NCALLOUTS; i++) {
+		if (i % 2 == 1 && firedat[i] != 0) {
+			kprintf("callout %u: fired after cancel\n", i);
+			ok = false;
+		}
+		if (i % 2 == 0 && firedat[i] < start + 3*i+1) {
+			kprintf("callout %u: fired early\n", i);
+			ok = false;
+		}
+	}
+	if (nfired != expect) {
+		kprintf("%u callouts fired, expected %u\n", nfired, expect);
+		ok = false;
+	}
+
+	kprintf("Sleeping for 50 ms...\n");
+	gettime(&secs1, &nsecs1);
+	clocksleep_ns(0, 50000000);
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	kprintf("Slept %lu.%09lu seconds\n", (unsigned long)secs,
+		(unsigned long)nsecs);
+	if (secs == 0 && nsecs < 50000000) {
+		kprintf("That's too short\n");
+		ok = false;
+	}
+
+	kprintf("Callout test %s.\n", ok ? "done" : "FAILED");
+	return 0;
+}
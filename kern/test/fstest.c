@@ -42,13 +42,17 @@
 #include <kern/errno.h>
 #include <kern/fcntl.h>
 #include <lib.h>
+#include <clock.h>
 #include <uio.h>
 #include <thread.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <sfs.h>
+#include <mainbus.h>
 #include <test.h>
+#include "opt-sfs.h"
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
 #define FILENAME "fstest.tmp"
@@ -56,6 +60,22 @@
 #define NTHREADS 12
 #define NCREATES 32
 
+/* Sequential throughput benchmark: file size, and passes per chunk size */
+#define SEQFILESIZE  (64*1024)
+#define SEQROUNDS    4
+#define SEQWRITERS   4
+
+/* Directory lookup benchmark: files created, and lookup passes over them */
+#define LOOKUPFILES  1000
+#define LOOKUPROUNDS 8
+
+/* Small-append benchmark: file size, and passes per record size */
+#define APPENDFILESIZE (32*1024)
+#define APPENDROUNDS   4
+
+/* Journal crash test: file size */
+#define JCRASHSIZE     (16*1024)
+
 static struct semaphore *threadsem = NULL;
 
 static
@@ -533,6 +553,716 @@ docreatestress(const char *filesys)
 	kprintf("*** fs create stress test done\n");
 }
 
+////////////////////////////////////////////////////////////
+//
+// Sequential throughput benchmark. Writes and reads back a
+// SEQFILESIZE file front to back, SEQROUNDS times, for each of a
+// range of chunk sizes, checking the data as it goes. Each word of
+// the file holds its own offset plus the round number.
+
+static
+void
+seqbench_fill(uint32_t *buf, size_t len, off_t pos, unsigned round)
+{
+	size_t i;
+
+	for (i=0; i<len/sizeof(uint32_t); i++) {
+		buf[i] = pos + i*sizeof(uint32_t) + round;
+	}
+}
+
+static
+int
+seqbench_check(const uint32_t *buf, size_t len, off_t pos, unsigned round)
+{
+	size_t i;
+
+	for (i=0; i<len/sizeof(uint32_t); i++) {
+		if (buf[i] != pos + i*sizeof(uint32_t) + round) {
+			kprintf("seqbench: offset %lu: got %u, expected %u\n",
+				(unsigned long)(pos + i*sizeof(uint32_t)),
+				buf[i],
+				(unsigned)(pos + i*sizeof(uint32_t) + round));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * One front-to-back pass over the file. Adds the elapsed time to *NS.
+ */
+static
+int
+seqbench_pass(struct vnode *vn, uint32_t *buf, size_t chunk,
+	      enum uio_rw rw, unsigned round, uint64_t *ns)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	int err;
+
+	gettime(&secs1, &nsecs1);
+	for (pos = 0; pos < SEQFILESIZE; pos += chunk) {
+		if (rw == UIO_WRITE) {
+			seqbench_fill(buf, chunk, pos, round);
+		}
+		uio_kinit(&iov, &ku, buf, chunk, pos, rw);
+		err = rw == UIO_WRITE ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("seqbench: %s error: %s\n",
+				rw == UIO_WRITE ? "write" : "read",
+				strerror(err));
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("seqbench: short %s at %lu\n",
+				rw == UIO_WRITE ? "write" : "read",
+				(unsigned long)pos);
+			return -1;
+		}
+		if (rw == UIO_READ && seqbench_check(buf, chunk, pos, round)) {
+			return -1;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	*ns += (uint64_t)secs * 1000000000 + nsecs;
+	return 0;
+}
+
+static
+unsigned long
+seqbench_rate(uint64_t ns)
+{
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (uint64_t)SEQFILESIZE * SEQROUNDS * 1000000000 / ns / 1024;
+}
+
+/*
+ * Interleaved writers: SEQWRITERS threads each write their own file
+ * SEQWCHUNK bytes at a time, yielding in between, so their
+ * allocations compete. Reading the files back in one request each,
+ * after a remount, then shows how contiguous the allocator kept them.
+ */
+#define SEQWFILESIZE  (SEQFILESIZE / SEQWRITERS)
+#define SEQWCHUNK     512
+
+static volatile bool seqwriter_failed;
+
+static
+void
+seqwriter_thread(void *fs, unsigned long num)
+{
+	const char *filesys = fs;
+	char name[32], suffix[8];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	uint32_t *buf;
+	off_t pos;
+	int err;
+
+	snprintf(suffix, sizeof(suffix), "seq%lu", num);
+	fstest_makename(name, sizeof(name), filesys, suffix);
+
+	buf = kmalloc(SEQWCHUNK);
+	if (buf == NULL) {
+		seqwriter_failed = true;
+		V(threadsem);
+		return;
+	}
+	err = vfs_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("seqbench: writer %lu: %s\n", num, strerror(err));
+		seqwriter_failed = true;
+		kfree(buf);
+		V(threadsem);
+		return;
+	}
+	for (pos = 0; pos < SEQWFILESIZE; pos += SEQWCHUNK) {
+		seqbench_fill(buf, SEQWCHUNK, pos, num);
+		uio_kinit(&iov, &ku, buf, SEQWCHUNK, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("seqbench: writer %lu: write failed\n", num);
+			seqwriter_failed = true;
+			break;
+		}
+		thread_yield();
+	}
+	vfs_close(vn);
+	kfree(buf);
+	V(threadsem);
+}
+
+/*
+ * Unmount and remount FILESYS, so that nothing written to it is still
+ * in the buffer cache and what gets read back comes from the disk.
+ * Only SFS can be remounted from here. Otherwise, or if the volume is
+ * busy (the current directory is on it, say), settle for a sync and
+ * say that the read-back numbers include cache hits.
+ */
+static
+void
+seqbench_remount(const char *filesys)
+{
+	int err;
+
+	vfs_sync();
+#if OPT_SFS
+	err = vfs_unmount(filesys);
+	if (err == 0) {
+		err = sfs_mount(filesys);
+		if (err) {
+			kprintf("seqbench: remounting %s: %s\n", filesys,
+				strerror(err));
+		}
+		return;
+	}
+#else
+	err = ENOSYS;
+#endif
+	kprintf("(can't remount %s: %s; read-back includes cache hits)\n",
+		filesys, strerror(err));
+}
+
+static
+void
+seqbench_interleaved(const char *filesys, uint32_t *buf)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	char name[32], suffix[8];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	uint64_t ns;
+	unsigned i;
+	int err;
+
+	init_threadsem();
+	seqwriter_failed = false;
+	for (i=0; i<SEQWRITERS; i++) {
+		err = thread_fork("seqwriter", seqwriter_thread,
+				  (char *)filesys, i, NULL);
+		if (err) {
+			panic("seqbench: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+	for (i=0; i<SEQWRITERS; i++) {
+		P(threadsem);
+	}
+
+	/* Get it all to disk, so the reads below aren't cache hits */
+	seqbench_remount(filesys);
+
+	ns = 0;
+	for (i=0; i<SEQWRITERS && !seqwriter_failed; i++) {
+		snprintf(suffix, sizeof(suffix), "seq%u", i);
+		fstest_makename(name, sizeof(name), filesys, suffix);
+		err = vfs_open(name, O_RDONLY, 0664, &vn);
+		if (err) {
+			kprintf("seqbench: %s: %s\n", suffix, strerror(err));
+			seqwriter_failed = true;
+			break;
+		}
+		gettime(&secs1, &nsecs1);
+		uio_kinit(&iov, &ku, buf, SEQWFILESIZE, 0, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		gettime(&secs2, &nsecs2);
+		vfs_close(vn);
+		if (err || ku.uio_resid > 0 ||
+		    seqbench_check(buf, SEQWFILESIZE, 0, i)) {
+			kprintf("seqbench: %s: read back failed\n", suffix);
+			seqwriter_failed = true;
+			break;
+		}
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		ns += (uint64_t)secs * 1000000000 + nsecs;
+	}
+
+	if (seqwriter_failed) {
+		kprintf("*** Test failed\n");
+	}
+	else {
+		if (ns == 0) {
+			ns = 1;
+		}
+		kprintf("%d interleaved writers, %d KB each: "
+			"read back at %lu KB/s\n",
+			SEQWRITERS, SEQWFILESIZE/1024,
+			(unsigned long)((uint64_t)SEQFILESIZE * 1000000000
+					/ ns / 1024));
+	}
+
+	for (i=0; i<SEQWRITERS; i++) {
+		snprintf(suffix, sizeof(suffix), "seq%u", i);
+		fstest_makename(name, sizeof(name), filesys, suffix);
+		vfs_remove(name);
+	}
+}
+
+static
+void
+doseqbench(const char *filesys)
+{
+	static const size_t chunks[] = { 512, 4096, 16384, SEQFILESIZE };
+	char name[32];
+	struct vnode *vn;
+	uint32_t *buf;
+	uint64_t wns, rns;
+	unsigned i, round;
+	int err;
+
+	kprintf("*** Starting fs sequential benchmark on %s:\n", filesys);
+
+	buf = kmalloc(SEQFILESIZE);
+	if (buf == NULL) {
+		kprintf("*** Test failed: out of memory\n");
+		return;
+	}
+
+	/* vfs_open destroys the string it's passed */
+	fstest_makename(name, sizeof(name), filesys, "");
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kprintf("*** Test failed\n");
+		kfree(buf);
+		return;
+	}
+
+	kprintf("%d KB file, %d passes\n", SEQFILESIZE/1024, SEQROUNDS);
+	kprintf("   chunk   write KB/s    read KB/s\n");
+	for (i=0; i<sizeof(chunks)/sizeof(chunks[0]); i++) {
+		wns = rns = 0;
+		for (round=0; round<SEQROUNDS; round++) {
+			if (seqbench_pass(vn, buf, chunks[i], UIO_WRITE,
+					  round, &wns) ||
+			    seqbench_pass(vn, buf, chunks[i], UIO_READ,
+					  round, &rns)) {
+				kprintf("*** Test failed\n");
+				goto done;
+			}
+		}
+		kprintf("%8lu %12lu %12lu\n", (unsigned long)chunks[i],
+			seqbench_rate(wns), seqbench_rate(rns));
+	}
+
+	/* Close the test file first, so the volume can be remounted */
+	vfs_close(vn);
+	vn = NULL;
+
+	seqbench_interleaved(filesys, buf);
+	kprintf("*** fs sequential benchmark done\n");
+
+ done:
+	if (vn != NULL) {
+		vfs_close(vn);
+	}
+	kfree(buf);
+	fstest_remove(filesys, "");
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory lookup benchmark. Fills the directory with LOOKUPFILES
+// empty files, then times looking each of them up (and a name that
+// isn't there) LOOKUPROUNDS times, and finally removes them all.
+
+static
+unsigned long
+lookupbench_rate(unsigned long ops, uint64_t ns)
+{
+	if (ns == 0) {
+		ns = 1;
+	}
+	return (uint64_t)ops * 1000000000 / ns;
+}
+
+static
+uint64_t
+lookupbench_ns(time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+static
+void
+dolookupbench(const char *filesys)
+{
+	char name[32], suffix[16];
+	struct vnode *root, *vn;
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t ns;
+	unsigned nfiles, i, round;
+	int err;
+
+	kprintf("*** Starting fs lookup benchmark on %s:\n", filesys);
+
+	/*
+	 * Hold the root directory for the duration, so whatever the
+	 * filesystem keeps in memory about it isn't thrown away
+	 * between operations.
+	 */
+	err = vfs_getroot(filesys, &root);
+	if (err) {
+		kprintf("Could not get root of %s: %s\n", filesys,
+			strerror(err));
+		kprintf("*** Test failed\n");
+		return;
+	}
+
+	gettime(&secs, &nsecs);
+	for (nfiles=0; nfiles<LOOKUPFILES; nfiles++) {
+		snprintf(suffix, sizeof(suffix), "%u", nfiles);
+		fstest_makename(name, sizeof(name), filesys, suffix);
+		err = vfs_open(name, O_WRONLY|O_CREAT|O_EXCL, 0664, &vn);
+		if (err) {
+			kprintf("Could not create file %u: %s\n", nfiles,
+				strerror(err));
+			break;
+		}
+		vfs_close(vn);
+	}
+	ns = lookupbench_ns(secs, nsecs);
+	if (nfiles == 0) {
+		kprintf("*** Test failed\n");
+		goto done;
+	}
+	kprintf("%u files\n", nfiles);
+	kprintf("      op      ops/sec\n");
+	kprintf("  create %12lu\n", lookupbench_rate(nfiles, ns));
+
+	gettime(&secs, &nsecs);
+	for (round=0; round<LOOKUPROUNDS; round++) {
+		for (i=0; i<nfiles; i++) {
+			snprintf(suffix, sizeof(suffix), "%u", i);
+			fstest_makename(name, sizeof(name), filesys, suffix);
+			err = vfs_lookup(name, &vn);
+			if (err) {
+				kprintf("Lookup of file %u failed: %s\n", i,
+					strerror(err));
+				kprintf("*** Test failed\n");
+				goto cleanup;
+			}
+			VOP_DECREF(vn);
+		}
+	}
+	ns = lookupbench_ns(secs, nsecs);
+	kprintf("  lookup %12lu\n",
+		lookupbench_rate(nfiles * LOOKUPROUNDS, ns));
+
+	gettime(&secs, &nsecs);
+	for (round=0; round<LOOKUPROUNDS; round++) {
+		for (i=0; i<nfiles; i++) {
+			fstest_makename(name, sizeof(name), filesys, "-none");
+			err = vfs_lookup(name, &vn);
+			if (err != ENOENT) {
+				kprintf("Lookup of missing file: %s\n",
+					err ? strerror(err) : "found");
+				if (err == 0) {
+					VOP_DECREF(vn);
+				}
+				kprintf("*** Test failed\n");
+				goto cleanup;
+			}
+		}
+	}
+	ns = lookupbench_ns(secs, nsecs);
+	kprintf("    miss %12lu\n",
+		lookupbench_rate(nfiles * LOOKUPROUNDS, ns));
+
+ cleanup:
+	gettime(&secs, &nsecs);
+	for (i=0; i<nfiles; i++) {
+		snprintf(suffix, sizeof(suffix), "%u", i);
+		fstest_makename(name, sizeof(name), filesys, suffix);
+		err = vfs_remove(name);
+		if (err) {
+			kprintf("Could not remove file %u: %s\n", i,
+				strerror(err));
+		}
+	}
+	ns = lookupbench_ns(secs, nsecs);
+	kprintf("  remove %12lu\n", lookupbench_rate(nfiles, ns));
+	kprintf("*** fs lookup benchmark done\n");
+
+ done:
+	VOP_DECREF(root);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Small-append benchmark. Builds an APPENDFILESIZE file out of
+// records of each of a range of sizes, front to back, as the shell
+// does when redirecting output, timing the writes and the close that
+// gets them to disk; then reads the file back and checks it.
+
+static
+char
+appendbench_byte(off_t pos, size_t recsize)
+{
+	return (pos + recsize) % 251;
+}
+
+static
+int
+appendbench_pass(const char *filesys, char *buf, size_t recsize,
+		 uint64_t *ns)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	char name[32];
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t len, i;
+	int err;
+
+	/* vfs_open destroys the string it's passed */
+	fstest_makename(name, sizeof(name), filesys, "");
+	err = vfs_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("appendbench: create: %s\n", strerror(err));
+		return -1;
+	}
+
+	gettime(&secs1, &nsecs1);
+	for (pos = 0; pos < APPENDFILESIZE; pos += len) {
+		len = recsize;
+		if (len > APPENDFILESIZE - pos) {
+			len = APPENDFILESIZE - pos;
+		}
+		for (i=0; i<len; i++) {
+			buf[i] = appendbench_byte(pos + i, recsize);
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("appendbench: write at %lu failed\n",
+				(unsigned long)pos);
+			vfs_close(vn);
+			return -1;
+		}
+	}
+	vfs_close(vn);
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	*ns += (uint64_t)secs * 1000000000 + nsecs;
+
+	fstest_makename(name, sizeof(name), filesys, "");
+	err = vfs_open(name, O_RDONLY, 0664, &vn);
+	if (err) {
+		kprintf("appendbench: open: %s\n", strerror(err));
+		return -1;
+	}
+	uio_kinit(&iov, &ku, buf, APPENDFILESIZE, 0, UIO_READ);
+	err = VOP_READ(vn, &ku);
+	vfs_close(vn);
+	if (err || ku.uio_resid > 0) {
+		kprintf("appendbench: read back failed\n");
+		return -1;
+	}
+	for (i=0; i<APPENDFILESIZE; i++) {
+		if (buf[i] != appendbench_byte(i, recsize)) {
+			kprintf("appendbench: offset %lu: got %d, "
+				"expected %d\n", (unsigned long)i, buf[i],
+				appendbench_byte(i, recsize));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+void
+doappendbench(const char *filesys)
+{
+	static const size_t recsizes[] = { 16, 100, 512, 1000 };
+	char *buf;
+	uint64_t ns;
+	unsigned i, round;
+
+	kprintf("*** Starting fs append benchmark on %s:\n", filesys);
+
+	buf = kmalloc(APPENDFILESIZE);
+	if (buf == NULL) {
+		kprintf("*** Test failed: out of memory\n");
+		return;
+	}
+
+	kprintf("%d KB file, %d passes\n", APPENDFILESIZE/1024,
+		APPENDROUNDS);
+	kprintf("  record  append KB/s\n");
+	for (i=0; i<sizeof(recsizes)/sizeof(recsizes[0]); i++) {
+		ns = 0;
+		for (round=0; round<APPENDROUNDS; round++) {
+			if (appendbench_pass(filesys, buf, recsizes[i], &ns)) {
+				kprintf("*** Test failed\n");
+				goto done;
+			}
+		}
+		if (ns == 0) {
+			ns = 1;
+		}
+		kprintf("%8lu %13lu\n", (unsigned long)recsizes[i],
+			(unsigned long)((uint64_t)APPENDFILESIZE * APPENDROUNDS
+					* 1000000000 / ns / 1024));
+	}
+	kprintf("*** fs append benchmark done\n");
+
+ done:
+	kfree(buf);
+	fstest_remove(filesys, "");
+}
+
+////////////////////////////////////////////////////////////
+//
+// Journal crash test. The first run writes a file and commits it,
+// then truncates it and writes it again, so the new data wants the
+// blocks just freed; gets that data to disk without a commit; and
+// halts, which is as good as a crash. After rebooting, mount the
+// volume, which replays the journal, and run the test again with
+// "check": the truncate never committed, so the file must still have
+// its original contents in its original blocks. Then shut down and
+// run sfsck on the disk. Data is filled as for seqbench.
+
+static
+int
+jcrash_io(struct vnode *vn, uint32_t *buf, enum uio_rw rw, unsigned round)
+{
+	struct iovec iov;
+	struct uio ku;
+	size_t i;
+	int err;
+
+	if (rw == UIO_WRITE) {
+		seqbench_fill(buf, JCRASHSIZE, 0, round);
+	}
+	uio_kinit(&iov, &ku, buf, JCRASHSIZE, 0, rw);
+	err = rw == UIO_WRITE ? VOP_WRITE(vn, &ku) : VOP_READ(vn, &ku);
+	if (err) {
+		kprintf("jcrash: %s error: %s\n",
+			rw == UIO_WRITE ? "write" : "read", strerror(err));
+		return -1;
+	}
+	if (ku.uio_resid > 0) {
+		kprintf("jcrash: short %s\n",
+			rw == UIO_WRITE ? "write" : "read");
+		return -1;
+	}
+	if (rw == UIO_WRITE) {
+		return 0;
+	}
+	for (i=0; i<JCRASHSIZE/sizeof(uint32_t); i++) {
+		if (buf[i] != i*sizeof(uint32_t) + round) {
+			kprintf("jcrash: offset %lu: got %u, expected %u%s\n",
+				(unsigned long)(i*sizeof(uint32_t)), buf[i],
+				(unsigned)(i*sizeof(uint32_t) + round),
+				buf[i] == i*sizeof(uint32_t) + round + 1 ?
+				" (overwritten before the free committed)" :
+				"");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static
+void
+dojcrashtest(const char *filesys, bool check)
+{
+	struct vnode *vn;
+	uint32_t *buf;
+	char name[32];
+	char namecopy[32];
+	int err;
+
+	buf = kmalloc(JCRASHSIZE);
+	if (buf == NULL) {
+		kprintf("*** Test failed: out of memory\n");
+		return;
+	}
+	fstest_makename(name, sizeof(name), filesys, "jc");
+
+	if (check) {
+		kprintf("*** Checking fs journal crash test on %s:\n",
+			filesys);
+		strcpy(namecopy, name);
+		err = vfs_open(namecopy, O_RDONLY, 0664, &vn);
+		if (err) {
+			kprintf("jcrash: %s: %s\n", name, strerror(err));
+			kprintf("*** Test failed\n");
+			goto done;
+		}
+		err = jcrash_io(vn, buf, UIO_READ, 1);
+		vfs_close(vn);
+		if (err) {
+			kprintf("*** Test failed\n");
+			goto done;
+		}
+		kprintf("*** fs journal crash test passed; now shut down "
+			"and run sfsck on %s\n", filesys);
+		goto done;
+	}
+
+	kprintf("*** Starting fs journal crash test on %s:\n", filesys);
+	strcpy(namecopy, name);
+	err = vfs_open(namecopy, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("jcrash: %s: %s\n", name, strerror(err));
+		kprintf("*** Test failed\n");
+		goto done;
+	}
+	if (jcrash_io(vn, buf, UIO_WRITE, 1)) {
+		goto fail;
+	}
+	err = vfs_sync();
+	if (err) {
+		kprintf("jcrash: sync: %s\n", strerror(err));
+		goto fail;
+	}
+
+	/* Nothing from here on gets committed */
+	err = VOP_TRUNCATE(vn, 0);
+	if (err) {
+		kprintf("jcrash: truncate: %s\n", strerror(err));
+		goto fail;
+	}
+	if (jcrash_io(vn, buf, UIO_WRITE, 2)) {
+		goto fail;
+	}
+	err = VOP_FSYNC(vn);
+	if (err) {
+		kprintf("jcrash: fsync: %s\n", strerror(err));
+		goto fail;
+	}
+
+	kprintf("Halting without a sync. Reboot, mount %s, and run "
+		"fs9 %s: check\n", filesys, filesys);
+	mainbus_halt();
+
+ fail:
+	kprintf("*** Test failed\n");
+	vfs_close(vn);
+ done:
+	kfree(buf);
+}
+
 ////////////////////////////////////////////////////////////
 
 static
@@ -542,7 +1272,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456789] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -574,6 +1304,28 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(seqbench);
+DEFTEST(lookupbench);
+DEFTEST(appendbench);
+
+/* Like the others, but takes "check" for its second run */
+int
+jcrashtest(int nargs, char **args)
+{
+	bool check = false;
+	int result;
+
+	if (nargs == 3 && !strcmp(args[2], "check")) {
+		check = true;
+		nargs--;
+	}
+	result = checkfilesystem(nargs, args);
+	if (result) {
+		return result;
+	}
+	dojcrashtest(args[1], check);
+	return 0;
+}
 
 ////////////////////////////////////////////////////////////
 
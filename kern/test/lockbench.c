@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock benchmark.
+ *
+ * The first part has 1, 2, 4, ... threads hammer one lock with a
+ * short critical section, once with lock_acquire spinning on a
+ * running holder and once with lock_spintries set to 0 so waiters go
+ * straight to sleep. The second part has the same thread counts
+ * open and close null: over and over, which goes through the VFS
+ * device and vnode locks on every call.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <test.h>
+
+#define NLOCKOPS	20000
+#define NVFSOPS		2000
+#define MAXTHREADS	8
+
+static struct semaphore *lbdonesem;
+static struct lock *lblock;
+static volatile unsigned long lbcount;
+
+static
+void
+lblockthread(void *junk, unsigned long nops)
+{
+	unsigned long i;
+
+	(void)junk;
+
+	for (i=0; i<nops; i++) {
+		lock_acquire(lblock);
+		lbcount++;
+		lock_release(lblock);
+	}
+	V(lbdonesem);
+}
+
+static
+void
+lbvfsthread(void *junk, unsigned long nops)
+{
+	char path[16];
+	struct vnode *vn;
+	unsigned long i;
+	int result;
+
+	(void)junk;
+
+	for (i=0; i<nops; i++) {
+		/* vfs_open modifies its argument */
+		strcpy(path, "null:");
+		result = vfs_open(path, O_RDONLY, 0, &vn);
+		if (result) {
+			panic("lockbench: vfs_open null: failed: %s\n",
+			      strerror(result));
+		}
+		vfs_close(vn);
+	}
+	V(lbdonesem);
+}
+
+static
+void
+lbround(const char *what, unsigned nthreads, unsigned long nops,
+	void (*func)(void *, unsigned long))
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t ns, total;
+	unsigned i;
+	int result;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lockbench", func, NULL, nops, NULL);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(lbdonesem);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	ns = (uint64_t)secs * 1000000000 + nsecs;
+	if (ns == 0) {
+		ns = 1;
+	}
+	total = (uint64_t)nthreads * nops;
+	kprintf("%-10s %2u threads %8lu ops in %lu.%09lu s: %lu ops/sec\n",
+		what, nthreads, (unsigned long)total, (unsigned long)secs,
+		(unsigned long)nsecs,
+		(unsigned long)(total * 1000000000 / ns));
+}
+
+/*
+ * Usage: sy6 [maxthreads]
+ */
+int
+lockbench(int nargs, char **args)
+{
+	unsigned maxthreads = MAXTHREADS;
+	unsigned wasspintries;
+	unsigned n;
+
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads < 1) {
+		kprintf("Usage: sy6 [maxthreads]\n");
+		return EINVAL;
+	}
+
+	if (lbdonesem == NULL) {
+		lbdonesem = sem_create("lbdonesem", 0);
+		if (lbdonesem == NULL) {
+			panic("lockbench: sem_create failed\n");
+		}
+	}
+	if (lblock == NULL) {
+		lblock = lock_create("lockbench");
+		if (lblock == NULL) {
+			panic("lockbench: lock_create failed\n");
+		}
+	}
+
+	kprintf("Lock benchmark: %u cpus, %u spin tries\n",
+		cpu_count(), LOCK_SPIN_TRIES);
+
+	wasspintries = lock_spintries;
+	lbcount = 0;
+	for (n=1; n<=maxthreads; n*=2) {
+		lock_spintries = LOCK_SPIN_TRIES;
+		lbround("spin", n, NLOCKOPS, lblockthread);
+		lock_spintries = 0;
+		lbround("sleep", n, NLOCKOPS, lblockthread);
+	}
+	lock_spintries = wasspintries;
+
+	for (n=1; n<=maxthreads; n*=2) {
+		lbround("vfs open", n, NVFSOPS, lbvfsthread);
+	}
+
+	cpu_printstats();
+	kprintf("Lock benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Reader-writer lock test and benchmark.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NRWTHREADS    16
+#define NRWLOOPS      100
+#define NBENCHOPS     500
+#define MAXBENCHTHREADS 32
+
+static struct rwlock *testrw;
+static struct semaphore *rwdonesem;
+
+/*
+ * Shared state protected by testrw. Writers keep rwval2 == rwval1*2;
+ * readers check that they never see it otherwise.
+ */
+static volatile unsigned long rwval1;
+static volatile unsigned long rwval2;
+static volatile unsigned rwreaders;
+static volatile unsigned rwwriters;
+static volatile bool rwfailed;
+
+static
+void
+rwinititems(void)
+{
+	if (testrw==NULL) {
+		testrw = rwlock_create("testrw");
+		if (testrw == NULL) {
+			panic("rwtest: rwlock_create failed\n");
+		}
+	}
+	if (rwdonesem==NULL) {
+		rwdonesem = sem_create("rwdonesem", 0);
+		if (rwdonesem == NULL) {
+			panic("rwtest: sem_create failed\n");
+		}
+	}
+}
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	rwfailed = true;
+}
+
+static
+void
+rwcheck_read(unsigned long num)
+{
+	if (rwwriters != 0) {
+		rwfail(num, "reader inside with a writer");
+	}
+	if (rwval2 != rwval1*2) {
+		rwfail(num, "reader saw a half-done write");
+	}
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	unsigned long seen;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		switch (random() % 3) {
+		    case 0:
+			rwlock_acquire_read(testrw);
+			rwreaders++;
+			rwcheck_read(num);
+			thread_yield();
+			rwcheck_read(num);
+			rwreaders--;
+			rwlock_release_read(testrw);
+			break;
+		    case 1:
+			rwlock_acquire_write(testrw);
+			rwwriters++;
+			if (rwwriters != 1 || rwreaders != 0) {
+				rwfail(num, "writer not alone");
+			}
+			rwval1++;
+			thread_yield();
+			rwval2 = rwval1*2;
+			rwwriters--;
+			rwlock_release_write(testrw);
+			break;
+		    case 2:
+			/* write, then downgrade and make sure no writer got in */
+			rwlock_acquire_write(testrw);
+			rwwriters++;
+			rwval1++;
+			rwval2 = rwval1*2;
+			seen = rwval1;
+			rwwriters--;
+			rwlock_downgrade(testrw);
+			rwreaders++;
+			thread_yield();
+			rwcheck_read(num);
+			if (rwval1 != seen) {
+				rwfail(num, "writer got in during downgrade");
+			}
+			rwreaders--;
+			rwlock_release_read(testrw);
+			break;
+		}
+	}
+	V(rwdonesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinititems();
+	rwfailed = false;
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NRWTHREADS; i++) {
+		result = thread_fork("rwtest", rwtestthread, NULL, i, NULL);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NRWTHREADS; i++) {
+		P(rwdonesem);
+	}
+
+	kprintf("rwlock test %s.\n", rwfailed ? "FAILED" : "done");
+	return 0;
+}
+
+/*
+ * Benchmark.
+ *
+ * A fixed pool of worker threads is forked once and reused for every
+ * configuration, so the numbers measure the lock and not thread
+ * creation. Each round wakes nthreads of them; each does NBENCHOPS
+ * acquisitions, bench_writepct percent of them for writing.
+ */
+
+static struct semaphore *benchgo[MAXBENCHTHREADS];
+static volatile unsigned bench_writepct;
+static volatile bool bench_quit;
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+	(void)junk;
+
+	while (1) {
+		P(benchgo[num]);
+		if (bench_quit) {
+			break;
+		}
+		for (i=0; i<NBENCHOPS; i++) {
+			if (random() % 100 < bench_writepct) {
+				rwlock_acquire_write(testrw);
+				rwval1++;
+				for (j=0; j<20; j++);
+				rwval2 = rwval1*2;
+				rwlock_release_write(testrw);
+			}
+			else {
+				rwlock_acquire_read(testrw);
+				for (j=0; j<20; j++);
+				rwlock_release_read(testrw);
+			}
+		}
+		V(rwdonesem);
+	}
+	V(rwdonesem);
+}
+
+static
+void
+rwbench_round(unsigned nthreads, unsigned writepct)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t ops, ns;
+	unsigned i;
+
+	bench_writepct = writepct;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		V(benchgo[i]);
+	}
+	for (i=0; i<nthreads; i++) {
+		P(rwdonesem);
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	ops = (uint64_t)nthreads * NBENCHOPS;
+	ns = (uint64_t)secs * 1000000000 + nsecs;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("%7u %7u%% %12lu\n", nthreads, writepct,
+		(unsigned long)(ops * 1000000000 / ns));
+}
+
+/*
+ * Usage: rw2 [maxthreads]
+ */
+int
+rwbench(int nargs, char **args)
+{
+	static const unsigned writepcts[] = { 0, 10, 50, 90, 100 };
+	unsigned maxthreads = 8;
+	unsigned nthreads, i;
+	char name[16];
+	int result;
+
+	if (nargs > 1) {
+		maxthreads = atoi(args[1]);
+	}
+	if (maxthreads < 1 || maxthreads > MAXBENCHTHREADS) {
+		kprintf("Usage: rw2 [maxthreads]  (1-%d)\n", MAXBENCHTHREADS);
+		return EINVAL;
+	}
+
+	rwinititems();
+	bench_quit = false;
+
+	for (i=0; i<maxthreads; i++) {
+		snprintf(name, sizeof(name), "rwbench%u", i);
+		benchgo[i] = sem_create(name, 0);
+		if (benchgo[i] == NULL) {
+			panic("rwbench: sem_create failed\n");
+		}
+		result = thread_fork(name, rwbenchthread, NULL, i, NULL);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	kprintf("rwlock benchmark: %u cpus, %d acquisitions per thread\n",
+		cpu_count(), NBENCHOPS);
+	kprintf("threads  writes   acquires/sec\n");
+	for (nthreads = 1; nthreads <= maxthreads; nthreads *= 2) {
+		for (i=0; i<sizeof(writepcts)/sizeof(writepcts[0]); i++) {
+			rwbench_round(nthreads, writepcts[i]);
+		}
+	}
+
+	bench_quit = true;
+	for (i=0; i<maxthreads; i++) {
+		V(benchgo[i]);
+		P(rwdonesem);
+		sem_destroy(benchgo[i]);
+		benchgo[i] = NULL;
+	}
+
+	kprintf("rwlock benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Thread create/destroy benchmark.
+ *
+ * Forks batches of threads that exit right away, waiting for each
+ * batch before starting the next, so exited threads get cleaned up
+ * (and, with thread_caching on, land in the thread cache) in between.
+ * Runs once with the thread cache and once without.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define NBENCHTHREADS	2000
+#define BATCH		8
+
+static struct semaphore *tbdonesem;
+
+static
+void
+tbthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(tbdonesem);
+}
+
+static
+void
+tbround(unsigned nthreads, bool caching)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t ns;
+	unsigned i, j;
+	int result;
+
+	thread_caching = caching;
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i+=BATCH) {
+		for (j=0; j<BATCH; j++) {
+			result = thread_fork("threadbench", tbthread,
+					     NULL, i+j, NULL);
+			if (result) {
+				panic("threadbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (j=0; j<BATCH; j++) {
+			P(tbdonesem);
+		}
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+
+	ns = (uint64_t)secs * 1000000000 + nsecs;
+	if (ns == 0) {
+		ns = 1;
+	}
+	kprintf("cache %-3s %8u threads in %lu.%09lu s: %lu threads/sec\n",
+		caching ? "on" : "off", nthreads, (unsigned long)secs,
+		(unsigned long)nsecs,
+		(unsigned long)((uint64_t)nthreads * 1000000000 / ns));
+}
+
+/*
+ * Usage: tt4 [nthreads]
+ */
+int
+threadbench(int nargs, char **args)
+{
+	unsigned nthreads = NBENCHTHREADS;
+	bool wascaching;
+
+	if (nargs > 1) {
+		nthreads = atoi(args[1]);
+	}
+	if (nthreads < BATCH) {
+		kprintf("Usage: tt4 [nthreads]  (at least %d)\n", BATCH);
+		return EINVAL;
+	}
+	nthreads = ROUNDUP(nthreads, BATCH);
+
+	if (tbdonesem == NULL) {
+		tbdonesem = sem_create("tbdonesem", 0);
+		if (tbdonesem == NULL) {
+			panic("threadbench: sem_create failed\n");
+		}
+	}
+
+	wascaching = thread_caching;
+	kprintf("Thread create/destroy benchmark: %u cpus, batches of %d\n",
+		cpu_count(), BATCH);
+	tbround(nthreads, true);
+	tbround(nthreads, false);
+	thread_caching = wascaching;
+
+	cpu_printstats();
+	kprintf("Thread benchmark done.\n");
+	return 0;
+}
@@ -30,17 +30,25 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spinlock.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
+#include <threadlist.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * Callouts (callbacks at specific points in the future) are kept in
+ * a hashed timing wheel, advanced once per hardclock tick by CPU 0.
+ * Timed sleeps are built on callouts.
+ *
+ * An idle CPU doesn't need to take a hardclock every tick: before it
+ * waits for an interrupt it stretches its timer out to the next thing
+ * it has to do (the next callout, for CPU 0) and catches up on the
+ * ticks it missed when it wakes up.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -58,6 +66,37 @@
  */
 static struct wchan *lbolt;
 
+/*
+ * The callout wheel. A callout due at tick T lives in slot
+ * T % CALLOUT_WHEELSIZE; callouts more than one revolution away just
+ * sit in their slot until the wheel comes round to the right tick.
+ * Everything here is protected by callout_lock.
+ */
+#define CALLOUT_WHEELSIZE	256
+
+static struct callout *callout_wheel[CALLOUT_WHEELSIZE];
+static struct spinlock callout_lock = SPINLOCK_INITIALIZER;
+static uint64_t callout_now;		/* ticks since boot */
+
+/*
+ * While CPU 0 is idle with its timer stretched, callout_idlecpu is
+ * set and callout_idleuntil is the tick it will wake up on; anyone
+ * scheduling a callout due before that has to kick it. Also protected
+ * by callout_lock.
+ */
+static struct cpu *callout_idlecpu;
+static uint64_t callout_idleuntil;
+
+/*
+ * Longest an idle CPU goes without a hardclock. Bounded by the wheel
+ * size so CPU 0 can find the next callout by looking at each slot
+ * once.
+ */
+#define IDLE_MAXTICKS	(HZ < CALLOUT_WHEELSIZE ? HZ : CALLOUT_WHEELSIZE)
+
+/* Tickless idle can be turned off from the menu for comparison. */
+bool clock_tickless = true;
+
 /*
  * Setup.
  */
@@ -81,6 +120,154 @@ timerclock(void)
 	wchan_wakeall(lbolt);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Callouts.
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_when = 0;
+	co->co_func = func;
+	co->co_arg = arg;
+	co->co_pending = false;
+}
+
+/* Unlink a pending callout from its wheel slot. */
+static
+void
+callout_remove(struct callout *co)
+{
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+	KASSERT(co->co_pending);
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_pending = false;
+}
+
+void
+callout_schedule(struct callout *co, unsigned nticks)
+{
+	struct callout **slot;
+	struct cpu *kick = NULL;
+
+	if (nticks == 0) {
+		nticks = 1;
+	}
+
+	spinlock_acquire(&callout_lock);
+	if (co->co_pending) {
+		callout_remove(co);
+	}
+	co->co_when = callout_now + nticks;
+	slot = &callout_wheel[co->co_when % CALLOUT_WHEELSIZE];
+	co->co_next = *slot;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = &co->co_next;
+	}
+	co->co_prevp = slot;
+	*slot = co;
+	co->co_pending = true;
+	if (callout_idlecpu != NULL && co->co_when < callout_idleuntil) {
+		/* CPU 0 is asleep past this; wake it to reprogram */
+		kick = callout_idlecpu;
+		callout_idlecpu = NULL;
+	}
+	spinlock_release(&callout_lock);
+
+	if (kick != NULL) {
+		ipi_send(kick, IPI_UNIDLE);
+	}
+}
+
+bool
+callout_cancel(struct callout *co)
+{
+	bool waspending;
+
+	spinlock_acquire(&callout_lock);
+	waspending = co->co_pending;
+	if (waspending) {
+		callout_remove(co);
+	}
+	spinlock_release(&callout_lock);
+	return waspending;
+}
+
+uint64_t
+clock_ticks(void)
+{
+	uint64_t now;
+
+	spinlock_acquire(&callout_lock);
+	now = callout_now;
+	spinlock_release(&callout_lock);
+	return now;
+}
+
+/*
+ * Advance the wheel one tick and run whatever has come due. The
+ * callout is off the wheel before its function is called, and we
+ * don't touch it afterwards, so the function may reschedule it or
+ * wake up a thread that then frees it.
+ */
+static
+void
+callout_tick(void)
+{
+	struct callout *co;
+	unsigned slot;
+
+	spinlock_acquire(&callout_lock);
+	callout_now++;
+	slot = callout_now % CALLOUT_WHEELSIZE;
+ again:
+	for (co = callout_wheel[slot]; co != NULL; co = co->co_next) {
+		if (co->co_when <= callout_now) {
+			callout_remove(co);
+			spinlock_release(&callout_lock);
+			co->co_func(co->co_arg);
+			spinlock_acquire(&callout_lock);
+			/* the slot may have changed under us; rescan */
+			goto again;
+		}
+	}
+	spinlock_release(&callout_lock);
+}
+
+/*
+ * Number of ticks until the next pending callout, or IDLE_MAXTICKS if
+ * there's nothing due before then.
+ */
+static
+unsigned
+callout_nextdue(void)
+{
+	struct callout *co;
+	unsigned n;
+	uint64_t when;
+
+	KASSERT(spinlock_do_i_hold(&callout_lock));
+
+	for (n=1; n<IDLE_MAXTICKS; n++) {
+		when = callout_now + n;
+		co = callout_wheel[when % CALLOUT_WHEELSIZE];
+		for (; co != NULL; co = co->co_next) {
+			if (co->co_when <= when) {
+				return n;
+			}
+		}
+	}
+	return IDLE_MAXTICKS;
+}
+
 /*
  * This is called HZ times a second (on each processor) by the timer
  * code.
@@ -93,24 +280,216 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if (curcpu->c_number == 0) {
+		callout_tick();
+	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
-	thread_yield();
+	/*
+	 * Nobody else to run here, so don't bother going through the
+	 * switch code. (Unlocked peek; if something shows up just now
+	 * we'll get it on the next tick.)
+	 */
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		thread_yield();
+	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Tickless idle.
+
 /*
- * Suspend execution for n seconds.
+ * Called by thread_switch, with interrupts off, just before the cpu
+ * waits for an interrupt. Stretch the timer out to the next event.
  */
 void
-clocksleep(int num_secs)
+clock_idle_enter(void)
+{
+	unsigned nticks;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	curcpu->c_idle_hardclocks = curcpu->c_hardclocks;
+	if (!clock_tickless) {
+		curcpu->c_idle_stretched = false;
+		return;
+	}
+
+	if (curcpu->c_number == 0) {
+		spinlock_acquire(&callout_lock);
+		nticks = callout_nextdue();
+		if (nticks > 1) {
+			callout_idlecpu = curcpu->c_self;
+			callout_idleuntil = callout_now + nticks;
+			curcpu->c_idle_startticks = callout_now;
+		}
+		spinlock_release(&callout_lock);
+	}
+	else {
+		nticks = IDLE_MAXTICKS;
+	}
+
+	if (nticks <= 1) {
+		/* something's due next tick anyway */
+		curcpu->c_idle_stretched = false;
+		return;
+	}
+
+	gettime(&curcpu->c_idle_secs, &curcpu->c_idle_nsecs);
+	mainbus_settimer(nticks);
+	curcpu->c_idle_stretched = true;
+	curcpu->c_tickless++;
+}
+
+/*
+ * Called by thread_switch after the cpu wakes up, still with
+ * interrupts off. Put the timer back to every tick, count what we
+ * skipped, and on CPU 0 run the callouts for the ticks we slept
+ * through so callout time keeps up with real time.
+ */
+void
+clock_idle_exit(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t elapsed, target;
+	unsigned taken;
+
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!curcpu->c_idle_stretched) {
+		return;
+	}
+	curcpu->c_idle_stretched = false;
+
+	gettime(&secs, &nsecs);
+	getinterval(curcpu->c_idle_secs, curcpu->c_idle_nsecs, secs, nsecs,
+		    &secs, &nsecs);
+	elapsed = (uint64_t)secs * HZ + nsecs / (1000000000 / HZ);
+
+	taken = curcpu->c_hardclocks - curcpu->c_idle_hardclocks;
+	if (elapsed > taken) {
+		curcpu->c_skippedticks += elapsed - taken;
+	}
+
+	/*
+	 * If the stretched interrupt already fired, the interrupt
+	 * code went back to one tick by itself; otherwise (we were
+	 * woken by something else) we have to.
+	 */
+	if (taken == 0) {
+		mainbus_settimer(1);
+	}
+
+	if (curcpu->c_number == 0) {
+		target = curcpu->c_idle_startticks + elapsed;
+		spinlock_acquire(&callout_lock);
+		callout_idlecpu = NULL;
+		while (callout_now < target) {
+			spinlock_release(&callout_lock);
+			callout_tick();
+			spinlock_acquire(&callout_lock);
+		}
+		spinlock_release(&callout_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timed sleep.
+
+/*
+ * State for one sleeping thread; lives on its stack. The callout
+ * sets ts_done and wakes the thread, both under ts_lock, so the
+ * sleeper can't see ts_done and tear everything down until the
+ * callout function is finished with it.
+ */
+struct timedsleep {
+	struct spinlock ts_lock;
+	struct wchan *ts_wchan;
+	volatile bool ts_done;
+	struct callout ts_callout;
+};
+
+static
+void
+clocksleep_wakeup(void *arg)
 {
-	while (num_secs > 0) {
+	struct timedsleep *ts = arg;
+
+	spinlock_acquire(&ts->ts_lock);
+	ts->ts_done = true;
+	wchan_wakeone(ts->ts_wchan);
+	spinlock_release(&ts->ts_lock);
+}
+
+/*
+ * Suspend execution for NTICKS hardclock ticks.
+ */
+void
+clocksleep_ticks(unsigned nticks)
+{
+	struct timedsleep ts;
+
+	if (nticks == 0) {
+		return;
+	}
+
+	ts.ts_wchan = wchan_create("clocksleep");
+	if (ts.ts_wchan == NULL) {
+		/* No memory for a wait channel; fall back to lbolt. */
 		wchan_lock(lbolt);
 		wchan_sleep(lbolt);
-		num_secs--;
+		return;
+	}
+	spinlock_init(&ts.ts_lock);
+	ts.ts_done = false;
+	callout_init(&ts.ts_callout, clocksleep_wakeup, &ts);
+
+	spinlock_acquire(&ts.ts_lock);
+	callout_schedule(&ts.ts_callout, nticks);
+	while (!ts.ts_done) {
+		wchan_lock(ts.ts_wchan);
+		spinlock_release(&ts.ts_lock);
+		wchan_sleep(ts.ts_wchan);
+		spinlock_acquire(&ts.ts_lock);
+	}
+	spinlock_release(&ts.ts_lock);
+
+	spinlock_cleanup(&ts.ts_lock);
+	wchan_destroy(ts.ts_wchan);
+}
+
+/*
+ * Suspend execution for the given time, rounded up to whole ticks.
+ */
+void
+clocksleep_ns(time_t secs, uint32_t nsecs)
+{
+	uint64_t nticks;
+	const uint32_t nsecs_per_tick = 1000000000 / HZ;
+
+	nticks = (uint64_t)secs * HZ +
+		(nsecs + nsecs_per_tick - 1) / nsecs_per_tick;
+	while (nticks > 0x7fffffff) {
+		clocksleep_ticks(0x7fffffff);
+		nticks -= 0x7fffffff;
+	}
+	clocksleep_ticks((unsigned)nticks);
+}
+
+/*
+ * Suspend execution for n seconds.
+ */
+void
+clocksleep(int num_secs)
+{
+	if (num_secs > 0) {
+		clocksleep_ticks(num_secs * HZ);
 	}
 }
@@ -36,6 +36,7 @@
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -147,6 +148,8 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+unsigned lock_spintries = LOCK_SPIN_TRIES;
+
 struct lock *
 lock_create(const char *name)
 {
@@ -173,6 +176,7 @@ lock_create(const char *name)
 
 	spinlock_init(&lock->lk_spin);
 	lock->lk_isLocked = false;
+	lock->lk_waiters = 0;
 	lock->thread = NULL;
 
         return lock;
@@ -184,18 +188,42 @@ lock_destroy(struct lock *lock)
         KASSERT(lock != NULL);
 
         // add stuff here as needed
+	KASSERT(lock->lk_waiters == 0);
         
         kfree(lock->lk_name);
-	kfree(lock->thread);
 	spinlock_cleanup(&lock->lk_spin);
 	wchan_destroy(lock->lk_wchan);
         kfree(lock);
 }
 
+/*
+ * Return true if the holder of LOCK is currently on a cpu other than
+ * ours, in which case it is likely to release the lock soon and it is
+ * cheaper to spin than to go to sleep. Must be called with lk_spin
+ * held; that keeps the holder from releasing the lock (and possibly
+ * exiting) while we look at it.
+ */
+static
+bool
+lock_holder_running(struct lock *lock)
+{
+	struct thread *holder;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_spin));
+
+	holder = lock->thread;
+	if (holder == NULL) {
+		return false;
+	}
+	return holder->t_state == S_RUN && holder->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
         // Write this
+	unsigned tries;
+
 	KASSERT(lock != NULL);
 
 	KASSERT(curthread->t_in_interrupt == false);
@@ -208,11 +236,32 @@ lock_acquire(struct lock *lock)
 	spinlock_acquire(&lock->lk_spin);	
 
 	while(lock->lk_isLocked == true) {
+		if (lock_holder_running(lock)) {
+			/*
+			 * Spin without the spinlock, watching only the
+			 * volatile flag, so the holder can get in to
+			 * release. Then go around again and recheck
+			 * under the spinlock.
+			 */
+			spinlock_release(&lock->lk_spin);
+			for (tries = 0; tries < lock_spintries; tries++) {
+				if (!lock->lk_isLocked) {
+					break;
+				}
+			}
+			spinlock_acquire(&lock->lk_spin);
+			if (!lock->lk_isLocked || tries < lock_spintries) {
+				continue;
+			}
+		}
+
+		lock->lk_waiters++;
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_spin);
 		wchan_sleep(lock->lk_wchan);
 
 		spinlock_acquire(&lock->lk_spin);
+		lock->lk_waiters--;
 	}
 
 	lock->lk_isLocked = true;
@@ -231,7 +280,10 @@ lock_release(struct lock *lock)
 		lock->lk_isLocked = false;
 		lock->thread = NULL;
 	
-		wchan_wakeone(lock->lk_wchan);
+		/* Nobody asleep: spinners will see lk_isLocked go false. */
+		if (lock->lk_waiters > 0) {
+			wchan_wakeone(lock->lk_wchan);
+		}
 		spinlock_release(&lock->lk_spin);	
 	} else {
 		return;
@@ -336,6 +388,10 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	}
 }
 
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
 struct rwlock*
 rwlock_create(const char *name){
 	struct rwlock *rwlock;
@@ -366,20 +422,12 @@ rwlock_create(const char *name){
 		return NULL;
 	}
 
-	rwlock->rwlk_lock = lock_create("lock");
-	if(rwlock->rwlk_lock == NULL){
-		kfree(rwlock->rwlk_name);
-		wchan_destroy(rwlock->rwlk_rwchan);
-		wchan_destroy(rwlock->rwlk_wwchan);
-		kfree(rwlock);
-		return NULL;
-	}
-
 	spinlock_init(&rwlock->rwlk_spin);
 	rwlock->rwlk_rcount = 0;
-	rwlock->rwlk_iswriting = false;
-	//rwlock->rwlk_wcount = 0;
-	rwlock->rwlk_prevrelease = false;
+	rwlock->rwlk_rwaiting = 0;
+	rwlock->rwlk_wwaiting = 0;
+	rwlock->rwlk_batch = 0;
+	rwlock->rwlk_writer = NULL;
 
 	return rwlock;
 }
@@ -387,32 +435,56 @@ rwlock_create(const char *name){
 void
 rwlock_destroy(struct rwlock *rwlock){
 	KASSERT(rwlock != NULL);
+	KASSERT(rwlock->rwlk_rcount == 0);
+	KASSERT(rwlock->rwlk_writer == NULL);
 
 	kfree(rwlock->rwlk_name);
 	wchan_destroy(rwlock->rwlk_rwchan);
 	wchan_destroy(rwlock->rwlk_wwchan);
 	spinlock_cleanup(&rwlock->rwlk_spin);
-	lock_destroy(rwlock->rwlk_lock);
 	kfree(rwlock);
 }
 
+/*
+ * Admit every reader currently waiting as one batch. Called with the
+ * spinlock held.
+ */
+static
+void
+rwlock_admit_readers(struct rwlock *rwlock){
+	KASSERT(spinlock_do_i_hold(&rwlock->rwlk_spin));
+
+	if(rwlock->rwlk_rwaiting > 0){
+		rwlock->rwlk_batch++;
+		wchan_wakeall(rwlock->rwlk_rwchan);
+	}
+}
+
 void
 rwlock_acquire_read(struct rwlock *rwlock){
+	unsigned mybatch;
+
 	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&rwlock->rwlk_spin);
 	
-	/*reader should wait in the following conditions:
-	1. if writer is accessing the resource (in this case lock will not be available).
-	2. if writer is waiting and the no of readers currently accessing the resource is beyond
-	   the permissible limit.
+	/*reader can go straight in unless a writer is accessing the
+	resource or waiting for it. Otherwise it waits for the next batch
+	of readers to be admitted; a writer that is still (or again)
+	accessing the resource when it wakes keeps it waiting.
 	*/
-	while(rwlock->rwlk_iswriting ||	(rwlock->rwlk_rcount > 10 && !wchan_isempty(rwlock->rwlk_wwchan))){ 
-		wchan_lock(rwlock->rwlk_rwchan);
-		spinlock_release(&rwlock->rwlk_spin);
-		wchan_sleep(rwlock->rwlk_rwchan);
-
-		spinlock_acquire(&rwlock->rwlk_spin);
+	if(rwlock->rwlk_writer != NULL || rwlock->rwlk_wwaiting > 0){
+		mybatch = rwlock->rwlk_batch;
+		rwlock->rwlk_rwaiting++;
+		while(rwlock->rwlk_writer != NULL || rwlock->rwlk_batch == mybatch){ 
+			wchan_lock(rwlock->rwlk_rwchan);
+			spinlock_release(&rwlock->rwlk_spin);
+			wchan_sleep(rwlock->rwlk_rwchan);
+
+			spinlock_acquire(&rwlock->rwlk_spin);
+		}
+		rwlock->rwlk_rwaiting--;
 	}
 
 	//increase the count before accessing the resource
@@ -425,41 +497,18 @@ rwlock_release_read(struct rwlock *rwlock){
 	KASSERT(rwlock != NULL);
 
 	spinlock_acquire(&rwlock->rwlk_spin);
+	KASSERT(rwlock->rwlk_rcount > 0);
 	//decrement the count when releasing the resource
 	rwlock->rwlk_rcount--;
 	
-	//reader should wake any thread only when there is no other reader accessing
-	//the resource
-	if(rwlock->rwlk_rcount > 0){
-		spinlock_release(&rwlock->rwlk_spin);
-		return;
-	}
-	
-	/*If rwlk_prevrelease value is true (writer was released from wait before), follow these conditions:
-	Check if there are any readers in wait channel. 
-	1. if yes, release one reader (loophole)???????
-	2. else release one for write
-	If rwlk_prevrelease value is false (reader was released before), check if there are any writers waiting
-	1. if yes, release one writer
-	2. else release all readers */
- 
-	if(rwlock->rwlk_prevrelease){
-		if(!wchan_isempty(rwlock->rwlk_rwchan)){
-			//should also check if there is any writer waiting. if so release only one to
-			//prevent starvation.
-			(wchan_isempty(rwlock->rwlk_wwchan)) ? wchan_wakeall(rwlock->rwlk_rwchan) : wchan_wakeone(rwlock->rwlk_rwchan);
-			rwlock->rwlk_prevrelease = false;
-		} else {
+	//the last reader out hands over to a waiting writer; if there is
+	//none, let in anyone who queued up behind a writer that has since
+	//come and gone
+	if(rwlock->rwlk_rcount == 0){
+		if(rwlock->rwlk_wwaiting > 0){
 			wchan_wakeone(rwlock->rwlk_wwchan);
-			rwlock->rwlk_prevrelease = true;
-		}
-	} else {
-		if(!wchan_isempty(rwlock->rwlk_wwchan)){
-			wchan_wakeone(rwlock->rwlk_wwchan);
-			rwlock->rwlk_prevrelease = true;
 		} else {
-			wchan_wakeall(rwlock->rwlk_rwchan);
-			rwlock->rwlk_prevrelease = false;
+			rwlock_admit_readers(rwlock);
 		}
 	}
 
@@ -469,25 +518,25 @@ rwlock_release_read(struct rwlock *rwlock){
 void
 rwlock_acquire_write(struct rwlock *rwlock){
 	KASSERT(rwlock != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+	KASSERT(rwlock->rwlk_writer != curthread);
 
 	spinlock_acquire(&rwlock->rwlk_spin);
 
-	//writer should wait if there is any reader accessing the resource
-	while(rwlock->rwlk_rcount > 0 || rwlock->rwlk_iswriting){
-		wchan_lock(rwlock->rwlk_wwchan);
-		//increase the counter if waiting
-		//rwlock->rwlk_wcount++;
-		spinlock_release(&rwlock->rwlk_spin);
-		wchan_sleep(rwlock->rwlk_wwchan);
+	//writer should wait if there is any reader or writer accessing the resource
+	if(rwlock->rwlk_rcount > 0 || rwlock->rwlk_writer != NULL){
+		rwlock->rwlk_wwaiting++;
+		while(rwlock->rwlk_rcount > 0 || rwlock->rwlk_writer != NULL){
+			wchan_lock(rwlock->rwlk_wwchan);
+			spinlock_release(&rwlock->rwlk_spin);
+			wchan_sleep(rwlock->rwlk_wwchan);
 
-		spinlock_acquire(&rwlock->rwlk_spin);
+			spinlock_acquire(&rwlock->rwlk_spin);
+		}
+		rwlock->rwlk_wwaiting--;
 	}
 
-	rwlock->rwlk_iswriting = true;
-	//lock_acquire(rwlock->rwlk_lock);
-
-	//decrement the count once awaken from sleep
-	//rwlock->rwlk_wcount--;
+	rwlock->rwlk_writer = curthread;
 	spinlock_release(&rwlock->rwlk_spin);	
 }
 
@@ -496,21 +545,33 @@ rwlock_release_write(struct rwlock *rwlock){
 	KASSERT(rwlock != NULL);
 
 	spinlock_acquire(&rwlock->rwlk_spin);
-	rwlock->rwlk_iswriting = false;
-	//lock_release(rwlock->rwlk_lock);
-
-	/*No need to check for rwlk_prevrelease because if writer is releasing the lock then
-	there is no probability that a reader will be accessing at the same time nor any writer
-	thread would have been woken before/after this thread. Hence, reader should be waken up
-	at any cost (unless there is no reader).*/	
-	if(!wchan_isempty(rwlock->rwlk_rwchan)){
-		//Check if any writer is waiting else wake all readers
-		(!wchan_isempty(rwlock->rwlk_wwchan)) ? wchan_wakeone(rwlock->rwlk_rwchan) : wchan_wakeall(rwlock->rwlk_rwchan);
-		rwlock->rwlk_prevrelease = false;
+	KASSERT(rwlock->rwlk_writer == curthread);
+	rwlock->rwlk_writer = NULL;
+
+	/*Readers that queued up while this writer held the lock go next,
+	as one batch, so a stream of writers can't starve them. Only if
+	there are none does the next writer get woken.*/	
+	if(rwlock->rwlk_rwaiting > 0){
+		rwlock_admit_readers(rwlock);
 	} else {
 		wchan_wakeone(rwlock->rwlk_wwchan);
-		rwlock->rwlk_prevrelease = true;
 	}
 
 	spinlock_release(&rwlock->rwlk_spin);
 }
+
+void
+rwlock_downgrade(struct rwlock *rwlock){
+	KASSERT(rwlock != NULL);
+
+	spinlock_acquire(&rwlock->rwlk_spin);
+	KASSERT(rwlock->rwlk_writer == curthread);
+	KASSERT(rwlock->rwlk_rcount == 0);
+
+	//become a reader without ever letting go of the resource
+	rwlock->rwlk_writer = NULL;
+	rwlock->rwlk_rcount = 1;
+	rwlock_admit_readers(rwlock);
+
+	spinlock_release(&rwlock->rwlk_spin);
+}
@@ -44,10 +44,12 @@
 #include <threadprivate.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <limits.h>
+#include <copyinout.h>
 
 #include "process.h"
 #include "opt-synchprobs.h"
@@ -115,26 +117,19 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Set up a new thread in THREAD, which is either fresh from kmalloc
+ * or recycled from a thread cache. Everything but the stack is
+ * initialized here; the caller deals with that.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -142,7 +137,6 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 
@@ -150,43 +144,45 @@ thread_create(const char *name)
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+	thread->t_enqueued = 0;
 
 	/* VM fields */
 	thread->t_addrspace = NULL;
+	thread->t_stackslot = 0;
 
 	/* VFS fields */
 	thread->t_cwd = NULL;
+	thread->t_fdtable = NULL;
 
 	/* If you add to struct thread, be sure to initialize here */
-	thread->t_pid = generate_pid();
+	thread->t_pid = generate_pid(thread);
 	if(thread->t_pid == -1){
-		kfree(thread);
-		return NULL;
+		kfree(thread->t_name);
+		return ENOMEM;
 	}
 
-	process[thread->t_pid]->exitlock = lock_create("exitlock");
-	if(process[thread->t_pid]->exitlock == NULL){
-		kfree(thread);
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
 		return NULL;
 	}
-
-	process[thread->t_pid]->exitcv = cv_create("exitcv");
-	if(process[thread->t_pid]->exitcv == NULL){
-		lock_destroy(process[thread->t_pid]->exitlock);
-		kfree(process[thread->t_pid]);
+	if (thread_init(thread, name)) {
 		kfree(thread);
 		return NULL;
 	}
-
-	process[thread->t_pid]->self = thread;
-	process[thread->t_pid]->exited = false;
-	process[thread->t_pid]->exitcode = -1;
-
-	if(thread->t_pid == 1){ /* No parent - init process */
-		process[thread->t_pid]->ppid = -1;
-	}else {
-		process[thread->t_pid]->ppid = curthread->t_pid;
-	}
+	thread->t_stack = NULL;
 
 	return thread;
 }
@@ -217,10 +213,21 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tickless = 0;
+	c->c_skippedticks = 0;
+	c->c_idle_stretched = false;
+	c->c_idle_hardclocks = 0;
+	c->c_idle_startticks = 0;
+	c->c_idle_secs = 0;
+	c->c_idle_nsecs = 0;
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_hits = 0;
+	c->c_threadcache_misses = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	bzero(&c->c_schedstat, sizeof(c->c_schedstat));
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -260,6 +267,167 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus, for code outside the thread system that
+ * wants to size things per-cpu or report it.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+void
+cpu_printstats(void)
+{
+	struct cpu *c;
+	unsigned i, num;
+	uint64_t secs, ticks;
+
+	/* callout time is kept up to date even across tickless idle */
+	ticks = clock_ticks();
+	secs = ticks / HZ;
+	if (secs == 0) {
+		secs = 1;
+	}
+
+	kprintf("Uptime %llu ticks, tickless idle %s\n",
+		(unsigned long long)ticks, clock_tickless ? "on" : "off");
+	kprintf("cpu  hardclocks   skipped  idlewaits  intrs/sec"
+		"  cached    hits  misses\n");
+	num = cpuarray_num(&allcpus);
+	for (i=0; i<num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("%3u %11u %9u %10u %10u %7u %7u %7u\n", c->c_number,
+			c->c_hardclocks, c->c_skippedticks, c->c_tickless,
+			(unsigned)(c->c_hardclocks / secs),
+			c->c_threadcache.tl_count, c->c_threadcache_hits,
+			c->c_threadcache_misses);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Scheduler statistics.
+//
+// thread_make_runnable stamps each thread with the time it went on a
+// run queue, and thread_switch charges the wait to the histogram of
+// the cpu that picks it up. Everything in c_schedstat is protected
+// by that cpu's run queue lock.
+//
+// The time is read before taking the run queue lock, so the clock
+// device isn't touched with the lock held. Until the clock has been
+// attached, early in boot, threads aren't stamped and their waits
+// aren't counted.
+
+/* Current time in nanoseconds, or 0 if there's no clock yet */
+static
+uint64_t
+sched_now(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+
+	if (!gettime_available()) {
+		return 0;
+	}
+	gettime(&secs, &nsecs);
+	return (uint64_t)secs * 1000000000 + nsecs;
+}
+
+/* Account for thread T leaving C's run queue to run at time NOW. */
+static
+void
+sched_dequeued(struct cpu *c, struct thread *t, uint64_t now)
+{
+	struct schedstat *ss = &c->c_schedstat;
+	uint64_t wait;
+	uint32_t us;
+	unsigned bucket;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	ss->ss_switches++;
+	if (t->t_enqueued == 0 || now == 0) {
+		t->t_enqueued = 0;
+		return;
+	}
+	/* NOW was read unlocked, so T may have been queued after it */
+	wait = now > t->t_enqueued ? now - t->t_enqueued : 0;
+	t->t_enqueued = 0;
+
+	ss->ss_waitns += wait;
+	us = wait / 1000 > 0xffffffff ? 0xffffffff : wait / 1000;
+	bucket = us == 0 ? 0 : 32 - __builtin_clz(us);
+	if (bucket >= SCHEDSTAT_BUCKETS) {
+		bucket = SCHEDSTAT_BUCKETS - 1;
+	}
+	ss->ss_hist[bucket]++;
+}
+
+unsigned
+cpu_schedstats(struct schedstat *stats, unsigned max, bool reset)
+{
+	struct cpu *c;
+	unsigned i, num;
+
+	num = cpuarray_num(&allcpus);
+	for (i=0; i<num; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		if (i < max) {
+			stats[i] = c->c_schedstat;
+			stats[i].ss_cpu = c->c_number;
+			stats[i].ss_runqueue = c->c_runqueue.tl_count;
+		}
+		if (reset) {
+			bzero(&c->c_schedstat, sizeof(c->c_schedstat));
+		}
+		spinlock_release(&c->c_runqueue_lock);
+	}
+	return num;
+}
+
+void
+cpu_printschedstats(void)
+{
+	struct schedstat *stats, *ss;
+	unsigned i, b, num, lo;
+	uint64_t avg;
+
+	num = cpuarray_num(&allcpus);
+	stats = kmalloc(num * sizeof(*stats));
+	if (stats == NULL) {
+		kprintf("cpu_printschedstats: Out of memory\n");
+		return;
+	}
+	num = cpu_schedstats(stats, num, false);
+
+	kprintf("cpu  switches    idled  enqueues  migr-in migr-out"
+		"  runq  max  avg wait\n");
+	for (i=0; i<num; i++) {
+		ss = &stats[i];
+		avg = ss->ss_switches ? ss->ss_waitns / ss->ss_switches : 0;
+		kprintf("%3u %9u %8u %9u %8u %8u %5u %4u %7lu us\n",
+			ss->ss_cpu, ss->ss_switches, ss->ss_idle,
+			ss->ss_enqueues, ss->ss_migrated_in,
+			ss->ss_migrated_out, ss->ss_runqueue,
+			ss->ss_maxrunqueue, (unsigned long)(avg / 1000));
+	}
+
+	kprintf("\nRun queue wait histogram:\n");
+	for (b=0; b<SCHEDSTAT_BUCKETS; b++) {
+		lo = b == 0 ? 0 : 1U << (b - 1);
+		kprintf("%s%7u us", b == SCHEDSTAT_BUCKETS - 1 ? ">=" : "  ",
+			lo);
+		for (i=0; i<num; i++) {
+			kprintf(" %8u", stats[i].ss_hist[b]);
+		}
+		kprintf("\n");
+	}
+	kfree(stats);
+}
+
 /*
  * Destroy a thread.
  *
@@ -282,6 +450,7 @@ thread_destroy(struct thread *thread)
 
 	/* VFS fields, cleaned up in thread_exit */
 	KASSERT(thread->t_cwd == NULL);
+	KASSERT(thread->t_fdtable == NULL);
 
 	/* VM fields, cleaned up in thread_exit */
 	KASSERT(thread->t_addrspace == NULL);
@@ -300,9 +469,98 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Thread cache.
+//
+// Each cpu keeps up to THREAD_CACHE_MAX dead threads, with their
+// stacks, for thread_fork to hand out again instead of going to
+// kmalloc for a thread and a stack every time. A cached thread has
+// been through the same cleanup as thread_destroy except for the
+// stack, which keeps a fresh guard. The cache is only touched by its
+// own cpu, with interrupts off.
+
+bool thread_caching = true;
+
+/*
+ * Put zombie Z in this cpu's cache if it has a stack and there's
+ * room. Returns false if the caller should destroy it instead.
+ */
+static
+bool
+thread_cache_put(struct thread *z)
+{
+	KASSERT(curthread->t_curspl > 0);
+
+	if (!thread_caching || z->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		return false;
+	}
+
+	/* Same checks and cleanup as thread_destroy, minus the stack */
+	KASSERT(z->t_cwd == NULL);
+	KASSERT(z->t_fdtable == NULL);
+	KASSERT(z->t_addrspace == NULL);
+	thread_checkstack(z);
+	thread_machdep_cleanup(&z->t_machdep);
+	kfree(z->t_name);
+	z->t_name = NULL;
+	z->t_wchan_name = "CACHED";
+
+	thread_checkstack_init(z);
+	threadlist_addhead(&curcpu->c_threadcache, z);
+	return true;
+}
+
+/*
+ * Get a thread with a stack for thread_fork, from this cpu's cache if
+ * possible.
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	if (thread != NULL) {
+		curcpu->c_threadcache_hits++;
+	}
+	else {
+		curcpu->c_threadcache_misses++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		thread = thread_create(name);
+		if (thread == NULL) {
+			return NULL;
+		}
+		thread->t_stack = kmalloc(STACK_SIZE);
+		if (thread->t_stack == NULL) {
+			pid_free(thread->t_pid);
+			thread_destroy(thread);
+			return NULL;
+		}
+		thread_checkstack_init(thread);
+		return thread;
+	}
+
+	if (thread_init(thread, name)) {
+		/* don't bother putting it back */
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
+	return thread;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Those that fit go in
+ * the thread cache instead.
  *
  * The list of zombies is per-cpu.
  */
@@ -315,7 +573,9 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (!thread_cache_put(z)) {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -464,11 +724,14 @@ thread_start_cpus(void)
 /*
  * Make a thread runnable.
  *
- * targetcpu might be curcpu; it might not be, too. 
+ * targetcpu might be curcpu; it might not be, too. NOW is the time to
+ * stamp it with, read by the caller before it took the run queue lock
+ * (or 0 not to count its wait).
  */
 static
 void
-thread_make_runnable(struct thread *target, bool already_have_lock)
+thread_make_runnable(struct thread *target, bool already_have_lock,
+		     uint64_t now)
 {
 	struct cpu *targetcpu;
 	bool isidle;
@@ -486,6 +749,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	isidle = targetcpu->c_isidle;
 	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_enqueued = now;
+	targetcpu->c_schedstat.ss_enqueues++;
+	if (targetcpu->c_runqueue.tl_count >
+	    targetcpu->c_schedstat.ss_maxrunqueue) {
+		targetcpu->c_schedstat.ss_maxrunqueue =
+			targetcpu->c_runqueue.tl_count;
+	}
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -514,23 +784,17 @@ int
 thread_fork(const char *name,
 	    void (*entrypoint)(void *data1, unsigned long data2),
 	    void *data1, unsigned long data2,
-	    struct thread **ret)
+	    pid_t *retpid)
 {
 	struct thread *newthread;
+	int result;
 
-	newthread = thread_create(name);
+	/* Get a thread and a stack */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
-	}
-	thread_checkstack_init(newthread);
-
 	/*
 	 * Now we clone various fields from the parent thread.
 	 */
@@ -542,6 +806,15 @@ thread_fork(const char *name,
 	/* do not clone address space -- let caller decide on that */
 
 	/* VFS fields */
+	if (curthread->t_fdtable != NULL) {
+		result = fdtable_copy(curthread->t_fdtable,
+				      &newthread->t_fdtable);
+		if (result) {
+			pid_free(newthread->t_pid);
+			thread_destroy(newthread);
+			return result;
+		}
+	}
 	if (curthread->t_cwd != NULL) {
 		VOP_INCREF(curthread->t_cwd);
 		newthread->t_cwd = curthread->t_cwd;
@@ -557,27 +830,19 @@ thread_fork(const char *name,
 	/* Set up the switchframe so entrypoint() gets called */
 	switchframe_init(newthread, entrypoint, data1, data2);
 
-	/* Lock the current cpu's run queue and make the new thread runnable */
-	thread_make_runnable(newthread, false);
-
-	for(int i=0;i<OPEN_MAX;i++)
-	{
-		newthread->filetable[i] = curthread->filetable[i];
-		if(newthread->filetable[i] != NULL){
-			newthread->filetable[i]->refcnt++;
-		}
-	}
-
 	/*
-	 * Return new thread structure if it's wanted. Note that using
-	 * the thread structure from the parent thread should be done
-	 * only with caution, because in general the child thread
-	 * might exit at any time.
+	 * Return the new thread's pid if it's wanted. This has to be
+	 * read before the thread can run: once it has, it might exit
+	 * and its structure be handed to some other thread_fork from
+	 * the thread cache.
 	 */
-	if (ret != NULL) {
-		*ret = newthread;
+	if (retpid != NULL) {
+		*retpid = newthread->t_pid;
 	}
 
+	/* Lock the current cpu's run queue and make the new thread runnable */
+	thread_make_runnable(newthread, false, sched_now());
+
 	return 0;
 }
 
@@ -595,6 +860,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	uint64_t now;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -617,6 +883,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
+	/* For the run queue statistics; see sched_now */
+	now = sched_now();
+
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
@@ -633,7 +902,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 		panic("Illegal S_RUN in thread_switch\n");
 		break;
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		thread_make_runnable(cur, true /*have lock*/, now);
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -679,15 +948,22 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
+		curcpu->c_schedstat.ss_idle++;
+	}
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
+			clock_idle_enter();
 			cpu_idle();
+			clock_idle_exit();
+			now = sched_now();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	sched_dequeued(curcpu, next, now);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -842,11 +1118,9 @@ thread_exit(void)
 		cur->t_cwd = NULL;
 	}
 
-	for(int itr = 0; itr < OPEN_MAX; itr++){
-		if(cur->filetable[itr] != NULL && cur->filetable[itr]->refcnt == 0){
-			lock_destroy(cur->filetable[itr]->lock);
-			kfree(cur->filetable[itr]);
-		}
+	if (cur->t_fdtable) {
+		fdtable_destroy(cur->t_fdtable);
+		cur->t_fdtable = NULL;
 	}
 
 	/* VM fields */
@@ -860,9 +1134,16 @@ thread_exit(void)
 		struct addrspace *as = cur->t_addrspace;
 		cur->t_addrspace = NULL;
 		as_activate(NULL);
+		if (cur->t_stackslot != 0) {
+			as_threadstack_release(as, cur->t_stackslot);
+			cur->t_stackslot = 0;
+		}
 		as_destroy(as);
 	}
 
+	/* Kernel threads never went through sys_exit; free their pid */
+	process_thread_exit(cur);
+
 	/* Check the stack guard band. */
 	thread_checkstack(cur);
 
@@ -926,7 +1207,7 @@ void
 thread_consider_migration(void)
 {
 	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
+	unsigned i, numcpus, moved = 0;
 	struct cpu *c;
 	struct threadlist victims;
 	struct thread *t;
@@ -995,6 +1276,8 @@ thread_consider_migration(void)
 
 			t->t_cpu = c;
 			threadlist_addtail(&c->c_runqueue, t);
+			c->c_schedstat.ss_migrated_in++;
+			moved++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -1015,13 +1298,12 @@ thread_consider_migration(void)
 	 * changed while we were working and we may end up with leftovers.
 	 * Don't panic; just put them back on our own run queue.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	while ((t = threadlist_remhead(&victims)) != NULL) {
+		threadlist_addtail(&curcpu->c_runqueue, t);
 	}
+	curcpu->c_schedstat.ss_migrated_out += moved;
+	spinlock_release(&curcpu->c_runqueue_lock);
 
 	KASSERT(threadlist_isempty(&victims));
 	threadlist_cleanup(&victims);
@@ -1120,7 +1402,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_make_runnable(target, false, sched_now());
 }
 
 /*
@@ -1154,7 +1436,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_make_runnable(target, false, sched_now());
 	}
 
 	threadlist_cleanup(&list);
@@ -1278,8 +1560,9 @@ interprocessor_interrupt(void)
 	spinlock_release(&curcpu->c_ipi_lock);
 }
 
+static
 int
-sys_sbrk(userptr_t arg1, int32_t* retval)
+sbrk(userptr_t arg1, int32_t* retval)
 {
 	vaddr_t size = (vaddr_t)arg1;
 
@@ -1355,3 +1638,51 @@ sys_sbrk(userptr_t arg1, int32_t* retval)
 	curthread->t_addrspace->as_hpend += size;
 	return 0;
 }
+
+int
+sys_sbrk(userptr_t arg1, int32_t* retval)
+{
+	struct addrspace *as = curthread->t_addrspace;
+	int result;
+
+	/* threads sharing the space mustn't move the break at once */
+	lock_acquire(as->as_lock);
+	result = sbrk(arg1, retval);
+	lock_release(as->as_lock);
+	return result;
+}
+
+/*
+ * Copy scheduler statistics for up to MAX cpus out to BUF; returns
+ * the number of cpus, which may be more than MAX.
+ */
+int
+sys_schedstat(userptr_t buf, unsigned max, int32_t* retval)
+{
+	struct schedstat *stats;
+	unsigned num;
+	int result;
+
+	num = cpu_count();
+	if (max > num) {
+		max = num;
+	}
+	if (max == 0) {
+		*retval = num;
+		return 0;
+	}
+
+	stats = kmalloc(max * sizeof(*stats));
+	if (stats == NULL) {
+		return ENOMEM;
+	}
+	num = cpu_schedstats(stats, max, false);
+	result = copyout(stats, buf, max * sizeof(*stats));
+	kfree(stats);
+	if (result) {
+		return result;
+	}
+
+	*retval = num;
+	return 0;
+}
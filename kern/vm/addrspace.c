@@ -34,6 +34,8 @@
 #include <synch.h>
 #include <swap.h>
 #include <addrspace.h>
+#include <current.h>
+#include <thread.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -60,9 +62,19 @@ as_create(void)
 		return NULL;
 	}
 
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		kfree(as);
+		return NULL;
+	}
+
 	as->as_segment = NULL;
 	as->as_pgtable = NULL;
 	as->as_hpstart = as->as_hpend = 0;
+	as->as_refcount = 1;
+	spinlock_init(&as->as_reflock);
+	as->as_stacksdefined = 1;
+	as->as_stacksused = 1;
 	
 	return as;
 }
@@ -136,6 +148,13 @@ as_copy(struct addrspace *old, struct addrspace **ret)
         newas->as_segment = sg_start;
 	newas->as_hpstart = old->as_hpstart;
 	newas->as_hpend = old->as_hpend;
+
+	/*
+	 * All the thread stacks get copied, but the only thread in the
+	 * new space is the one forking, on its own stack.
+	 */
+	newas->as_stacksdefined = old->as_stacksdefined;
+	newas->as_stacksused = 1 | (1U << curthread->t_stackslot);
 	
 	pg = newas->as_pgtable;
 	strt = old->as_pgtable;
@@ -171,15 +190,46 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	return 0;
 }
 
+void
+as_incref(struct addrspace *as)
+{
+	spinlock_acquire(&as->as_reflock);
+	KASSERT(as->as_refcount > 0);
+	as->as_refcount++;
+	spinlock_release(&as->as_reflock);
+}
+
+bool
+as_shared(struct addrspace *as)
+{
+	bool shared;
+
+	spinlock_acquire(&as->as_reflock);
+	shared = as->as_refcount > 1;
+	spinlock_release(&as->as_reflock);
+	return shared;
+}
+
 void
 as_destroy(struct addrspace *as)
 {
+	unsigned refs;
+
+	KASSERT(as !=NULL);
+
+	spinlock_acquire(&as->as_reflock);
+	KASSERT(as->as_refcount > 0);
+	refs = --as->as_refcount;
+	spinlock_release(&as->as_reflock);
+	if (refs > 0) {
+		/* other threads are still using it */
+		return;
+	}
+
 	/*
 	 * Clean up as needed.
 	 */
 
-	KASSERT(as !=NULL);
-
 	delete_coremap(as);
 	swap_clean(as);
 
@@ -203,9 +253,114 @@ as_destroy(struct addrspace *as)
                 kfree(sg_prev);
         }
 	
+	lock_destroy(as->as_lock);
+	spinlock_cleanup(&as->as_reflock);
 	kfree(as);
 }
 
+/* Lowest address of the stack in SLOT; its guard page is on top */
+static
+vaddr_t
+as_threadstack_base(int slot)
+{
+	return USERSTACK - AS_STACKPAGES * PAGE_SIZE
+		- slot * (AS_THREADSTACKPAGES + 1) * PAGE_SIZE;
+}
+
+/*
+ * Add page table entries for the stack in SLOT. They go on the front
+ * of the list, because sbrk expects the last entry to be the top of
+ * the heap. All of them are allocated before any goes on the list, so
+ * running out of memory leaves the page table as it was.
+ */
+static
+int
+as_define_threadstack(struct addrspace *as, int slot)
+{
+	pagetable *pg, *first, *last;
+	vaddr_t base;
+	int page;
+
+	base = as_threadstack_base(slot);
+
+	first = last = NULL;
+	for (page = 0; page < AS_THREADSTACKPAGES; page++) {
+		pg = kmalloc(sizeof(pagetable));
+		if (pg == NULL) {
+			while (first != NULL) {
+				pg = first;
+				first = (pagetable *)first->pg_next;
+				kfree(pg);
+			}
+			return ENOMEM;
+		}
+		pg->pg_vaddr = base + page * PAGE_SIZE;
+		pg->pg_paddr = 0;
+		pg->pg_inmem = true;
+		pg->pg_inswap = false;
+		pg->pg_next = (struct pagetable*)first;
+		first = pg;
+		if (last == NULL) {
+			last = pg;
+		}
+	}
+
+	/* vm_fault walks the list holding cm_lock */
+	spinlock_acquire(&cm_lock);
+	last->pg_next = (struct pagetable*)as->as_pgtable;
+	as->as_pgtable = first;
+	spinlock_release(&cm_lock);
+	return 0;
+}
+
+int
+as_threadstack(struct addrspace *as, int *slot, vaddr_t *stackptr)
+{
+	uint32_t bit;
+	int n, result;
+
+	lock_acquire(as->as_lock);
+	if (as->as_stacksused == 0xffffffff) {
+		lock_release(as->as_lock);
+		return EAGAIN;
+	}
+	n = __builtin_ctz(~as->as_stacksused);
+	bit = 1U << n;
+	if ((as->as_stacksdefined & bit) == 0) {
+		result = as_define_threadstack(as, n);
+		if (result) {
+			lock_release(as->as_lock);
+			return result;
+		}
+		as->as_stacksdefined |= bit;
+	}
+	as->as_stacksused |= bit;
+	lock_release(as->as_lock);
+
+	*slot = n;
+	*stackptr = as_threadstack_base(n) + AS_THREADSTACKPAGES * PAGE_SIZE;
+	return 0;
+}
+
+/*
+ * Only the slot goes back; its pages and page table entries stay for
+ * the next thread to use the slot. Since no mapping changes, TLB
+ * entries other cpus hold for the stack are still good and there is
+ * nothing to shoot down. If this ever starts unmapping the stack it
+ * will need a shootdown on every cpu running a thread in AS.
+ */
+void
+as_threadstack_release(struct addrspace *as, int slot)
+{
+	KASSERT(slot > 0 && slot < AS_MAXTHREADS);
+
+	lock_acquire(as->as_lock);
+	KASSERT(as->as_stacksdefined & (1U << slot));
+	KASSERT(as->as_stacksused & (1U << slot));
+	as->as_stacksused &= ~(1U << slot);
+	lock_release(as->as_lock);
+}
+
 void
 as_activate(struct addrspace *as)
 {
@@ -302,7 +457,7 @@ as_prepare_load(struct addrspace *as)
 		return 0;
 	}
 
-	as_define_region(as, USERSTACK-(12 * PAGE_SIZE), 12 * PAGE_SIZE, 0x4, 0x2, 0, true); 
+	as_define_region(as, USERSTACK - AS_STACKPAGES * PAGE_SIZE, AS_STACKPAGES * PAGE_SIZE, 0x4, 0x2, 0, true);
 
 	segment *sg = as->as_segment;
 	while(sg != NULL){
@@ -28,6 +28,7 @@
  */
 
 #include <unistd.h>
+#include <errno.h>
 #include <err.h>
 
 /*
@@ -36,27 +37,41 @@
  */
 
 
-/* Copy one file to another. */
+/*
+ * Copy the rest of FROMFD to TOFD inside the kernel, so the data never
+ * comes out to user memory. Returns 0 when done, or -1 if the kernel
+ * doesn't do copy_file_range (or not for these files) and nothing has
+ * been copied yet, in which case the caller should do it by hand.
+ */
 static
-void
-copy(const char *from, const char *to)
+int
+kcopy(int fromfd, int tofd, const char *from, const char *to)
 {
-	int fromfd;
-	int tofd;
-	char buf[1024];
-	int len, wr, wrtot;
+	int len, first = 1;
 
-	/*
-	 * Open the files, and give up if they won't open
-	 */
-	fromfd = open(from, O_RDONLY);
-	if (fromfd<0) {
-		err(1, "%s", from);
+	while ((len = copy_file_range(fromfd, NULL, tofd, NULL,
+				      64*1024, 0)) > 0) {
+		first = 0;
 	}
-	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
-	if (tofd<0) {
-		err(1, "%s", to);
+	if (len < 0) {
+		if (first && (errno == ENOSYS || errno == ESPIPE ||
+			      errno == EINVAL)) {
+			return -1;
+		}
+		err(1, "%s to %s", from, to);
 	}
+	return 0;
+}
+
+/*
+ * Copy the rest of FROMFD to TOFD the old way, through a user buffer.
+ */
+static
+void
+ucopy(int fromfd, int tofd, const char *from, const char *to)
+{
+	char buf[1024];
+	int len, wr, wrtot;
 
 	/*
 	 * As long as we get more than zero bytes, we haven't hit EOF.
@@ -84,6 +99,31 @@ copy(const char *from, const char *to)
 	if (len<0) {
 		err(1, "%s", from);
 	}
+}
+
+/* Copy one file to another. */
+static
+void
+copy(const char *from, const char *to)
+{
+	int fromfd;
+	int tofd;
+
+	/*
+	 * Open the files, and give up if they won't open
+	 */
+	fromfd = open(from, O_RDONLY);
+	if (fromfd<0) {
+		err(1, "%s", from);
+	}
+	tofd = open(to, O_WRONLY|O_CREAT|O_TRUNC);
+	if (tofd<0) {
+		err(1, "%s", to);
+	}
+
+	if (kcopy(fromfd, tofd, from, to) < 0) {
+		ucopy(fromfd, tofd, from, to);
+	}
 
 	if (close(fromfd) < 0) {
 		err(1, "%s: close", from);
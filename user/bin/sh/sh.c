@@ -65,6 +65,9 @@
 /* set to nonzero if __time syscall seems to work */
 static int timing = 0;
 
+/* set by -s: start commands with spawn() instead of fork and execv */
+static int usespawn = 0;
+
 /* array of backgrounded jobs (allows "foregrounding") */
 #define MAXBG 128
 static pid_t bgpids[MAXBG];
@@ -292,6 +295,53 @@ static struct {
 	{ NULL, NULL }
 };
 
+/*
+ * launch
+ * starts args[0] running in a new process and returns its pid, or -1
+ * (after complaining) if it couldn't be started. in spawn mode the
+ * kernel builds the new process directly, which saves copying the
+ * whole shell image just so execv can throw it away.
+ */
+static
+pid_t
+launch(char **args)
+{
+	pid_t pid;
+
+#ifndef HOST
+	if (usespawn) {
+		pid = spawn(args[0], args);
+		if (pid < 0) {
+			warn("%s", args[0]);
+		}
+		return pid;
+	}
+#endif
+
+	pid = fork();
+	switch (pid) {
+		case -1:
+			/* error */
+			warn("fork");
+			return -1;
+		case 0:
+			/* child */
+			execv(args[0], args);
+			warn("%s", args[0]);
+			/*
+			 * Use _exit() instead of exit() in the child
+			 * process to avoid calling atexit() functions,
+			 * which would cause hostcompat (if present) to
+			 * reset the tty state and mess up our input
+			 * handling.
+			 */
+			_exit(1);
+		default:
+			break;
+	}
+	return pid;
+}
+
 /*
  * docommand
  * tokenizes the command line using strtok.  if there aren't any commands,
@@ -354,26 +404,9 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
-	switch (pid) {
-		case -1:
-			/* error */
-			warn("fork");
-			return _MKWAIT_EXIT(255);
-		case 0:
-			/* child */
-			execv(args[0], args);
-			warn("%s", args[0]);
-			/*
-			 * Use _exit() instead of exit() in the child
-			 * process to avoid calling atexit() functions,
-			 * which would cause hostcompat (if present) to
-			 * reset the tty state and mess up our input
-			 * handling.
-			 */
-			_exit(1);
-		default:
-			break;
+	pid = launch(args);
+	if (pid < 0) {
+		return _MKWAIT_EXIT(255);
 	}
 
 	/* parent */
@@ -492,7 +525,8 @@ check_timing(void)
 /* 
  * main
  * if there are no arguments, run interactively, otherwise, run a program
- * from within the shell, but immediately exit.
+ * from within the shell, but immediately exit. -s launches commands
+ * with spawn() instead of fork and execv.
  */
 int
 main(int argc, char *argv[])
@@ -502,6 +536,12 @@ main(int argc, char *argv[])
 #endif
 	check_timing();
 
+	if (argc > 1 && !strcmp(argv[1], "-s")) {
+		usespawn = 1;
+		argc--;
+		argv++;
+	}
+
 	/*
 	 * Allow argc to be 0 in case we're running on a broken kernel,
 	 * or one that doesn't set argv when starting the first shell.
@@ -513,7 +553,7 @@ main(int argc, char *argv[])
 		return docommand(argv[2]);
 	}
 	else {
-		errx(1, "Usage: sh [-c command]");
+		errx(1, "Usage: sh [-s] [-c command]");
 	}
 	return 0;
 }
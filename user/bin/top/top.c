@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * top - watch the scheduler.
+ *
+ * Usage: top [-n count] [-d seconds]
+ *
+ * Every few seconds (default 2), prints for each cpu how many context
+ * switches, wakeups and migrations happened since the last report,
+ * how long the run queue is, and how long threads waited on it: the
+ * average and the 50th and 99th percentiles, from the kernel's wait
+ * histogram. Runs until interrupted, or COUNT reports.
+ */
+
+#include <sys/schedstat.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <err.h>
+
+#define MAXCPUS		32
+
+static struct schedstat prev[MAXCPUS], cur[MAXCPUS];
+
+/*
+ * Upper bound, in microseconds, of the histogram bucket holding the
+ * PCT'th percentile of the waits in HIST.
+ */
+static
+unsigned
+percentile(const unsigned *hist, unsigned total, unsigned pct)
+{
+	unsigned b, seen = 0, want;
+
+	if (total == 0) {
+		return 0;
+	}
+	want = (total * pct + 99) / 100;
+	for (b=0; b<SCHEDSTAT_BUCKETS-1; b++) {
+		seen += hist[b];
+		if (seen >= want) {
+			break;
+		}
+	}
+	return 1U << b;
+}
+
+static
+void
+report(unsigned ncpus, unsigned secs)
+{
+	struct schedstat *c, *p;
+	unsigned hist[SCHEDSTAT_BUCKETS];
+	unsigned i, b, switches, waited;
+	unsigned long long waitns;
+
+	printf("cpu  switch/s  idle/s  wakeup/s  in  out  runq  max"
+	       "   avg    p50    p99 (us)\n");
+	for (i=0; i<ncpus; i++) {
+		c = &cur[i];
+		p = &prev[i];
+		switches = c->ss_switches - p->ss_switches;
+		waited = 0;
+		for (b=0; b<SCHEDSTAT_BUCKETS; b++) {
+			hist[b] = c->ss_hist[b] - p->ss_hist[b];
+			waited += hist[b];
+		}
+		waitns = c->ss_waitns - p->ss_waitns;
+		printf("%3u %9u %7u %9u %3u %4u %5u %4u %6llu %6u %6u\n",
+		       c->ss_cpu, switches / secs,
+		       (c->ss_idle - p->ss_idle) / secs,
+		       (c->ss_enqueues - p->ss_enqueues) / secs,
+		       c->ss_migrated_in - p->ss_migrated_in,
+		       c->ss_migrated_out - p->ss_migrated_out,
+		       c->ss_runqueue, c->ss_maxrunqueue,
+		       waited ? waitns / waited / 1000 : 0ULL,
+		       percentile(hist, waited, 50),
+		       percentile(hist, waited, 99));
+	}
+	printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct timespec ts;
+	int count = -1;
+	unsigned delay = 2;
+	unsigned ncpus;
+	int i, n;
+
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			count = atoi(argv[++i]);
+		}
+		else if (!strcmp(argv[i], "-d") && i+1 < argc) {
+			delay = atoi(argv[++i]);
+		}
+		else {
+			errx(1, "Usage: top [-n count] [-d seconds]");
+		}
+	}
+	if (delay < 1) {
+		delay = 1;
+	}
+
+	n = schedstat(prev, MAXCPUS);
+	if (n < 0) {
+		err(1, "schedstat");
+	}
+	ncpus = n > MAXCPUS ? MAXCPUS : n;
+
+	while (count != 0) {
+		ts.tv_sec = delay;
+		ts.tv_nsec = 0;
+		nanosleep(&ts, NULL);
+
+		if (schedstat(cur, MAXCPUS) < 0) {
+			err(1, "schedstat");
+		}
+		report(ncpus, delay);
+		memcpy(prev, cur, sizeof(cur));
+		if (count > 0) {
+			count--;
+		}
+	}
+	return 0;
+}
@@ -38,6 +38,7 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
 #include <kern/ioctl.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
@@ -53,6 +54,9 @@
  * header files, as follows:
  *
  *     stat:     sys/stat.h
+ *     readv:    sys/uio.h
+ *     writev:   sys/uio.h
+ *     schedstat: sys/schedstat.h
  *     fstat:    sys/stat.h
  *     lstat:    sys/stat.h
  *     mkdir:    sys/stat.h
@@ -127,6 +131,8 @@ int waitpid(pid_t pid, int *returncode, int flags);
 int open(const char *filename, int flags, ...);
 int read(int filehandle, void *buf, size_t size);
 int write(int filehandle, const void *buf, size_t size);
+int pread(int filehandle, void *buf, size_t size, off_t pos);
+int pwrite(int filehandle, const void *buf, size_t size, off_t pos);
 int close(int filehandle);
 int reboot(int code);
 int sync(void);
@@ -153,7 +159,15 @@ int readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
 int __getcwd(char *buf, size_t buflen);
+int futex(int *addr, int op, int val);
+pid_t spawn(const char *prog, char *const *args);
+int copy_file_range(int infd, off_t *inpos, int outfd, off_t *outpos,
+		    size_t len, unsigned flags);
+pid_t __threadfork(void (*start)(void *, void *), void *func, void *arg);
+__DEAD void threadexit(void *value);
+int threadjoin(pid_t tid, void **value);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
@@ -163,5 +177,7 @@ int __getcwd(char *buf, size_t buflen);
 
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+pid_t threadcreate(void *(*func)(void *), void *arg); /* __threadfork */
+pid_t threadfork(void (*func)(void));			/* __threadfork */
 
 #endif /* _UNISTD_H_ */
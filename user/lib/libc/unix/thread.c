@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Threads on top of __threadfork.
+ *
+ * The kernel starts a new thread in one of the start routines here,
+ * on a stack of its own, with the function to run and its argument.
+ * A thread that returns from its function exits as if it had called
+ * threadexit with the return value.
+ */
+
+#include <unistd.h>
+
+static
+void
+threadstart(void *func, void *arg)
+{
+	void *(*f)(void *) = func;
+
+	threadexit(f(arg));
+}
+
+static
+void
+threadstart_noarg(void *func, void *arg)
+{
+	void (*f)(void) = func;
+
+	(void)arg;
+	f();
+	threadexit(NULL);
+}
+
+/*
+ * Start a thread running FUNC(ARG) in this process. Returns its id,
+ * for threadjoin, or -1 with errno set.
+ */
+pid_t
+threadcreate(void *(*func)(void *), void *arg)
+{
+	return __threadfork(threadstart, (void *)func, arg);
+}
+
+/*
+ * Start a thread running FUNC(), for programs that don't care to
+ * join it.
+ */
+pid_t
+threadfork(void (*func)(void))
+{
+	return __threadfork(threadstart_noarg, (void *)func, NULL);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User-level mutex and condition variable on top of futex().
+ *
+ * The mutex is the usual three-state futex mutex: 0 means free, 1
+ * means held with nobody waiting, 2 means held and someone may be
+ * asleep in the kernel. Only the 2 state costs a system call on
+ * unlock.
+ */
+
+#include <unistd.h>
+#include <usynch.h>
+
+/* More waiters than there can possibly be. */
+#define UCOND_WAKEALL	0x7fffffff
+
+/*
+ * Atomic compare-and-swap using LL/SC: if *p == old, set it to new.
+ * Returns the value that was in *p. Retries if the SC fails.
+ */
+static
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int x, y;
+
+	do {
+		y = 0;
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set noreorder;"	/* we fill the delay slot */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *p */
+			"bne %0, %3, 1f;"	/*   if (x != old) give up */
+			"nop;"
+			"move %1, %4;"		/*   y = new */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			"1:;"
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "+r" (y)
+			: "r" (p), "r" (old), "r" (new)
+			: "memory");
+	} while (x == old && y == 0);
+
+	return x;
+}
+
+/*
+ * Atomically store new in *p and return the old value.
+ */
+static
+int
+atomic_swap(volatile int *p, int new)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, new) != old);
+	return old;
+}
+
+/*
+ * Atomically add delta to *p and return the old value.
+ */
+static
+int
+atomic_add(volatile int *p, int delta)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, old + delta) != old);
+	return old;
+}
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	return atomic_cas(&m->um_state, 0, 1) == 0 ? 0 : -1;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		/* uncontended */
+		return;
+	}
+
+	/*
+	 * Mark the mutex contended and sleep until it is free. Whoever
+	 * gets it this way leaves it at 2, since there may be other
+	 * sleepers behind us.
+	 */
+	if (c != 2) {
+		c = atomic_swap(&m->um_state, 2);
+	}
+	while (c != 0) {
+		futex((int *)&m->um_state, FUTEX_WAIT, 2);
+		c = atomic_swap(&m->um_state, 2);
+	}
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	if (atomic_add(&m->um_state, -1) != 1) {
+		/* was 2: somebody may be asleep */
+		m->um_state = 0;
+		futex((int *)&m->um_state, FUTEX_WAKE, 1);
+	}
+}
+
+void
+ucond_init(struct ucond *c)
+{
+	c->uc_seq = 0;
+}
+
+void
+ucond_wait(struct ucond *c, struct umutex *m)
+{
+	int seq;
+
+	/*
+	 * If a signal comes in between the unlock and the FUTEX_WAIT the
+	 * sequence number will have moved and the wait returns at once.
+	 */
+	seq = c->uc_seq;
+	umutex_unlock(m);
+	futex((int *)&c->uc_seq, FUTEX_WAIT, seq);
+
+	/* Relock as contended; other waiters may have been woken too. */
+	while (atomic_swap(&m->um_state, 2) != 0) {
+		futex((int *)&m->um_state, FUTEX_WAIT, 2);
+	}
+}
+
+void
+ucond_signal(struct ucond *c)
+{
+	atomic_add(&c->uc_seq, 1);
+	futex((int *)&c->uc_seq, FUTEX_WAKE, 1);
+}
+
+void
+ucond_broadcast(struct ucond *c)
+{
+	atomic_add(&c->uc_seq, 1);
+	futex((int *)&c->uc_seq, FUTEX_WAKE, UCOND_WAKEALL);
+}
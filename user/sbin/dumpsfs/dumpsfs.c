@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
 #include <limits.h>
@@ -56,6 +57,57 @@
 
 #include "disk.h"
 
+/* Format of the volume, and its block size */
+static int oldformat;
+static uint32_t blocksize;
+
+/* An inode's block, in either format */
+union inodeblock {
+	struct sfs_inode old;
+	struct sfs_inode2 cur;
+	char data[SFS_MAXBLOCKSIZE];
+};
+
+/*
+ * Say where the journal is, and whether it's empty; if it isn't, the
+ * volume wasn't unmounted and mounting it will replay what's there.
+ */
+static
+void
+dumpjournal(uint32_t jstart, uint32_t jblocks)
+{
+	char buf[SFS_MAXBLOCKSIZE];
+	struct sfs_jhdr jh;
+	uint32_t seq;
+
+	if (jblocks == 0) {
+		printf("No journal\n");
+		return;
+	}
+	printf("Journal: %u blocks at block %u\n", jblocks, jstart);
+
+	diskread(buf, jstart);
+	memcpy(&jh, buf, sizeof(jh));
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC ||
+	    SWAPL(jh.jh_type) != SFS_JTYPE_HEADER) {
+		printf("    Bad journal header\n");
+		return;
+	}
+	seq = SWAPL(jh.jh_seq);
+
+	diskread(buf, jstart+1);
+	memcpy(&jh, buf, sizeof(jh));
+	if (SWAPL(jh.jh_magic) == SFS_JMAGIC &&
+	    SWAPL(jh.jh_type) == SFS_JTYPE_DESC &&
+	    SWAPL(jh.jh_seq) == seq) {
+		printf("    Not empty: transaction %u on to be replayed\n",
+		       seq);
+	}
+	else {
+		printf("    Empty; next transaction %u\n", seq);
+	}
+}
+
 static
 uint32_t
 dumpsb(void)
@@ -69,6 +121,30 @@ dumpsb(void)
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
 
+	switch (SWAPL(sp.sp_version)) {
+	    case SFS_OLDVERSION:
+		oldformat = 1;
+		blocksize = SFS_BLOCKSIZE;
+		break;
+	    case SFS_VERSION:
+		blocksize = SWAPL(sp.sp_blocksize);
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    blocksize % SFS_BLOCKSIZE != 0) {
+			errx(1, "Bad block size %u", blocksize);
+		}
+		break;
+	    default:
+		errx(1, "Unknown format version %u", SWAPL(sp.sp_version));
+	}
+	printf("Format version %u, %u-byte blocks\n", SWAPL(sp.sp_version),
+	       blocksize);
+	disksetblocksize(blocksize);
+
+	if (!oldformat) {
+		dumpjournal(SWAPL(sp.sp_jstart), SWAPL(sp.sp_jblocks));
+	}
+
 	return SWAPL(sp.sp_nblocks);
 }
 
@@ -76,8 +152,8 @@ static
 void
 dodirblock(uint32_t block)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
 	int i;
 
 	diskread(&sds, block);
@@ -95,40 +171,170 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Current format: the disk block holding block FILEBLOCK of the file
+ * with inode SFI, or 0.
+ */
 static
-void
-dumpdir(uint32_t ino)
+uint32_t
+bmap2(const struct sfs_inode2 *sfi, uint32_t fileblock)
 {
-	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
-	int nentries, i;
-	uint32_t block, nblocks=0;
+	uint32_t ib[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	uint32_t perid = SFS_BSDBPERIDB(blocksize);
+	uint32_t block, idoff, first, len;
+	int i;
 
-	diskread(&sfi, ino);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		first = SWAPL(sfi->sfi_extents[i].sfe_fileblock);
+		len = SWAPL(sfi->sfi_extents[i].sfe_len);
+		if (len > 0 && fileblock >= first && fileblock - first < len) {
+			return SWAPL(sfi->sfi_extents[i].sfe_diskblock) +
+				(fileblock - first);
+		}
+	}
 
-	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
-	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
-		warnx("Warning: dir size is not a multiple of dir entry size");
+	if (fileblock < perid) {
+		block = SWAPL(sfi->sfi_indirect);
+		idoff = fileblock;
 	}
-	printf("Directory %u: %d entries\n", ino, nentries);
+	else {
+		fileblock -= perid;
+		if (fileblock / perid >= perid) {
+			return 0;
+		}
+		block = SWAPL(sfi->sfi_dindirect);
+		if (block == 0) {
+			return 0;
+		}
+		diskread(&ib, block);
+		block = SWAPL(ib[fileblock / perid]);
+		idoff = fileblock % perid;
+	}
+	if (block == 0) {
+		return 0;
+	}
+	diskread(&ib, block);
+	return SWAPL(ib[idoff]);
+}
 
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = SWAPL(sfi.sfi_direct[i]);
+/*
+ * Most blocks getfileblocks can return for a file with inode SFI.
+ */
+static
+uint32_t
+maxfileblocks(const union inodeblock *sfi)
+{
+	uint32_t perid = SFS_BSDBPERIDB(blocksize);
+
+	if (oldformat) {
+		return SFS_NDIRECT + 1 + SFS_DBPERIDB;
+	}
+	return (SWAPL(sfi->cur.sfi_size) + blocksize - 1) / blocksize +
+		2 + perid;
+}
+
+/*
+ * Get the disk blocks of the file with inode SFI, in the order they're
+ * used, into BLOCKS. If WITHMAP is set this includes its indirect
+ * blocks; in the current format they come after the data blocks.
+ */
+static
+uint32_t
+getfileblocks(const union inodeblock *sfi, uint32_t *blocks, int withmap)
+{
+	uint32_t ib[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
+	uint32_t perid = SFS_BSDBPERIDB(blocksize);
+	uint32_t block, nfileblocks, n=0;
+	uint32_t i;
+
+	if (oldformat) {
+		for (i=0; i<SFS_NDIRECT; i++) {
+			block = SWAPL(sfi->old.sfi_direct[i]);
+			if (block) {
+				blocks[n++] = block;
+			}
+		}
+		block = SWAPL(sfi->old.sfi_indirect);
 		if (block) {
-			dodirblock(block);
-			nblocks++;
+			if (withmap) {
+				blocks[n++] = block;
+			}
+			diskread(&ib, block);
+			for (i=0; i<SFS_DBPERIDB; i++) {
+				block = SWAPL(ib[i]);
+				if (block) {
+					blocks[n++] = block;
+				}
+			}
 		}
+		return n;
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
+
+	nfileblocks = (SWAPL(sfi->cur.sfi_size) + blocksize - 1) / blocksize;
+	for (i=0; i<nfileblocks; i++) {
+		block = bmap2(&sfi->cur, i);
+		if (block) {
+			blocks[n++] = block;
+		}
+	}
+	if (!withmap) {
+		return n;
+	}
+	block = SWAPL(sfi->cur.sfi_indirect);
+	if (block) {
+		blocks[n++] = block;
+	}
+	block = SWAPL(sfi->cur.sfi_dindirect);
+	if (block) {
+		blocks[n++] = block;
+		diskread(&ib, block);
+		for (i=0; i<perid; i++) {
 			block = SWAPL(ib[i]);
 			if (block) {
-				dodirblock(block);
-				nblocks++;
+				blocks[n++] = block;
 			}
 		}
 	}
+	return n;
+}
+
+/*
+ * Same, with the array allocated.
+ */
+static
+uint32_t
+getfileblocks_alloc(const union inodeblock *sfi, uint32_t **blocks,
+		    int withmap)
+{
+	*blocks = malloc(maxfileblocks(sfi) * sizeof(uint32_t));
+	if (*blocks == NULL) {
+		errx(1, "Out of memory");
+	}
+	return getfileblocks(sfi, *blocks, withmap);
+}
+
+static
+void
+dumpdir(uint32_t ino)
+{
+	union inodeblock sfi;
+	uint32_t *blocks;
+	int nentries;
+	uint32_t i, nblocks;
+
+	diskread(&sfi, ino);
+
+	nentries = SWAPL(sfi.old.sfi_size) / sizeof(struct sfs_dir);
+	if (SWAPL(sfi.old.sfi_size) % sizeof(struct sfs_dir) != 0) {
+		warnx("Warning: dir size is not a multiple of dir entry size");
+	}
+	printf("Directory %u: %d entries\n", ino, nentries);
+
+	nblocks = getfileblocks_alloc(&sfi, &blocks, 0);
+	for (i=0; i<nblocks; i++) {
+		dodirblock(blocks[i]);
+	}
+	free(blocks);
 	printf("    %u blocks in directory\n", nblocks);
 }
 
@@ -136,15 +342,17 @@ static
 void
 dumpbits(uint32_t fsblocks)
 {
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nblocks = SFS_BSBITBLOCKS(fsblocks, blocksize);
 	uint32_t i, j;
-	char data[SFS_BLOCKSIZE];
+	char data[SFS_MAXBLOCKSIZE];
 
-	printf("Freemap: %u blocks (%u %u %u)\n", nblocks, SFS_BITMAPSIZE(fsblocks), fsblocks, SFS_BLOCKBITS);
+	printf("Freemap: %u blocks (%u %u %u)\n", nblocks,
+	       SFS_BSBITMAPSIZE(fsblocks, blocksize), fsblocks,
+	       SFS_BSBLOCKBITS(blocksize));
 
 	for (i=0; i<nblocks; i++) {
 		diskread(data, SFS_MAP_LOCATION+i);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			printf("%02x", (unsigned char)data[j]);
 			if (j%32==31) {
 				printf("\n");
@@ -154,23 +362,121 @@ dumpbits(uint32_t fsblocks)
 	printf("\n");
 }
 
+/*
+ * Fragmentation report.
+ *
+ * For each file in the root directory, count the extents (runs of
+ * consecutive disk blocks) its blocks, including the indirect blocks,
+ * fall into, in the order they're used. Then count the runs of free
+ * space in the freemap.
+ */
+
+static
+uint32_t
+countextents(const uint32_t *blocks, uint32_t n)
+{
+	uint32_t i, extents;
+
+	extents = n > 0 ? 1 : 0;
+	for (i=1; i<n; i++) {
+		if (blocks[i] != blocks[i-1] + 1) {
+			extents++;
+		}
+	}
+	return extents;
+}
+
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	union inodeblock dir, sfi;
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	uint32_t *dirblocks, *blocks;
+	uint32_t ndirblocks, n, i, j, ino, extents, groupbits;
+	uint32_t nfiles=0, totblocks=0, totextents=0;
+	uint32_t freeruns=0, longest=0, run=0, nfree=0;
+	unsigned char data[SFS_MAXBLOCKSIZE];
+
+	printf("Fragmentation:\n");
+
+	diskread(&dir, SFS_ROOT_LOCATION);
+	ndirblocks = getfileblocks_alloc(&dir, &dirblocks, 0);
+	for (i=0; i<ndirblocks; i++) {
+		diskread(&sds, dirblocks[i]);
+		for (j=0; j<blocksize/sizeof(struct sfs_dir); j++) {
+			ino = SWAPL(sds[j].sfd_ino);
+			if (ino == SFS_NOINO) {
+				continue;
+			}
+			sds[j].sfd_name[SFS_NAMELEN-1] = 0;
+			diskread(&sfi, ino);
+			n = getfileblocks_alloc(&sfi, &blocks, 1);
+			extents = countextents(blocks, n);
+			free(blocks);
+			printf("    %-30s %5u blocks %5u extents\n",
+			       sds[j].sfd_name, n, extents);
+			nfiles++;
+			totblocks += n;
+			totextents += extents;
+		}
+	}
+	free(dirblocks);
+	if (totextents > 0) {
+		printf("    %u files, %u blocks, %u extents "
+		       "(%u.%02u blocks/extent)\n", nfiles, totblocks,
+		       totextents, totblocks / totextents,
+		       (totblocks % totextents) * 100 / totextents);
+	}
+
+	groupbits = SFS_BSBLOCKBITS(blocksize);
+	for (i=0; i<fsblocks; i++) {
+		if (i % groupbits == 0) {
+			diskread(data, SFS_MAP_LOCATION + i/groupbits);
+		}
+		j = i % groupbits;
+		if (data[j/CHAR_BIT] & (1 << (j % CHAR_BIT))) {
+			run = 0;
+			continue;
+		}
+		nfree++;
+		if (run++ == 0) {
+			freeruns++;
+		}
+		if (run > longest) {
+			longest = run;
+		}
+	}
+	printf("    %u free blocks in %u runs, longest %u\n",
+	       nfree, freeruns, longest);
+}
+
 int
 main(int argc, char **argv)
 {
 	uint32_t nblocks;
+	int fragonly = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	if (argc==3 && !strcmp(argv[1], "-f")) {
+		fragonly = 1;
+		argv++;
+		argc--;
+	}
 	if (argc!=2) {
-		errx(1, "Usage: dumpsfs device/diskfile");
+		errx(1, "Usage: dumpsfs [-f] device/diskfile");
 	}
 
 	opendisk(argv[1]);
 	nblocks = dumpsb();
-	dumpbits(nblocks);
-	dumpdir(SFS_ROOT_LOCATION);
+	if (!fragonly) {
+		dumpbits(nblocks);
+		dumpdir(SFS_ROOT_LOCATION);
+	}
+	dumpfrag(nblocks);
 
 	closedisk();
 
@@ -41,14 +41,15 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nsectors;
+static uint32_t blocksize = SECTORSIZE;
 
 void
 opendisk(const char *path)
@@ -64,10 +65,10 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nsectors = statbuf.st_size / SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
+	nsectors--;
 
 	{
 		char buf[64];
@@ -94,14 +95,42 @@ uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return blocksize;
+}
+
+/*
+ * Read and write in blocks of BSIZE bytes (a multiple of the sector
+ * size) from now on, instead of in sectors.
+ */
+void
+disksetblocksize(uint32_t bsize)
+{
+	assert(fd>=0);
+	assert(bsize >= SECTORSIZE && bsize % SECTORSIZE == 0);
+	blocksize = bsize;
 }
 
 uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nsectors / (blocksize / SECTORSIZE);
+}
+
+/*
+ * Where block BLOCK starts in the disk file.
+ */
+static
+off_t
+diskoffset(uint32_t block)
+{
+	off_t pos = (off_t)block * blocksize;
+
+#ifdef HOST
+	// skip over disk file header
+	pos += SECTORSIZE;
+#endif
+	return pos;
 }
 
 void
@@ -113,17 +142,12 @@ diskwrite(const void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, diskoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = write(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -146,17 +170,12 @@ diskread(void *data, uint32_t block)
 
 	assert(fd>=0);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, diskoffset(block), SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
+	while (tot < blocksize) {
+		len = read(fd, cdata + tot, blocksize - tot);
 		if (len < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
@@ -30,6 +30,7 @@
 void opendisk(const char *path);
 
 uint32_t diskblocksize(void);
+void disksetblocksize(uint32_t bsize);
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
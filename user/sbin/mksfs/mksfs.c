@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <limits.h>
 #include <err.h>
@@ -57,12 +58,27 @@
 
 #define MAXBITBLOCKS 32
 
+/* Format being made, and its block size */
+static uint32_t version = SFS_VERSION;
+static uint32_t blocksize = SFS_MAXBLOCKSIZE;
+
+/* Journal, current format only: where, and how many blocks (0 if none) */
+static uint32_t jstart;
+static uint32_t jblocks;
+
+/* Largest journal picked by default */
+#define MAXDEFJBLOCKS 1024
+
+/* One block's worth of data, for the blocks that aren't all used */
+static char blockbuf[SFS_MAXBLOCKSIZE];
+
 static
 void
 check(void)
 {
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_inode2)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 }
 
@@ -81,8 +97,16 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_version = SWAPL(version);
+	if (version != SFS_OLDVERSION) {
+		sp.sp_blocksize = SWAPL(blocksize);
+		sp.sp_jstart = SWAPL(jstart);
+		sp.sp_jblocks = SWAPL(jblocks);
+	}
 
-	diskwrite(&sp, SFS_SB_LOCATION);
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, &sp, sizeof(sp));
+	diskwrite(blockbuf, SFS_SB_LOCATION);
 }
 
 static
@@ -90,17 +114,33 @@ void
 writerootdir(void)
 {
 	struct sfs_inode sfi;
+	struct sfs_inode2 sfi2;
+
+	bzero(blockbuf, blocksize);
+
+	if (version == SFS_OLDVERSION) {
+		bzero((void *)&sfi, sizeof(sfi));
 
-	bzero((void *)&sfi, sizeof(sfi));
+		sfi.sfi_size = SWAPL(0);
+		sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
+		sfi.sfi_linkcount = SWAPS(1);
 
-	sfi.sfi_size = SWAPL(0);
-	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
-	sfi.sfi_linkcount = SWAPS(1);
+		memcpy(blockbuf, &sfi, sizeof(sfi));
+	}
+	else {
+		bzero((void *)&sfi2, sizeof(sfi2));
+
+		sfi2.sfi_size = SWAPL(0);
+		sfi2.sfi_type = SWAPS(SFS_TYPE_DIR);
+		sfi2.sfi_linkcount = SWAPS(1);
+
+		memcpy(blockbuf, &sfi2, sizeof(sfi2));
+	}
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	diskwrite(blockbuf, SFS_ROOT_LOCATION);
 }
 
-static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
+static char bitbuf[MAXBITBLOCKS*SFS_MAXBLOCKSIZE];
 
 static
 void
@@ -118,8 +158,8 @@ void
 writebitmap(uint32_t fsblocks)
 {
 
-	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nbits = SFS_BSBITMAPSIZE(fsblocks, blocksize);
+	uint32_t nblocks = SFS_BSBITBLOCKS(fsblocks, blocksize);
 	char *ptr;
 	uint32_t i;
 
@@ -133,28 +173,143 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(jstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
 
 	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
+		ptr = bitbuf + i*blocksize;
 		diskwrite(ptr, SFS_MAP_LOCATION+i);
 	}
 }
 
+/*
+ * Write an empty journal: a header saying replay starts with
+ * transaction 1, and a zeroed block where it would go.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jhdr jh;
+
+	if (jblocks == 0) {
+		return;
+	}
+
+	bzero(&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC);
+	jh.jh_type = SWAPL(SFS_JTYPE_HEADER);
+	jh.jh_seq = SWAPL(1);
+
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, &jh, sizeof(jh));
+	diskwrite(blockbuf, jstart);
+
+	bzero(blockbuf, blocksize);
+	diskwrite(blockbuf, jstart+1);
+}
+
+/*
+ * Place the journal right after the freemap. Unless JREQ (-j) says
+ * otherwise, make it a sixteenth of the volume, up to MAXDEFJBLOCKS,
+ * and leave it out if that's too small.
+ */
+static
+void
+setjournal(uint32_t fsblocks, int jreq)
+{
+	uint32_t bitblocks, minsize;
+
+	if (version == SFS_OLDVERSION) {
+		if (jreq > 0) {
+			errx(1, "The original format has no journal");
+		}
+		return;
+	}
+
+	bitblocks = SFS_BSBITBLOCKS(fsblocks, blocksize);
+	minsize = SFS_JMINSIZE(bitblocks);
+	jstart = SFS_MAP_LOCATION + bitblocks;
+
+	if (jreq < 0) {
+		jblocks = fsblocks / 16;
+		if (jblocks > MAXDEFJBLOCKS) {
+			jblocks = MAXDEFJBLOCKS;
+		}
+		if (jblocks < minsize) {
+			jblocks = 0;
+		}
+	}
+	else {
+		jblocks = jreq;
+		if (jblocks > 0 && jblocks < minsize) {
+			errx(1, "Journal must be at least %u blocks", minsize);
+		}
+	}
+
+	if (jblocks == 0) {
+		jstart = 0;
+	}
+	else if (jstart > fsblocks || jblocks > (fsblocks - jstart) / 2) {
+		errx(1, "Journal of %u blocks too big for the volume",
+		     jblocks);
+	}
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-o | -b blocksize] [-j jblocks] "
+	     "device/diskfile volume-name");
+}
+
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
+	int jreq = -1;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -o: original format; -b: block size for the current format;
+	 * -j: journal size in blocks, 0 for none
+	 */
+	if (argc>=4 && !strcmp(argv[1], "-o")) {
+		version = SFS_OLDVERSION;
+		blocksize = SFS_BLOCKSIZE;
+		argv++;
+		argc--;
+	}
+	else if (argc>=5 && !strcmp(argv[1], "-b")) {
+		blocksize = atoi(argv[2]);
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			errx(1, "Block size must be a power of 2 from "
+			     "%u to %u", SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
+		}
+		argv += 2;
+		argc -= 2;
+	}
+	if (argc==5 && !strcmp(argv[1], "-j")) {
+		jreq = atoi(argv[2]);
+		if (jreq < 0) {
+			usage();
+		}
+		argv += 2;
+		argc -= 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
 	}
 
 	check();
@@ -177,17 +332,20 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
+	if (sectorsize!=SFS_BLOCKSIZE) {
 		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+		     sectorsize, SFS_BLOCKSIZE);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
+	setjournal(size, jreq);
 
 	writesuper(volname, size);
 	writerootdir();
 	writebitmap(size);
+	writejournal();
 
 	closedisk();
 
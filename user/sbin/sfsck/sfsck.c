@@ -66,6 +66,16 @@
 
 static int badness=0;
 
+/* Format of the volume, its block size, and block numbers per block */
+static int oldformat;
+static uint32_t blocksize, dbperidb;
+
+/* An inode, in either format; size, type, and link count are shared */
+union sfsck_inode {
+	struct sfs_inode old;
+	struct sfs_inode2 cur;
+};
+
 static
 void
 setbadness(int code)
@@ -83,18 +93,46 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_version = SWAPL(sp->sp_version);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
 }
 
 static
 void
-swapinode(struct sfs_inode *sfi)
+swapinode2(struct sfs_inode2 *sfi)
 {
 	int i;
 
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sfi->sfi_extents[i].sfe_fileblock =
+			SWAPL(sfi->sfi_extents[i].sfe_fileblock);
+		sfi->sfi_extents[i].sfe_diskblock =
+			SWAPL(sfi->sfi_extents[i].sfe_diskblock);
+		sfi->sfi_extents[i].sfe_len =
+			SWAPL(sfi->sfi_extents[i].sfe_len);
+	}
+	sfi->sfi_indirect = SWAPL(sfi->sfi_indirect);
+	sfi->sfi_dindirect = SWAPL(sfi->sfi_dindirect);
+}
+
+static
+void
+swapinode(union sfsck_inode *usfi)
+{
+	struct sfs_inode *sfi = &usfi->old;
+	int i;
+
 	sfi->sfi_size = SWAPL(sfi->sfi_size);
 	sfi->sfi_type = SWAPS(sfi->sfi_type);
 	sfi->sfi_linkcount = SWAPS(sfi->sfi_linkcount);
 
+	if (!oldformat) {
+		swapinode2(&usfi->cur);
+		return;
+	}
+
 	for (i=0; i<SFS_NDIRECT; i++) {
 		sfi->sfi_direct[i] = SWAPL(sfi->sfi_direct[i]);
 	}
@@ -139,8 +177,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<dbperidb; i++) {
 		entries[i] = SWAPL(entries[i]);
 	}
 }
@@ -169,9 +207,37 @@ domalloc(size_t len)
 
 ////////////////////////////////////////////////////////////
 
+/* Space for reading and writing whole blocks */
+static char blockbuf[SFS_MAXBLOCKSIZE];
+
+static
+void
+readinode(uint32_t ino, union sfsck_inode *sfi)
+{
+	diskread(blockbuf, ino);
+	memcpy(sfi, blockbuf, sizeof(*sfi));
+	swapinode(sfi);
+}
+
+/* the rest of an inode's block is always zero */
+static
+void
+writeinode(uint32_t ino, const union sfsck_inode *sfi)
+{
+	union sfsck_inode tmp = *sfi;
+
+	swapinode(&tmp);
+	bzero(blockbuf, blocksize);
+	memcpy(blockbuf, &tmp, sizeof(tmp));
+	diskwrite(blockbuf, ino);
+}
+
+////////////////////////////////////////////////////////////
+
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block used by the journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -194,7 +260,7 @@ static
 void
 bitmap_init(uint32_t bitblocks)
 {
-	size_t i, mapsize = bitblocks * SFS_BLOCKSIZE;
+	size_t i, mapsize = bitblocks * blocksize;
 	bitmapdata = domalloc(mapsize * sizeof(uint8_t));
 	tofreedata = domalloc(mapsize * sizeof(uint8_t));
 	for (i=0; i<mapsize; i++) {
@@ -210,6 +276,7 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
 		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
@@ -292,7 +359,8 @@ reportbits(uint32_t bitblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = bitblock*SFS_BLOCKBITS + byte*CHAR_BIT + y;
+			blocknum = bitblock*SFS_BSBLOCKBITS(blocksize) +
+				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in bitmap",
 			      (unsigned long) blocknum, what);
 		}
@@ -303,18 +371,18 @@ static
 void
 check_bitmap(void)
 {
-	uint8_t bits[SFS_BLOCKSIZE], *found, *tofree, tmp;
+	uint8_t bits[SFS_MAXBLOCKSIZE], *found, *tofree, tmp;
 	uint32_t alloccount=0, freecount=0, i, j;
 	int bchanged;
 
 	for (i=0; i<bitblocks; i++) {
 		diskread(bits, SFS_MAP_LOCATION+i);
 		swapbits(bits);
-		found = bitmapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
+		found = bitmapdata + i*blocksize;
+		tofree = tofreedata + i*blocksize;
 		bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			/* we shouldn't have blocks marked both ways */
 			assert((found[j] & tofree[j])==0);
 
@@ -449,7 +517,7 @@ static
 void
 adjust_filelinks(void)
 {
-	struct sfs_inode sfi;
+	union sfsck_inode sfi;
 	int i;
 
 	for (i=0; i<ninodes; i++) {
@@ -457,18 +525,16 @@ adjust_filelinks(void)
 			/* directory */
 			continue;
 		}
-		diskread(&sfi, inodes[i].ino);
-		swapinode(&sfi);
-		assert(sfi.sfi_type == SFS_TYPE_FILE);
-		if (sfi.sfi_linkcount != inodes[i].linkcount) {
+		readinode(inodes[i].ino, &sfi);
+		assert(sfi.old.sfi_type == SFS_TYPE_FILE);
+		if (sfi.old.sfi_linkcount != inodes[i].linkcount) {
 			warnx("File %lu link count %lu should be %lu (fixed)",
 			      (unsigned long) inodes[i].ino,
-			      (unsigned long) sfi.sfi_linkcount,
+			      (unsigned long) sfi.old.sfi_linkcount,
 			      (unsigned long) inodes[i].linkcount);
-			sfi.sfi_linkcount = inodes[i].linkcount;
+			sfi.old.sfi_linkcount = inodes[i].linkcount;
 			setbadness(EXIT_RECOV);
-			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
+			writeinode(inodes[i].ino, &sfi);
 		}
 		count_files++;
 	}
@@ -508,6 +574,43 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Check that the journal, if any, is empty. If it isn't, the volume
+ * wasn't unmounted, and the metadata in place may be out of date
+ * until mounting it replays the journal; "fixing" it now would only
+ * do damage.
+ */
+static
+void
+check_journal(uint32_t jstart, uint32_t jblocks)
+{
+	struct sfs_jhdr jh;
+	uint32_t seq;
+
+	if (jstart < SFS_MAP_LOCATION + bitblocks || jstart > nblocks ||
+	    jblocks > nblocks - jstart || jblocks < SFS_JMINSIZE(bitblocks)) {
+		errx(EXIT_UNRECOV, "Bad journal (%lu blocks at %lu)",
+		     (unsigned long) jblocks, (unsigned long) jstart);
+	}
+
+	diskread(blockbuf, jstart);
+	memcpy(&jh, blockbuf, sizeof(jh));
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC ||
+	    SWAPL(jh.jh_type) != SFS_JTYPE_HEADER) {
+		errx(EXIT_UNRECOV, "Bad journal header");
+	}
+	seq = SWAPL(jh.jh_seq);
+
+	diskread(blockbuf, jstart+1);
+	memcpy(&jh, blockbuf, sizeof(jh));
+	if (SWAPL(jh.jh_magic) == SFS_JMAGIC &&
+	    SWAPL(jh.jh_type) == SFS_JTYPE_DESC &&
+	    SWAPL(jh.jh_seq) == seq) {
+		errx(EXIT_UNRECOV, "Journal not empty; mount the volume "
+		     "to replay it first");
+	}
+}
+
 static
 void
 check_sb(void)
@@ -522,18 +625,46 @@ check_sb(void)
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
 
+	switch (sp.sp_version) {
+	    case SFS_OLDVERSION:
+		oldformat = 1;
+		blocksize = SFS_BLOCKSIZE;
+		break;
+	    case SFS_VERSION:
+		blocksize = sp.sp_blocksize;
+		if (blocksize < SFS_BLOCKSIZE ||
+		    blocksize > SFS_MAXBLOCKSIZE ||
+		    (blocksize & (blocksize - 1)) != 0) {
+			errx(EXIT_UNRECOV, "Bad block size %lu",
+			     (unsigned long) blocksize);
+		}
+		break;
+	    default:
+		errx(EXIT_UNRECOV, "Unknown format version %lu",
+		     (unsigned long) sp.sp_version);
+	}
+	dbperidb = SFS_BSDBPERIDB(blocksize);
+	disksetblocksize(blocksize);
+
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
-	bitblocks = SFS_BITBLOCKS(nblocks);
+	bitblocks = SFS_BSBITBLOCKS(nblocks, blocksize);
 	assert(nblocks>0);
 	assert(bitblocks>0);
 
 	bitmap_init(bitblocks);
-	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
+	for (i=nblocks; i<bitblocks*SFS_BSBLOCKBITS(blocksize); i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
 
+	if (!oldformat && sp.sp_jblocks != 0) {
+		check_journal(sp.sp_jstart, sp.sp_jblocks);
+		for (i=0; i<sp.sp_jblocks; i++) {
+			bitmap_mark(sp.sp_jstart+i, B_JOURNAL, i);
+		}
+	}
+
 	if (checknullstring(sp.sp_volname, sizeof(sp.sp_volname))) {
 		warnx("Volume name not null-terminated (fixed)");
 		setbadness(EXIT_RECOV);
@@ -547,7 +678,9 @@ check_sb(void)
 
 	if (schanged) {
 		swapsb(&sp);
-		diskwrite(&sp, SFS_SB_LOCATION);
+		diskread(blockbuf, SFS_SB_LOCATION);
+		memcpy(blockbuf, &sp, sizeof(sp));
+		diskwrite(blockbuf, SFS_SB_LOCATION);
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
@@ -564,7 +697,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		     uint32_t nblocks, uint32_t *badcountp, 
 		     int isdir, int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
 	uint32_t i, ct;
 
 	if (*ientry !=0) {
@@ -573,13 +706,13 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		bitmap_mark(*ientry, B_IBLOCK, ino);
 	}
 	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			entries[i] = 0;
 		}
 	}
 
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ino, &entries[i], 
 					     blockp, nblocks, 
 					     badcountp,
@@ -590,7 +723,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (*blockp < nblocks) {
 				if (entries[i] != 0) {
 					bitmap_mark(entries[i],
@@ -612,7 +745,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
@@ -631,17 +764,13 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 }
 
-/* returns nonzero if inode modified */
+/* original format: direct and indirect blocks */
 static
-int
-check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
+void
+check_inode_blocks_old(uint32_t ino, struct sfs_inode *sfi, uint32_t nblocks,
+		       uint32_t *badcountp, int isdir)
 {
-	uint32_t size, block, nblocks, badcount;
-
-	badcount = 0;
-
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-	nblocks = size/SFS_BLOCKSIZE;
+	uint32_t block, badcount = *badcountp;
 
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
@@ -693,6 +822,89 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 #endif
 #endif
 
+	*badcountp = badcount;
+}
+
+/*
+ * current format: extents, then the indirect and double indirect
+ * blocks. returns nonzero if a bad extent was removed.
+ */
+static
+int
+check_inode_blocks2(uint32_t ino, struct sfs_inode2 *sfi, uint32_t fblocks,
+		    uint32_t *badcountp, int isdir)
+{
+	struct sfs_extent *e;
+	uint32_t block, i, k;
+	int removed = 0;
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sfi->sfi_extents[i];
+		if (e->sfe_len == 0) {
+			continue;
+		}
+		if (e->sfe_diskblock == 0 ||
+		    e->sfe_diskblock + e->sfe_len > nblocks ||
+		    e->sfe_diskblock + e->sfe_len < e->sfe_diskblock) {
+			warnx("Inode %lu: extent %lu out of range (removed)",
+			      (unsigned long) ino, (unsigned long) i);
+			setbadness(EXIT_RECOV);
+			bzero(e, sizeof(*e));
+			removed = 1;
+			continue;
+		}
+		for (k=0; k<e->sfe_len; k++) {
+			if (e->sfe_fileblock + k < fblocks) {
+				bitmap_mark(e->sfe_diskblock + k,
+					    isdir ? B_DIRDATA : B_DATA, ino);
+			}
+			else {
+				(*badcountp)++;
+				bitmap_mark(e->sfe_diskblock + k,
+					    B_TOFREE, 0);
+			}
+		}
+		if (e->sfe_fileblock >= fblocks) {
+			bzero(e, sizeof(*e));
+		}
+		else if (e->sfe_fileblock + e->sfe_len > fblocks) {
+			e->sfe_len = fblocks - e->sfe_fileblock;
+		}
+	}
+
+	block = 0;
+	check_indirect_block(ino, &sfi->sfi_indirect,
+			     &block, fblocks, badcountp, isdir, 1);
+	/* nothing comes after it, so skip it if it isn't there */
+	if (sfi->sfi_dindirect != 0) {
+		check_indirect_block(ino, &sfi->sfi_dindirect,
+				     &block, fblocks, badcountp, isdir, 2);
+	}
+	return removed;
+}
+
+/* returns nonzero if inode modified */
+static
+int
+check_inode_blocks(uint32_t ino, union sfsck_inode *sfi, int isdir)
+{
+	uint32_t size, nblocks, badcount;
+	int ichanged = 0;
+
+	badcount = 0;
+
+	size = SFS_ROUNDUP(sfi->old.sfi_size, blocksize);
+	nblocks = size/blocksize;
+
+	if (oldformat) {
+		check_inode_blocks_old(ino, &sfi->old, nblocks, &badcount,
+				       isdir);
+	}
+	else {
+		ichanged = check_inode_blocks2(ino, &sfi->cur, nblocks,
+					       &badcount, isdir);
+	}
+
 	if (badcount > 0) {
 		warnx("Inode %lu: %lu blocks after EOF (freed)", 
 		     (unsigned long) ino, (unsigned long) badcount);
@@ -700,7 +912,7 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 		return 1;
 	}
 
-	return 0;
+	return ichanged;
 }
 
 ////////////////////////////////////////////////////////////
@@ -709,7 +921,7 @@ static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_MAXBLOCKSIZE/sizeof(uint32_t)];
 
 	if (iblock == 0) {
 		return 0;
@@ -721,10 +933,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -776,9 +988,36 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
 #define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
 
+/* current format: extents, then the tree */
 static
 uint32_t
-dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
+dobmap2(const struct sfs_inode2 *sfi, uint32_t fileblock)
+{
+	const struct sfs_extent *e;
+	int i;
+
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		e = &sfi->sfi_extents[i];
+		if (e->sfe_len > 0 && fileblock >= e->sfe_fileblock &&
+		    fileblock - e->sfe_fileblock < e->sfe_len) {
+			return e->sfe_diskblock + 
+				(fileblock - e->sfe_fileblock);
+		}
+	}
+
+	if (fileblock < dbperidb) {
+		return ibmap(sfi->sfi_indirect, fileblock, 1);
+	}
+	fileblock -= dbperidb;
+	if (fileblock / dbperidb < dbperidb) {
+		return ibmap(sfi->sfi_dindirect, fileblock, dbperidb);
+	}
+	return 0;
+}
+
+static
+uint32_t
+dobmap_old(const struct sfs_inode *sfi, uint32_t fileblock)
 {
 	uint32_t iblock, offset;
 
@@ -803,11 +1042,21 @@ dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
 	return 0;
 }
 
+static
+uint32_t
+dobmap(const union sfsck_inode *sfi, uint32_t fileblock)
+{
+	if (oldformat) {
+		return dobmap_old(&sfi->old, fileblock);
+	}
+	return dobmap2(&sfi->cur, fileblock);
+}
+
 static
 void
-dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
+dirread(union sfsck_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 
@@ -821,16 +1070,16 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 		}
 		else {
 			warnx("Warning: sparse directory found");
-			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			bzero(d + i*atonce, blocksize);
 		}
 	}
 }
 
 static
 void
-dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
+dirwrite(const union sfsck_inode *sfi, struct sfs_dir *d, int nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j, bad;
 
@@ -970,14 +1219,13 @@ static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 {
-	struct sfs_inode sfi;
+	union sfsck_inode sfi;
 	struct sfs_dir *direntries;
 	int *sortvector;
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
-	diskread(&sfi, ino);
-	swapinode(&sfi);
+	readinode(ino, &sfi);
 
 	if (remember_dir(ino, pathsofar)) {
 		/* crosslinked dir */
@@ -987,11 +1235,11 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	bitmap_mark(ino, B_INODE, ino);
 	count_dirs++;
 
-	if (sfi.sfi_size % sizeof(struct sfs_dir) != 0) {
+	if (sfi.old.sfi_size % sizeof(struct sfs_dir) != 0) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory /%s has illegal size %lu (fixed)",
-		      pathsofar, (unsigned long) sfi.sfi_size);
-		sfi.sfi_size = SFS_ROUNDUP(sfi.sfi_size, 
+		      pathsofar, (unsigned long) sfi.old.sfi_size);
+		sfi.old.sfi_size = SFS_ROUNDUP(sfi.old.sfi_size, 
 					   sizeof(struct sfs_dir));
 		ichanged = 1;
 	}
@@ -1000,9 +1248,9 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
-	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
+	ndirentries = sfi.old.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+				    blocksize/sizeof(struct sfs_dir));
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1093,7 +1341,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			      pathsofar);
 			ndirentries++;
 			dchanged = 1;
-			sfi.sfi_size += sizeof(struct sfs_dir);
+			sfi.old.sfi_size += sizeof(struct sfs_dir);
 			ichanged = 1;
 		}
 		else {
@@ -1117,7 +1365,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			      pathsofar);
 			ndirentries++;
 			dchanged = 1;
-			sfi.sfi_size += sizeof(struct sfs_dir);
+			sfi.old.sfi_size += sizeof(struct sfs_dir);
 			ichanged = 1;
 		}
 		else {
@@ -1140,20 +1388,18 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 		else {
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
-			struct sfs_inode subsfi;
+			union sfsck_inode subsfi;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
-			swapinode(&subsfi);
+			readinode(direntries[i].sfd_ino, &subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
 
-			switch (subsfi.sfi_type) {
+			switch (subsfi.old.sfi_type) {
 			    case SFS_TYPE_FILE:
 				if (check_inode_blocks(direntries[i].sfd_ino,
 						       &subsfi, 0)) {
-					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
+					writeinode(direntries[i].sfd_ino,
+						   &subsfi);
 				}
 				observe_filelink(direntries[i].sfd_ino);
 				break;
@@ -1185,12 +1431,12 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		}
 	}
 
-	if (sfi.sfi_linkcount != subdircount+2) {
+	if (sfi.old.sfi_linkcount != subdircount+2) {
 		setbadness(EXIT_RECOV);
 		warnx("Directory /%s: Link count %lu should be %lu (fixed)",
-		      pathsofar, (unsigned long) sfi.sfi_linkcount,
+		      pathsofar, (unsigned long) sfi.old.sfi_linkcount,
 		      (unsigned long) subdircount+2);
-		sfi.sfi_linkcount = subdircount+2;
+		sfi.old.sfi_linkcount = subdircount+2;
 		ichanged = 1;
 	}
 
@@ -1199,8 +1445,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	}
 
 	if (ichanged) {
-		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		writeinode(ino, &sfi);
 	}
 
 	free(direntries);
@@ -1214,11 +1459,10 @@ static
 void
 check_root_dir(void)
 {
-	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
-	swapinode(&sfi);
+	union sfsck_inode sfi;
+	readinode(SFS_ROOT_LOCATION, &sfi);
 
-	switch (sfi.sfi_type) {
+	switch (sfi.old.sfi_type) {
 	    case SFS_TYPE_DIR:
 		break;
 	    case SFS_TYPE_FILE:
@@ -1226,12 +1470,11 @@ check_root_dir(void)
 		goto fix;
 	    default:
 		warnx("Root directory inode has invalid type %lu (fixed)",
-		      (unsigned long) sfi.sfi_type);
+		      (unsigned long) sfi.old.sfi_type);
 	    fix:
 		setbadness(EXIT_RECOV);
-		sfi.sfi_type = SFS_TYPE_DIR;
-		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		sfi.old.sfi_type = SFS_TYPE_DIR;
+		writeinode(SFS_ROOT_LOCATION, &sfi);
 		break;
 	}
 
@@ -1253,6 +1496,7 @@ main(int argc, char **argv)
 
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_inode2)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	opendisk(argv[1]);
@@ -34,21 +34,88 @@
  * and should work on SFS when the file system assignment is
  * done. Sufficiently small files should work on SFS even before that
  * assignment.
+ *
+ * Each 10-byte record holds its own offset, so the file can be checked.
+ * After the usual one-write-per-record pass, the file is written again
+ * with writev, BATCH records per call, and read back with read and
+ * readv; each pass reports how many system calls it took and its
+ * throughput. Finally a few records are checked with pread.
  */
 
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <err.h>
 
+#define RECSIZE	10
+#define BATCH	32
+
 static char buffer[100];
+static char records[BATCH][RECSIZE+1];
+
+static time_t startsecs;
+static unsigned long startnsecs;
+
+static
+void
+startpass(void)
+{
+	__time(&startsecs, &startnsecs);
+}
+
+static
+void
+endpass(const char *what, int size, int calls)
+{
+	time_t secs;
+	unsigned long nsecs;
+	unsigned long long ns;
+
+	__time(&secs, &nsecs);
+	ns = (unsigned long long)(secs - startsecs) * 1000000000ULL
+		+ nsecs - startnsecs;
+	if (ns == 0) {
+		ns = 1;
+	}
+	printf("%-8s %7d calls  %7llu KB/s\n", what, calls,
+	       (unsigned long long)size * 1000000000ULL / ns / 1024);
+}
+
+/* Fill iov[] with the BATCH records starting at offset POS. */
+static
+int
+fillbatch(struct iovec *iov, int pos, int size)
+{
+	int n;
+
+	for (n=0; n<BATCH && pos < size; n++, pos += RECSIZE) {
+		snprintf(records[n], sizeof(records[n]), "%-10d", pos);
+		iov[n].iov_base = records[n];
+		iov[n].iov_len = RECSIZE;
+	}
+	return n;
+}
+
+static
+void
+checkrecord(const char *rec, int pos)
+{
+	char expect[RECSIZE+1];
+
+	snprintf(expect, sizeof(expect), "%-10d", pos);
+	if (memcmp(rec, expect, RECSIZE)) {
+		errx(1, "record at %d is wrong", pos);
+	}
+}
 
 int
 main(int argc, char *argv[])
 {
 	const char *filename;
-	int i, size;
+	struct iovec iov[BATCH];
+	int i, n, size, calls;
 	int fileid;
 	int len;
 
@@ -58,23 +125,89 @@ main(int argc, char *argv[])
 
 	filename = argv[1];
 	size = atoi(argv[2]);
+	/* whole records only, so every pass writes the same bytes */
+	size = (size + RECSIZE - 1) / RECSIZE * RECSIZE;
 
 	printf("Creating a file of size %d\n", size);
 
-	fileid = open(filename, O_WRONLY|O_CREAT|O_TRUNC);
+	fileid = open(filename, O_RDWR|O_CREAT|O_TRUNC);
 	if (fileid < 0) {
 		err(1, "%s: create", filename);
 	}
 
+	startpass();
 	i=0;
+	calls=0;
 	while (i<size) {
 		snprintf(buffer, sizeof(buffer), "%-10d", i);
 		len = write(fileid, buffer, strlen(buffer));
 		if (len<0) {
 			err(1, "%s: write", filename);
 		}
+		calls++;
 		i += len;
 	}	
+	endpass("write", size, calls);
+
+	if (lseek(fileid, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	startpass();
+	calls=0;
+	for (i=0; i<size; i += n * RECSIZE) {
+		n = fillbatch(iov, i, size);
+		len = writev(fileid, iov, n);
+		if (len != n * RECSIZE) {
+			err(1, "%s: writev", filename);
+		}
+		calls++;
+	}
+	endpass("writev", size, calls);
+
+	if (lseek(fileid, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	startpass();
+	calls=0;
+	for (i=0; i<size; i += RECSIZE) {
+		len = read(fileid, buffer, RECSIZE);
+		if (len != RECSIZE) {
+			err(1, "%s: read", filename);
+		}
+		checkrecord(buffer, i);
+		calls++;
+	}
+	endpass("read", size, calls);
+
+	if (lseek(fileid, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", filename);
+	}
+	startpass();
+	calls=0;
+	for (i=0; i<size; i += n * RECSIZE) {
+		n = fillbatch(iov, i, size);
+		len = readv(fileid, iov, n);
+		if (len != n * RECSIZE) {
+			err(1, "%s: readv", filename);
+		}
+		for (len=0; len<n; len++) {
+			checkrecord(records[len], i + len * RECSIZE);
+		}
+		calls++;
+	}
+	endpass("readv", size, calls);
+
+	/* positional reads, back to front; the seek offset mustn't move */
+	for (i = size - RECSIZE; i >= 0; i -= size / 8 + RECSIZE) {
+		i -= i % RECSIZE;
+		if (pread(fileid, buffer, RECSIZE, i) != RECSIZE) {
+			err(1, "%s: pread", filename);
+		}
+		checkrecord(buffer, i);
+	}
+	if (lseek(fileid, 0, SEEK_CUR) != size) {
+		errx(1, "%s: pread moved the seek offset", filename);
+	}
 
 	close(fileid);
 
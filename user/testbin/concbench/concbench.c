@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * concbench - concurrent file I/O throughput, one process per file.
+ *
+ * Usage: concbench [prefix [maxprocs]]
+ *
+ * Makes MAXPROCS files of FILEKB each, named PREFIX"concbench.N".
+ * Then, for 1, 2, 4, ... MAXPROCS processes, forks that many children
+ * that each rewrite their own file and then read it back ROUNDS
+ * times, checking the data, and prints the combined KB/s for each
+ * phase. With the filesystem doing per-file locking, the numbers
+ * should go up with the number of processes on a multi-CPU machine
+ * instead of staying flat.
+ */
+
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_PROCS	4
+#define MAXPROCS	32
+#define FILEKB		64
+#define CHUNK		4096
+#define ROUNDS		4
+
+static const char *prefix = "";
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+makename(char *buf, size_t len, int n)
+{
+	snprintf(buf, len, "%sconcbench.%d", prefix, n);
+}
+
+static
+void
+fill(char *buf, int file, int pos)
+{
+	int i;
+
+	for (i=0; i<CHUNK; i++) {
+		buf[i] = (char)(file * 7 + (pos + i) / 64);
+	}
+}
+
+static
+void
+writefile(int n)
+{
+	char name[128], buf[CHUNK];
+	int fd, pos;
+
+	makename(name, sizeof(name), n);
+	fd = open(name, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	for (pos=0; pos<FILEKB*1024; pos += CHUNK) {
+		fill(buf, n, pos);
+		if (write(fd, buf, CHUNK) != CHUNK) {
+			err(1, "%s: write", name);
+		}
+	}
+	close(fd);
+}
+
+static
+void
+readfile(int n)
+{
+	char name[128], buf[CHUNK], want[CHUNK];
+	int fd, pos;
+
+	makename(name, sizeof(name), n);
+	fd = open(name, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", name);
+	}
+	for (pos=0; pos<FILEKB*1024; pos += CHUNK) {
+		if (read(fd, buf, CHUNK) != CHUNK) {
+			err(1, "%s: read", name);
+		}
+		fill(want, n, pos);
+		if (memcmp(buf, want, CHUNK)) {
+			errx(1, "%s: bad data at %d", name, pos);
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Run NPROCS children doing one phase; return the elapsed time.
+ */
+static
+unsigned long long
+runphase(int nprocs, int reading)
+{
+	unsigned long long start, ns;
+	pid_t pids[MAXPROCS];
+	int i, r, status;
+
+	start = now_ns();
+	for (i=0; i<nprocs; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			if (reading) {
+				for (r=0; r<ROUNDS; r++) {
+					readfile(i);
+				}
+			}
+			else {
+				writefile(i);
+			}
+			_exit(0);
+		}
+	}
+	for (i=0; i<nprocs; i++) {
+		if (waitpid(pids[i], &status, 0) < 0) {
+			err(1, "waitpid");
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			errx(1, "child %d failed", i);
+		}
+	}
+	ns = now_ns() - start;
+	return ns == 0 ? 1 : ns;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char name[128];
+	unsigned long long wns, rns, kb;
+	int maxprocs = DEFAULT_PROCS;
+	int nprocs, i;
+
+	if (argc > 1) {
+		prefix = argv[1];
+	}
+	if (argc > 2) {
+		maxprocs = atoi(argv[2]);
+	}
+	if (argc > 3 || maxprocs < 1 || maxprocs > MAXPROCS) {
+		errx(1, "Usage: concbench [prefix [maxprocs]]  (1-%d)",
+		     MAXPROCS);
+	}
+
+	for (i=0; i<maxprocs; i++) {
+		writefile(i);
+	}
+
+	printf("%d KB per process, %d read passes\n", FILEKB, ROUNDS);
+	printf("procs    write KB/s     read KB/s\n");
+	for (nprocs = 1; nprocs <= maxprocs; nprocs *= 2) {
+		wns = runphase(nprocs, 0);
+		rns = runphase(nprocs, 1);
+		kb = (unsigned long long)nprocs * FILEKB;
+		printf("%5d %13llu %13llu\n", nprocs,
+		       kb * 1000000000ULL / wns,
+		       kb * ROUNDS * 1000000000ULL / rns);
+	}
+
+	for (i=0; i<maxprocs; i++) {
+		makename(name, sizeof(name), i);
+		remove(name);
+	}
+	printf("concbench done.\n");
+	return 0;
+}
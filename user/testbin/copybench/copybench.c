@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * copybench - file copy throughput, user buffer versus in-kernel.
+ *
+ * Usage: copybench [prefix [sizekb]]
+ *
+ * Makes a SIZEKB file named PREFIX"copybench.src" and copies it three
+ * ways: read/write with cp's 1K buffer, read/write with a 16K buffer,
+ * and copy_file_range, checking each copy and printing KB/s and the
+ * number of system calls. Run it once with a prefix on each file
+ * system to compare them, e.g. "copybench emu0:" and
+ * "copybench lhd0:".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#define DEFAULT_KB	256
+#define BIGBUF		(16*1024)
+
+static char srcname[128], dstname[128];
+static char buf[BIGBUF], buf2[BIGBUF];
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+makesrc(int size)
+{
+	int fd, i, n;
+
+	fd = open(srcname, O_WRONLY|O_CREAT|O_TRUNC);
+	if (fd < 0) {
+		err(1, "%s", srcname);
+	}
+	for (i=0; i<size; i += n) {
+		n = size - i < BIGBUF ? size - i : BIGBUF;
+		memset(buf, 'a' + (i / BIGBUF) % 26, n);
+		if (write(fd, buf, n) != n) {
+			err(1, "%s: write", srcname);
+		}
+	}
+	close(fd);
+}
+
+/* Returns the number of system calls used for the copy itself. */
+static
+int
+usercopy(int infd, int outfd, int bufsize)
+{
+	int len, calls = 0;
+
+	while ((len = read(infd, buf, bufsize)) > 0) {
+		if (write(outfd, buf, len) != len) {
+			err(1, "%s: write", dstname);
+		}
+		calls += 2;
+	}
+	if (len < 0) {
+		err(1, "%s: read", srcname);
+	}
+	return calls + 1;
+}
+
+static
+int
+kernelcopy(int infd, int outfd)
+{
+	int len, calls = 0;
+
+	while ((len = copy_file_range(infd, NULL, outfd, NULL,
+				      1024*1024, 0)) > 0) {
+		calls++;
+	}
+	if (len < 0) {
+		err(1, "copy_file_range");
+	}
+	return calls + 1;
+}
+
+static
+void
+check(int size)
+{
+	int a, b, i, n;
+
+	a = open(srcname, O_RDONLY);
+	b = open(dstname, O_RDONLY);
+	if (a < 0 || b < 0) {
+		err(1, "reopen");
+	}
+	for (i=0; i<size; i += n) {
+		n = read(a, buf, BIGBUF);
+		if (n <= 0 || read(b, buf2, n) != n || memcmp(buf, buf2, n)) {
+			errx(1, "%s differs from %s", dstname, srcname);
+		}
+	}
+	if (read(b, buf2, 1) != 0) {
+		errx(1, "%s is too long", dstname);
+	}
+	close(a);
+	close(b);
+}
+
+static
+void
+run(const char *what, int bufsize, int size)
+{
+	unsigned long long start, ns;
+	int infd, outfd, calls;
+
+	infd = open(srcname, O_RDONLY);
+	if (infd < 0) {
+		err(1, "%s", srcname);
+	}
+	outfd = open(dstname, O_WRONLY|O_CREAT|O_TRUNC);
+	if (outfd < 0) {
+		err(1, "%s", dstname);
+	}
+
+	start = now_ns();
+	if (bufsize > 0) {
+		calls = usercopy(infd, outfd, bufsize);
+	}
+	else {
+		calls = kernelcopy(infd, outfd);
+	}
+	ns = now_ns() - start;
+	close(infd);
+	close(outfd);
+	if (ns == 0) {
+		ns = 1;
+	}
+
+	check(size);
+	printf("%-16s %6d calls  %7llu KB/s\n", what, calls,
+	       (unsigned long long)size * 1000000000ULL / ns / 1024);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *prefix = "";
+	int kb = DEFAULT_KB;
+
+	if (argc > 1) {
+		prefix = argv[1];
+	}
+	if (argc > 2) {
+		kb = atoi(argv[2]);
+	}
+	if (argc > 3 || kb <= 0) {
+		errx(1, "Usage: copybench [prefix [sizekb]]");
+	}
+	snprintf(srcname, sizeof(srcname), "%scopybench.src", prefix);
+	snprintf(dstname, sizeof(dstname), "%scopybench.dst", prefix);
+
+	makesrc(kb * 1024);
+	run("read/write 1K", 1024, kb * 1024);
+	run("read/write 16K", BIGBUF, kb * 1024);
+	run("copy_file_range", 0, kb * 1024);
+
+	remove(srcname);
+	remove(dstname);
+	printf("copybench done.\n");
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * execbench - execv throughput with big argument lists.
+ *
+ * Usage: execbench [count [nargs [arglen]]]
+ *
+ * Execs itself COUNT times in a row, each time passing NARGS extra
+ * arguments of ARGLEN characters each along with its own bookkeeping
+ * (how many execs are left and when it started). Every generation
+ * checks that all the arguments arrived intact, like argtest does by
+ * eye, and the last one prints execs per second.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <err.h>
+
+#define SELF		"/testbin/execbench"
+#define NFIXED		8	/* name, -c, left, total, secs, nsecs, nargs, arglen */
+
+#define DEFAULT_COUNT	50
+#define DEFAULT_NARGS	64
+#define DEFAULT_ARGLEN	200
+#define MAXNARGS	1024
+
+static char *newargv[NFIXED + MAXNARGS + 1];
+static char fixed[NFIXED][16];
+
+static
+void
+checkargs(char **args, int nargs, int arglen)
+{
+	int i, j;
+
+	for (i=0; i<nargs; i++) {
+		if ((int)strlen(args[i]) != arglen) {
+			errx(1, "arg %d: length %d, expected %d", i,
+			     (int)strlen(args[i]), arglen);
+		}
+		for (j=0; j<arglen; j++) {
+			if (args[i][j] != 'a' + (i + j) % 26) {
+				errx(1, "arg %d: wrong character at %d", i, j);
+			}
+		}
+	}
+}
+
+static
+void
+next(int left, int total, time_t secs, unsigned long nsecs, int nargs, int arglen,
+     char **args)
+{
+	int i;
+
+	strcpy(fixed[0], "execbench");
+	strcpy(fixed[1], "-c");
+	snprintf(fixed[2], sizeof(fixed[2]), "%d", left);
+	snprintf(fixed[3], sizeof(fixed[3]), "%d", total);
+	snprintf(fixed[4], sizeof(fixed[4]), "%lu", (unsigned long)secs);
+	snprintf(fixed[5], sizeof(fixed[5]), "%lu", nsecs);
+	snprintf(fixed[6], sizeof(fixed[6]), "%d", nargs);
+	snprintf(fixed[7], sizeof(fixed[7]), "%d", arglen);
+
+	for (i=0; i<NFIXED; i++) {
+		newargv[i] = fixed[i];
+	}
+	for (i=0; i<nargs; i++) {
+		newargv[NFIXED + i] = args[i];
+	}
+	newargv[NFIXED + nargs] = NULL;
+
+	execv(SELF, newargv);
+	err(1, "%s", SELF);
+}
+
+static
+void
+finish(int total, time_t secs1, unsigned long nsecs1, int nargs, int arglen)
+{
+	time_t secs2;
+	unsigned long nsecs2;
+	unsigned long long ns;
+
+	__time(&secs2, &nsecs2);
+	ns = (unsigned long long)(secs2 - secs1) * 1000000000ULL
+		+ nsecs2 - nsecs1;
+	if (ns == 0) {
+		ns = 1;
+	}
+	printf("%d execs of %d x %d-byte args in %llu.%03llu s: "
+	       "%llu execs/sec\n", total, nargs, arglen,
+	       ns / 1000000000ULL, (ns / 1000000) % 1000,
+	       (unsigned long long)total * 1000000000ULL / ns);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int count = DEFAULT_COUNT;
+	int left;
+	int nargs = DEFAULT_NARGS;
+	int arglen = DEFAULT_ARGLEN;
+	time_t secs;
+	unsigned long nsecs;
+	char **args;
+	int i, j;
+
+	if (argc >= NFIXED && !strcmp(argv[1], "-c")) {
+		/* a later generation */
+		left = atoi(argv[2]);
+		count = atoi(argv[3]);
+		secs = atoi(argv[4]);
+		nsecs = atoi(argv[5]);
+		nargs = atoi(argv[6]);
+		arglen = atoi(argv[7]);
+		if (argc != NFIXED + nargs) {
+			errx(1, "argc %d, expected %d", argc, NFIXED + nargs);
+		}
+		checkargs(argv + NFIXED, nargs, arglen);
+		if (left > 0) {
+			next(left - 1, count, secs, nsecs, nargs, arglen,
+			     argv + NFIXED);
+		}
+		finish(count, secs, nsecs, nargs, arglen);
+		return 0;
+	}
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		nargs = atoi(argv[2]);
+	}
+	if (argc > 3) {
+		arglen = atoi(argv[3]);
+	}
+	if (count < 1 || nargs < 0 || nargs > MAXNARGS || arglen < 1 ||
+	    (nargs + NFIXED + 1) * (sizeof(char *) + 16) +
+	    (size_t)nargs * (arglen + 1) > ARG_MAX) {
+		errx(1, "Usage: execbench [count [nargs [arglen]]]  "
+		     "(arguments must fit in %d bytes)", ARG_MAX);
+	}
+
+	args = malloc(nargs * sizeof(char *));
+	if (args == NULL) {
+		err(1, "malloc");
+	}
+	for (i=0; i<nargs; i++) {
+		args[i] = malloc(arglen + 1);
+		if (args[i] == NULL) {
+			err(1, "malloc");
+		}
+		for (j=0; j<arglen; j++) {
+			args[i][j] = 'a' + (i + j) % 26;
+		}
+		args[i][arglen] = '\0';
+	}
+
+	__time(&secs, &nsecs);
+	next(count - 1, count, secs, nsecs, nargs, arglen, args);
+	return 1;
+}
@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * fdtest - descriptor table semantics.
+ *
+ * Usage: fdtest [filename]
+ *
+ * Checks that open returns the lowest free descriptor, that dup2'd
+ * descriptors share one seek offset, that a forked child shares its
+ * parent's open files (offset included), and that each descriptor
+ * only closes its own reference. Then forks several children at once
+ * that all append through the same inherited descriptor, and checks
+ * that no writes were lost.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdio.h>
+#include <err.h>
+
+#define NKIDS	8
+#define KIDWRITES 16
+
+static
+void
+expect(int got, int want, const char *what)
+{
+	if (got != want) {
+		errx(1, "%s: got %d, expected %d", what, got, want);
+	}
+}
+
+static
+void
+waitkid(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child %d failed", pid);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *file = "fdtest.tmp";
+	pid_t pids[NKIDS];
+	char buf[8];
+	int fd, fd2, fd3, i, j;
+
+	if (argc > 1) {
+		file = argv[1];
+	}
+
+	fd = open(file, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", file);
+	}
+	/* 0-2 are the console */
+	expect(fd, 3, "first open");
+
+	fd2 = open(file, O_RDONLY);
+	expect(fd2, 4, "second open");
+	close(fd);
+	fd3 = open(file, O_RDONLY);
+	expect(fd3, 3, "open after close (lowest free)");
+	close(fd3);
+	close(fd2);
+
+	/* dup2: one open file, one offset */
+	fd = open(file, O_RDWR|O_TRUNC);
+	expect(fd, 3, "reopen");
+	expect(dup2(fd, 10), 10, "dup2");
+	expect(write(fd, "ab", 2), 2, "write");
+	expect(lseek(10, 0, SEEK_CUR), 2, "offset through dup");
+	close(fd);
+	expect(write(10, "cd", 2), 2, "write after closing the original");
+	expect(lseek(10, 0, SEEK_SET), 0, "rewind");
+	memset(buf, 0, sizeof(buf));
+	expect(read(10, buf, 4), 4, "read back");
+	if (memcmp(buf, "abcd", 4)) {
+		errx(1, "dup2: wrong data");
+	}
+
+	/* fork: the child's writes move the parent's offset */
+	pids[0] = fork();
+	if (pids[0] < 0) {
+		err(1, "fork");
+	}
+	if (pids[0] == 0) {
+		if (write(10, "e", 1) != 1) {
+			_exit(1);
+		}
+		close(10);
+		_exit(0);
+	}
+	waitkid(pids[0]);
+	expect(lseek(10, 0, SEEK_CUR), 5, "offset after child's write");
+
+	/* lots of children appending through the shared descriptor */
+	for (i=0; i<NKIDS; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			err(1, "fork");
+		}
+		if (pids[i] == 0) {
+			for (j=0; j<KIDWRITES; j++) {
+				if (write(10, "x", 1) != 1) {
+					_exit(1);
+				}
+			}
+			_exit(0);
+		}
+	}
+	for (i=0; i<NKIDS; i++) {
+		waitkid(pids[i]);
+	}
+	expect(lseek(10, 0, SEEK_CUR), 5 + NKIDS*KIDWRITES,
+	       "offset after concurrent children");
+
+	close(10);
+	expect(close(10), -1, "double close");
+	remove(file);
+
+	printf("fdtest done.\n");
+	return 0;
+}
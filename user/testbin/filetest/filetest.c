@@ -31,13 +31,15 @@
  * filetest.c
  *
  * 	Tests the filesystem by opening, writing to and reading from a 
- * 	user specified file.
+ * 	user specified file. Then checks positional and vectored I/O
+ * 	against the same file.
  *
  * This should run (on SFS) even before the file system assignment is started.
  * It should also continue to work once said assignment is complete.
  * It will not run fully on emufs, because emufs does not support remove().
  */
 
+#include <sys/uio.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -91,6 +93,51 @@ main(int argc, char *argv[])
 		errx(1, "Buffer data mismatch!");
 	}
 
+	/*
+	 * pwrite/pread work at the given offset and leave the seek
+	 * offset alone; readv scatters into several buffers in order.
+	 */
+	fd = open(argv[1], O_RDWR);
+	if (fd<0) {
+		err(1, "%s: open for read/write", argv[1]);
+	}
+	rv = pwrite(fd, "Tweedle", 7, 0);
+	if (rv != 7) {
+		err(1, "%s: pwrite", argv[1]);
+	}
+	memset(readbuf, 0, sizeof(readbuf));
+	rv = pread(fd, readbuf, 10, 30);
+	if (rv != 10) {
+		err(1, "%s: pread", argv[1]);
+	}
+	if (memcmp(readbuf, writebuf+30, 10)) {
+		errx(1, "pread data mismatch!");
+	}
+	if (lseek(fd, 0, SEEK_CUR) != 0) {
+		errx(1, "pread/pwrite moved the seek offset");
+	}
+
+	{
+		char a[7], b[33];
+		struct iovec iov[2];
+
+		iov[0].iov_base = a;
+		iov[0].iov_len = sizeof(a);
+		iov[1].iov_base = b;
+		iov[1].iov_len = sizeof(b);
+		rv = readv(fd, iov, 2);
+		if (rv != 40) {
+			err(1, "%s: readv", argv[1]);
+		}
+		if (memcmp(a, "Tweedle", 7) || memcmp(b, writebuf+7, 33)) {
+			errx(1, "readv data mismatch!");
+		}
+	}
+	rv = close(fd);
+	if (rv<0) {
+		err(1, "%s: close (3rd time)", argv[1]);
+	}
+
 	rv = remove(argv[1]);
 	if (rv<0) {
 		err(1, "%s: remove", argv[1]);
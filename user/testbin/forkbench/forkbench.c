@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * forkbench - fork/exit/waitpid throughput.
+ *
+ * Usage: forkbench [count]
+ *
+ * First forks COUNT children one at a time, each exiting right away
+ * with a status the parent checks; then forks them in batches of
+ * BATCH so many pids are live at once. COUNT defaults to several times
+ * the size of the pid table, so pids have to be recycled. Prints
+ * forks per second for each phase.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_COUNT	500
+#define BATCH		16
+
+static
+void
+startclock(time_t *secs, unsigned long *nsecs)
+{
+	__time(secs, nsecs);
+}
+
+static
+void
+stopclock(const char *what, int count, time_t secs1, unsigned long nsecs1)
+{
+	time_t secs2;
+	unsigned long nsecs2;
+	unsigned long long ns;
+
+	__time(&secs2, &nsecs2);
+	ns = (unsigned long long)(secs2 - secs1) * 1000000000ULL
+		+ nsecs2 - nsecs1;
+	if (ns == 0) {
+		ns = 1;
+	}
+	printf("%-12s %6d forks in %llu.%03llu s: %llu forks/sec\n",
+	       what, count, ns / 1000000000ULL, (ns / 1000000) % 1000,
+	       (unsigned long long)count * 1000000000ULL / ns);
+}
+
+static
+pid_t
+spawnchild(int n)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(n & 0xff);
+	}
+	return pid;
+}
+
+static
+void
+reap(pid_t pid, int n)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid %d", pid);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != (n & 0xff)) {
+		errx(1, "child %d: bad exit status 0x%x", n, status);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	pid_t pids[BATCH];
+	time_t secs;
+	unsigned long nsecs;
+	int count, i, j;
+
+	count = DEFAULT_COUNT;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (count < 1) {
+		errx(1, "Usage: forkbench [count]");
+	}
+
+	startclock(&secs, &nsecs);
+	for (i=0; i<count; i++) {
+		reap(spawnchild(i), i);
+	}
+	stopclock("one at a time", count, secs, nsecs);
+
+	startclock(&secs, &nsecs);
+	for (i=0; i<count; i += BATCH) {
+		for (j=0; j<BATCH && i+j<count; j++) {
+			pids[j] = spawnchild(i+j);
+		}
+		for (j=0; j<BATCH && i+j<count; j++) {
+			reap(pids[j], i+j);
+		}
+	}
+	stopclock("batched", count, secs, nsecs);
+
+	printf("forkbench done.\n");
+	return 0;
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futextest - test futex() and the libc umutex/ucond built on it.
+ *
+ * First checks the single-thread paths: the error cases of the system
+ * call, and that uncontended mutex and condition operations leave
+ * everything in the right state without blocking. Then uses a second
+ * thread to check that FUTEX_WAIT really sleeps until a FUTEX_WAKE,
+ * and that a contended umutex hands off to a blocked waiter.
+ */
+
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <err.h>
+#include <usynch.h>
+
+#define MAXWAKETRIES	100000
+
+static struct umutex m = UMUTEX_INITIALIZER;
+static struct ucond c = UCOND_INITIALIZER;
+
+static volatile int waitword;
+static volatile int waitresult;
+static volatile int waitdone;
+
+static
+void *
+waiter(void *arg)
+{
+	(void)arg;
+
+	/* Nobody changes waitword, so only a FUTEX_WAKE gets us out. */
+	waitresult = futex((int *)&waitword, FUTEX_WAIT, 0);
+	waitdone = 1;
+	return NULL;
+}
+
+static
+void *
+locker(void *arg)
+{
+	(void)arg;
+
+	umutex_lock(&m);
+	umutex_unlock(&m);
+	return NULL;
+}
+
+static
+void
+join(pid_t tid)
+{
+	if (threadjoin(tid, NULL) < 0) {
+		err(1, "threadjoin %d", tid);
+	}
+}
+
+/*
+ * Start a thread that waits on waitword, then wake it. FUTEX_WAKE
+ * returns 0 until the waiter is actually asleep, so keep trying; once
+ * it returns 1 the waiter must come back from FUTEX_WAIT with 0.
+ */
+static
+void
+test_wake(void)
+{
+	pid_t tid;
+	int r, tries;
+
+	tid = threadcreate(waiter, NULL);
+	if (tid < 0) {
+		err(1, "threadcreate");
+	}
+	for (tries = 0; tries < MAXWAKETRIES; tries++) {
+		r = futex((int *)&waitword, FUTEX_WAKE, 1);
+		if (r < 0) {
+			err(1, "FUTEX_WAKE");
+		}
+		if (r == 1) {
+			break;
+		}
+		if (waitdone) {
+			errx(1, "waiter returned %d without being woken",
+			     waitresult);
+		}
+	}
+	if (tries == MAXWAKETRIES) {
+		errx(1, "waiter never went to sleep");
+	}
+	join(tid);
+	if (waitresult != 0) {
+		errx(1, "woken FUTEX_WAIT returned %d", waitresult);
+	}
+	printf("futextest: wait/wake passed\n");
+}
+
+/*
+ * Hold the mutex while a second thread tries to take it. Once it has
+ * marked the mutex contended it is on its way to sleep, and unlocking
+ * has to wake it or the join never returns.
+ */
+static
+void
+test_contended(void)
+{
+	pid_t tid;
+
+	umutex_lock(&m);
+	tid = threadcreate(locker, NULL);
+	if (tid < 0) {
+		err(1, "threadcreate");
+	}
+	while (m.um_state != 2) {
+		/* wait for the other thread to block */
+	}
+	umutex_unlock(&m);
+	join(tid);
+	if (m.um_state != 0) {
+		errx(1, "contended unlock left state %d", m.um_state);
+	}
+	printf("futextest: contended mutex passed\n");
+}
+
+int
+main(void)
+{
+	int word = 5;
+	int r;
+
+	/* Wait on a value that doesn't match must not sleep. */
+	r = futex(&word, FUTEX_WAIT, 6);
+	if (r != -1 || errno != EAGAIN) {
+		errx(1, "FUTEX_WAIT with stale value: expected EAGAIN");
+	}
+
+	/* Nobody waiting: nobody woken. */
+	r = futex(&word, FUTEX_WAKE, 1);
+	if (r != 0) {
+		errx(1, "FUTEX_WAKE woke %d, expected 0", r);
+	}
+
+	r = futex(NULL, FUTEX_WAKE, 1);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "futex on NULL: expected EFAULT");
+	}
+
+	r = futex((int *)((char *)&word + 1), FUTEX_WAKE, 1);
+	if (r != -1 || errno != EFAULT) {
+		errx(1, "futex on unaligned address: expected EFAULT");
+	}
+
+	r = futex(&word, 42, 1);
+	if (r != -1 || errno != EINVAL) {
+		errx(1, "futex with bad op: expected EINVAL");
+	}
+
+	umutex_lock(&m);
+	if (m.um_state != 1) {
+		errx(1, "uncontended lock left state %d", m.um_state);
+	}
+	if (umutex_trylock(&m) == 0) {
+		errx(1, "trylock succeeded on a held mutex");
+	}
+	ucond_signal(&c);
+	ucond_broadcast(&c);
+	umutex_unlock(&m);
+	if (m.um_state != 0) {
+		errx(1, "unlock left state %d", m.um_state);
+	}
+	if (umutex_trylock(&m) != 0) {
+		errx(1, "trylock failed on a free mutex");
+	}
+	umutex_unlock(&m);
+
+	test_wake();
+	test_contended();
+
+	printf("futextest: passed\n");
+	return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * parsum - threads sharing an address space.
+ *
+ * Usage: parsum [maxthreads]
+ *
+ * First has threads bump a shared counter under a umutex, which checks
+ * that they really share memory and that futex waits and wakes work
+ * between them. Then splits a CPU-bound sum over 1, 2, 4, ...
+ * MAXTHREADS threads, each handing its part back through threadjoin,
+ * and prints how long each took; on a multi-cpu machine the time
+ * should drop as threads are added.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+#include <usynch.h>
+
+#define MAXTHREADS	16
+#define NBUMPS		2000
+#define NTERMS		(1 << 22)
+
+static struct umutex countlock = UMUTEX_INITIALIZER;
+static volatile int counter;
+
+static
+void *
+bumper(void *arg)
+{
+	int i;
+
+	(void)arg;
+	for (i=0; i<NBUMPS; i++) {
+		umutex_lock(&countlock);
+		counter++;
+		umutex_unlock(&countlock);
+	}
+	return NULL;
+}
+
+/* Sum of (i * i) mod 7 over part N of NTERMS, for ARG = N/NTHREADS */
+static volatile int nthreads;
+
+static
+void *
+summer(void *arg)
+{
+	unsigned n = (unsigned)arg;
+	unsigned i, start, end, sum = 0;
+
+	start = NTERMS / nthreads * n;
+	end = NTERMS / nthreads * (n + 1);
+	for (i=start; i<end; i++) {
+		sum += (i * i) % 7;
+	}
+	return (void *)sum;
+}
+
+static
+unsigned
+expected_sum(void)
+{
+	unsigned i, sum = 0;
+
+	for (i=0; i<NTERMS; i++) {
+		sum += (i * i) % 7;
+	}
+	return sum;
+}
+
+static
+void
+join(pid_t tid, void **value)
+{
+	if (threadjoin(tid, value) < 0) {
+		err(1, "threadjoin %d", tid);
+	}
+}
+
+static
+void
+test_counter(int n)
+{
+	pid_t tids[MAXTHREADS];
+	int i;
+
+	counter = 0;
+	for (i=0; i<n; i++) {
+		tids[i] = threadcreate(bumper, NULL);
+		if (tids[i] < 0) {
+			err(1, "threadcreate");
+		}
+	}
+	for (i=0; i<n; i++) {
+		join(tids[i], NULL);
+	}
+	if (counter != n * NBUMPS) {
+		errx(1, "counter is %d, expected %d", counter, n * NBUMPS);
+	}
+	printf("%d threads sharing a counter: passed\n", n);
+}
+
+static
+void
+time_sum(int n, unsigned want)
+{
+	pid_t tids[MAXTHREADS];
+	void *part;
+	unsigned sum = 0;
+	time_t secs1, secs2;
+	unsigned long nsecs1, nsecs2;
+	unsigned long long ns;
+	int i;
+
+	nthreads = n;
+	__time(&secs1, &nsecs1);
+	for (i=0; i<n; i++) {
+		tids[i] = threadcreate(summer, (void *)i);
+		if (tids[i] < 0) {
+			err(1, "threadcreate");
+		}
+	}
+	for (i=0; i<n; i++) {
+		join(tids[i], &part);
+		sum += (unsigned)part;
+	}
+	__time(&secs2, &nsecs2);
+
+	if (sum != want) {
+		errx(1, "%d threads: sum %u, expected %u", n, sum, want);
+	}
+	ns = (unsigned long long)(secs2 - secs1) * 1000000000ULL
+		+ nsecs2 - nsecs1;
+	printf("%2d threads: %llu.%03llu s\n", n,
+	       ns / 1000000000ULL, (ns / 1000000) % 1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int maxthreads = 4;
+	unsigned want;
+	int n;
+
+	if (argc > 1) {
+		maxthreads = atoi(argv[1]);
+	}
+	if (maxthreads < 1 || maxthreads > MAXTHREADS) {
+		errx(1, "Usage: parsum [maxthreads]  (1-%d)", MAXTHREADS);
+	}
+
+	test_counter(maxthreads);
+
+	want = expected_sum();
+	for (n = 1; n <= maxthreads; n *= 2) {
+		time_sum(n, want);
+	}
+	printf("parsum: passed\n");
+	return 0;
+}
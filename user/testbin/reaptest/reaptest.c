@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * reaptest - waitpid(-1) and exit notification.
+ *
+ * Usage: reaptest [count]
+ *
+ * Forks COUNT children at once, each exiting with its own status, and
+ * reaps them all with waitpid(-1), checking that every child turns up
+ * exactly once with the right status. Also checks that WNOHANG doesn't
+ * block while a child is still running, that a waitpid whose status
+ * pointer is bad doesn't use up the child, and that waitpid(-1) with
+ * no children fails with ECHILD. Prints reaps per second.
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+#define DEFAULT_COUNT	32
+#define MAXCOUNT	100
+
+static pid_t pids[MAXCOUNT];
+static int seen[MAXCOUNT];
+
+static
+int
+findchild(pid_t pid, int count)
+{
+	int i;
+
+	for (i=0; i<count; i++) {
+		if (pids[i] == pid) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static
+void
+test_wnohang(void)
+{
+	struct timespec ts;
+	pid_t pid, ret;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		ts.tv_sec = 0;
+		ts.tv_nsec = 200000000;
+		nanosleep(&ts, NULL);
+		_exit(7);
+	}
+
+	ret = waitpid(-1, &status, WNOHANG);
+	if (ret < 0) {
+		err(1, "waitpid WNOHANG");
+	}
+	if (ret != 0) {
+		errx(1, "waitpid WNOHANG returned %d for a running child",
+		     ret);
+	}
+
+	ret = waitpid(-1, &status, 0);
+	if (ret < 0) {
+		err(1, "waitpid");
+	}
+	if (ret != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 7) {
+		errx(1, "WNOHANG child: got pid %d status 0x%x", ret, status);
+	}
+	printf("WNOHANG: passed\n");
+}
+
+static
+void
+test_efault(void)
+{
+	pid_t pid, ret;
+	int status;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		_exit(9);
+	}
+
+	/* a kernel address: the status can't be copied out there */
+	ret = waitpid(pid, (int *)0x80001000, 0);
+	if (ret >= 0) {
+		errx(1, "waitpid with a kernel status pointer succeeded");
+	}
+	if (errno != EFAULT) {
+		err(1, "waitpid with a kernel status pointer: "
+		    "expected EFAULT");
+	}
+
+	ret = waitpid(pid, &status, 0);
+	if (ret < 0) {
+		err(1, "waitpid after EFAULT");
+	}
+	if (ret != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 9) {
+		errx(1, "after EFAULT: got pid %d status 0x%x", ret, status);
+	}
+	printf("EFAULT: passed\n");
+}
+
+static
+void
+test_echild(void)
+{
+	int status;
+
+	if (waitpid(-1, &status, 0) >= 0) {
+		errx(1, "waitpid(-1) with no children succeeded");
+	}
+	if (errno != ECHILD) {
+		err(1, "waitpid(-1) with no children: expected ECHILD");
+	}
+	printf("ECHILD: passed\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	int count = DEFAULT_COUNT;
+	int i, n, status;
+	pid_t pid;
+	time_t secs1, secs2;
+	unsigned long nsecs1, nsecs2;
+	unsigned long long ns;
+
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (count < 1 || count > MAXCOUNT) {
+		errx(1, "Usage: reaptest [count]  (1-%d)", MAXCOUNT);
+	}
+
+	test_echild();
+	test_wnohang();
+	test_efault();
+
+	__time(&secs1, &nsecs1);
+	for (i=0; i<count; i++) {
+		pid = fork();
+		if (pid < 0) {
+			err(1, "fork");
+		}
+		if (pid == 0) {
+			_exit(i & 0xff);
+		}
+		pids[i] = pid;
+		seen[i] = 0;
+	}
+	for (i=0; i<count; i++) {
+		pid = waitpid(-1, &status, 0);
+		if (pid < 0) {
+			err(1, "waitpid(-1)");
+		}
+		n = findchild(pid, count);
+		if (n < 0) {
+			errx(1, "waitpid(-1) returned stranger %d", pid);
+		}
+		if (seen[n]++) {
+			errx(1, "child %d (pid %d) reaped twice", n, pid);
+		}
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != (n & 0xff)) {
+			errx(1, "child %d: bad exit status 0x%x", n, status);
+		}
+	}
+	__time(&secs2, &nsecs2);
+
+	test_echild();
+
+	ns = (unsigned long long)(secs2 - secs1) * 1000000000ULL
+		+ nsecs2 - nsecs1;
+	if (ns == 0) {
+		ns = 1;
+	}
+	printf("%d children forked and reaped in %llu.%03llu s: "
+	       "%llu/sec\n", count, ns / 1000000000ULL, (ns / 1000000) % 1000,
+	       (unsigned long long)count * 1000000000ULL / ns);
+	printf("reaptest: passed\n");
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * spawnbench - command launch latency, fork+execv versus spawn.
+ *
+ * Usage: spawnbench [count [program]]
+ *
+ * Starts PROGRAM (default /bin/true) COUNT times each way, waiting for
+ * each one to exit before starting the next, and prints the average
+ * time per launch. The fork+execv numbers include copying this
+ * process's image; the spawn numbers shouldn't, so the gap grows with
+ * the size of the parent (BALLAST makes it big enough to notice).
+ */
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define DEFAULT_COUNT	50
+#define BALLAST		(256 * 1024)
+
+/* Touched so it's really part of the image fork has to copy. */
+static char ballast[BALLAST];
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	__time(&secs, &nsecs);
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+reap(pid_t pid)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid %d", pid);
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child %d: bad exit status 0x%x", pid, status);
+	}
+}
+
+static
+pid_t
+forkexec(char **args)
+{
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execv(args[0], args);
+		warn("%s", args[0]);
+		_exit(1);
+	}
+	return pid;
+}
+
+static
+pid_t
+dospawn(char **args)
+{
+	pid_t pid;
+
+	pid = spawn(args[0], args);
+	if (pid < 0) {
+		err(1, "spawn: %s", args[0]);
+	}
+	return pid;
+}
+
+static
+void
+run(const char *what, pid_t (*launch)(char **), char **args, int count)
+{
+	unsigned long long start, ns;
+	int i;
+
+	start = now_ns();
+	for (i=0; i<count; i++) {
+		reap(launch(args));
+	}
+	ns = now_ns() - start;
+	printf("%-12s %5d launches, %llu us each\n",
+	       what, count, ns / count / 1000);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *args[2];
+	int count, i;
+
+	count = DEFAULT_COUNT;
+	args[0] = (char *)"/bin/true";
+	args[1] = NULL;
+	if (argc > 1) {
+		count = atoi(argv[1]);
+	}
+	if (argc > 2) {
+		args[0] = argv[2];
+	}
+	if (count < 1 || argc > 3) {
+		errx(1, "Usage: spawnbench [count [program]]");
+	}
+
+	for (i=0; i<BALLAST; i += 4096) {
+		ballast[i] = 1;
+	}
+
+	run("fork+execv", forkexec, args, count);
+	run("spawn", dospawn, args, count);
+
+	printf("spawnbench done.\n");
+	return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * threadexec - execv in a process with other threads.
+ *
+ * While a second thread is running (blocked on a mutex the main
+ * thread holds), execv must fail with EBUSY and leave everything as
+ * it was: the thread still runs and can be joined. Once it has
+ * exited, the same execv must work; the program runs itself again
+ * with an argument saying so, and reports from there.
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <err.h>
+#include <usynch.h>
+
+#define PROG	"/testbin/threadexec"
+
+static struct umutex m = UMUTEX_INITIALIZER;
+static volatile int ran;
+
+static
+void *
+locker(void *arg)
+{
+	(void)arg;
+
+	umutex_lock(&m);
+	ran = 1;
+	umutex_unlock(&m);
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *args[3];
+	pid_t tid;
+	int r;
+
+	if (argc == 2 && !strcmp(argv[1], "again")) {
+		printf("threadexec: passed\n");
+		return 0;
+	}
+
+	args[0] = (char *)"threadexec";
+	args[1] = (char *)"again";
+	args[2] = NULL;
+
+	umutex_lock(&m);
+	tid = threadcreate(locker, NULL);
+	if (tid < 0) {
+		err(1, "threadcreate");
+	}
+	while (m.um_state != 2) {
+		/* wait for the other thread to block */
+	}
+
+	r = execv(PROG, args);
+	if (r != -1 || errno != EBUSY) {
+		errx(1, "execv with another thread: expected EBUSY");
+	}
+
+	umutex_unlock(&m);
+	if (threadjoin(tid, NULL) < 0) {
+		err(1, "threadjoin");
+	}
+	if (!ran) {
+		errx(1, "thread didn't run after the failed execv");
+	}
+	printf("threadexec: execv with another thread failed with EBUSY\n");
+
+	execv(PROG, args);
+	err(1, "execv after join");
+}